@@ -16,6 +16,13 @@ static void usage()
           "-s string      : The program is a string (end of options).\n"
           "-gstart N      : Initial # of objects allowed before a gc sweep.\n"
           "-gmul N        : (# allowed * N) when sweep can't free anything.\n"
+          "-cache         : Save the program to a bytecode cache ('.lilyc'),\n"
+          "                 and run from the cache if it's up to date.\n"
+          "-noopt         : Don't run the peephole optimizer over the code.\n"
+          "-outbuf N      : Collect output (print, stdout, template content)\n"
+          "                 and write it out N bytes at a time.\n"
+          "-profile path  : Write a profile to path (collapsed stacks for\n"
+          "                 flame graphs) and path.txt (time per function).\n"
           "file           : The program is the given filename.\n", stderr);
     exit(EXIT_FAILURE);
 }
@@ -24,6 +31,10 @@ int is_file;
 int do_tags = 0;
 int gc_start = -1;
 int gc_multiplier = -1;
+int use_cache = 0;
+int optimize = 1;
+int output_size = 0;
+char *profile_path = NULL;
 char *to_process = NULL;
 
 static void process_args(int argc, char **argv, int *argc_offset)
@@ -35,6 +46,17 @@ static void process_args(int argc, char **argv, int *argc_offset)
             usage();
         else if (strcmp("-t", arg) == 0)
             do_tags = 1;
+        else if (strcmp("-cache", arg) == 0)
+            use_cache = 1;
+        else if (strcmp("-noopt", arg) == 0)
+            optimize = 0;
+        else if (strcmp("-profile", arg) == 0) {
+            i++;
+            if (i + 1 == argc)
+                usage();
+
+            profile_path = argv[i];
+        }
         else if (strcmp("-gstart", arg) == 0) {
             i++;
             if (i + 1 == argc)
@@ -42,6 +64,13 @@ static void process_args(int argc, char **argv, int *argc_offset)
 
             gc_start = atoi(argv[i]);
         }
+        else if (strcmp("-outbuf", arg) == 0) {
+            i++;
+            if (i + 1 == argc)
+                usage();
+
+            output_size = atoi(argv[i]);
+        }
         else if (strcmp("-gmul", arg) == 0) {
             i++;
             if (i + 1 == argc)
@@ -83,6 +112,11 @@ int main(int argc, char **argv)
     if (gc_multiplier != -1)
         config.gc_multiplier = gc_multiplier;
 
+    config.bytecode_cache = use_cache;
+    config.optimize = optimize;
+    config.output_size = output_size;
+    config.profile_path = profile_path;
+
     config.argc = argc - argc_offset;
     config.argv = argv + argc_offset;
 
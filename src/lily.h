@@ -88,6 +88,11 @@ typedef void (*lily_render_func)(const char *content, void *data);
 //     argv          - (Default: NULL)
 //                     The argument list (later used by Lily's sys.argv).
 //
+//     bytecode_cache - (Default: 0)
+//                     If 1, lily_parse_file saves the compiled program next to
+//                     the file (as '.lilyc'), and later runs load that instead
+//                     of parsing again. See lily_parse_file.
+//
 //     data          - (Default: stdin)
 //                     This will later be sent as the data part of the
 //                     import_func hook.
@@ -103,9 +108,34 @@ typedef void (*lily_render_func)(const char *content, void *data);
 //     import_func   - (Default: lily_default_import_func)
 //                     What function should be called to handle imports?
 //
+//     optimize      - (Default: 1)
+//                     If 1, the code of each function is run through a
+//                     peephole optimizer before it is used. Set this to 0 to
+//                     run the code exactly as the emitter wrote it.
+//
+//     output_size   - (Default: 0)
+//                     If more than 0, template content and what the program
+//                     writes to stdout (print, stdout.print, stdout.write) are
+//                     collected in a buffer instead of being written right
+//                     away. Once the buffer holds at least this many bytes,
+//                     it is sent to render_func in one call. Whatever is left
+//                     is sent when a parse or render call finishes, before
+//                     stdin is read, when stdout is closed, and when
+//                     lily_flush_output is called.
+//
+//     profile_path  - (Default: NULL)
+//                     If not NULL, the interpreter samples what the vm is
+//                     running every millisecond of cpu time. When the
+//                     interpreter is freed, the samples are written to this
+//                     path as collapsed stacks (for flame graphs), and to this
+//                     path plus '.txt' as a table of the time spent in each
+//                     function. Only one interpreter can be profiled at a time.
+//                     This does nothing on Windows.
+//
 //     render_func   - (Default: fputs)
 //                     What function should be called if there is template
-//                     content to be rendered?
+//                     content to be rendered? If output_size is set, this also
+//                     receives the program's stdout output, in batches.
 //
 //     sipkey        - (Default: [1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16]
 //                     The sipkey is an array of 16 char values that helps to
@@ -115,8 +145,12 @@ typedef struct lily_config_ {
     char **argv;
     int gc_start;
     int gc_multiplier;
+    int bytecode_cache;
+    int optimize;
+    int output_size;
     lily_render_func render_func;
     lily_import_func import_func;
+    const char *profile_path;
     char sipkey[16];
     void *data;
 } lily_config;
@@ -145,6 +179,65 @@ lily_state *lily_new_state(lily_config *config);
 // Destroy an interpreter and any values it holds.
 void lily_free_state(lily_state *s);
 
+// Function: lily_clone_state
+// Create an interpreter that runs the program 's' has already parsed.
+//
+// The clone shares code, classes, and literals with 's', but receives its own
+// copy of every global. Each clone therefore starts from the values that the
+// globals held when this was called. This is cheaper than parsing the program
+// again, so it suits servers that want a pristine interpreter per request.
+//
+// Clones cannot parse or render. Instead, callers use 'lily_find_function' and
+// 'lily_call_trapped' to run the program. Foreign values held in globals are
+// shared with 's' instead of copied.
+//
+// This returns NULL if 's' is a clone, or if 's' is in the middle of a call
+// (such as from a foreign function that 's' called). A running state's globals
+// may only be partly set up, and the clone wouldn't know about the calls in
+// progress. The parallel package is the exception: parallel.map clones the
+// state that called it internally, without these checks, and documents that
+// its workers see the globals as they are at the call.
+//
+// Clones are destroyed with 'lily_free_state', and must be destroyed before 's'
+// is. 's' must not parse or render while it has clones.
+lily_state *lily_clone_state(lily_state *s);
+
+// Function: lily_open_scope
+// Create a clone of 's' for a single request.
+//
+// This is 'lily_clone_state', except that the values the result makes come
+// from an arena that belongs to it. 'lily_close_scope' then frees the arena all
+// at once, instead of destroying values one at a time. Files and foreign values
+// made in the scope are destroyed when it closes, not before. The scope's
+// globals are copies, so everything the scope made is dropped when it closes.
+//
+// Other interpreters (including 's') can be used while a scope is open, and a
+// thread can have more than one scope open. This returns NULL if 's' can't be
+// cloned.
+//
+// Foreign values are shared with 's' (see 'lily_clone_state'), so a scope must
+// not change them. Anything it added to one would be gone once it closes. The
+// scope holds one ref to each until it closes, and doesn't otherwise change
+// their refcounts.
+// Otherwise, nothing a scope runs is stored into 's'. Pointers into the scope
+// (such as from 'lily_call_result') must not be used after it closes. Building with
+// LILY_SCOPE_CHECK makes 'lily_close_scope' report values of 's' that came
+// from the scope. Building with LILY_USE_SYSTEM_MALLOC turns arenas off, and
+// scopes are freed like clones.
+lily_state *lily_open_scope(lily_state *s);
+
+// Function: lily_close_scope
+// Destroy a scope from 'lily_open_scope', and everything it made.
+void lily_close_scope(lily_state *s);
+
+// Function: lily_flush_output
+// Send buffered output to the config's render_func.
+//
+// This does nothing unless the config has an output_size. Embedders that call
+// into the interpreter directly (such as through lily_call) can use this to
+// send output before the next parse or render call.
+void lily_flush_output(lily_state *s);
+
 /////////////////////////////
 // Section: Parsing/Rendering
 /////////////////////////////
@@ -173,9 +266,24 @@ void lily_free_state(lily_state *s);
 //     s        - The interpreter.
 //     filename - A path to a file to process. Must end in '.lily'.
 //
+// If the config has bytecode_cache set, and this is the first thing the
+// interpreter parses, then the compiled program is saved to 'filename' plus a
+// 'c' suffix. Later runs skip lexing and parsing if the cache is still fresh.
+// A cache is fresh if it was made by this version of Lily, every source file
+// has the same size and content, and every foreign module has the same
+// dynaload table.
+//
+// A program loaded from a cache only has what the vm needs to run it. Functions
+// such as lily_find_function can't see anything that the program declared.
+//
 // Returns 1 on success, 0 on failure.
 int lily_parse_file(lily_state *s, const char *filename);
 
+// Function: lily_used_cache
+// Return 1 if 'lily_parse_file' loaded the program from its bytecode cache, or
+// 0 if the program was parsed (or nothing has been loaded yet).
+int lily_used_cache(lily_state *s);
+
 // Function: lily_parse_string
 // Send an interpreter to parse a string.
 //
@@ -512,6 +620,10 @@ int lily_load_string_package(lily_state *s, const char *path,
 
 // Function: lily_bytestring_raw
 // Get the raw buffer behind a ByteString.
+//
+// If the ByteString shares a buffer with another (because one is a slice of the
+// other), it's given a buffer of its own first, so that writes to the result
+// don't reach the other. This changes the ByteString.
 char *lily_bytestring_raw(lily_bytestring_val *byte_val);
 
 // Function: lily_bytestring_length
@@ -528,6 +640,10 @@ int lily_bytestring_length(lily_bytestring_val *byte_val);
 //
 // No safety checking is performed on the index given.
 //
+// Elements are stored inline within the container. If 'con' is a List, the
+// pointer returned is only valid until the List is next grown (by
+// lily_list_insert, lily_list_push, or lily_list_reserve).
+//
 // Parameters:
 //     con   - The container (user-defined class, non-empty variant, List, or
 //             Tuple).
@@ -544,10 +660,12 @@ lily_value *lily_con_get(lily_container_val *con, int index);
 // No safety checking is performed on the index given.
 //
 // Parameters:
+//     s     - The interpreter that 'con' belongs to.
 //     con   - The container (user-defined class, non-empty variant, List, or
 //             Tuple).
 //     index - Target index. Cannot be negative. 0 is the first element.
-void lily_con_set(lily_container_val *con, int index, lily_value *value);
+void lily_con_set(lily_state *s, lily_container_val *con, int index,
+        lily_value *value);
 
 // Function: lily_con_set_from_stack
 // (Stack: -1) Set an element into a container from the stack.
@@ -592,6 +710,8 @@ int lily_function_is_native(lily_function_val *func);
 // the wrong kind of a key for a hash (ex: a String key for a Integer hash).
 //
 // The result of this function is either a pointer to the value found or NULL.
+// Records are stored inside of the hash, so the pointer is only valid until the
+// next time a key is added to the hash.
 //
 // Parameters:
 //     s    - The interpreter. This must be the same interpreter that the hash
@@ -655,10 +775,12 @@ int lily_hash_take(lily_state *s, lily_hash_val *hash, lily_value *key);
 // been reserved.
 //
 // Parameters:
+//     s     - The interpreter that 'con' belongs to.
 //     con   - A List value.
 //     index - Index position. Cannot be negative. 0 is the first element.
 //     value - A full value to push.
-void lily_list_insert(lily_container_val *con, int index, lily_value *value);
+void lily_list_insert(lily_state *s, lily_container_val *con, int index,
+        lily_value *value);
 
 // Function: lily_list_reserve
 // Reserve N elements in a List.
@@ -699,10 +821,19 @@ void lily_list_take(lily_state *s, lily_container_val *con, int index);
 // the caller must **not** send non-List values to this function.
 //
 // This pushes the value provided onto the end of the List given.
-void lily_list_push(lily_container_val *con, lily_value *value);
+//
+// Parameters:
+//     s     - The interpreter that 'con' belongs to.
+//     con   - A List value.
+//     value - A full value to push.
+void lily_list_push(lily_state *s, lily_container_val *con, lily_value *value);
 
 // Function: lily_string_raw
 // Returns the raw buffer behind a String.
+//
+// The result always ends with a \0. A String that is a slice of another may not
+// have one, and gets a copy of its bytes before returning. This changes the
+// String, so it must not be called on a String that another thread can reach.
 char *lily_string_raw(lily_string_val *string_val);
 
 // Function: lily_string_length
@@ -791,10 +922,15 @@ lily_string_val *    lily_arg_string    (lily_state *s, int index);
 
 // Function: lily_arg_string_raw
 // Fetch the underlying buffer of a String from the stack.
+//
+// Like lily_string_raw, this can give the String a buffer of its own.
 char *               lily_arg_string_raw(lily_state *s, int index);
 
 // Function: lily_arg_value
 // Fetch a complete value with flags and class information.
+//
+// The result points into the interpreter's stack. The stack may move when it
+// grows, so the result is only valid until the next push or call.
 lily_value *         lily_arg_value     (lily_state *s, int index);
 
 // Function: lily_arg_count
@@ -849,6 +985,10 @@ int lily_arg_isa(lily_state *s, int index, uint16_t class_id);
 // When implementing a dynaload loader, the variable loading functions should
 // finish with exactly 1 extra value on the stack. That extra value becomes the
 // value for the var.
+//
+// Pushing may grow the stack, which can move it. Any value pointer that came
+// from the stack (an argument, a call result, or the top of the stack) must be
+// fetched again after a push.
 
 // Function: lily_push_boolean
 // (Stack: +1) Push a Boolean value onto the stack.
@@ -1103,6 +1243,8 @@ lily_string_val *    lily_as_string    (lily_value *value);
 
 // Function: lily_as_string_raw
 // Extract the raw buffer behind a String.
+//
+// Like lily_string_raw, this can give the String a buffer of its own.
 char *               lily_as_string_raw(lily_value *value);
 
 //////////////////////////////
@@ -1156,10 +1298,23 @@ void lily_call_prepare(lily_state *s, lily_function_val *func);
 // Function: lily_call_result
 // Return the register that 'lily_call_prepare' reserved.
 //
-// The value itself (not the contents) is valid until the next
-// 'lily_call_prepare', or when the called foreign function goes out of scope.
+// The register is valid until the next push or call, since either of those can
+// grow and move the stack. Callers that call the same function many times
+// should fetch the result again after each call.
 lily_value *lily_call_result(lily_state *s);
 
+// Function: lily_call_trapped
+// (Stack: -count) Perform a prepared call on a clone, trapping exceptions.
+//
+// This is 'lily_call', except that an uncaught exception stops at this call
+// instead of passing through. This only works on states from
+// 'lily_clone_state', and returns 0 for any other state.
+//
+// If the call succeeds, this returns 1 and 'lily_call_result' has the result.
+// Otherwise, this returns 0 and the error is available through
+// 'lily_error_message'. The clone can make further calls either way.
+int lily_call_trapped(lily_state *s, int count);
+
 ///////////////////////////
 // Section: Exception raise
 ///////////////////////////
@@ -1235,6 +1390,8 @@ void lily_stack_drop_top(lily_state *s);
 
 // Function: lily_stack_get_top
 // Return the value at the top of the stack.
+//
+// The result is valid until the next push or call.
 lily_value *lily_stack_get_top(lily_state *s);
 
 /////////////////////////////////////
@@ -1391,6 +1548,46 @@ int lily_is_valid_utf8(const char *source);
 // Place a gc tag onto 'value'. May invoke a sweep.
 void lily_value_tag(lily_state *s, lily_value *value);
 
+// Constant: LILY_GC_PAUSE_BUCKETS
+// How many buckets lily_gc_pause_histogram writes.
+#define LILY_GC_PAUSE_BUCKETS 16
+
+// Function: lily_gc_pause_histogram
+// Write how long the collector has paused the interpreter into 'buckets'.
+//
+// The collector marks a little at a time, so each pause is usually one step of
+// a collection instead of the whole collection. The first bucket counts pauses
+// under 1 microsecond. Each bucket after that counts pauses up to twice as long
+// as the one before it (bucket 'n' is under 2^n microseconds). The last bucket
+// counts everything longer.
+//
+// 'buckets' must have room for LILY_GC_PAUSE_BUCKETS elements.
+void lily_gc_pause_histogram(lily_state *s, uint64_t *buckets);
+
+// Function: lily_opcode_name
+// Return the name of opcode 'op' (see lily_int_opcode.h), or NULL if there is
+// no such opcode.
+const char *lily_opcode_name(int op);
+
+// Function: lily_opcode_count
+// Return how many times the vm has run opcode 'op'.
+//
+// The vm only counts opcodes if Lily was built with WITH_OPCODE_STATS.
+// Otherwise, this is always 0. An interpreter built with the counters writes
+// them to stderr when it's freed.
+uint64_t lily_opcode_count(lily_state *s, int op);
+
+// Function: lily_opcode_pair_count
+// Return how many times the vm has run opcode 'second' right after opcode
+// 'first'. Like lily_opcode_count, this needs WITH_OPCODE_STATS.
+uint64_t lily_opcode_pair_count(lily_state *s, int first, int second);
+
+// Function: lily_function_call_count
+// Return how many times 'func' has been called, either by the vm or through
+// lily_call. Closures of the same function share a count. Like
+// lily_opcode_count, this needs WITH_OPCODE_STATS.
+uint64_t lily_function_call_count(lily_function_val *func);
+
 // Function: lily_cid_at
 // Function for autogenerated ID_* macros to get a class id.
 uint16_t lily_cid_at(lily_state *s, int index);
@@ -1,3 +1,6 @@
+#include <stdint.h>
+#include <string.h>
+
 #include "lily_alloc.h"
 
 void *lily_malloc(size_t size)
@@ -22,3 +25,485 @@ void lily_free(void *ptr)
 {
     free(ptr);
 }
+
+/** Most of the values that the vm makes are a small struct (containers,
+    strings, functions, and so on). Sending each of those to malloc is slow, so
+    they come from a slab pool instead.
+
+    The pool has one size class for each multiple of 8 bytes, up to
+    LILY_SLAB_MAX. Each class carves objects out of slabs, and keeps objects
+    that have been given back in a free list. Slabs are aligned to their size,
+    and start with a header saying which class they belong to. That's how
+    lily_slab_free finds where an object goes without being given the pool.
+    The header also has the pool's arena, so that a value can find where its
+    buffers came from (see lily_slab_arena).
+    Slabs are never given back until the pool is freed.
+
+    Building with LILY_USE_SYSTEM_MALLOC sends everything to malloc instead.
+    Tools like valgrind can't see inside of a slab, so they need that. **/
+
+#ifndef LILY_USE_SYSTEM_MALLOC
+
+# ifdef _WIN32
+#  include <malloc.h>
+# endif
+
+# define SLAB_SIZE 16384
+# define SLAB_GRAIN 8
+# define SLAB_CLASS_COUNT (LILY_SLAB_MAX / SLAB_GRAIN)
+
+typedef struct lily_slab_class_ {
+    void *free_list;
+    /* Objects that haven't been handed out yet in the newest slab. */
+    char *next_object;
+    char *slab_end;
+    size_t object_size;
+} lily_slab_class;
+
+typedef struct lily_slab_ {
+    lily_slab_class *cls;
+    struct lily_slab_ *next;
+    struct lily_arena_ *arena;
+} lily_slab;
+
+struct lily_slab_pool_ {
+    lily_slab_class classes[SLAB_CLASS_COUNT];
+    lily_slab *slabs;
+    struct lily_arena_ *arena;
+};
+
+/* Objects start after the header, rounded up to keep them aligned. */
+# define SLAB_HEADER_SIZE \
+    ((sizeof(lily_slab) + SLAB_GRAIN - 1) & ~(size_t)(SLAB_GRAIN - 1))
+
+static void *aligned_malloc(size_t size, size_t alignment)
+{
+    void *result;
+
+# ifdef _WIN32
+    result = _aligned_malloc(size, alignment);
+# else
+    if (posix_memalign(&result, alignment, size) != 0)
+        result = NULL;
+# endif
+
+    if (result == NULL)
+        abort();
+
+    return result;
+}
+
+static void aligned_free(void *ptr)
+{
+# ifdef _WIN32
+    _aligned_free(ptr);
+# else
+    free(ptr);
+# endif
+}
+
+static lily_slab *new_slab(void)
+{
+    return aligned_malloc(SLAB_SIZE, SLAB_SIZE);
+}
+
+static void free_slab(lily_slab *slab)
+{
+    aligned_free(slab);
+}
+
+lily_slab_pool *lily_new_slab_pool(lily_arena *arena)
+{
+    lily_slab_pool *pool = lily_malloc(sizeof(*pool));
+    int i;
+
+    for (i = 0;i < SLAB_CLASS_COUNT;i++) {
+        lily_slab_class *cls = pool->classes + i;
+
+        cls->free_list = NULL;
+        cls->next_object = NULL;
+        cls->slab_end = NULL;
+        cls->object_size = (i + 1) * SLAB_GRAIN;
+    }
+
+    pool->slabs = NULL;
+    pool->arena = arena;
+    return pool;
+}
+
+void lily_free_slab_pool(lily_slab_pool *pool)
+{
+    lily_slab *slab_iter = pool->slabs;
+
+    while (slab_iter) {
+        lily_slab *slab_next = slab_iter->next;
+
+        free_slab(slab_iter);
+        slab_iter = slab_next;
+    }
+
+    lily_free(pool);
+}
+
+void *lily_slab_malloc(lily_slab_pool *pool, size_t size)
+{
+    lily_slab_class *cls = pool->classes + ((size - 1) / SLAB_GRAIN);
+    void *result = cls->free_list;
+
+    if (result) {
+        cls->free_list = *(void **)result;
+        return result;
+    }
+
+    if (cls->next_object == cls->slab_end) {
+        lily_slab *slab = new_slab();
+        size_t count = (SLAB_SIZE - SLAB_HEADER_SIZE) / cls->object_size;
+
+        slab->cls = cls;
+        slab->next = pool->slabs;
+        slab->arena = pool->arena;
+        pool->slabs = slab;
+
+        cls->next_object = (char *)slab + SLAB_HEADER_SIZE;
+        cls->slab_end = cls->next_object + (count * cls->object_size);
+    }
+
+    result = cls->next_object;
+    cls->next_object += cls->object_size;
+    return result;
+}
+
+void lily_slab_free(void *ptr)
+{
+    uintptr_t slab_start = (uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1);
+    lily_slab *slab = (lily_slab *)slab_start;
+    lily_slab_class *cls = slab->cls;
+
+    *(void **)ptr = cls->free_list;
+    cls->free_list = ptr;
+}
+
+lily_arena *lily_slab_arena(void *ptr)
+{
+    uintptr_t slab_start = (uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1);
+
+    return ((lily_slab *)slab_start)->arena;
+}
+
+int lily_slab_pool_owns(lily_slab_pool *pool, void *ptr)
+{
+    uintptr_t slab_start = (uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1);
+    lily_slab *slab_iter = pool->slabs;
+
+    while (slab_iter) {
+        if ((uintptr_t)slab_iter == slab_start)
+            return 1;
+
+        slab_iter = slab_iter->next;
+    }
+
+    return 0;
+}
+
+/** An arena hands out memory by moving a pointer through large blocks, and
+    gives all of it back at once when it is freed. It's for memory that all
+    dies at the same time, such as everything that a request scope makes.
+
+    Memory is taken from an arena by passing it to lily_arena_malloc. Freeing
+    memory from an arena does nothing, unless it was the last thing handed out
+    (so a buffer that grows as it's written can do so in place). The arena
+    functions check which blocks belong to the arena first, and send anything
+    else (or everything, if the arena is NULL) to lily_malloc and friends.
+
+    Blocks are aligned to their size. A large allocation gets a block to itself
+    that's a multiple of that size. Either way, masking an address from the
+    arena gives the start of its block. **/
+
+# define ARENA_BLOCK_SIZE 65536
+/* Allocations larger than this get a block of their own. */
+# define ARENA_LARGE_SIZE (ARENA_BLOCK_SIZE / 4)
+/* Each allocation starts with its size, so that realloc knows how much to
+   copy. This is also the alignment that allocations are given, which matches
+   what malloc gives. */
+# define ARENA_HEADER_SIZE 16
+
+typedef struct lily_arena_block_ {
+    struct lily_arena_block_ *next;
+    uint64_t pad;
+} lily_arena_block;
+
+struct lily_arena_ {
+    char *next_byte;
+    char *block_end;
+    /* The header of the last allocation, which can be resized in place. */
+    char *last;
+    lily_arena_block *blocks;
+    /* Where each block starts, as an open addressing set. */
+    uintptr_t *starts;
+    uint32_t start_mask;
+    uint32_t start_count;
+};
+
+lily_arena *lily_new_arena(void)
+{
+    lily_arena *arena = malloc(sizeof(*arena));
+    uint32_t size = 16;
+
+    if (arena == NULL)
+        abort();
+
+    arena->next_byte = NULL;
+    arena->block_end = NULL;
+    arena->last = NULL;
+    arena->blocks = NULL;
+    arena->starts = calloc(size, sizeof(*arena->starts));
+    arena->start_mask = size - 1;
+    arena->start_count = 0;
+
+    if (arena->starts == NULL)
+        abort();
+
+    return arena;
+}
+
+void lily_free_arena(lily_arena *arena)
+{
+    lily_arena_block *block_iter = arena->blocks;
+
+    while (block_iter) {
+        lily_arena_block *block_next = block_iter->next;
+
+        aligned_free(block_iter);
+        block_iter = block_next;
+    }
+
+    free(arena->starts);
+    free(arena);
+}
+
+static uint32_t arena_start_slot(lily_arena *arena, uintptr_t start)
+{
+    uint32_t slot = (uint32_t)((start / ARENA_BLOCK_SIZE) * 2654435761u) &
+            arena->start_mask;
+
+    while (arena->starts[slot] && arena->starts[slot] != start)
+        slot = (slot + 1) & arena->start_mask;
+
+    return slot;
+}
+
+int lily_arena_owns(lily_arena *arena, void *ptr)
+{
+    /* A zero-size allocation at the end of a block points at the end of it,
+       which is the start of the next block. Every pointer the arena gives out
+       is past the block's header, so looking one byte back finds the right
+       block for those too. */
+    uintptr_t start = ((uintptr_t)ptr - 1) & ~(uintptr_t)(ARENA_BLOCK_SIZE - 1);
+
+    return ptr != NULL &&
+           arena->starts[arena_start_slot(arena, start)] == start;
+}
+
+static void arena_add_start(lily_arena *arena, uintptr_t start)
+{
+    /* Keep the set at most half full. */
+    if ((arena->start_count + 1) * 2 > arena->start_mask + 1) {
+        uintptr_t *old_starts = arena->starts;
+        uint32_t old_size = arena->start_mask + 1;
+        uint32_t i;
+
+        arena->starts = calloc(old_size * 2, sizeof(*arena->starts));
+        arena->start_mask = (old_size * 2) - 1;
+        arena->start_count = 0;
+
+        if (arena->starts == NULL)
+            abort();
+
+        for (i = 0;i < old_size;i++) {
+            if (old_starts[i])
+                arena_add_start(arena, old_starts[i]);
+        }
+
+        free(old_starts);
+    }
+
+    arena->starts[arena_start_slot(arena, start)] = start;
+    arena->start_count++;
+}
+
+static char *arena_new_block(lily_arena *arena, size_t size)
+{
+    lily_arena_block *block = aligned_malloc(size, ARENA_BLOCK_SIZE);
+
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena_add_start(arena, (uintptr_t)block);
+
+    return (char *)block + sizeof(*block);
+}
+
+static void *arena_malloc(lily_arena *arena, size_t size)
+{
+    size_t need = ARENA_HEADER_SIZE +
+            ((size + ARENA_HEADER_SIZE - 1) & ~(size_t)(ARENA_HEADER_SIZE - 1));
+    char *header;
+
+    if (size > ARENA_LARGE_SIZE) {
+        size_t block_size = sizeof(lily_arena_block) + need;
+
+        block_size = (block_size + ARENA_BLOCK_SIZE - 1) &
+                ~(size_t)(ARENA_BLOCK_SIZE - 1);
+        header = arena_new_block(arena, block_size);
+    }
+    else {
+        if ((size_t)(arena->block_end - arena->next_byte) < need) {
+            arena->next_byte = arena_new_block(arena, ARENA_BLOCK_SIZE);
+            arena->block_end = (char *)arena->blocks + ARENA_BLOCK_SIZE;
+        }
+
+        header = arena->next_byte;
+        arena->next_byte += need;
+        arena->last = header;
+    }
+
+    *(size_t *)header = size;
+    return header + ARENA_HEADER_SIZE;
+}
+
+static void *arena_realloc(lily_arena *arena, void *ptr, size_t new_size)
+{
+    char *header = (char *)ptr - ARENA_HEADER_SIZE;
+    size_t old_size = *(size_t *)header;
+
+    if (header == arena->last) {
+        size_t need = ARENA_HEADER_SIZE + ((new_size + ARENA_HEADER_SIZE - 1) &
+                ~(size_t)(ARENA_HEADER_SIZE - 1));
+
+        if ((size_t)(arena->block_end - header) >= need &&
+            new_size <= ARENA_LARGE_SIZE) {
+            arena->next_byte = header + need;
+            *(size_t *)header = new_size;
+            return ptr;
+        }
+    }
+
+    void *result = arena_malloc(arena, new_size);
+
+    memcpy(result, ptr, old_size < new_size ? old_size : new_size);
+    return result;
+}
+
+void *lily_arena_malloc(lily_arena *arena, size_t size)
+{
+    if (arena == NULL)
+        return lily_malloc(size);
+
+    return arena_malloc(arena, size);
+}
+
+void *lily_arena_realloc(lily_arena *arena, void *ptr, size_t new_size)
+{
+    if (arena == NULL)
+        return lily_realloc(ptr, new_size);
+    else if (ptr == NULL)
+        return arena_malloc(arena, new_size);
+    else if (lily_arena_owns(arena, ptr) == 0)
+        return lily_realloc(ptr, new_size);
+
+    return arena_realloc(arena, ptr, new_size);
+}
+
+void lily_arena_free(lily_arena *arena, void *ptr)
+{
+    if (arena == NULL || lily_arena_owns(arena, ptr) == 0) {
+        lily_free(ptr);
+        return;
+    }
+
+    char *header = (char *)ptr - ARENA_HEADER_SIZE;
+
+    if (header == arena->last) {
+        arena->next_byte = header;
+        arena->last = NULL;
+    }
+}
+
+#else
+
+struct lily_slab_pool_ {
+    int unused;
+};
+
+lily_slab_pool *lily_new_slab_pool(lily_arena *arena)
+{
+    (void)arena;
+    return lily_malloc(sizeof(lily_slab_pool));
+}
+
+void lily_free_slab_pool(lily_slab_pool *pool)
+{
+    lily_free(pool);
+}
+
+void *lily_slab_malloc(lily_slab_pool *pool, size_t size)
+{
+    return lily_malloc(size);
+}
+
+void lily_slab_free(void *ptr)
+{
+    lily_free(ptr);
+}
+
+lily_arena *lily_slab_arena(void *ptr)
+{
+    (void)ptr;
+    return NULL;
+}
+
+int lily_slab_pool_owns(lily_slab_pool *pool, void *ptr)
+{
+    (void)pool;
+    (void)ptr;
+    return 0;
+}
+
+/* Tools that check memory need to see each allocation, so arenas are turned
+   off. Request scopes free what they made one value at a time instead. */
+
+lily_arena *lily_new_arena(void)
+{
+    return NULL;
+}
+
+void lily_free_arena(lily_arena *arena)
+{
+    (void)arena;
+}
+
+void *lily_arena_malloc(lily_arena *arena, size_t size)
+{
+    (void)arena;
+    return lily_malloc(size);
+}
+
+void *lily_arena_realloc(lily_arena *arena, void *ptr, size_t new_size)
+{
+    (void)arena;
+    return lily_realloc(ptr, new_size);
+}
+
+void lily_arena_free(lily_arena *arena, void *ptr)
+{
+    (void)arena;
+    lily_free(ptr);
+}
+
+int lily_arena_owns(lily_arena *arena, void *ptr)
+{
+    (void)arena;
+    (void)ptr;
+    return 0;
+}
+
+#endif
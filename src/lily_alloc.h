@@ -7,4 +7,35 @@ void *lily_malloc(size_t);
 void *lily_realloc(void *, size_t);
 void lily_free(void *);
 
+/* An arena hands out memory from large blocks, and releases all of it at once
+   when it is freed. The arena functions take a NULL arena (or memory that the
+   arena didn't give out) and use lily_malloc and friends for it. Arenas are
+   turned off (NULL) when building with LILY_USE_SYSTEM_MALLOC. */
+typedef struct lily_arena_ lily_arena;
+
+lily_arena *lily_new_arena(void);
+void lily_free_arena(lily_arena *);
+void *lily_arena_malloc(lily_arena *, size_t);
+void *lily_arena_realloc(lily_arena *, void *, size_t);
+void lily_arena_free(lily_arena *, void *);
+int lily_arena_owns(lily_arena *, void *);
+
+/* A slab pool hands out small, fixed-size objects from large blocks. Each
+   interpreter has its own pool. Objects can be given back without the pool,
+   and the pool releases all blocks at once when it is freed. */
+typedef struct lily_slab_pool_ lily_slab_pool;
+
+/* The largest size that lily_slab_malloc will take. */
+# define LILY_SLAB_MAX 64
+
+lily_slab_pool *lily_new_slab_pool(lily_arena *);
+void lily_free_slab_pool(lily_slab_pool *);
+void *lily_slab_malloc(lily_slab_pool *, size_t);
+void lily_slab_free(void *);
+/* The arena given to the pool that an object came from. Values use this to
+   find where their buffers came from when they aren't given a state. */
+lily_arena *lily_slab_arena(void *);
+/* Walks every slab, so this is only for debugging. */
+int lily_slab_pool_owns(lily_slab_pool *, void *);
+
 #endif
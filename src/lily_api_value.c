@@ -1,5 +1,9 @@
 #include <string.h>
 
+#ifndef _WIN32
+# include <sys/stat.h>
+#endif
+
 #include "lily.h"
 
 #include "lily_value_structs.h"
@@ -10,57 +14,91 @@
 
 #define DEFINE_GETTERS(name, action, ...) \
 int lily_##name##_boolean(__VA_ARGS__) \
-{ return source  action->value.integer; } \
+{ return (source action)->value.integer; } \
 uint8_t lily_##name##_byte(__VA_ARGS__) \
-{ return source  action->value.integer; } \
+{ return (source action)->value.integer; } \
 lily_bytestring_val *lily_##name##_bytestring(__VA_ARGS__) \
-{ return (lily_bytestring_val *)source  action->value.string; } \
+{ return (lily_bytestring_val *)(source action)->value.string; } \
 lily_container_val *lily_##name##_container(__VA_ARGS__) \
-{ return source  action->value.container; } \
+{ return (source action)->value.container; } \
 double lily_##name##_double(__VA_ARGS__) \
-{ return source  action->value.doubleval; } \
+{ return (source action)->value.doubleval; } \
 lily_file_val *lily_##name##_file(__VA_ARGS__) \
-{ return source  action->value.file; } \
+{ return (source action)->value.file; } \
 FILE *lily_##name##_file_raw(__VA_ARGS__) \
-{ return source  action->value.file->inner_file; } \
+{ return (source action)->value.file->inner_file; } \
 lily_function_val *lily_##name##_function(__VA_ARGS__) \
-{ return source  action->value.function; } \
+{ return (source action)->value.function; } \
 lily_hash_val *lily_##name##_hash(__VA_ARGS__) \
-{ return source  action->value.hash; } \
+{ return (source action)->value.hash; } \
 lily_generic_val *lily_##name##_generic(__VA_ARGS__) \
-{ return source  action->value.generic; } \
+{ return (source action)->value.generic; } \
 int64_t lily_##name##_integer(__VA_ARGS__) \
-{ return source  action->value.integer; } \
+{ return (source action)->value.integer; } \
 lily_string_val *lily_##name##_string(__VA_ARGS__) \
-{ return source  action->value.string; } \
+{ return (source action)->value.string; } \
 char *lily_##name##_string_raw(__VA_ARGS__) \
-{ return source  action->value.string->string; } \
+{ return lily_string_raw((source action)->value.string); } \
 lily_value *lily_##name##_value(__VA_ARGS__) \
-{ return source  action; } \
+{ return source action; } \
 
-DEFINE_GETTERS(arg, ->call_chain->start[index], lily_state *source, int index)
+DEFINE_GETTERS(arg, ->call_chain->start + index, lily_state *source, int index)
 DEFINE_GETTERS(as, , lily_value *source)
 
 lily_value *lily_con_get(lily_container_val *c, int index)
 {
-    return c->values[index];
+    /* The caller wants a full value, which a packed List doesn't have. */
+    if (LILY_LIST_IS_PACKED(c))
+        lily_list_unpack(c);
+
+    return c->values + index;
 }
 
-void lily_con_set(lily_container_val *c, int index, lily_value *v)
+void lily_con_set(lily_state *s, lily_container_val *c, int index,
+        lily_value *v)
 {
-    lily_value_assign(c->values[index], v);
+    if (LILY_LIST_IS_PACKED(c)) {
+        if (c->packed_id == v->class_id) {
+            lily_list_packed_set(c, index, v);
+            return;
+        }
+
+        lily_list_unpack(c);
+    }
+
+    if (v->flags & VAL_IS_GC_SWEEPABLE)
+        lily_gc_barrier(s, v);
+
+    lily_value_assign(c->values + index, v);
 }
 
 void lily_con_set_from_stack(lily_state *s, lily_container_val *c, int index)
 {
-    lily_value *target = c->values[index];
+    if (LILY_LIST_IS_PACKED(c)) {
+        lily_value *top = s->call_chain->top - 1;
+
+        if (c->packed_id == top->class_id) {
+            lily_list_packed_set(c, index, top);
+            top->flags = 0;
+            s->call_chain->top--;
+            return;
+        }
+
+        lily_list_unpack(c);
+    }
+
+    lily_value *target = c->values + index;
 
     if (target->flags & VAL_IS_DEREFABLE)
         lily_deref(target);
 
     s->call_chain->top--;
 
-    lily_value *top = *(s->call_chain->top);
+    lily_value *top = s->call_chain->top;
+
+    if (top->flags & VAL_IS_GC_SWEEPABLE)
+        lily_gc_barrier(s, top);
+
     *target = *top;
 
     top->flags = 0;
@@ -78,7 +116,7 @@ int lily_arg_count(lily_state *s)
 
 int lily_arg_isa(lily_state *s, int index, uint16_t class_id)
 {
-    return s->call_chain->start[index]->class_id == class_id;
+    return s->call_chain->start[index].class_id == class_id;
 }
 
 /* Stack operations
@@ -88,38 +126,142 @@ int lily_arg_isa(lily_state *s, int index, uint16_t class_id)
 lily_value *lily_stack_take(lily_state *s)
 {
     s->call_chain->top--;
-    return *s->call_chain->top;
-}
-
-void lily_stack_push_and_destroy(lily_state *s, lily_value *v)
-{
-    lily_push_value(s, v);
-    lily_deref(v);
-    lily_free(v);
+    return s->call_chain->top;
 }
 
 lily_value *lily_stack_get_top(lily_state *s)
 {
-    return *(s->call_chain->top - 1);
+    return s->call_chain->top - 1;
 }
 
 void lily_stack_drop_top(lily_state *s)
 {
     s->call_chain->top--;
-    lily_value *z = *s->call_chain->top;
+    lily_value *z = s->call_chain->top;
     lily_deref(z);
     z->flags = 0;
 }
 
 /* Simple per-type operations. */
 
+static size_t packed_width(uint16_t class_id)
+{
+    if (class_id == LILY_ID_BYTE)
+        return sizeof(uint8_t);
+
+    return sizeof(lily_raw_value);
+}
+
+/* How much space each element of the List takes up. */
+static size_t list_width(lily_container_val *c)
+{
+    if (c->packed_id)
+        return packed_width(c->packed_id);
+
+    return sizeof(lily_value);
+}
+
+/* Turn an empty List into a packed one holding 'class_id' values, with room for
+   'size' of them. */
+void lily_list_pack(lily_container_val *c, uint16_t class_id, uint32_t size)
+{
+    lily_arena *arena = lily_slab_arena(c);
+
+    lily_arena_free(arena, c->values);
+    c->values = lily_arena_malloc(arena,
+            (size ? size : 1) * packed_width(class_id));
+    c->packed_id = class_id;
+    c->extra_space = size;
+}
+
+/* Give a packed List full values. It stays this way from now on. */
+void lily_list_unpack(lily_container_val *c)
+{
+    lily_arena *arena = lily_slab_arena(c);
+    uint32_t size = c->num_values + c->extra_space;
+    lily_value *values = lily_arena_malloc(arena,
+            (size ? size : 1) * sizeof(*values));
+    uint32_t i;
+
+    for (i = 0;i < c->num_values;i++)
+        lily_list_packed_get(c, i, values + i);
+
+    lily_arena_free(arena, c->values);
+    c->values = values;
+    c->packed_id = 0;
+}
+
+/* Packed values are never refcounted, so these don't ref or deref. The target
+   is overwritten, and should not have a refcounted value in it. */
+void lily_list_packed_get(lily_container_val *c, uint32_t index,
+        lily_value *target)
+{
+    if (c->packed_id == LILY_ID_BYTE)
+        target->value.integer = ((uint8_t *)c->values)[index];
+    else
+        target->value = ((lily_raw_value *)c->values)[index];
+
+    target->flags = c->packed_id;
+}
+
+void lily_list_packed_set(lily_container_val *c, uint32_t index,
+        lily_value *v)
+{
+    if (c->packed_id == LILY_ID_BYTE)
+        ((uint8_t *)c->values)[index] = (uint8_t)v->value.integer;
+    else
+        ((lily_raw_value *)c->values)[index] = v->value;
+}
+
+/* Get the element at 'index' for reading, without unpacking the List. If the
+   List is packed, the value is copied into 'scratch'. */
+lily_value *lily_list_peek(lily_container_val *c, uint32_t index,
+        lily_value *scratch)
+{
+    if (LILY_LIST_IS_PACKED(c)) {
+        lily_list_packed_get(c, index, scratch);
+        return scratch;
+    }
+
+    return c->values + index;
+}
+
+/* An empty List can be packed once it's known what it holds. A packed List
+   given a value of some other class (which can only come from a foreign
+   function using $1) goes back to full values. */
+static void check_packing(lily_container_val *c, lily_value *v)
+{
+    if (c->packed_id == v->class_id)
+        return;
+
+    if (c->packed_id)
+        lily_list_unpack(c);
+    else if (c->num_values == 0 && LILY_CAN_PACK(v->class_id))
+        lily_list_pack(c, v->class_id, c->extra_space);
+}
+
 void lily_list_take(lily_state *s, lily_container_val *c, int index)
 {
-    lily_value *v = c->values[index];
-    lily_push_value(s, v);
+    if (c->packed_id) {
+        lily_value v;
+        char *values = (char *)c->values;
+        size_t width = packed_width(c->packed_id);
+
+        lily_list_packed_get(c, index, &v);
+        lily_push_value(s, &v);
+
+        if (index != c->num_values)
+            memmove(values + index * width, values + (index + 1) * width,
+                    (c->num_values - index - 1) * width);
+
+        c->num_values--;
+        c->extra_space++;
+        return;
+    }
 
+    lily_value *v = c->values + index;
+    lily_push_value(s, v);
     lily_deref(v);
-    lily_free(v);
 
     if (index != c->num_values)
         memmove(c->values + index, c->values + index + 1,
@@ -133,8 +275,8 @@ static void grow_list(lily_container_val *lv)
 {
     /* There's probably room for improvement here, later on. */
     int extra = (lv->num_values + 8) >> 2;
-    lv->values = lily_realloc(lv->values,
-            (lv->num_values + extra) * sizeof(*lv->values));
+    lv->values = lily_arena_realloc(lily_slab_arena(lv), lv->values,
+            (lv->num_values + extra) * list_width(lv));
     lv->extra_space = extra;
 }
 
@@ -151,22 +293,75 @@ void lily_list_reserve(lily_container_val *c, int new_size)
     while (size < new_size)
         size *= 2;
 
-    c->values = lily_realloc(c->values, size * sizeof(*c->values));
+    c->values = lily_arena_realloc(lily_slab_arena(c), c->values,
+            size * list_width(c));
     c->extra_space = size - c->num_values;
 }
 
-void lily_list_push(lily_container_val *c, lily_value *v)
+/* Packed values can't refer to the List, and don't need a ref or the gc. */
+static void packed_insert(lily_container_val *c, int index, lily_value *v)
+{
+    if (c->extra_space == 0)
+        grow_list(c);
+
+    if (index != c->num_values) {
+        char *values = (char *)c->values;
+        size_t width = packed_width(c->packed_id);
+
+        memmove(values + (index + 1) * width, values + index * width,
+                (c->num_values - index) * width);
+    }
+
+    lily_list_packed_set(c, index, v);
+    c->num_values++;
+    c->extra_space--;
+}
+
+/* Elements are stored inline, so growing may move them. The source value could
+   be one of those elements, so it's copied out before the list grows. */
+void lily_list_push(lily_state *s, lily_container_val *c, lily_value *v)
 {
+    check_packing(c, v);
+
+    if (c->packed_id) {
+        packed_insert(c, c->num_values, v);
+        return;
+    }
+
+    lily_value copy = *v;
+
+    if (copy.flags & VAL_IS_DEREFABLE)
+        copy.value.generic->refcount++;
+
+    if (copy.flags & VAL_IS_GC_SWEEPABLE)
+        lily_gc_barrier(s, &copy);
+
     if (c->extra_space == 0)
         grow_list(c);
 
-    c->values[c->num_values] = lily_value_copy(v);
+    c->values[c->num_values] = copy;
     c->num_values++;
     c->extra_space--;
 }
 
-void lily_list_insert(lily_container_val *c, int index, lily_value *v)
+void lily_list_insert(lily_state *s, lily_container_val *c, int index,
+        lily_value *v)
 {
+    check_packing(c, v);
+
+    if (c->packed_id) {
+        packed_insert(c, index, v);
+        return;
+    }
+
+    lily_value copy = *v;
+
+    if (copy.flags & VAL_IS_DEREFABLE)
+        copy.value.generic->refcount++;
+
+    if (copy.flags & VAL_IS_GC_SWEEPABLE)
+        lily_gc_barrier(s, &copy);
+
     if (c->extra_space == 0)
         grow_list(c);
 
@@ -174,13 +369,15 @@ void lily_list_insert(lily_container_val *c, int index, lily_value *v)
         memmove(c->values + index + 1, c->values + index,
                 (c->num_values - index) * sizeof(*c->values));
 
-    c->values[index] = lily_value_copy(v);
+    c->values[index] = copy;
     c->num_values++;
     c->extra_space--;
 }
 
 char *lily_bytestring_raw(lily_bytestring_val *sv)
 {
+    /* The caller may change what's returned, so a slice can't keep sharing. */
+    lily_string_unshare((lily_string_val *)sv);
     return sv->string;
 }
 
@@ -189,8 +386,27 @@ int lily_bytestring_length(lily_bytestring_val *sv)
     return sv->size;
 }
 
+/* Regular files are read ahead in blocks this size. A line that's larger
+   grows the buffer to fit. */
+#define FILE_BUFFER_SIZE 65536
+
+/* Anything that reads or writes inner_file directly needs it to be where the
+   last line stopped. Lines are only read ahead from regular files, so this
+   seek works. */
+static void give_back_read_ahead(lily_file_val *filev)
+{
+    uint32_t unused = filev->read_end - filev->read_pos;
+
+    if (unused && filev->inner_file)
+        fseek(filev->inner_file, -(long)unused, SEEK_CUR);
+
+    filev->read_pos = 0;
+    filev->read_end = 0;
+}
+
 FILE *lily_file_raw(lily_file_val *fv)
 {
+    give_back_read_ahead(fv);
     return fv->inner_file;
 }
 
@@ -202,10 +418,11 @@ FILE *lily_file_for_write(lily_state *s, lily_file_val *filev)
     if (filev->write_ok == 0)
         lily_IOError(s, "File not open for writing.");
 
+    give_back_read_ahead(filev);
     return filev->inner_file;
 }
 
-FILE *lily_file_for_read(lily_state *s, lily_file_val *filev)
+static void check_read(lily_state *s, lily_file_val *filev)
 {
     if (filev->inner_file == NULL)
         lily_IOError(s, "IO operation on closed file.");
@@ -213,9 +430,129 @@ FILE *lily_file_for_read(lily_state *s, lily_file_val *filev)
     if (filev->read_ok == 0)
         lily_IOError(s, "File not open for reading.");
 
+    /* Like stdio does, send what's buffered for stdout before waiting on
+       stdin, so that a prompt is seen. */
+    if (filev->inner_file == stdin)
+        lily_flush_output(s);
+}
+
+FILE *lily_file_for_read(lily_state *s, lily_file_val *filev)
+{
+    check_read(s, filev);
+    give_back_read_ahead(filev);
     return filev->inner_file;
 }
 
+static int file_is_regular(FILE *f)
+{
+#ifdef _WIN32
+    /* Text mode changes the size of what's read, so seeking back by that
+       amount isn't safe. */
+    (void)f;
+    return 0;
+#else
+    struct stat st;
+
+    return fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode);
+#endif
+}
+
+/* Pipes and terminals are read a line at a time, so that a line is handed out
+   as soon as it's there. This uses getc instead of fgets, because fgets doesn't
+   say how much it read if the line has a \0. */
+static uint32_t read_one_line(FILE *f, char *buffer, uint32_t space)
+{
+    uint32_t pos = 0;
+    int ch;
+
+    while (pos < space) {
+        ch = getc(f);
+
+        if (ch == EOF)
+            break;
+
+        buffer[pos] = (char)ch;
+        pos++;
+
+        if (ch == '\n')
+            break;
+    }
+
+    return pos;
+}
+
+uint32_t lily_file_next_line(lily_state *s, lily_file_val *filev,
+        const char **out)
+{
+    check_read(s, filev);
+
+    FILE *f = filev->inner_file;
+
+    if (filev->read_buffer == NULL) {
+        filev->read_size = FILE_BUFFER_SIZE;
+        filev->read_buffer = lily_malloc(filev->read_size *
+                sizeof(*filev->read_buffer));
+        filev->read_ahead = (uint8_t)file_is_regular(f);
+    }
+
+    /* Don't look through what was already searched for a newline. */
+    uint32_t search_pos = filev->read_pos;
+
+    while (1) {
+        char *buffer = filev->read_buffer;
+        char *newline = memchr(buffer + search_pos, '\n',
+                filev->read_end - search_pos);
+
+        if (newline) {
+            uint32_t size = (uint32_t)(newline + 1 - buffer) - filev->read_pos;
+
+            *out = buffer + filev->read_pos;
+            filev->read_pos += size;
+            return size;
+        }
+
+        /* Move the partial line to the front, and grow if it fills the
+           buffer. */
+        uint32_t partial = filev->read_end - filev->read_pos;
+
+        memmove(buffer, buffer + filev->read_pos, partial);
+        filev->read_pos = 0;
+        filev->read_end = partial;
+        search_pos = partial;
+
+        if (partial == filev->read_size) {
+            filev->read_size *= 2;
+            buffer = lily_realloc(buffer, filev->read_size * sizeof(*buffer));
+            filev->read_buffer = buffer;
+        }
+
+        uint32_t space = filev->read_size - partial;
+        uint32_t got;
+
+        if (filev->read_ahead)
+            got = (uint32_t)fread(buffer + partial, 1, space, f);
+        else
+            got = read_one_line(f, buffer + partial, space);
+
+        if (got == 0) {
+            /* The end of the File: What's left is the last line. */
+            *out = buffer;
+            filev->read_pos = partial;
+            return partial;
+        }
+
+        filev->read_end += got;
+    }
+}
+
+void lily_file_free_buffer(lily_file_val *filev)
+{
+    lily_free(filev->read_buffer);
+    filev->read_buffer = NULL;
+    filev->read_pos = 0;
+    filev->read_end = 0;
+}
+
 int lily_function_is_foreign(lily_function_val *fv)
 {
     return fv->code == NULL;
@@ -228,6 +565,10 @@ int lily_function_is_native(lily_function_val *fv)
 
 char *lily_string_raw(lily_string_val *sv)
 {
+    /* A slice that ends where the parent does already has a \0. */
+    if (sv->parent && sv->string[sv->size] != '\0')
+        lily_string_unshare(sv);
+
     return sv->string;
 }
 
@@ -241,6 +582,14 @@ int lily_string_length(lily_string_val *sv)
 extern void lily_destroy_hash(lily_value *);
 extern lily_gc_entry *lily_gc_stopper;
 
+static void free_values(lily_container_val *c)
+{
+    if (LILY_POOLED_VALUES(c->class_id, c->num_values))
+        lily_slab_free(c->values);
+    else
+        lily_arena_free(lily_slab_arena(c), c->values);
+}
+
 static void destroy_container(lily_value *v)
 {
     lily_container_val *iv = v->value.container;
@@ -258,37 +607,68 @@ static void destroy_container(lily_value *v)
     }
 
     int i;
-    for (i = 0;i < iv->num_values;i++) {
-        lily_deref(iv->values[i]);
-        lily_free(iv->values[i]);
-    }
+    for (i = 0;i < iv->num_values;i++)
+        lily_deref(iv->values + i);
 
-    lily_free(iv->values);
+    free_values(iv);
 
     if (full_destroy)
-        lily_free(iv);
+        lily_slab_free(iv);
 }
 
 static void destroy_list(lily_value *v)
 {
     lily_container_val *lv = v->value.container;
 
-    int i;
-    for (i = 0;i < lv->num_values;i++) {
-        lily_deref(lv->values[i]);
-        lily_free(lv->values[i]);
+    /* Packed values have nothing to deref. */
+    if (LILY_LIST_IS_PACKED(lv) == 0) {
+        int i;
+        for (i = 0;i < lv->num_values;i++)
+            lily_deref(lv->values + i);
+    }
+
+    free_values(lv);
+    lily_slab_free(lv);
+}
+
+/* Parents are never slices, so this doesn't need to go further up. */
+static void deref_parent(lily_string_val *parent)
+{
+    parent->refcount--;
+
+    if (parent->refcount == 0) {
+        lily_arena_free(lily_slab_arena(parent), parent->string);
+        lily_slab_free(parent);
     }
+}
+
+void lily_string_unshare(lily_string_val *sv)
+{
+    lily_string_val *parent = sv->parent;
+
+    if (parent == NULL)
+        return;
 
-    lily_free(lv->values);
-    lily_free(lv);
+    char *buffer = lily_arena_malloc(lily_slab_arena(sv),
+            (sv->size + 1) * sizeof(*buffer));
+
+    memcpy(buffer, sv->string, sv->size);
+    buffer[sv->size] = '\0';
+    sv->string = buffer;
+    sv->parent = NULL;
+    deref_parent(parent);
 }
 
 static void destroy_string(lily_value *v)
 {
     lily_string_val *sv = v->value.string;
 
-    lily_free(sv->string);
-    lily_free(sv);
+    if (sv->parent)
+        deref_parent(sv->parent);
+    else
+        lily_arena_free(lily_slab_arena(sv), sv->string);
+
+    lily_slab_free(sv);
 }
 
 static void destroy_function(lily_value *v)
@@ -319,14 +699,14 @@ static void destroy_function(lily_value *v)
 
             if (up->cell_refcount == 0) {
                 lily_deref(up);
-                lily_free(up);
+                lily_slab_free(up);
             }
         }
     }
-    lily_free(upvalues);
+    lily_arena_free(lily_slab_arena(fv), upvalues);
 
     if (full_destroy)
-        lily_free(fv);
+        lily_slab_free(fv);
 }
 
 static void destroy_file(lily_value *v)
@@ -336,6 +716,7 @@ static void destroy_file(lily_value *v)
     if (filev->inner_file && filev->is_builtin == 0)
         fclose(filev->inner_file);
 
+    lily_free(filev->read_buffer);
     lily_free(filev);
 }
 
@@ -413,8 +794,11 @@ static int subvalue_eq(lily_state *s, int *depth, lily_value *left,
         ok = 1;
         int i;
         for (i = 0;i < left_list->num_values;i++) {
-            lily_value *left_item = left_list->values[i];
-            lily_value *right_item = right_list->values[i];
+            lily_value left_scratch, right_scratch;
+            lily_value *left_item = lily_list_peek(left_list, i,
+                    &left_scratch);
+            lily_value *right_item = lily_list_peek(right_list, i,
+                    &right_scratch);
             (*depth)++;
             if (lily_value_compare_raw(s, depth, left_item, right_item) == 0) {
                 (*depth)--;
@@ -430,6 +814,32 @@ static int subvalue_eq(lily_state *s, int *depth, lily_value *left,
     return ok;
 }
 
+/* Interned strings and literals are often compared against themselves, so
+   check for that first. Strings that have different saved hashes can't be
+   equal either. */
+int lily_string_eq(lily_string_val *left, lily_string_val *right)
+{
+    if (left == right)
+        return 1;
+
+    if (left->size != right->size ||
+        (left->hash && right->hash && left->hash != right->hash))
+        return 0;
+
+    return memcmp(left->string, right->string, left->size) == 0;
+}
+
+int lily_string_cmp(lily_string_val *left, lily_string_val *right)
+{
+    uint32_t size = left->size < right->size ? left->size : right->size;
+    int result = memcmp(left->string, right->string, size);
+
+    if (result == 0)
+        result = (left->size > right->size) - (left->size < right->size);
+
+    return result;
+}
+
 /* Determine if two values are equivalent to each other. */
 int lily_value_compare_raw(lily_state *s, int *depth, lily_value *left,
         lily_value *right)
@@ -447,8 +857,7 @@ int lily_value_compare_raw(lily_state *s, int *depth, lily_value *left,
     else if (left_tag == LILY_ID_DOUBLE)
         return left->value.doubleval == right->value.doubleval;
     else if (left_tag == LILY_ID_STRING)
-        return strcmp(left->value.string->string,
-                right->value.string->string) == 0;
+        return lily_string_eq(left->value.string, right->value.string);
     else if (left_tag == LILY_ID_BYTESTRING) {
         lily_string_val *left_sv = left->value.string;
         lily_string_val *right_sv = right->value.string;
@@ -472,18 +881,18 @@ int lily_value_compare_raw(lily_state *s, int *depth, lily_value *left,
         if (ok) {
             (*depth)++;
             int i;
-            for (i = 0;i < left_hash->num_bins;i++) {
-                lily_hash_entry *left = left_hash->bins[i];
-                if (left) {
-                    lily_value *right = lily_hash_get(s, right_hash,
-                            left->boxed_key);
-
-                    if (right == NULL ||
-                        lily_value_compare_raw(s, depth, left->record,
-                                right) == 0) {
-                        ok = 0;
-                        break;
-                    }
+            for (i = 0;i < left_hash->entries_used;i++) {
+                lily_hash_entry *left = left_hash->entries + i;
+                if (left->key.flags == 0)
+                    continue;
+
+                lily_value *right = lily_hash_get(s, right_hash, &left->key);
+
+                if (right == NULL ||
+                    lily_value_compare_raw(s, depth, &left->record,
+                            right) == 0) {
+                    ok = 0;
+                    break;
                 }
             }
             (*depth)--;
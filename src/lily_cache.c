@@ -0,0 +1,1457 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "lily.h"
+
+#include "lily_alloc.h"
+#include "lily_cache.h"
+#include "lily_parser.h"
+
+#include "lily_int_code_iter.h"
+#include "lily_int_opcode.h"
+
+extern uint64_t siphash24(const void *, unsigned long, const char [16]);
+
+/** The bytecode cache saves a program once it has been compiled, so that later
+    runs can skip lexing, parsing, and emitting. The cache is a single image of
+    what the vm needs to run the program: native functions, literals, classes
+    made by the program, and the globals. It's written next to the first file,
+    with a 'c' after the suffix ('.lilyc').
+
+    Foreign symbols are not saved. The image has the module and name of each
+    foreign function, class, and var that the program used, and loading the
+    image dynaloads them again. Loading can give out different ids than the
+    first run did, so the code of the image is walked and relocated with a code
+    iterator once everything is loaded.
+
+    An image is only used if it was made by the same version of the interpreter,
+    every source file has the same size and contents, and every foreign module
+    has the same dynaload table. If any of those checks fail, the program is
+    parsed like normal and a new image is written.
+
+    There are a few kinds of programs that aren't cached. Modules loaded from a
+    string instead of a file can't be checked, and neither can foreign modules
+    that aren't registered or backed by a library. If the program has either of
+    those, the image isn't written. **/
+
+/* Bump this when the layout of an image changes. */
+#define IMAGE_FORMAT 1
+
+/* This is written next to the format, so that images aren't shared between
+   machines of a different byte order. */
+#define IMAGE_BYTE_ORDER 0x01020304
+
+#define IMAGE_MODULE_REGISTERED 0
+#define IMAGE_MODULE_LIBRARY    1
+
+#define IMAGE_CLASS_NONE    0
+#define IMAGE_CLASS_FOREIGN 1
+#define IMAGE_CLASS_USER    2
+#define IMAGE_CLASS_ENUM    3
+#define IMAGE_CLASS_VARIANT 4
+
+#define IMAGE_GLOBAL_USER    0
+#define IMAGE_GLOBAL_FOREIGN 1
+
+#define IMAGE_INTEGER      0
+#define IMAGE_DOUBLE       1
+#define IMAGE_STRING       2
+#define IMAGE_BYTESTRING   3
+#define IMAGE_UNIT         4
+#define IMAGE_FOREIGN_FUNC 5
+#define IMAGE_NATIVE_FUNC  6
+
+static const char image_magic[8] = "lilyc\r\n";
+
+/* Source files and the image itself are checked with this key. It doesn't need
+   to be secret, since it's only used to notice changes. */
+static const char image_key[16] = {
+    'l', 'i', 'l', 'y', 'c', 'a', 'c', 'h', 'e', 0, 1, 2, 3, 4, 5, 6
+};
+
+typedef struct {
+    char *data;
+    uint32_t pos;
+    uint32_t size;
+} image_writer;
+
+typedef struct {
+    const char *data;
+    uint32_t pos;
+    uint32_t size;
+    /* This is set to 0 if a read goes past the end of the image. */
+    uint32_t ok;
+} image_reader;
+
+/* This holds the classes of an image while they're being loaded, since they're
+   loaded in a few passes. */
+typedef struct {
+    const char *name;
+    uint16_t kind;
+    /* For foreign classes, the module. For everything else, the parent. */
+    uint16_t source;
+    uint16_t flags;
+    uint16_t size;
+    uint16_t inherit_depth;
+    /* For classes and enums, the source file they're in. */
+    uint16_t module;
+} image_class;
+
+typedef struct {
+    lily_parse_state *parser;
+    image_reader *reader;
+
+    const char **source_paths;
+    lily_module_entry **sources;
+    lily_module_entry **modules;
+
+    /* These map from what the image has to what the interpreter has. The
+       classes are in the image's class id order. */
+    lily_class **classes;
+    uint16_t *global_map;
+    uint16_t *readonly_map;
+
+    lily_function_val **functions;
+
+    uint16_t source_count;
+    uint16_t module_count;
+    uint16_t class_count;
+    uint16_t global_count;
+    uint16_t readonly_count;
+    uint16_t function_count;
+    uint32_t pad;
+} image_loader;
+
+/* This is for saving, to know which module each foreign symbol came from. */
+typedef struct {
+    lily_module_entry **sources;
+    lily_module_entry **modules;
+    uint16_t source_count;
+    uint16_t module_count;
+    uint32_t pad;
+} image_modules;
+
+/***
+ *      _   _      _
+ *     | | | | ___| |_ __   ___ _ __ ___
+ *     | |_| |/ _ \ | '_ \ / _ \ '__/ __|
+ *     |  _  |  __/ | |_) |  __/ |  \__ \
+ *     |_| |_|\___|_| .__/ \___|_|  |___/
+ *                  |_|
+ */
+
+static char *image_path_for(const char *path)
+{
+    size_t len = strlen(path);
+    char *result = lily_malloc((len + 2) * sizeof(*result));
+
+    strcpy(result, path);
+    result[len] = 'c';
+    result[len + 1] = '\0';
+    return result;
+}
+
+/* Read all of the file at 'path'. The result is NULL if the file can't be
+   opened. Otherwise, the caller must free the result. */
+static char *read_whole_file(const char *path, uint32_t *size_out)
+{
+    FILE *f = fopen(path, "rb");
+
+    if (f == NULL)
+        return NULL;
+
+    uint32_t size = 0;
+    uint32_t capacity = 4096;
+    char *buffer = lily_malloc(capacity * sizeof(*buffer));
+
+    while (1) {
+        size_t got = fread(buffer + size, 1, capacity - size, f);
+
+        size += (uint32_t)got;
+
+        if (size != capacity)
+            break;
+
+        capacity *= 2;
+        buffer = lily_realloc(buffer, capacity * sizeof(*buffer));
+    }
+
+    fclose(f);
+    *size_out = size;
+    return buffer;
+}
+
+/* Dynaload tables are an array of strings. The first has a count of cid names
+   and then the names. The rest are entries that start with a letter and a count
+   byte (which may be 0), followed by the name and body. The table ends with an
+   entry starting with 'Z'. */
+static uint64_t hash_dynaload_table(const char **table)
+{
+    const char *header = table[0];
+    const char *header_iter = header + 1;
+    int count = (unsigned char)header[0];
+    int i;
+
+    for (i = 0;i < count;i++)
+        header_iter += strlen(header_iter) + 1;
+
+    uint64_t hash = siphash24(header, header_iter - header, image_key);
+
+    for (i = 1;table[i][0] != 'Z';i++) {
+        const char *entry = table[i];
+        const char *name = entry + 2;
+        const char *body = name + strlen(name) + 1;
+        size_t size = (body + strlen(body)) - entry;
+
+        hash = (hash * 0x100000001b3ULL) ^ siphash24(entry, size, image_key);
+    }
+
+    return hash;
+}
+
+static void write_bytes(image_writer *w, const void *source, uint32_t size)
+{
+    if (w->pos + size > w->size) {
+        while (w->pos + size > w->size)
+            w->size *= 2;
+
+        w->data = lily_realloc(w->data, w->size * sizeof(*w->data));
+    }
+
+    memcpy(w->data + w->pos, source, size);
+    w->pos += size;
+}
+
+static void write_u8(image_writer *w, uint8_t value)
+{
+    write_bytes(w, &value, sizeof(value));
+}
+
+static void write_u16(image_writer *w, uint16_t value)
+{
+    write_bytes(w, &value, sizeof(value));
+}
+
+static void write_u32(image_writer *w, uint32_t value)
+{
+    write_bytes(w, &value, sizeof(value));
+}
+
+static void write_u64(image_writer *w, uint64_t value)
+{
+    write_bytes(w, &value, sizeof(value));
+}
+
+static void write_data(image_writer *w, const char *data, uint32_t size)
+{
+    write_u32(w, size);
+    write_bytes(w, data, size);
+}
+
+/* Strings are written with their terminator, so they can be used right out of
+   the image when it's loaded. */
+static void write_string(image_writer *w, const char *str)
+{
+    write_data(w, str, (uint32_t)strlen(str) + 1);
+}
+
+static void read_bytes(image_reader *r, void *dest, uint32_t size)
+{
+    if (r->size - r->pos < size) {
+        r->ok = 0;
+        memset(dest, 0, size);
+        return;
+    }
+
+    memcpy(dest, r->data + r->pos, size);
+    r->pos += size;
+}
+
+static uint8_t read_u8(image_reader *r)
+{
+    uint8_t value;
+    read_bytes(r, &value, sizeof(value));
+    return value;
+}
+
+static uint16_t read_u16(image_reader *r)
+{
+    uint16_t value;
+    read_bytes(r, &value, sizeof(value));
+    return value;
+}
+
+static uint32_t read_u32(image_reader *r)
+{
+    uint32_t value;
+    read_bytes(r, &value, sizeof(value));
+    return value;
+}
+
+static uint64_t read_u64(image_reader *r)
+{
+    uint64_t value;
+    read_bytes(r, &value, sizeof(value));
+    return value;
+}
+
+static const char *read_data(image_reader *r, uint32_t *size_out)
+{
+    uint32_t size = read_u32(r);
+
+    if (r->size - r->pos < size) {
+        r->ok = 0;
+        *size_out = 0;
+        return "";
+    }
+
+    const char *result = r->data + r->pos;
+
+    r->pos += size;
+    *size_out = size;
+    return result;
+}
+
+static const char *read_string(image_reader *r)
+{
+    uint32_t size;
+    const char *result = read_data(r, &size);
+
+    if (size == 0 || result[size - 1] != '\0') {
+        r->ok = 0;
+        result = "";
+    }
+
+    return result;
+}
+
+/* Read the u16 code of a function into a new buffer. The extra space at the
+   end is to match what emitter makes. */
+static uint16_t *read_code(image_reader *r, uint32_t size)
+{
+    uint16_t *code = lily_malloc((size + 1) * sizeof(*code));
+
+    read_bytes(r, code, size * sizeof(*code));
+    return code;
+}
+
+/***
+ *      ____
+ *     / ___|  __ ___   _____
+ *     \___ \ / _` \ \ / / _ \
+ *      ___) | (_| |\ V /  __/
+ *     |____/ \__,_| \_/ \___|
+ *
+ */
+
+static int index_of_module(lily_module_entry **modules, uint16_t count,
+        lily_module_entry *m)
+{
+    int i;
+
+    for (i = 0;i < count;i++) {
+        if (modules[i] == m)
+            return i;
+    }
+
+    return -1;
+}
+
+/* Native functions only know the path of their module, so search by that. */
+static int index_of_source(image_modules *im, const char *path)
+{
+    int i;
+
+    for (i = 0;i < im->source_count;i++) {
+        if (im->sources[i]->path == path ||
+            strcmp(im->sources[i]->path, path) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+/* Sort modules into source files and foreign modules. The first source is the
+   first file. This fails if there's a module that the image can't represent. */
+static int collect_modules(lily_parse_state *parser, image_modules *im)
+{
+    lily_module_entry *module_iter = parser->module_start;
+    int count = 0;
+
+    while (module_iter) {
+        count++;
+        module_iter = module_iter->root_next;
+    }
+
+    im->sources = lily_malloc(count * sizeof(*im->sources));
+    im->modules = lily_malloc(count * sizeof(*im->modules));
+    im->sources[0] = parser->main_module;
+    im->source_count = 1;
+    im->module_count = 0;
+
+    for (module_iter = parser->module_start;
+         module_iter;
+         module_iter = module_iter->root_next) {
+        if (module_iter == parser->main_module)
+            continue;
+
+        if (module_iter->dynaload_table) {
+            if ((module_iter->flags & MODULE_IS_REGISTERED) == 0 &&
+                module_iter->handle == NULL)
+                return 0;
+
+            im->modules[im->module_count] = module_iter;
+            im->module_count++;
+        }
+        else if (module_iter->flags & MODULE_IS_FILE) {
+            im->sources[im->source_count] = module_iter;
+            im->source_count++;
+        }
+        else
+            return 0;
+    }
+
+    return 1;
+}
+
+static int write_sources(image_writer *w, image_modules *im)
+{
+    int i;
+
+    write_u16(w, im->source_count);
+
+    for (i = 0;i < im->source_count;i++) {
+        const char *path = im->sources[i]->path;
+        uint32_t size;
+        char *data = read_whole_file(path, &size);
+
+        if (data == NULL)
+            return 0;
+
+        write_string(w, path);
+        write_u32(w, size);
+        write_u64(w, siphash24(data, size, image_key));
+        lily_free(data);
+    }
+
+    return 1;
+}
+
+static void write_modules(image_writer *w, image_modules *im)
+{
+    int i;
+
+    write_u16(w, im->module_count);
+
+    for (i = 0;i < im->module_count;i++) {
+        lily_module_entry *m = im->modules[i];
+
+        if (m->flags & MODULE_IS_REGISTERED) {
+            write_u8(w, IMAGE_MODULE_REGISTERED);
+            write_string(w, m->loadname);
+        }
+        else {
+            write_u8(w, IMAGE_MODULE_LIBRARY);
+            write_string(w, m->path);
+        }
+
+        write_u64(w, hash_dynaload_table(m->dynaload_table));
+    }
+}
+
+static void write_classes(image_writer *w, lily_parse_state *parser,
+        image_modules *im)
+{
+    uint16_t count = parser->symtab->next_class_id;
+    lily_class **classes = lily_malloc(count * sizeof(*classes));
+    lily_module_entry **owners = lily_malloc(count * sizeof(*owners));
+    lily_module_entry *module_iter;
+    int i;
+
+    memset(classes, 0, count * sizeof(*classes));
+
+    /* This walks classes the same way that lily_register_classes does. */
+    for (module_iter = parser->module_start;
+         module_iter;
+         module_iter = module_iter->root_next) {
+        lily_class *class_iter = module_iter->class_chain;
+
+        for (;class_iter;class_iter = class_iter->next) {
+            if (class_iter->id < count) {
+                classes[class_iter->id] = class_iter;
+                owners[class_iter->id] = module_iter;
+            }
+
+            if ((class_iter->flags & CLS_IS_ENUM) == 0)
+                continue;
+
+            lily_named_sym *sym_iter = class_iter->members;
+
+            for (;sym_iter;sym_iter = sym_iter->next) {
+                lily_variant_class *v = (lily_variant_class *)sym_iter;
+
+                if (sym_iter->item_kind == ITEM_TYPE_VARIANT &&
+                    v->cls_id < count)
+                    classes[v->cls_id] = (lily_class *)v;
+            }
+        }
+    }
+
+    write_u16(w, count);
+
+    for (i = 0;i < count;i++) {
+        lily_class *cls = classes[i];
+
+        if (cls == NULL)
+            write_u8(w, IMAGE_CLASS_NONE);
+        else if (cls->item_kind == ITEM_TYPE_VARIANT) {
+            lily_variant_class *v = (lily_variant_class *)cls;
+
+            write_u8(w, IMAGE_CLASS_VARIANT);
+            write_string(w, v->name);
+            write_u16(w, v->parent->id);
+            write_u16(w, v->flags);
+        }
+        else if (owners[i]->dynaload_table) {
+            write_u8(w, IMAGE_CLASS_FOREIGN);
+            write_string(w, cls->name);
+            write_u16(w, index_of_module(im->modules, im->module_count,
+                    owners[i]));
+        }
+        else {
+            if (cls->flags & CLS_IS_ENUM)
+                write_u8(w, IMAGE_CLASS_ENUM);
+            else
+                write_u8(w, IMAGE_CLASS_USER);
+
+            write_string(w, cls->name);
+            write_u16(w, cls->parent ? cls->parent->id : 0);
+            write_u16(w, cls->flags & ~CLS_VISITED);
+            write_u16(w, cls->prop_count);
+            write_u16(w, cls->inherit_depth);
+            write_u16(w, index_of_module(im->sources, im->source_count,
+                    owners[i]));
+        }
+    }
+
+    lily_free(owners);
+    lily_free(classes);
+}
+
+static void write_globals(image_writer *w, lily_parse_state *parser,
+        image_modules *im)
+{
+    uint16_t count = parser->symtab->next_global_id;
+    lily_var **vars = lily_malloc(count * sizeof(*vars));
+    uint16_t *owners = lily_malloc(count * sizeof(*owners));
+    int i;
+
+    memset(vars, 0, count * sizeof(*vars));
+
+    /* Globals from foreign modules are vars that were dynaloaded. Anything else
+       is a global of the program. */
+    for (i = 0;i < im->module_count;i++) {
+        lily_var *var_iter = im->modules[i]->var_chain;
+
+        for (;var_iter;var_iter = var_iter->next) {
+            if (var_iter->flags & VAR_IS_GLOBAL &&
+                var_iter->reg_spot < count) {
+                vars[var_iter->reg_spot] = var_iter;
+                owners[var_iter->reg_spot] = (uint16_t)i;
+            }
+        }
+    }
+
+    write_u16(w, count);
+
+    for (i = 0;i < count;i++) {
+        if (vars[i] == NULL)
+            write_u8(w, IMAGE_GLOBAL_USER);
+        else {
+            write_u8(w, IMAGE_GLOBAL_FOREIGN);
+            write_u16(w, owners[i]);
+            write_string(w, vars[i]->name);
+        }
+    }
+
+    lily_free(owners);
+    lily_free(vars);
+}
+
+static void find_foreign_func(lily_var **vars, uint16_t *owners,
+        uint16_t count, lily_var *var, uint16_t module_index)
+{
+    if (var->flags & VAR_IS_FOREIGN_FUNC &&
+        var->reg_spot < count) {
+        vars[var->reg_spot] = var;
+        owners[var->reg_spot] = module_index;
+    }
+}
+
+static int write_function(image_writer *w, image_modules *im,
+        lily_function_val *f)
+{
+    lily_proto *proto = f->proto;
+    int source = index_of_source(im, proto->module_path);
+
+    if (f->code == NULL || source == -1)
+        return 0;
+
+    write_u8(w, IMAGE_NATIVE_FUNC);
+    write_u16(w, (uint16_t)source);
+    write_string(w, proto->name);
+    write_u16(w, f->reg_count);
+    write_u16(w, f->code_len);
+    write_bytes(w, f->code, f->code_len * sizeof(*f->code));
+
+    /* locals[0] is the size of locals, including itself. */
+    if (proto->locals) {
+        write_u16(w, proto->locals[0]);
+        write_bytes(w, proto->locals + 1,
+                (proto->locals[0] - 1) * sizeof(*proto->locals));
+    }
+    else
+        write_u16(w, 0);
+
+    return 1;
+}
+
+static int write_readonly(image_writer *w, lily_parse_state *parser,
+        image_modules *im)
+{
+    lily_value_stack *literals = parser->symtab->literals;
+    uint16_t count = (uint16_t)lily_vs_pos(literals);
+    lily_var **vars = lily_malloc(count * sizeof(*vars));
+    uint16_t *owners = lily_malloc(count * sizeof(*owners));
+    int i, ok = 1;
+
+    memset(vars, 0, count * sizeof(*vars));
+
+    for (i = 0;i < im->module_count;i++) {
+        lily_module_entry *m = im->modules[i];
+        lily_var *var_iter = m->var_chain;
+        lily_class *class_iter = m->class_chain;
+
+        for (;var_iter;var_iter = var_iter->next)
+            find_foreign_func(vars, owners, count, var_iter, i);
+
+        for (;class_iter;class_iter = class_iter->next) {
+            lily_named_sym *sym_iter = class_iter->members;
+
+            for (;sym_iter;sym_iter = sym_iter->next) {
+                if (sym_iter->item_kind == ITEM_TYPE_VAR)
+                    find_foreign_func(vars, owners, count,
+                            (lily_var *)sym_iter, i);
+            }
+        }
+    }
+
+    write_u16(w, count);
+
+    /* Skip __main__, which is always first. */
+    for (i = 1;i < count && ok;i++) {
+        lily_literal *lit = (lily_literal *)lily_vs_nth(literals, i);
+
+        switch (lit->class_id) {
+            case LILY_ID_INTEGER:
+                write_u8(w, IMAGE_INTEGER);
+                write_u64(w, (uint64_t)lit->value.integer);
+                break;
+            case LILY_ID_DOUBLE:
+                write_u8(w, IMAGE_DOUBLE);
+                write_bytes(w, &lit->value.doubleval,
+                        sizeof(lit->value.doubleval));
+                break;
+            case LILY_ID_STRING:
+                write_u8(w, IMAGE_STRING);
+                write_string(w, lit->value.string->string);
+                break;
+            case LILY_ID_BYTESTRING:
+                write_u8(w, IMAGE_BYTESTRING);
+                write_data(w, lit->value.string->string,
+                        lit->value.string->size);
+                break;
+            case LILY_ID_UNIT:
+                write_u8(w, IMAGE_UNIT);
+                break;
+            case LILY_ID_FUNCTION: {
+                lily_function_val *f = lit->value.function;
+                lily_var *var = vars[i];
+
+                if (f->foreign_func == NULL) {
+                    ok = write_function(w, im, f);
+                    break;
+                }
+
+                if (var == NULL) {
+                    ok = 0;
+                    break;
+                }
+
+                write_u8(w, IMAGE_FOREIGN_FUNC);
+                write_u16(w, owners[i]);
+                write_u16(w, var->parent ? var->parent->id : 0);
+                write_string(w, var->name);
+                break;
+            }
+            default:
+                ok = 0;
+                break;
+        }
+    }
+
+    lily_free(owners);
+    lily_free(vars);
+    return ok;
+}
+
+static int write_main(image_writer *w, lily_parse_state *parser)
+{
+    lily_emit_state *emit = parser->emit;
+    /* Drop the o_vm_exit that lily_prepare_main added. It's added back when
+       the image is loaded. */
+    uint32_t size = lily_u16_pos(emit->code) - 1;
+
+    /* Code is walked with a code iterator when loading, which can't go any
+       further than this. */
+    if (size > UINT16_MAX)
+        return 0;
+
+    write_u16(w, (uint16_t)emit->main_block->next_reg_spot);
+    write_u16(w, (uint16_t)size);
+    write_bytes(w, emit->code->data, size * sizeof(*emit->code->data));
+    return 1;
+}
+
+static int build_image(lily_parse_state *parser, image_writer *w,
+        image_modules *im)
+{
+    if (collect_modules(parser, im) == 0)
+        return 0;
+
+    write_u32(w, IMAGE_FORMAT);
+    write_u32(w, IMAGE_BYTE_ORDER);
+    write_string(w, LILY_VERSION_DIR);
+    write_u16(w, o_vm_exit + 1);
+
+    if (write_sources(w, im) == 0)
+        return 0;
+
+    write_modules(w, im);
+    write_classes(w, parser, im);
+    write_globals(w, parser, im);
+
+    if (write_readonly(w, parser, im) == 0)
+        return 0;
+
+    return write_main(w, parser);
+}
+
+/* The image goes to a temporary file first, so that a run that's loading the
+   image never sees half of one. */
+static void write_image_file(const char *path, image_writer *w)
+{
+    char *image_path = image_path_for(path);
+    char *temp_path = lily_malloc((strlen(image_path) + 5) *
+            sizeof(*temp_path));
+    uint64_t hash = siphash24(w->data, w->pos, image_key);
+    FILE *f;
+
+    strcpy(temp_path, image_path);
+    strcat(temp_path, ".tmp");
+
+    f = fopen(temp_path, "wb");
+
+    if (f) {
+        int ok = fwrite(image_magic, sizeof(image_magic), 1, f) == 1 &&
+                 fwrite(&w->pos, sizeof(w->pos), 1, f) == 1 &&
+                 fwrite(&hash, sizeof(hash), 1, f) == 1 &&
+                 fwrite(w->data, 1, w->pos, f) == w->pos;
+
+        ok = (fclose(f) == 0) && ok;
+
+        /* Windows won't rename over a file that exists. */
+        if (ok && rename(temp_path, image_path) != 0) {
+            remove(image_path);
+            ok = (rename(temp_path, image_path) == 0);
+        }
+
+        if (ok == 0)
+            remove(temp_path);
+    }
+
+    lily_free(temp_path);
+    lily_free(image_path);
+}
+
+/* This is called after the program has been compiled, right before the vm runs
+   it. Saving is best effort: If the program can't be put into an image, or the
+   image can't be written, the program runs anyway. */
+void lily_cache_save(lily_parse_state *parser)
+{
+    image_writer w;
+    image_modules im;
+
+    w.data = lily_malloc(1024 * sizeof(*w.data));
+    w.pos = 0;
+    w.size = 1024;
+    im.sources = NULL;
+    im.modules = NULL;
+
+    if (build_image(parser, &w, &im))
+        write_image_file(parser->main_module->path, &w);
+
+    lily_free(im.modules);
+    lily_free(im.sources);
+    lily_free(w.data);
+}
+
+/***
+ *      _                    _
+ *     | |    ___   __ _  __| |
+ *     | |   / _ \ / _` |/ _` |
+ *     | |__| (_) | (_| | (_| |
+ *     |_____\___/ \__,_|\__,_|
+ *
+ */
+
+/** Loading is done in two stages. The first stage checks that the image is
+    still good, and doesn't touch the interpreter (except for loading libraries,
+    which is harmless). If the image is stale, loading stops there and the
+    program is parsed instead.
+
+    The second stage puts the image into the interpreter. Since the first stage
+    checked everything that could have changed, this shouldn't fail. If it
+    does, the image has been damaged in some way that the checks missed, and
+    the interpreter raises an error. **/
+
+static int check_header(image_reader *r)
+{
+    char magic[sizeof(image_magic)];
+
+    read_bytes(r, magic, sizeof(magic));
+
+    uint32_t size = read_u32(r);
+    uint64_t hash = read_u64(r);
+
+    if (r->ok == 0 ||
+        memcmp(magic, image_magic, sizeof(magic)) != 0 ||
+        size != r->size - r->pos ||
+        hash != siphash24(r->data + r->pos, size, image_key))
+        return 0;
+
+    uint32_t format = read_u32(r);
+    uint32_t byte_order = read_u32(r);
+    const char *version = read_string(r);
+    uint16_t opcode_count = read_u16(r);
+
+    return r->ok &&
+           format == IMAGE_FORMAT &&
+           byte_order == IMAGE_BYTE_ORDER &&
+           strcmp(version, LILY_VERSION_DIR) == 0 &&
+           opcode_count == o_vm_exit + 1;
+}
+
+static int check_sources(image_loader *l, const char *path)
+{
+    image_reader *r = l->reader;
+    uint16_t count = read_u16(r);
+    int i;
+
+    if (count == 0)
+        return 0;
+
+    l->source_paths = lily_malloc(count * sizeof(*l->source_paths));
+    l->source_count = count;
+
+    for (i = 0;i < count;i++) {
+        const char *source_path = read_string(r);
+        uint32_t want_size = read_u32(r);
+        uint64_t want_hash = read_u64(r);
+        uint32_t size;
+        char *data;
+
+        if (r->ok == 0)
+            return 0;
+
+        /* The first file might have been given with a different path. That's
+           fine, since the image is always next to it. */
+        if (i == 0)
+            source_path = path;
+
+        l->source_paths[i] = source_path;
+        data = read_whole_file(source_path, &size);
+
+        if (data == NULL)
+            return 0;
+
+        int same = (size == want_size &&
+                    siphash24(data, size, image_key) == want_hash);
+
+        lily_free(data);
+
+        if (same == 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+static lily_module_entry *load_library(lily_parse_state *parser,
+        const char *path)
+{
+    lily_module_entry *result = NULL;
+
+    /* This does what load_module does around the import hook, since loading
+       a library expects to be in the middle of an import. */
+    parser->last_import = NULL;
+    lily_u16_write_1(parser->data_stack, 0);
+
+    if (lily_load_library(parser->vm, path))
+        result = parser->last_import;
+
+    lily_u16_set_pos(parser->data_stack, 0);
+    return result;
+}
+
+static int check_modules(image_loader *l)
+{
+    lily_parse_state *parser = l->parser;
+    image_reader *r = l->reader;
+    uint16_t count = read_u16(r);
+    int i;
+
+    l->modules = lily_malloc((count + 1) * sizeof(*l->modules));
+    l->module_count = count;
+
+    for (i = 0;i < count;i++) {
+        uint8_t kind = read_u8(r);
+        const char *name = read_string(r);
+        uint64_t want_hash = read_u64(r);
+        lily_module_entry *m;
+
+        if (r->ok == 0)
+            return 0;
+
+        if (kind == IMAGE_MODULE_REGISTERED)
+            m = lily_find_registered_module(parser->symtab, name);
+        else
+            m = load_library(parser, name);
+
+        if (m == NULL ||
+            hash_dynaload_table(m->dynaload_table) != want_hash)
+            return 0;
+
+        l->modules[i] = m;
+    }
+
+    return 1;
+}
+
+static lily_class *find_foreign_class(image_loader *l, uint16_t module_index,
+        const char *name)
+{
+    if (module_index >= l->module_count)
+        return NULL;
+
+    lily_item *item = lily_find_or_dl_toplevel(l->parser,
+            l->modules[module_index], name);
+
+    if (item == NULL || item->item_kind == ITEM_TYPE_VAR)
+        return NULL;
+
+    return (lily_class *)item;
+}
+
+/* Classes are loaded in three passes. Foreign classes go first, since classes
+   in the program may inherit from them. Next are the variants of foreign enums.
+   Last are classes and enums from the program, in the order that they were
+   first made. Enums make their variants when they're made. */
+static int load_classes(image_loader *l)
+{
+    lily_symtab *symtab = l->parser->symtab;
+    image_reader *r = l->reader;
+    uint16_t count = read_u16(r);
+    image_class *entries = lily_malloc((count + 1) * sizeof(*entries));
+    int i, j, ok = 1;
+
+    l->classes = lily_malloc((count + 1) * sizeof(*l->classes));
+    l->class_count = count;
+    memset(l->classes, 0, (count + 1) * sizeof(*l->classes));
+    memset(entries, 0, (count + 1) * sizeof(*entries));
+
+    for (i = 0;i < count;i++) {
+        image_class *e = entries + i;
+
+        e->kind = read_u8(r);
+
+        if (e->kind == IMAGE_CLASS_NONE)
+            continue;
+
+        e->name = read_string(r);
+        e->source = read_u16(r);
+
+        if (e->kind == IMAGE_CLASS_USER || e->kind == IMAGE_CLASS_ENUM) {
+            e->flags = read_u16(r);
+            e->size = read_u16(r);
+            e->inherit_depth = read_u16(r);
+            e->module = read_u16(r);
+
+            if (e->module >= l->source_count)
+                r->ok = 0;
+        }
+        else if (e->kind == IMAGE_CLASS_VARIANT)
+            e->flags = read_u16(r);
+    }
+
+    if (r->ok == 0)
+        count = 0;
+
+    for (i = 0;i < count && ok;i++) {
+        image_class *e = entries + i;
+
+        if (e->kind != IMAGE_CLASS_FOREIGN)
+            continue;
+
+        l->classes[i] = find_foreign_class(l, e->source, e->name);
+        ok = (l->classes[i] != NULL);
+    }
+
+    for (i = 0;i < count && ok;i++) {
+        image_class *e = entries + i;
+
+        if (e->kind != IMAGE_CLASS_VARIANT ||
+            e->source >= count ||
+            entries[e->source].kind != IMAGE_CLASS_FOREIGN)
+            continue;
+
+        lily_class *enum_cls = l->classes[e->source];
+
+        l->classes[i] = (lily_class *)lily_find_variant(enum_cls, e->name);
+        ok = (l->classes[i] != NULL);
+    }
+
+    lily_module_entry *save_active = symtab->active_module;
+
+    for (i = 0;i < count && ok;i++) {
+        image_class *e = entries + i;
+        lily_class *cls;
+
+        /* New classes go into the active module. */
+        symtab->active_module = l->sources[e->module];
+
+        if (e->kind == IMAGE_CLASS_USER) {
+            lily_class *parent = NULL;
+
+            if (e->source) {
+                parent = l->classes[e->source];
+
+                if (e->source >= i || parent == NULL) {
+                    ok = 0;
+                    break;
+                }
+            }
+
+            cls = lily_new_class(symtab, e->name);
+            cls->flags = e->flags;
+            cls->parent = parent;
+            cls->prop_count = e->size;
+            cls->inherit_depth = e->inherit_depth;
+            l->classes[i] = cls;
+        }
+        else if (e->kind == IMAGE_CLASS_ENUM) {
+            int variant_count = 0;
+
+            cls = lily_new_enum_class(symtab, e->name);
+            cls->flags = e->flags;
+
+            /* Variants were made in id order, and making them in that order
+               again gives them the same layout. */
+            for (j = i + 1;j < count;j++) {
+                image_class *v = entries + j;
+
+                if (v->kind != IMAGE_CLASS_VARIANT || v->source != i)
+                    continue;
+
+                lily_variant_class *variant = lily_new_variant_class(symtab,
+                        cls, v->name);
+
+                variant->flags = v->flags;
+                l->classes[j] = (lily_class *)variant;
+                variant_count++;
+            }
+
+            cls->variant_size = variant_count;
+            lily_fix_enum_variant_ids(symtab, cls);
+            l->classes[i] = cls;
+        }
+    }
+
+    symtab->active_module = save_active;
+    lily_free(entries);
+    return ok && r->ok;
+}
+
+static int load_globals(image_loader *l)
+{
+    lily_parse_state *parser = l->parser;
+    image_reader *r = l->reader;
+    uint16_t count = read_u16(r);
+    int i;
+
+    l->global_map = lily_malloc((count + 1) * sizeof(*l->global_map));
+    l->global_count = count;
+
+    /* Each global has a slot in the toplevel frame, so they have to be made in
+       the same order as before. */
+    for (i = 0;i < count && r->ok;i++) {
+        uint8_t kind = read_u8(r);
+
+        if (kind == IMAGE_GLOBAL_USER) {
+            lily_push_unit(parser->vm);
+            l->global_map[i] = parser->symtab->next_global_id;
+            parser->symtab->next_global_id++;
+            continue;
+        }
+
+        uint16_t module_index = read_u16(r);
+        const char *name = read_string(r);
+
+        if (r->ok == 0 || module_index >= l->module_count)
+            return 0;
+
+        lily_item *item = lily_find_or_dl_toplevel(parser,
+                l->modules[module_index], name);
+
+        if (item == NULL || item->item_kind != ITEM_TYPE_VAR ||
+            (item->flags & VAR_IS_GLOBAL) == 0)
+            return 0;
+
+        l->global_map[i] = ((lily_var *)item)->reg_spot;
+    }
+
+    return r->ok;
+}
+
+static int load_foreign_func(image_loader *l, uint16_t *out)
+{
+    image_reader *r = l->reader;
+    uint16_t module_index = read_u16(r);
+    uint16_t class_index = read_u16(r);
+    const char *name = read_string(r);
+    lily_item *item;
+
+    if (r->ok == 0 || module_index >= l->module_count ||
+        class_index >= l->class_count)
+        return 0;
+
+    if (class_index == 0)
+        item = lily_find_or_dl_toplevel(l->parser, l->modules[module_index],
+                name);
+    else {
+        lily_class *cls = l->classes[class_index];
+
+        if (cls == NULL)
+            return 0;
+
+        item = lily_find_or_dl_member(l->parser, cls, name, cls);
+    }
+
+    if (item == NULL || item->item_kind != ITEM_TYPE_VAR ||
+        (item->flags & VAR_IS_FOREIGN_FUNC) == 0)
+        return 0;
+
+    *out = ((lily_var *)item)->reg_spot;
+    return 1;
+}
+
+static int load_native_func(image_loader *l, uint16_t *out)
+{
+    lily_parse_state *parser = l->parser;
+    image_reader *r = l->reader;
+    uint16_t source = read_u16(r);
+    const char *name = read_string(r);
+    uint16_t reg_count = read_u16(r);
+    uint16_t code_len = read_u16(r);
+
+    if (r->ok == 0 || source >= l->source_count)
+        return 0;
+
+    uint16_t *code = read_code(r, code_len);
+    uint16_t locals_size = read_u16(r);
+    uint16_t *locals = NULL;
+
+    if (locals_size) {
+        locals = lily_malloc(locals_size * sizeof(*locals));
+        locals[0] = locals_size;
+        read_bytes(r, locals + 1, (locals_size - 1) * sizeof(*locals));
+    }
+
+    lily_function_val *f = lily_slab_malloc(parser->vm->pool, sizeof(*f));
+    lily_proto *proto = lily_emit_new_proto(parser->emit,
+            l->sources[source]->path, NULL, name);
+
+    proto->code = code;
+    proto->locals = locals;
+
+    f->refcount = 1;
+    f->foreign_func = NULL;
+    f->code = code;
+    f->code_len = code_len;
+    f->reg_count = reg_count;
+    f->num_upvalues = 0;
+    f->upvalues = NULL;
+    f->gc_entry = NULL;
+    f->cid_table = l->sources[source]->cid_table;
+    f->proto = proto;
+
+    lily_value *v = lily_malloc(sizeof(*v));
+
+    v->flags = LILY_ID_FUNCTION;
+    v->value.function = f;
+
+    *out = (uint16_t)lily_vs_pos(parser->symtab->literals);
+    lily_vs_push(parser->symtab->literals, v);
+
+    l->functions[l->function_count] = f;
+    l->function_count++;
+    return r->ok;
+}
+
+static int load_readonly(image_loader *l)
+{
+    lily_symtab *symtab = l->parser->symtab;
+    image_reader *r = l->reader;
+    uint16_t count = read_u16(r);
+    int i, ok = r->ok;
+
+    l->readonly_map = lily_malloc((count + 1) * sizeof(*l->readonly_map));
+    l->functions = lily_malloc((count + 1) * sizeof(*l->functions));
+    l->readonly_count = count;
+    l->readonly_map[0] = 0;
+
+    for (i = 1;i < count && ok;i++) {
+        uint8_t kind = read_u8(r);
+        uint16_t *out = l->readonly_map + i;
+        lily_literal *lit = NULL;
+
+        switch (kind) {
+            case IMAGE_INTEGER:
+                lit = lily_get_integer_literal(symtab, (int64_t)read_u64(r));
+                break;
+            case IMAGE_DOUBLE: {
+                double d;
+
+                read_bytes(r, &d, sizeof(d));
+                lit = lily_get_double_literal(symtab, d);
+                break;
+            }
+            case IMAGE_STRING:
+                lit = lily_get_string_literal(symtab, read_string(r));
+                break;
+            case IMAGE_BYTESTRING: {
+                uint32_t size;
+                const char *data = read_data(r, &size);
+
+                lit = lily_get_bytestring_literal(symtab, data, (int)size);
+                break;
+            }
+            case IMAGE_UNIT:
+                lit = lily_get_unit_literal(symtab);
+                break;
+            case IMAGE_FOREIGN_FUNC:
+                ok = load_foreign_func(l, out);
+                break;
+            case IMAGE_NATIVE_FUNC:
+                ok = load_native_func(l, out);
+                break;
+            default:
+                ok = 0;
+                break;
+        }
+
+        if (lit)
+            *out = lit->reg_spot;
+
+        ok = ok && r->ok;
+    }
+
+    return ok;
+}
+
+static int relocate_id(uint16_t *id, uint16_t *map, uint16_t count)
+{
+    if (*id >= count)
+        return 0;
+
+    *id = map[*id];
+    return 1;
+}
+
+static int relocate_class_id(image_loader *l, uint16_t *id)
+{
+    /* Builtin classes always have the same id. 0 isn't a class, but
+       o_jump_if_not_class uses it to check for unset optional arguments. */
+    if (*id < START_CLASS_ID)
+        return 1;
+
+    if (*id >= l->class_count || l->classes[*id] == NULL)
+        return 0;
+
+    /* Variants have their id in the same place as classes do. */
+    *id = l->classes[*id]->id;
+    return 1;
+}
+
+/* Fix the operands of 'code' that point to readonly entries, globals, and
+   classes. */
+static int relocate_code(image_loader *l, uint16_t *code, uint16_t code_len)
+{
+    lily_code_iter ci;
+    int ok = 1;
+
+    lily_ci_init(&ci, code, 0, code_len);
+
+    while (ok && lily_ci_next(&ci)) {
+        uint16_t *buffer = code + ci.offset;
+
+        /* Bad opcodes don't move the iterator. */
+        if (ci.round_total == 0)
+            return 0;
+
+        switch (ci.opcode) {
+            case o_load_readonly:
+            case o_call_native:
+            case o_call_foreign:
+            case o_closure_function:
+                ok = relocate_id(buffer + 1, l->readonly_map,
+                        l->readonly_count);
+                break;
+            case o_global_get:
+                ok = relocate_id(buffer + 1, l->global_map, l->global_count);
+                break;
+            case o_global_set:
+                ok = relocate_id(buffer + 2, l->global_map, l->global_count);
+                break;
+            case o_instance_new:
+            case o_load_empty_variant:
+            case o_build_variant:
+            case o_build_hash:
+            case o_jump_if_not_class:
+                ok = relocate_class_id(l, buffer + 1);
+                break;
+            case o_exception_catch:
+                ok = relocate_class_id(l, buffer + 2);
+                break;
+            default:
+                break;
+        }
+    }
+
+    /* The last instruction can't go past the end. */
+    return ok && ci.offset == code_len;
+}
+
+static int load_main(image_loader *l)
+{
+    lily_emit_state *emit = l->parser->emit;
+    image_reader *r = l->reader;
+    uint16_t reg_count = read_u16(r);
+    uint16_t size = read_u16(r);
+    int i, ok = r->ok;
+
+    for (i = 0;i < l->function_count && ok;i++) {
+        lily_function_val *f = l->functions[i];
+
+        ok = relocate_code(l, f->code, f->code_len);
+    }
+
+    if (ok == 0)
+        return 0;
+
+    lily_buffer_u16 *b = emit->code;
+
+    lily_u16_write_prep(b, size);
+    read_bytes(r, b->data + lily_u16_pos(b), size * sizeof(*b->data));
+
+    if (r->ok == 0 ||
+        relocate_code(l, b->data + lily_u16_pos(b), size) == 0)
+        return 0;
+
+    /* lily_prepare_main will finish __main__ from these. */
+    lily_u16_set_pos(b, lily_u16_pos(b) + size);
+    emit->main_block->next_reg_spot = reg_count;
+    return 1;
+}
+
+static int load_image(image_loader *l)
+{
+    int i;
+
+    l->sources = lily_malloc(l->source_count * sizeof(*l->sources));
+    l->sources[0] = l->parser->main_module;
+
+    for (i = 1;i < l->source_count;i++)
+        l->sources[i] = lily_new_cached_module(l->parser, l->source_paths[i]);
+
+    return load_classes(l) &&
+           load_globals(l) &&
+           load_readonly(l) &&
+           load_main(l);
+}
+
+/* Try to load the program at 'path' from the image next to it. If there isn't
+   an image, or if it's stale, this returns 0 without changing anything.
+   Otherwise, the program is ready to be run and this returns 1. */
+int lily_cache_load(lily_parse_state *parser, const char *path)
+{
+    char *image_path = image_path_for(path);
+    uint32_t size;
+    char *data = read_whole_file(image_path, &size);
+    int result = 0;
+
+    if (data == NULL) {
+        lily_free(image_path);
+        return 0;
+    }
+
+    image_reader r;
+    image_loader l;
+
+    r.data = data;
+    r.pos = 0;
+    r.size = size;
+    r.ok = 1;
+
+    memset(&l, 0, sizeof(l));
+    l.parser = parser;
+    l.reader = &r;
+
+    if (check_header(&r) &&
+        check_sources(&l, path) &&
+        check_modules(&l))
+        result = load_image(&l) ? 1 : -1;
+
+    lily_free(l.functions);
+    lily_free(l.readonly_map);
+    lily_free(l.global_map);
+    lily_free(l.classes);
+    lily_free(l.modules);
+    lily_free(l.sources);
+    lily_free(l.source_paths);
+    lily_free(data);
+
+    if (result == -1) {
+        /* The image is damaged and the interpreter has part of it. There's no
+           way to undo that, so give up. */
+        lily_msgbuf *msgbuf = lily_mb_flush(parser->msgbuf);
+
+        lily_mb_add(msgbuf, image_path);
+        lily_free(image_path);
+        lily_raise_err(parser->raiser, "Bytecode cache '%s' is invalid.",
+                lily_mb_raw(msgbuf));
+    }
+
+    lily_free(image_path);
+    return result;
+}
@@ -0,0 +1,9 @@
+#ifndef LILY_CACHE_H
+# define LILY_CACHE_H
+
+struct lily_parse_state_;
+
+int lily_cache_load(struct lily_parse_state_ *, const char *);
+void lily_cache_save(struct lily_parse_state_ *);
+
+#endif
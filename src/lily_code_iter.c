@@ -74,6 +74,15 @@ int lily_ci_next(lily_code_iter *iter)
             iter->outputs_4 = 1;
             iter->line_6 = 1;
 
+            iter->round_total = 5;
+            break;
+        case o_int_add_imm:
+        case o_int_minus_imm:
+            iter->special_1 = 1;
+            iter->inputs_3 = 1;
+            iter->outputs_4 = 1;
+            iter->line_6 = 1;
+
             iter->round_total = 5;
             break;
         case o_jump:
@@ -89,6 +98,18 @@ int lily_ci_next(lily_code_iter *iter)
 
             iter->round_total = 4;
             break;
+        case o_jump_if_int_eq:
+        case o_jump_if_int_greater:
+        case o_jump_if_int_greater_eq:
+        case o_jump_if_number_eq:
+        case o_jump_if_number_greater:
+        case o_jump_if_number_greater_eq:
+            iter->special_1 = 1;
+            iter->inputs_3 = 2;
+            iter->jumps_5 = 1;
+
+            iter->round_total = 5;
+            break;
         case o_call_native:
         case o_call_foreign:
         case o_call_register:
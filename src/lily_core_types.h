@@ -199,7 +199,8 @@ typedef struct lily_var_ {
     uint16_t item_kind;
     uint16_t flags;
     uint16_t reg_spot;
-    uint16_t pad;
+    /* VAR_IS_CONSTANT: How many loops deep the var was assigned. */
+    uint16_t constant_loop_depth;
     lily_type *type;
     char *name;
     uint64_t shorthash;
@@ -210,7 +211,10 @@ typedef struct lily_var_ {
        then the var is in __main__ and a global. Otherwise, it is a local.
        This is an important difference, because the vm has to do different
        loads for globals versus locals. */
-    uint32_t function_depth;
+    uint16_t function_depth;
+    /* VAR_IS_CONSTANT: The value of a Boolean or Byte, or the literal that
+       holds the value of an Integer, Double, or String. */
+    uint16_t constant_spot;
     /* (Up to) the first 8 bytes of the name. This is compared before comparing
        the name. */
     struct lily_class_ *parent;
@@ -308,6 +312,10 @@ typedef struct lily_proto_ {
          instead.
        * The full sequence is terminated by a tab character (\t). */
     char *arg_names;
+#ifdef LILY_OPCODE_STATS
+    /* How many times a function using this proto has been called. */
+    uint64_t call_count;
+#endif
 } lily_proto;
 
 
@@ -421,12 +429,19 @@ typedef struct lily_proto_ {
 /* This is an incomplete forward declaration. */
 #define VAR_IS_FORWARD          0x400
 
+/* This local has only been assigned a constant value. The emitter uses the
+   value in place of the var when folding constant expressions. */
+#define VAR_IS_CONSTANT         0x800
+
 /* This module was added by being registered. */
 #define MODULE_IS_REGISTERED 0x1
 
 /* Parser's import handler needs to execute this module's code. */
 #define MODULE_NOT_EXECUTED  0x2
 
+/* This module's source is a file (instead of a string). */
+#define MODULE_IS_FILE       0x4
+
 #define LILY_LAST_ID       65528
 /* Instances of these are never made, so these ids will never be seen by vm. */
 #define LILY_ID_SELF       65529
@@ -6,6 +6,7 @@
 #include "lily_expr.h"
 #include "lily_emitter.h"
 #include "lily_parser.h"
+#include "lily_optimize.h"
 
 #include "lily_int_opcode.h"
 #include "lily_int_code_iter.h"
@@ -129,6 +130,9 @@ static lily_storage *get_storage(lily_emit_state *, lily_type *);
 static lily_block *find_deepest_loop(lily_emit_state *);
 static void inject_patch_into_block(lily_emit_state *, lily_block *, uint16_t);
 static void eval_tree(lily_emit_state *, lily_ast *, lily_type *);
+static void emit_literal(lily_emit_state *, lily_ast *);
+static void emit_integer(lily_emit_state *, lily_ast *);
+static void emit_boolean(lily_emit_state *, lily_ast *);
 
 /* This is called from parser to get emitter to write a function call targeting
    a var. The var should always be an __import__ function. */
@@ -145,6 +149,10 @@ void lily_emit_eval_optarg(lily_emit_state *emit, lily_ast *ast)
     eval_tree(emit, ast, NULL);
     emit->expr_num++;
 
+    /* The caller may have sent a value instead. */
+    if (ast->left->tree_type == tree_local_var)
+        ast->left->sym->flags &= ~VAR_IS_CONSTANT;
+
     uint16_t patch_spot = lily_u16_pop(emit->patches);
 
     /* This adds +1 because it's fixing o_jump. For that opcode, the jump is 1
@@ -169,6 +177,9 @@ void lily_emit_eval_optarg_keyed(lily_emit_state *emit, lily_ast *ast)
     eval_tree(emit, ast, NULL);
     emit->expr_num++;
 
+    if (ast->left->tree_type == tree_local_var)
+        ast->left->sym->flags &= ~VAR_IS_CONSTANT;
+
     uint16_t patch_spot = lily_u16_pop(emit->patches);
 
     /* This is +3 because it's fixing the jump of o_jump_if_not_class. The jump
@@ -284,6 +295,9 @@ void lily_emit_finalize_for_in(lily_emit_state *emit, lily_var *user_loop_var,
     lily_sym *target;
     int need_sync = user_loop_var->flags & VAR_IS_GLOBAL;
 
+    /* The loop may be using a var that was constant before. */
+    user_loop_var->flags &= ~VAR_IS_CONSTANT;
+
     if (need_sync) {
         lily_class *cls = emit->symtab->integer_class;
         /* o_for_integer expects the target register to be a local. Since it
@@ -1384,6 +1398,9 @@ static void write_final_code_for_block(lily_emit_state *emit,
     code = lily_malloc((code_size + 1) * sizeof(*code));
     memcpy(code, source + code_start, sizeof(*code) * code_size);
 
+    if (emit->parser->config->optimize)
+        code_size = lily_optimize_code(code, code_size);
+
     f->code_len = code_size;
     f->code = code;
     f->proto->code = code;
@@ -1612,6 +1629,9 @@ lily_proto *lily_emit_new_proto(lily_emit_state *emit, const char *module_path,
     p->locals = NULL;
     p->code = NULL;
     p->arg_names = NULL;
+#ifdef LILY_OPCODE_STATS
+    p->call_count = 0;
+#endif
 
     protos->data[protos->pos] = p;
     protos->pos++;
@@ -2322,6 +2342,379 @@ static void eval_oo_access(lily_emit_state *emit, lily_ast *ast)
 
 /** Here are most of the functions related to evaluating trees. **/
 
+/* Binary ops with constant values on both sides are done here instead of in
+   the vm, and the tree becomes a literal holding the result. Literals are
+   constant, and so are locals that have only been given a constant value (see
+   mark_local_constant). Anything the vm would raise on (ex: division by zero)
+   isn't folded, so the error still happens when the code runs. */
+
+typedef struct {
+    uint16_t class_id;
+    lily_raw_value value;
+} lily_fold_value;
+
+/* How many loops the current block is in, within the current function. */
+static uint16_t current_loop_depth(lily_emit_state *emit)
+{
+    lily_block *block = emit->block;
+    uint16_t depth = 0;
+
+    while (block != emit->function_block) {
+        if (block->block_type == block_while ||
+            block->block_type == block_do_while ||
+            block->block_type == block_for_in)
+            depth++;
+
+        block = block->prev;
+    }
+
+    return depth;
+}
+
+static lily_literal *literal_at(lily_emit_state *emit, uint16_t spot)
+{
+    return (lily_literal *)lily_vs_nth(emit->symtab->literals, spot);
+}
+
+/* If 'ast' has a constant value, store it in 'fv' and return 1. Otherwise,
+   return 0. */
+static int get_fold_value(lily_emit_state *emit, lily_ast *ast,
+        lily_fold_value *fv)
+{
+    while (ast->tree_type == tree_parenth)
+        ast = ast->arg_start;
+
+    if (ast->tree_type == tree_integer ||
+        ast->tree_type == tree_boolean ||
+        ast->tree_type == tree_byte) {
+        if (ast->tree_type == tree_integer)
+            fv->class_id = LILY_ID_INTEGER;
+        else if (ast->tree_type == tree_boolean)
+            fv->class_id = LILY_ID_BOOLEAN;
+        else
+            fv->class_id = LILY_ID_BYTE;
+
+        fv->value.integer = ast->backing_value;
+        return 1;
+    }
+
+    lily_literal *lit;
+
+    if (ast->tree_type == tree_literal)
+        lit = literal_at(emit, ast->literal_reg_spot);
+    else if (ast->tree_type == tree_local_var) {
+        lily_var *var = (lily_var *)ast->sym;
+
+        /* A var assigned in a loop may have a different value the next time
+           around, if a later part of the loop changes it. */
+        if ((var->flags & VAR_IS_CONSTANT) == 0 ||
+            var->constant_loop_depth != current_loop_depth(emit))
+            return 0;
+
+        fv->class_id = var->type->cls->id;
+
+        if (fv->class_id == LILY_ID_BOOLEAN ||
+            fv->class_id == LILY_ID_BYTE) {
+            fv->value.integer = var->constant_spot;
+            return 1;
+        }
+
+        lit = literal_at(emit, var->constant_spot);
+    }
+    else
+        return 0;
+
+    if (lit->class_id != LILY_ID_INTEGER &&
+        lit->class_id != LILY_ID_DOUBLE &&
+        lit->class_id != LILY_ID_STRING)
+        return 0;
+
+    fv->class_id = lit->class_id;
+    fv->value = lit->value;
+    return 1;
+}
+
+static int fold_compare(int op, int cmp)
+{
+    switch (op) {
+        case expr_eq_eq:  return cmp == 0;
+        case expr_not_eq: return cmp != 0;
+        case expr_lt:     return cmp < 0;
+        case expr_lt_eq:  return cmp <= 0;
+        case expr_gr:     return cmp > 0;
+        default:          return cmp >= 0;
+    }
+}
+
+static int fold_integer(int op, int64_t left, int64_t right, int64_t *result)
+{
+    /* Wrap around on overflow, like the vm does. */
+    uint64_t l = (uint64_t)left, r = (uint64_t)right;
+
+    switch (op) {
+        case expr_plus:        *result = (int64_t)(l + r); break;
+        case expr_minus:       *result = (int64_t)(l - r); break;
+        case expr_multiply:    *result = (int64_t)(l * r); break;
+        case expr_bitwise_and: *result = left & right;     break;
+        case expr_bitwise_or:  *result = left | right;     break;
+        case expr_bitwise_xor: *result = left ^ right;     break;
+        case expr_divide:
+        case expr_modulo:
+            if (right == 0 || (left == INT64_MIN && right == -1))
+                return 0;
+
+            *result = (op == expr_divide ? left / right : left % right);
+            break;
+        case expr_left_shift:
+        case expr_right_shift:
+            if (right < 0 || right > 63)
+                return 0;
+
+            *result = (op == expr_left_shift
+                    ? (int64_t)(l << right) : left >> right);
+            break;
+        default:
+            return 0;
+    }
+
+    return 1;
+}
+
+static int fold_double(int op, double left, double right, double *result)
+{
+    switch (op) {
+        case expr_plus:     *result = left + right; break;
+        case expr_minus:    *result = left - right; break;
+        case expr_multiply: *result = left * right; break;
+        case expr_divide:
+            if (right == 0.0)
+                return 0;
+
+            *result = left / right;
+            break;
+        default:
+            return 0;
+    }
+
+    /* Double literals are matched by value, and 0.0 == -0.0. Leave zero alone
+       so the wrong one isn't picked up. */
+    return *result != 0.0;
+}
+
+/* Fold 'left <op> right' into 'out', returning 1 if it worked. */
+static int fold_values(lily_emit_state *emit, int op, lily_fold_value *left,
+        lily_fold_value *right, lily_fold_value *out)
+{
+    int id = left->class_id;
+
+    if (op == expr_plus_plus) {
+        lily_msgbuf *msgbuf = lily_mb_flush(emit->raiser->aux_msgbuf);
+        lily_value v;
+
+        v.flags = left->class_id;
+        v.value = left->value;
+        lily_mb_add_value(msgbuf, emit->parser->vm, &v);
+        v.flags = right->class_id;
+        v.value = right->value;
+        lily_mb_add_value(msgbuf, emit->parser->vm, &v);
+
+        lily_literal *lit = lily_get_string_literal(emit->symtab,
+                lily_mb_raw(msgbuf));
+
+        out->class_id = LILY_ID_STRING;
+        out->value = lit->value;
+        return 1;
+    }
+
+    if (id != right->class_id)
+        return 0;
+
+    if (op >= expr_eq_eq && op <= expr_not_eq) {
+        int64_t l = left->value.integer, r = right->value.integer;
+        int result;
+
+        if (id == LILY_ID_DOUBLE) {
+            /* Compared directly so that NaN works like it does in the vm. */
+            double dl = left->value.doubleval, dr = right->value.doubleval;
+
+            switch (op) {
+                case expr_eq_eq:  result = dl == dr; break;
+                case expr_not_eq: result = dl != dr; break;
+                case expr_lt:     result = dl < dr;  break;
+                case expr_lt_eq:  result = dl <= dr; break;
+                case expr_gr:     result = dl > dr;  break;
+                default:          result = dl >= dr; break;
+            }
+        }
+        else if (id == LILY_ID_STRING) {
+            lily_string_val *sl = left->value.string;
+            lily_string_val *sr = right->value.string;
+
+            if (op == expr_eq_eq || op == expr_not_eq)
+                result = fold_compare(op, sl->size != sr->size ||
+                        memcmp(sl->string, sr->string, sl->size) != 0);
+            else
+                result = fold_compare(op, strcmp(sl->string, sr->string));
+        }
+        else if (id == LILY_ID_INTEGER || id == LILY_ID_BYTE ||
+                 (id == LILY_ID_BOOLEAN &&
+                  (op == expr_eq_eq || op == expr_not_eq)))
+            result = fold_compare(op, (l > r) - (l < r));
+        else
+            return 0;
+
+        out->class_id = LILY_ID_BOOLEAN;
+        out->value.integer = result;
+        return 1;
+    }
+
+    out->class_id = id;
+
+    if (id == LILY_ID_INTEGER)
+        return fold_integer(op, left->value.integer, right->value.integer,
+                &out->value.integer);
+    else if (id == LILY_ID_DOUBLE)
+        return fold_double(op, left->value.doubleval, right->value.doubleval,
+                &out->value.doubleval);
+
+    return 0;
+}
+
+/* Constant sides that aren't vars were loaded into a storage when they were
+   evaluated. Each of those loads is the last thing written (the right side's
+   after the left side's), so they can be taken back. */
+static int take_back_fold_loads(lily_emit_state *emit, lily_ast *ast)
+{
+    lily_ast *sides[2] = {ast->right, ast->left};
+    uint16_t pos = lily_u16_pos(emit->code);
+    int i;
+
+    for (i = 0;i < 2;i++) {
+        lily_ast *side = sides[i];
+
+        while (side->tree_type == tree_parenth)
+            side = side->arg_start;
+
+        if (side->tree_type == tree_local_var)
+            continue;
+
+        if (pos < 4)
+            return 0;
+
+        uint16_t op = lily_u16_get(emit->code, pos - 4);
+
+        if ((op != o_load_integer &&
+             op != o_load_readonly &&
+             op != o_load_boolean &&
+             op != o_load_byte) ||
+            lily_u16_get(emit->code, pos - 2) != side->result->reg_spot)
+            return 0;
+
+        pos -= 4;
+    }
+
+    lily_u16_set_pos(emit->code, pos);
+    return 1;
+}
+
+/* Turn 'ast' into a tree holding 'fv', then emit it. */
+static void become_fold_value(lily_emit_state *emit, lily_ast *ast,
+        lily_fold_value *fv)
+{
+    lily_symtab *symtab = emit->symtab;
+    int64_t i = fv->value.integer;
+
+    if (fv->class_id == LILY_ID_BOOLEAN) {
+        ast->tree_type = tree_boolean;
+        ast->backing_value = (int16_t)i;
+        emit_boolean(emit, ast);
+        return;
+    }
+    else if (fv->class_id == LILY_ID_INTEGER &&
+             i >= INT16_MIN && i <= INT16_MAX) {
+        ast->tree_type = tree_integer;
+        ast->backing_value = (int16_t)i;
+        emit_integer(emit, ast);
+        return;
+    }
+
+    lily_literal *lit;
+
+    if (fv->class_id == LILY_ID_INTEGER) {
+        lit = lily_get_integer_literal(symtab, i);
+        ast->type = symtab->integer_class->self_type;
+    }
+    else if (fv->class_id == LILY_ID_DOUBLE) {
+        lit = lily_get_double_literal(symtab, fv->value.doubleval);
+        ast->type = symtab->double_class->self_type;
+    }
+    else {
+        lit = lily_get_string_literal(symtab, fv->value.string->string);
+        ast->type = symtab->string_class->self_type;
+    }
+
+    ast->tree_type = tree_literal;
+    ast->literal_reg_spot = lit->reg_spot;
+    emit_literal(emit, ast);
+}
+
+/* This is called on binary ops (including ++) after both sides have been
+   evaluated. If the op could be folded, 'ast' is now a literal with a result,
+   and 1 is returned. */
+static int fold_binary_op(lily_emit_state *emit, lily_ast *ast)
+{
+    lily_fold_value left, right, result;
+
+    if (get_fold_value(emit, ast->left, &left) == 0 ||
+        get_fold_value(emit, ast->right, &right) == 0 ||
+        fold_values(emit, ast->op, &left, &right, &result) == 0 ||
+        take_back_fold_loads(emit, ast) == 0)
+        return 0;
+
+    become_fold_value(emit, ast, &result);
+    return 1;
+}
+
+/* This is called after 'ast' (an assignment to a local) is done. A var given a
+   constant where it is declared is marked so that later folding can use the
+   value. Any other assignment means it isn't constant anymore. */
+static void mark_local_constant(lily_emit_state *emit, lily_ast *ast,
+        int is_decl)
+{
+    lily_var *var = (lily_var *)ast->left->sym;
+    lily_fold_value fv;
+
+    var->flags &= ~VAR_IS_CONSTANT;
+
+    if (is_decl == 0 ||
+        ast->op != expr_assign ||
+        get_fold_value(emit, ast->right, &fv) == 0 ||
+        fv.class_id != var->type->cls->id)
+        return;
+
+    lily_symtab *symtab = emit->symtab;
+
+    if (fv.class_id == LILY_ID_BOOLEAN || fv.class_id == LILY_ID_BYTE)
+        var->constant_spot = (uint16_t)fv.value.integer;
+    else if (fv.class_id == LILY_ID_INTEGER)
+        var->constant_spot = lily_get_integer_literal(symtab,
+                fv.value.integer)->reg_spot;
+    else if (fv.class_id == LILY_ID_DOUBLE) {
+        /* See fold_double. */
+        if (fv.value.doubleval == 0.0)
+            return;
+
+        var->constant_spot = lily_get_double_literal(symtab,
+                fv.value.doubleval)->reg_spot;
+    }
+    else
+        var->constant_spot = lily_get_string_literal(symtab,
+                fv.value.string->string)->reg_spot;
+
+    var->constant_loop_depth = current_loop_depth(emit);
+    var->flags |= VAR_IS_CONSTANT;
+}
+
 /* This handles simple binary ops (no assign, &&/||, |>, or compounds. This
    assumes that both sides have already been evaluated. */
 static void emit_binary_op(lily_emit_state *emit, lily_ast *ast)
@@ -2436,6 +2829,28 @@ static void emit_binary_op(lily_emit_state *emit, lily_ast *ast)
         s->flags |= SYM_NOT_ASSIGNABLE;
     }
 
+    if ((opcode == o_int_add || opcode == o_int_minus) &&
+        ast->right->tree_type == tree_integer) {
+        /* The right side was just loaded from bytecode. Instead of using the
+           register it was loaded into, take the load back and put the value
+           into the op. The register check makes sure the load is the last
+           thing that was written: Anything after it would write to a
+           different storage. */
+        int pos = lily_u16_pos(emit->code) - 4;
+
+        if (pos >= 0 &&
+            lily_u16_get(emit->code, pos) == o_load_integer &&
+            lily_u16_get(emit->code, pos + 2) == rhs_sym->reg_spot) {
+            opcode = (opcode == o_int_add ? o_int_add_imm : o_int_minus_imm);
+            lily_u16_set_pos(emit->code, pos);
+            lily_u16_write_5(emit->code, opcode,
+                    ast->right->backing_value, lhs_sym->reg_spot, s->reg_spot,
+                    ast->line_num);
+            ast->result = (lily_sym *)s;
+            return;
+        }
+    }
+
     lily_u16_write_5(emit->code, opcode, lhs_sym->reg_spot, rhs_sym->reg_spot,
             s->reg_spot, ast->line_num);
 
@@ -2638,9 +3053,11 @@ static void eval_assign(lily_emit_state *emit, lily_ast *ast)
     lily_tree_type left_tt = ast->left->tree_type;
     lily_sym *left_sym = NULL;
     lily_sym *right_sym = NULL;
+    int is_decl = 0;
 
     if (left_tt == tree_local_var ||
         left_tt == tree_global_var) {
+        is_decl = ast->left->sym->flags & SYM_NOT_INITIALIZED;
         eval_assign_global_local(emit, ast);
 
         left_sym = ast->left->result;
@@ -2724,6 +3141,9 @@ after_type_check:;
             lily_u16_write_4(emit->code, opcode, right_sym->reg_spot,
                     left_sym->reg_spot, ast->line_num);
         }
+
+        if (left_tt == tree_local_var)
+            mark_local_constant(emit, ast, is_decl);
     }
     else if (left_tt == tree_property) {
         lily_u16_write_5(emit->code, o_property_set,
@@ -2743,6 +3163,7 @@ after_type_check:;
         uint16_t spot = find_closed_sym_spot(emit, left_var->function_depth,
                 left_sym);
 
+        left_var->flags &= ~VAR_IS_CONSTANT;
         lily_u16_write_4(emit->code, o_closure_set, spot, right_sym->reg_spot,
                 ast->line_num);
     }
@@ -4221,6 +4642,9 @@ static void eval_plus_plus(lily_emit_state *emit, lily_ast *ast)
     if (ast->right->tree_type != tree_local_var)
         eval_tree(emit, ast->right, NULL);
 
+    if (fold_binary_op(emit, ast))
+        return;
+
     if (ast->parent == NULL ||
         (ast->parent->tree_type != tree_binary ||
          ast->parent->op != expr_plus_plus)) {
@@ -4308,7 +4732,8 @@ static void eval_tree(lily_emit_state *emit, lily_ast *ast, lily_type *expect)
             if (ast->right->tree_type != tree_local_var)
                 eval_tree(emit, ast->right, ast->left->result->type);
 
-            emit_binary_op(emit, ast);
+            if (fold_binary_op(emit, ast) == 0)
+                emit_binary_op(emit, ast);
         }
     }
     else if (ast->tree_type == tree_parenth) {
@@ -4390,6 +4815,93 @@ void lily_emit_eval_expr_to_var(lily_emit_state *emit, lily_expr_state *es,
             var->reg_spot, ast->line_num);
 }
 
+/* Conditions that compare two Integer or two Double values jump on the result
+   of the comparison directly, instead of making a Boolean for o_jump_if. This
+   evaluates 'ast' and returns 1 if it wrote that kind of jump. Otherwise, the
+   tree is evaluated normally, and 0 is returned so the caller can write the
+   jump. */
+static int eval_compare_condition(lily_emit_state *emit, lily_ast *ast)
+{
+    int op = ast->op;
+
+    if (ast->tree_type != tree_binary ||
+        op < expr_eq_eq ||
+        op > expr_not_eq) {
+        eval_enforce_value(emit, ast, NULL,
+                "Conditional expression has no value.");
+        return 0;
+    }
+
+    if (ast->left->tree_type != tree_local_var)
+        eval_tree(emit, ast->left, NULL);
+
+    if (ast->right->tree_type != tree_local_var)
+        eval_tree(emit, ast->right, ast->left->result->type);
+
+    if (fold_binary_op(emit, ast)) {
+        emit->expr_num++;
+        return 0;
+    }
+
+    lily_sym *lhs_sym = ast->left->result;
+    lily_sym *rhs_sym = ast->right->result;
+    int lhs_id = lhs_sym->type->cls->id;
+
+    if (lhs_sym->type != rhs_sym->type ||
+        (lhs_id != LILY_ID_INTEGER && lhs_id != LILY_ID_DOUBLE)) {
+        emit_binary_op(emit, ast);
+        emit->expr_num++;
+        return 0;
+    }
+
+    emit->expr_num++;
+
+    lily_block_type current_type = emit->block->block_type;
+    /* if and while jump past their body when the condition is false, and
+       do-while jumps back up when the condition is true. */
+    int check = (current_type == block_do_while);
+    int opcode;
+
+    if (op == expr_lt || op == expr_lt_eq) {
+        lily_sym *temp = rhs_sym;
+        rhs_sym = lhs_sym;
+        lhs_sym = temp;
+    }
+
+    if (op == expr_not_eq)
+        check = !check;
+
+    if (lhs_id == LILY_ID_INTEGER) {
+        if (op == expr_eq_eq || op == expr_not_eq)
+            opcode = o_jump_if_int_eq;
+        else if (op == expr_gr || op == expr_lt)
+            opcode = o_jump_if_int_greater;
+        else
+            opcode = o_jump_if_int_greater_eq;
+    }
+    else {
+        if (op == expr_eq_eq || op == expr_not_eq)
+            opcode = o_jump_if_number_eq;
+        else if (op == expr_gr || op == expr_lt)
+            opcode = o_jump_if_number_greater;
+        else
+            opcode = o_jump_if_number_greater_eq;
+    }
+
+    if (current_type != block_do_while) {
+        lily_u16_write_5(emit->code, opcode, check, lhs_sym->reg_spot,
+                rhs_sym->reg_spot, 4);
+        lily_u16_write_1(emit->patches, lily_u16_pos(emit->code) - 1);
+    }
+    else {
+        int location = lily_u16_pos(emit->code) - emit->block->code_start;
+        lily_u16_write_5(emit->code, opcode, check, lhs_sym->reg_spot,
+                rhs_sym->reg_spot, (uint16_t)-location);
+    }
+
+    return 1;
+}
+
 /* Evaluate the root of the given pool, making sure that the result is something
    that can be truthy/falsey. SyntaxError is raised if the result isn't.
    Since this is called to evaluate conditions, this also writes any needed jump
@@ -4403,16 +4915,17 @@ void lily_emit_eval_condition(lily_emit_state *emit, lily_expr_state *es)
           ast->tree_type == tree_byte ||
           ast->tree_type == tree_integer) &&
           ast->backing_value != 0) == 0) {
-        eval_enforce_value(emit, ast, NULL,
-                "Conditional expression has no value.");
-        ensure_valid_condition_type(emit, ast->result->type);
+        if (eval_compare_condition(emit, ast) == 0) {
+            ensure_valid_condition_type(emit, ast->result->type);
 
-        if (current_type != block_do_while)
-            emit_jump_if(emit, ast, 0);
-        else {
-            int location = lily_u16_pos(emit->code) - emit->block->code_start;
-            lily_u16_write_4(emit->code, o_jump_if, 1, ast->result->reg_spot,
-                    (uint16_t)-location);
+            if (current_type != block_do_while)
+                emit_jump_if(emit, ast, 0);
+            else {
+                int location = lily_u16_pos(emit->code) -
+                        emit->block->code_start;
+                lily_u16_write_4(emit->code, o_jump_if, 1,
+                        ast->result->reg_spot, (uint16_t)-location);
+            }
         }
     }
     else {
@@ -4520,6 +5033,15 @@ void lily_prepare_main(lily_emit_state *emit, lily_function_val *main_func)
 {
     int register_count = emit->main_block->next_reg_spot;
 
+    /* This is done before o_vm_exit is written so the optimizer can't remove
+       it. The cache expects it to be last. */
+    if (emit->parser->config->optimize) {
+        int size = lily_optimize_code(emit->code->data,
+                lily_u16_pos(emit->code));
+
+        lily_u16_set_pos(emit->code, size);
+    }
+
     lily_u16_write_1(emit->code, o_vm_exit);
 
     main_func->code_len = lily_u16_pos(emit->code);
@@ -0,0 +1,372 @@
+#include <string.h>
+
+#include "lily.h"
+
+#include "lily_value_structs.h"
+#include "lily_value_flags.h"
+#include "lily_alloc.h"
+#include "lily_value_raw.h"
+
+extern uint64_t siphash24(const void *, unsigned long, const char [16]);
+
+/** A hash is split into two arrays. The entries hold keys and records inline,
+    in the order that keys were first inserted. Iteration walks through them
+    directly. The slots are a power-of-two index into the entries, searched by
+    linear probing with Robin Hood ordering.
+
+    Robin Hood ordering means that a slot is never given to a key that is closer
+    to its home slot than the key already there. A search can stop as soon as it
+    finds a slot whose key is closer to home than the search key would be. It
+    also means removing a key can shift the slots after it back by one, instead
+    of leaving a tombstone behind.
+
+    Each slot stores the entry's hash, folded down to 32 bits for the current
+    table size. Probing compares against that first, so most mismatches never
+    touch the entries.
+
+    Removing a key leaves a hole in the entries (a key with flags of 0). Holes
+    are squeezed out the next time the table is rebuilt, unless the hash is
+    being iterated over at the time. **/
+
+#define MIN_SLOTS 8
+
+/* Entries are allowed to fill 3/4 of the slots. */
+#define ENTRIES_FOR_SLOTS(n) ((n) - ((n) >> 2))
+
+lily_hash_val *lily_new_hash_raw(lily_slab_pool *pool, lily_arena *arena,
+        int size)
+{
+    uint32_t slot_count = MIN_SLOTS;
+    uint32_t slot_bits = 3;
+
+    while (ENTRIES_FOR_SLOTS(slot_count) < size) {
+        slot_count <<= 1;
+        slot_bits++;
+    }
+
+    int entries_size = ENTRIES_FOR_SLOTS(slot_count);
+    lily_hash_val *hv = lily_slab_malloc(pool, sizeof(*hv));
+
+    hv->refcount = 1;
+    hv->iter_count = 0;
+    hv->num_entries = 0;
+    hv->entries_used = 0;
+    hv->entries_size = entries_size;
+    hv->slot_mask = slot_count - 1;
+    hv->slot_bits = slot_bits;
+    hv->slots = lily_arena_malloc(arena, slot_count * sizeof(*hv->slots));
+    hv->entries = lily_arena_malloc(arena,
+            entries_size * sizeof(*hv->entries));
+
+    memset(hv->slots, 0, slot_count * sizeof(*hv->slots));
+
+    return hv;
+}
+
+/* Strings save their hash the first time that they're hashed, so a key that is
+   used over and over is only hashed once. String literals are hashed when
+   they're made. Since the threads of parallel.map share literals, they only
+   read a literal's hash, and never write it. */
+uint64_t lily_string_hash(lily_string_val *sv, const char *sipkey)
+{
+    uint64_t hash = sv->hash;
+
+    /* A string that really hashes to 0 is hashed every time, which is fine. */
+    if (hash == 0) {
+        hash = siphash24(sv->string, sv->size, sipkey);
+
+        if (hash)
+            sv->hash = hash;
+    }
+
+    return hash;
+}
+
+uint64_t lily_hash_key(lily_state *s, lily_value *key)
+{
+    if (key->class_id == LILY_ID_STRING)
+        return lily_string_hash(key->value.string,
+                lily_config_get(s)->sipkey);
+
+    return (uint64_t)key->value.integer;
+}
+
+/* Integer keys are their own hash, and they're often sequential. Sequential
+   keys are best off in sequential slots, so the bits that pick the slot are
+   kept as-is. The bits above them are mixed and folded in. Each run of
+   'slot_count' keys therefore covers every slot exactly once, and keys that
+   only differ in their upper bits still spread out. */
+static uint32_t fold_hash(uint64_t hash, uint32_t slot_bits)
+{
+    uint64_t h = hash >> slot_bits;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return (uint32_t)(hash ^ h);
+}
+
+static int key_eq(lily_value *left, lily_value *right)
+{
+    if (left->class_id == LILY_ID_STRING)
+        return lily_string_eq(left->value.string, right->value.string);
+
+    return left->value.integer == right->value.integer;
+}
+
+/* Returns the slot holding 'key', or -1 if the key isn't in the table. */
+static int find_slot(lily_hash_val *hv, uint64_t hash, lily_value *key)
+{
+    uint32_t mask = hv->slot_mask;
+    uint32_t short_hash = fold_hash(hash, hv->slot_bits);
+    uint32_t pos = short_hash & mask;
+    uint32_t dist = 0;
+
+    while (1) {
+        lily_hash_slot *slot = hv->slots + pos;
+
+        if (slot->entry == 0 ||
+            ((pos - slot->hash) & mask) < dist)
+            return -1;
+
+        if (slot->hash == short_hash) {
+            lily_hash_entry *entry = hv->entries + slot->entry - 1;
+
+            if (entry->hash == hash && key_eq(&entry->key, key))
+                return (int)pos;
+        }
+
+        pos = (pos + 1) & mask;
+        dist++;
+    }
+}
+
+/* Point a slot at entry 'index' (1-based). The caller must make sure that a
+   free slot exists. */
+static void insert_slot(lily_hash_val *hv, uint32_t short_hash, uint32_t index)
+{
+    uint32_t mask = hv->slot_mask;
+    uint32_t pos = short_hash & mask;
+    uint32_t dist = 0;
+
+    while (1) {
+        lily_hash_slot *slot = hv->slots + pos;
+
+        if (slot->entry == 0) {
+            slot->entry = index;
+            slot->hash = short_hash;
+            return;
+        }
+
+        uint32_t slot_dist = (pos - slot->hash) & mask;
+
+        if (slot_dist < dist) {
+            /* The current occupant is closer to home. Take the slot, then find
+               a new place for the occupant. */
+            uint32_t swap_index = slot->entry;
+            uint32_t swap_hash = slot->hash;
+
+            slot->entry = index;
+            slot->hash = short_hash;
+            index = swap_index;
+            short_hash = swap_hash;
+            dist = slot_dist;
+        }
+
+        pos = (pos + 1) & mask;
+        dist++;
+    }
+}
+
+static void remove_slot(lily_hash_val *hv, uint32_t pos)
+{
+    uint32_t mask = hv->slot_mask;
+    uint32_t next = (pos + 1) & mask;
+
+    /* Shift back anything that isn't already in its home slot. */
+    while (hv->slots[next].entry != 0 &&
+           ((next - hv->slots[next].hash) & mask) != 0) {
+        hv->slots[pos] = hv->slots[next];
+        pos = next;
+        next = (next + 1) & mask;
+    }
+
+    hv->slots[pos].entry = 0;
+}
+
+static void rebuild(lily_hash_val *hv, uint32_t slot_bits)
+{
+    uint32_t slot_count = (uint32_t)1 << slot_bits;
+    int i, j;
+
+    /* Squeezing out holes moves entries, which would confuse anything that is
+       walking through them. */
+    if (hv->iter_count == 0 && hv->num_entries != hv->entries_used) {
+        for (i = 0, j = 0;i < hv->entries_used;i++) {
+            if (hv->entries[i].key.flags == 0)
+                continue;
+
+            if (i != j)
+                hv->entries[j] = hv->entries[i];
+
+            j++;
+        }
+
+        hv->entries_used = j;
+    }
+
+    int entries_size = ENTRIES_FOR_SLOTS(slot_count);
+
+    lily_arena *arena = lily_slab_arena(hv);
+
+    hv->entries = lily_arena_realloc(arena, hv->entries,
+            entries_size * sizeof(*hv->entries));
+    hv->entries_size = entries_size;
+
+    lily_arena_free(arena, hv->slots);
+    hv->slots = lily_arena_malloc(arena, slot_count * sizeof(*hv->slots));
+    hv->slot_mask = slot_count - 1;
+    hv->slot_bits = slot_bits;
+    memset(hv->slots, 0, slot_count * sizeof(*hv->slots));
+
+    for (i = 0;i < hv->entries_used;i++) {
+        lily_hash_entry *entry = hv->entries + i;
+
+        if (entry->key.flags)
+            insert_slot(hv, fold_hash(entry->hash, slot_bits), i + 1);
+    }
+}
+
+static void grow(lily_hash_val *hv)
+{
+    uint32_t slot_bits = hv->slot_bits;
+
+    /* If at least half of the entries are holes, squeezing them out makes
+       enough room without growing. */
+    if (hv->iter_count != 0 ||
+        hv->num_entries > hv->entries_used / 2)
+        slot_bits++;
+
+    rebuild(hv, slot_bits);
+}
+
+int lily_hash_take(lily_state *s, lily_hash_val *hv, lily_value *key)
+{
+    uint64_t hash = lily_hash_key(s, key);
+    int pos = find_slot(hv, hash, key);
+
+    if (pos == -1)
+        return 0;
+
+    uint32_t index = hv->slots[pos].entry - 1;
+    lily_hash_entry *entry = hv->entries + index;
+
+    remove_slot(hv, pos);
+
+    lily_push_value(s, &entry->key);
+    lily_push_value(s, &entry->record);
+    lily_deref(&entry->key);
+    lily_deref(&entry->record);
+
+    /* The record is cleared too so the gc doesn't look into it. */
+    entry->key.flags = 0;
+    entry->record.flags = 0;
+    hv->num_entries--;
+
+    /* Holes at the end can be reused right away. */
+    while (hv->entries_used &&
+           hv->entries[hv->entries_used - 1].key.flags == 0)
+        hv->entries_used--;
+
+    return 1;
+}
+
+void lily_hash_set(lily_state *s, lily_hash_val *hv, lily_value *key,
+        lily_value *record)
+{
+    if (record->flags & VAL_IS_GC_SWEEPABLE)
+        lily_gc_barrier(s, record);
+
+    lily_hash_set_hashed(hv, key, record, lily_hash_key(s, key));
+}
+
+/* This is lily_hash_set for a key that has already been hashed. This doesn't
+   run the gc's barrier, so a sweepable record must go through it first. */
+void lily_hash_set_hashed(lily_hash_val *hv, lily_value *key,
+        lily_value *record, uint64_t hash)
+{
+    int pos = find_slot(hv, hash, key);
+
+    if (pos != -1) {
+        lily_hash_entry *entry = hv->entries + hv->slots[pos].entry - 1;
+        lily_value_assign(&entry->record, record);
+        return;
+    }
+
+    /* The key or record may be inside this hash, and growing can move them.
+       Copy them out first. */
+    lily_value new_key = *key;
+    lily_value new_record = *record;
+
+    if (new_key.flags & VAL_IS_DEREFABLE)
+        new_key.value.generic->refcount++;
+
+    if (new_record.flags & VAL_IS_DEREFABLE)
+        new_record.value.generic->refcount++;
+
+    if (hv->entries_used == hv->entries_size)
+        grow(hv);
+
+    uint32_t index = hv->entries_used;
+    lily_hash_entry *entry = hv->entries + index;
+
+    entry->hash = hash;
+    entry->key = new_key;
+    entry->record = new_record;
+    hv->entries_used++;
+    hv->num_entries++;
+
+    insert_slot(hv, fold_hash(hash, hv->slot_bits), index + 1);
+}
+
+void lily_hash_set_from_stack(lily_state *s, lily_hash_val *hv)
+{
+    lily_value *record = lily_stack_take(s);
+    lily_value *key = lily_stack_take(s);
+
+    lily_hash_set(s, hv, key, record);
+
+    lily_deref(record);
+    record->flags = 0;
+
+    lily_deref(key);
+    key->flags = 0;
+}
+
+lily_value *lily_hash_get(lily_state *s, lily_hash_val *hv, lily_value *key)
+{
+    lily_hash_entry *entry = lily_hash_find_entry(hv, key,
+            lily_hash_key(s, key));
+
+    if (entry == NULL)
+        return NULL;
+
+    return &entry->record;
+}
+
+/* Return the entry holding 'key', or NULL if there isn't one. The entry's key
+   is the one that was first inserted, which may not be the same value as the
+   key given. */
+lily_hash_entry *lily_hash_find_entry(lily_hash_val *hv, lily_value *key,
+        uint64_t hash)
+{
+    int pos = find_slot(hv, hash, key);
+
+    if (pos == -1)
+        return NULL;
+
+    return hv->entries + hv->slots[pos].entry - 1;
+}
@@ -31,6 +31,12 @@ typedef enum {
     o_int_bitwise_or,
     o_int_bitwise_xor,
 
+    /* o_int_add and o_int_minus, except the right side is a 16-bit SIGNED
+       value in bytecode instead of a register. The value is written before the
+       left side. */
+    o_int_add_imm,
+    o_int_minus_imm,
+
     /* Operations where a Double may be on one or both sides. */
     o_number_add,
     o_number_minus,
@@ -63,6 +69,18 @@ typedef enum {
        against class id 0 which only exists on registers that have been cleared
        out of a value. */
     o_jump_if_not_class,
+    /* These are given a check bit, two values, and a distance to move. The
+       values are compared, and the jump is taken if the result matches the
+       check bit. Both values are Integer (int) or both are Double (number).
+       These are written for conditions, so that a comparison doesn't have to
+       make a Boolean for o_jump_if to test. Not equal uses eq with the check
+       bit flipped, and less / less equal swap sides like the comparisons. */
+    o_jump_if_int_eq,
+    o_jump_if_int_greater,
+    o_jump_if_int_greater_eq,
+    o_jump_if_number_eq,
+    o_jump_if_number_greater,
+    o_jump_if_number_greater_eq,
 
     /* Perform a single step of a `for i in a...b` loop. */
     o_for_integer,
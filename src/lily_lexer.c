@@ -7,6 +7,7 @@
 
 #include "lily_config.h"
 #include "lily_lexer.h"
+#include "lily_string_scan.h"
 #include "lily_utf8.h"
 #include "lily_alloc.h"
 
@@ -340,139 +341,98 @@ void lily_pop_lex_entry(lily_lex_state *lexer)
         lexer->line_num = 0;
 }
 
-#define READER_PREP \
-int bufsize, i; \
-lily_lex_state *lexer = entry->lexer; \
-char *input_buffer = lexer->input_buffer; \
- \
-bufsize = lexer->input_size; \
-i = 0; \
-int utf8_check = 0;
-
-#define READER_GROW_CHECK \
-if ((i + 2) == bufsize) { \
-    lily_grow_lexer_buffers(lexer); \
-    input_buffer = lexer->input_buffer; \
-    bufsize = lexer->input_size; \
-}
-
-#define READER_EOF_CHECK(to_check, against) \
-if (to_check == against) { \
-    input_buffer[i] = '\n'; \
-    input_buffer[i + 1] = '\0'; \
-    /* Bump the line number, unless only EOF or \0 was seen. */ \
-    lexer->line_num += !!i; \
-    break; \
-}
-
-#define READER_END \
-if (utf8_check && lily_is_valid_utf8(input_buffer) == 0) { \
-    lily_raise_err(lexer->raiser, "Invalid utf-8 sequence on line %d.", \
-            lexer->line_num); \
-} \
- \
-return i;
+/** Line reading **/
 
-/** file and str reading functions **/
-
-/* This reads a line from a file-backed entry. */
-static int read_file_line(lily_lex_entry *entry)
+/* Copy the next line of the entry's source into the input buffer. A line ends
+   with \n, \r, or \r\n, and the input buffer always gets \n. The result is
+   the size of the line (with the newline), or 0 if the source is done. */
+static int read_line(lily_lex_state *lexer)
 {
-    READER_PREP
-    FILE *input_file = (FILE *)entry->source;
-    int ch;
+    lily_lex_entry *entry = lexer->entry;
+    const char *start = entry->source;
+    const char *end = entry->source_end;
+    char *input_buffer = lexer->input_buffer;
+
+    if (start == end) {
+        input_buffer[0] = '\n';
+        input_buffer[1] = '\0';
+        return 0;
+    }
 
-    while (1) {
-        ch = fgetc(input_file);
+    const char *newline = memchr(start, '\n', end - start);
+    const char *line_end = newline ? newline : end;
+    const char *cr = memchr(start, '\r', line_end - start);
+    const char *next;
 
-        READER_GROW_CHECK
-        READER_EOF_CHECK(ch, EOF)
+    if (cr) {
+        line_end = cr;
+        next = cr + 1;
 
-        input_buffer[i] = ch;
+        if (next != end && *next == '\n')
+            next++;
+    }
+    else if (newline)
+        next = newline + 1;
+    else
+        next = end;
 
-        if (ch == '\r' || ch == '\n') {
-            lexer->line_num++;
+    int size = (int)(line_end - start);
 
-            if (ch == '\r') {
-                input_buffer[i] = '\n';
-                ch = fgetc(input_file);
-                if (ch != '\n')
-                    ungetc(ch, input_file);
-            }
+    while (size + 2 > lexer->input_size)
+        lily_grow_lexer_buffers(lexer);
 
-            i++;
-            input_buffer[i] = '\0';
-            break;
-        }
-        else if ((unsigned char)ch > 127)
-            utf8_check = 1;
+    input_buffer = lexer->input_buffer;
+    memcpy(input_buffer, start, size);
+    input_buffer[size] = '\n';
+    input_buffer[size + 1] = '\0';
+    entry->source = next;
+    lexer->line_num++;
 
-        i++;
-    }
+    if (entry->utf8_error != NULL && entry->utf8_error < next)
+        lily_raise_err(lexer->raiser, "Invalid utf-8 sequence on line %d.",
+                lexer->line_num);
 
-    READER_END
+    return size + 1;
 }
 
-/* This reads a line from a string-backed entry. */
-static int read_str_line(lily_lex_entry *entry)
+/* Read all of a file into a buffer that the entry owns. The file is closed
+   afterward, since the buffer is all that the entry needs. */
+static char *read_whole_file(FILE *f, size_t *out_size)
 {
-    READER_PREP
-    char *ch = (char *)entry->source;
+    size_t size = 0, capacity = 4096;
 
-    while (1) {
-        READER_GROW_CHECK
-        READER_EOF_CHECK(*ch, '\0')
+    /* This is a guess, because text mode may change the size on Windows. */
+    if (fseek(f, 0, SEEK_END) == 0) {
+        long end = ftell(f);
 
-        input_buffer[i] = *ch;
+        if (end > 0)
+            capacity = (size_t)end + 1;
 
-        if (*ch == '\r' || *ch == '\n') {
-            lexer->line_num++;
+        fseek(f, 0, SEEK_SET);
+    }
 
-            if (*ch == '\r') {
-                input_buffer[i] = '\n';
-                ch++;
-                if (*ch == '\n')
-                    ch++;
-            }
-            else
-                ch++;
+    char *buffer = lily_malloc(capacity * sizeof(*buffer));
 
-            i++;
-            input_buffer[i] = '\0';
+    while (1) {
+        size += fread(buffer + size, 1, capacity - size, f);
+
+        if (size < capacity)
             break;
-        }
-        else if (((unsigned char)*ch) > 127)
-            utf8_check = 1;
 
-        i++;
-        ch++;
+        capacity *= 2;
+        buffer = lily_realloc(buffer, capacity * sizeof(*buffer));
     }
 
-    entry->source = ch;
-    READER_END
-}
-
-#undef READER_PREP
-#undef READER_GROW_CHECK
-#undef READER_EOF_CHECK
-#undef READER_END
-
-static int read_line(lily_lex_state *lex)
-{
-    lily_lex_entry *entry = lex->entry;
-    if (entry->entry_type == et_file)
-        return read_file_line(entry);
-    else
-        return read_str_line(entry);
+    fclose(f);
+    *out_size = size;
+    return buffer;
 }
 
 static void close_entry(lily_lex_entry *entry)
 {
-    if (entry->entry_type == et_file)
-        fclose((FILE *)entry->source);
-    else if (entry->entry_type != et_shallow_string)
-        /* entry->source moves, but entry->extra doesn't. Use this. */
-        lily_free(entry->extra);
+    /* Shallow strings don't have a buffer of their own. */
+    lily_free(entry->extra);
+    entry->extra = NULL;
 }
 
 /** Scanning functions and helpers **/
@@ -1238,24 +1198,36 @@ void lily_lexer_load(lily_lex_state *lexer, lily_lex_entry_type entry_type,
         const void *source)
 {
     lily_lex_entry *entry = get_entry(lexer);
+    char *buffer;
+    size_t size;
 
     entry->extra = NULL;
     entry->entry_type = entry_type;
     entry->final_token = tk_eof;
 
-    if (entry_type != et_file &&
-        entry_type != et_shallow_string) {
-        char *str_source = (char *)source;
-        char *copy = lily_malloc((strlen(str_source) + 1) * sizeof(*copy));
-
-        strcpy(copy, str_source);
-        source = copy;
-        entry->extra = copy;
-
+    if (entry_type == et_file) {
+        buffer = read_whole_file((FILE *)source, &size);
+        entry->extra = buffer;
+    }
+    else if (entry_type == et_shallow_string) {
+        buffer = (char *)source;
+        size = strlen(buffer);
+    }
+    else {
+        size = strlen((const char *)source);
+        buffer = lily_malloc((size + 1) * sizeof(*buffer));
+        memcpy(buffer, source, size + 1);
+        entry->extra = buffer;
         entry->final_token = tk_end_lambda;
     }
 
-    entry->source = (void *)source;
+    /* The whole source is checked once, instead of each line as it's read.
+       The error isn't raised until the line that has it is reached. */
+    int error_pos = lily_find_invalid_utf8(buffer, (int)size);
+
+    entry->utf8_error = error_pos == -1 ? NULL : buffer + error_pos;
+    entry->source = buffer;
+    entry->source_end = buffer + size;
     read_line(lexer);
 }
 
@@ -1617,64 +1589,64 @@ void lily_verify_template(lily_lex_state *lexer)
    stored the content into. */
 int lily_lexer_read_content(lily_lex_state *lexer, char **out_buffer)
 {
-    char c;
-    int lbp, htmlp;
-
-    /* htmlp and lbp are used so it's obvious they aren't globals. */
-    lbp = lexer->input_pos;
-    c = lexer->input_buffer[lbp];
-    htmlp = 0;
+    char *label = lexer->label;
+    char *line = lexer->input_buffer + lexer->input_pos;
+    int line_size = (int)strlen(line);
+    int label_pos = 0;
 
     /* For `?>\n`, don't render the newline (it's annoying). */
-    if (c == '\n' &&
-        lbp > 2 &&
-        lexer->input_buffer[lbp - 1] == '>' &&
-        lexer->input_buffer[lbp - 2] == '?') {
-
-        goto next_line;
-    }
+    if (line[0] == '\n' &&
+        lexer->input_pos > 2 &&
+        line[-1] == '>' &&
+        line[-2] == '?')
+        line_size = 0;
 
     /* Send html to the server either when unable to hold more or the lily tag
-       is found. */
+       is found. Each line is searched for the tag, then copied over whole. */
     while (1) {
-        lbp++;
-        if (c == '<') {
-            if (strncmp(lexer->input_buffer + lbp, "?lily", 5) == 0) {
-                lexer->label[htmlp] = '\0';
-                *out_buffer = lexer->label;
-                lexer->input_pos = lbp + 5;
-                return 0;
-            }
-        }
-        lexer->label[htmlp] = c;
-        htmlp++;
-        if (htmlp == (lexer->input_size - 1)) {
-            lexer->label[htmlp] = '\0';
-            *out_buffer = lexer->label;
-            lexer->input_pos = lbp;
+        int tag_at = lily_scan_find(line, line_size, "<?lily", 6);
+        int take = (tag_at == -1) ? line_size : tag_at;
+        int room = lexer->input_size - 1 - label_pos;
+
+        if (take > room) {
+            memcpy(label + label_pos, line, room);
+            label_pos += room;
+            label[label_pos] = '\0';
+            *out_buffer = label;
+            lexer->input_pos = (uint32_t)(line - lexer->input_buffer + room);
             return 1;
         }
 
-        if (c == '\n') {
-next_line:
-            if (read_line(lexer))
-                lbp = 0;
-            else {
-                lexer->token = lexer->entry->final_token;
+        memcpy(label + label_pos, line, take);
+        label_pos += take;
 
-                /* This allows files to have a newline at the end, without
-                   sending just that newline. */
-                if (htmlp == 1 && lexer->label[0] == '\n')
-                    htmlp = 0;
+        if (tag_at != -1) {
+            label[label_pos] = '\0';
+            *out_buffer = label;
+            lexer->input_pos = (uint32_t)(line - lexer->input_buffer +
+                    tag_at + 6);
+            return 0;
+        }
 
-                lexer->label[htmlp] = '\0';
-                *out_buffer = lexer->label;
-                lexer->input_pos = 0;
-                return 0;
-            }
+        line_size = read_line(lexer);
+
+        if (line_size == 0) {
+            lexer->token = lexer->entry->final_token;
+
+            /* This allows files to have a newline at the end, without
+               sending just that newline. */
+            if (label_pos == 1 && label[0] == '\n')
+                label_pos = 0;
+
+            label[label_pos] = '\0';
+            *out_buffer = label;
+            lexer->input_pos = 0;
+            return 0;
         }
 
-        c = lexer->input_buffer[lbp];
+        /* Reading may have grown the buffers. */
+        label = lexer->label;
+        line = lexer->input_buffer;
     }
 }
 
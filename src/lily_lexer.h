@@ -88,8 +88,8 @@ typedef struct lily_lex_entry_ {
 
     lily_literal *saved_last_literal;
     char *saved_input;
-    uint16_t saved_input_pos;
-    uint16_t saved_input_size;
+    uint32_t saved_input_pos;
+    uint32_t saved_input_size;
     lily_token saved_token : 16;
     lily_token final_token : 16;
     uint32_t saved_line_num;
@@ -97,8 +97,13 @@ typedef struct lily_lex_entry_ {
     uint16_t pad;
     int64_t saved_last_integer;
 
-    void *source;
-    void *extra;
+    /* The next line to read, and the end of the source. */
+    const char *source;
+    const char *source_end;
+    /* Where the source first has invalid utf-8, or NULL if it doesn't. */
+    const char *utf8_error;
+    /* This is the buffer, if the entry owns it. */
+    char *extra;
 
     struct lily_lex_entry_ *prev;
     struct lily_lex_entry_ *next;
@@ -113,11 +118,11 @@ typedef struct lily_lex_state_ {
     uint32_t line_num;
     uint32_t expand_start_line;
 
-    uint16_t pad;
-    uint16_t label_size;
+    uint32_t pad;
+    uint32_t label_size;
 
-    uint16_t input_size;
-    uint16_t input_pos;
+    uint32_t input_size;
+    uint32_t input_pos;
 
     int64_t last_integer;
 
@@ -10,6 +10,8 @@
 #include "lily_value_flags.h"
 #include "lily_vm.h"
 #include "lily_alloc.h"
+#include "lily_value_raw.h"
+#include "lily_string_scan.h"
 
 extern lily_type *lily_unit_type;
 
@@ -140,7 +142,8 @@ void lily_mb_add(lily_msgbuf *msgbuf, const char *str)
     if ((msgbuf->pos + len + 1) > msgbuf->size)
         resize_msgbuf(msgbuf, msgbuf->pos + len + 1);
 
-    strcat(msgbuf->message, str);
+    /* The end is known, so don't make strcat find it again. */
+    memcpy(msgbuf->message + msgbuf->pos, str, len + 1);
     msgbuf->pos += len;
 }
 
@@ -152,8 +155,8 @@ static void add_bytestring(lily_msgbuf *msgbuf, lily_string_val *sv)
 /* Add a safe version of a \0 terminated string to a buffer. */
 void lily_mb_escape_add_str(lily_msgbuf *msgbuf, const char *str)
 {
-    /* Both callers (vm's KeyError and msgbuf's interpolation) want the string
-       to be quoted, so do it for them. */
+    /* The caller (vm's KeyError) wants the string to be quoted, so do it for
+       them. */
     lily_mb_add_char(msgbuf, '"');
     add_escaped_raw(msgbuf, 0, str, strlen(str));
     lily_mb_add_char(msgbuf, '"');
@@ -402,19 +405,20 @@ static void add_list_like(lily_vm_state *vm, lily_msgbuf *msgbuf, tag *t,
         lily_value *v, const char *prefix, const char *suffix)
 {
     int i;
-    lily_value **values = v->value.container->values;
-    int count = v->value.container->num_values;
+    lily_container_val *c = v->value.container;
+    lily_value scratch;
+    int count = c->num_values;
 
     lily_mb_add(msgbuf, prefix);
 
     /* This is necessary because num_values is unsigned. */
     if (count != 0) {
         for (i = 0;i < count - 1;i++) {
-            add_value_to_msgbuf(vm, msgbuf, t, values[i]);
+            add_value_to_msgbuf(vm, msgbuf, t, lily_list_peek(c, i, &scratch));
             lily_mb_add(msgbuf, ", ");
         }
         if (i != count)
-            add_value_to_msgbuf(vm, msgbuf, t, values[i]);
+            add_value_to_msgbuf(vm, msgbuf, t, lily_list_peek(c, i, &scratch));
     }
 
     lily_mb_add(msgbuf, suffix);
@@ -448,8 +452,13 @@ static void add_value_to_msgbuf(lily_vm_state *vm, lily_msgbuf *msgbuf,
         add_byte(msgbuf, (uint8_t) v->value.integer);
     else if (v->class_id == LILY_ID_DOUBLE)
         add_double(msgbuf, v->value.doubleval);
-    else if (v->class_id == LILY_ID_STRING)
-        lily_mb_escape_add_str(msgbuf, v->value.string->string);
+    else if (v->class_id == LILY_ID_STRING) {
+        lily_string_val *sv = v->value.string;
+
+        lily_mb_add_char(msgbuf, '"');
+        add_escaped_raw(msgbuf, 0, sv->string, sv->size);
+        lily_mb_add_char(msgbuf, '"');
+    }
     else if (v->class_id == LILY_ID_BYTESTRING)
         add_bytestring(msgbuf, v->value.string);
     else if (v->class_id == LILY_ID_FUNCTION) {
@@ -469,19 +478,18 @@ static void add_value_to_msgbuf(lily_vm_state *vm, lily_msgbuf *msgbuf,
         lily_hash_val *hv = v->value.hash;
         lily_mb_add_char(msgbuf, '[');
         int i, j;
-        for (i = 0, j = 0;i < hv->num_bins;i++) {
-            lily_hash_entry *entry = hv->bins[i];
-
-            while (entry) {
-                add_value_to_msgbuf(vm, msgbuf, t, entry->boxed_key);
-                lily_mb_add(msgbuf, " => ");
-                add_value_to_msgbuf(vm, msgbuf, t, entry->record);
-                if (j != hv->num_entries - 1)
-                    lily_mb_add(msgbuf, ", ");
-
-                j++;
-                entry = entry->next;
-            }
+        for (i = 0, j = 0;i < hv->entries_used;i++) {
+            lily_hash_entry *entry = hv->entries + i;
+            if (entry->key.flags == 0)
+                continue;
+
+            add_value_to_msgbuf(vm, msgbuf, t, &entry->key);
+            lily_mb_add(msgbuf, " => ");
+            add_value_to_msgbuf(vm, msgbuf, t, &entry->record);
+            if (j != hv->num_entries - 1)
+                lily_mb_add(msgbuf, ", ");
+
+            j++;
         }
         lily_mb_add_char(msgbuf, ']');
     }
@@ -517,8 +525,11 @@ static void add_value_to_msgbuf(lily_vm_state *vm, lily_msgbuf *msgbuf,
 void lily_mb_add_value(lily_msgbuf *msgbuf, lily_vm_state *vm,
         lily_value *value)
 {
-    if (value->class_id == LILY_ID_STRING)
-        lily_mb_add(msgbuf, value->value.string->string);
+    if (value->class_id == LILY_ID_STRING) {
+        lily_string_val *sv = value->value.string;
+
+        lily_mb_add_slice(msgbuf, sv->string, 0, sv->size);
+    }
     else
         add_value_to_msgbuf(vm, msgbuf, NULL, value);
 }
@@ -531,37 +542,30 @@ void lily_mb_add_value(lily_msgbuf *msgbuf, lily_vm_state *vm,
 const char *lily_mb_html_escape(lily_msgbuf *msgbuf, const char *input_str)
 {
     lily_mb_flush(msgbuf);
-    int start = 0, stop = 0;
-    const char *ch = &input_str[0];
+    int size = (int)strlen(input_str);
+    int start = 0, stop;
 
     while (1) {
-        if (*ch == '&') {
-            stop = (ch - input_str);
-            lily_mb_add_slice(msgbuf, input_str, start, stop);
+        stop = start + lily_scan_html(input_str + start, size - start);
+
+        if (stop == size)
+            break;
+
+        lily_mb_add_slice(msgbuf, input_str, start, stop);
+
+        if (input_str[stop] == '&')
             lily_mb_add(msgbuf, "&amp;");
-            start = stop + 1;
-        }
-        else if (*ch == '<') {
-            stop = (ch - input_str);
-            lily_mb_add_slice(msgbuf, input_str, start, stop);
+        else if (input_str[stop] == '<')
             lily_mb_add(msgbuf, "&lt;");
-            start = stop + 1;
-        }
-        else if (*ch == '>') {
-            stop = (ch - input_str);
-            lily_mb_add_slice(msgbuf, input_str, start, stop);
+        else
             lily_mb_add(msgbuf, "&gt;");
-            start = stop + 1;
-        }
-        else if (*ch == '\0')
-            break;
 
-        ch++;
+        start = stop + 1;
     }
 
+    /* If nothing was escaped, the caller gets back what it sent. */
     if (start != 0) {
-        stop = (ch - input_str);
-        lily_mb_add_slice(msgbuf, input_str, start, stop);
+        lily_mb_add_slice(msgbuf, input_str, start, size);
         input_str = msgbuf->message;
     }
 
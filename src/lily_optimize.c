@@ -0,0 +1,418 @@
+#include <string.h>
+
+#include "lily_alloc.h"
+#include "lily_optimize.h"
+
+#include "lily_int_code_iter.h"
+#include "lily_int_opcode.h"
+
+/** The optimizer is a peephole pass over the code of a function (or __main__)
+    that runs after the emitter is done with it. Each round does the following:
+
+    * Jump threading: A jump that lands on an o_jump is sent to where that
+      o_jump goes instead.
+    * Unreachable code: Instructions that no path from the start reaches are
+      removed. The emitter writes a lot of these, such as the o_return_unit at
+      the end of a function that already returned.
+    * An o_jump that goes to the next instruction is removed.
+    * Dead stores: A load or assign into a register is removed if the next
+      instruction is also a load or assign into that register (that doesn't read
+      it). Neither can raise, so nothing can see the value that was dropped.
+
+    Removed instructions are then squeezed out, and every jump is fixed to the
+    new positions. Rounds stop when nothing changes.
+
+    The code iterator is used to walk over instructions, so new opcodes only
+    need to be taught to the iterator. The exception is o_exception_catch, which
+    the emitter writes with a different layout than the iterator describes.
+
+    If the optimizer finds something it doesn't understand, such as an unknown
+    opcode or a jump into the middle of an instruction, the code is left as it
+    was in the last round. **/
+
+/* Stop after this many rounds, even if there are still changes to make. */
+#define MAX_ROUNDS 8
+
+/* Threading only follows this many o_jump, in case they form a loop. */
+#define MAX_THREAD 16
+
+#define MARK_START   0x1
+#define MARK_REACHED 0x2
+#define MARK_DELETED 0x4
+
+typedef struct {
+    uint16_t *code;
+
+    /* These are indexed by code position. */
+    uint8_t *marks;
+    uint16_t *new_pos;
+
+    /* Positions that reachability hasn't looked at yet. */
+    uint16_t *todo;
+
+    int size;
+    int changed;
+} lily_optimizer;
+
+static uint16_t decode(lily_optimizer *o, lily_code_iter *ci, int offset)
+{
+    lily_ci_init(ci, o->code, offset, o->size);
+    lily_ci_next(ci);
+    return ci->round_total;
+}
+
+/* Returns where the jump of the current instruction is (relative to the
+   opcode), or 0 if there isn't one. */
+static int jump_spot(lily_code_iter *ci)
+{
+    if (ci->jumps_5 == 0)
+        return 0;
+
+    /* The emitter writes this one as opcode, line, class, jump. */
+    if (ci->opcode == o_exception_catch)
+        return 3;
+
+    return ci->round_total - ci->line_6 - ci->jumps_5;
+}
+
+/* These jumps are read by the vm as signed values. The others can only go
+   forward. */
+static int is_signed_jump(uint16_t op)
+{
+    switch (op) {
+        case o_jump:
+        case o_jump_if:
+        case o_jump_if_int_eq:
+        case o_jump_if_int_greater:
+        case o_jump_if_int_greater_eq:
+        case o_jump_if_number_eq:
+        case o_jump_if_number_greater:
+        case o_jump_if_number_greater_eq:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/* Returns where the jump at 'spot' goes, or -1 if it goes nowhere. Catching
+   opcodes use 0 to say there is no next catch. */
+static int jump_target(lily_optimizer *o, int offset, int spot)
+{
+    uint16_t op = o->code[offset];
+    uint16_t distance = o->code[offset + spot];
+
+    if (is_signed_jump(op))
+        return offset + (int16_t)distance;
+
+    if (distance == 0)
+        return -1;
+
+    return offset + distance;
+}
+
+/* Only instructions that can't raise and don't touch anything but their output
+   are counted as stores. The output of each is at +2. */
+static int is_simple_store(uint16_t op)
+{
+    switch (op) {
+        case o_assign:
+        case o_assign_noref:
+        case o_load_readonly:
+        case o_load_integer:
+        case o_load_boolean:
+        case o_load_byte:
+        case o_load_empty_variant:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int falls_through(uint16_t op)
+{
+    switch (op) {
+        case o_jump:
+        case o_return_value:
+        case o_return_unit:
+        case o_exception_raise:
+        case o_vm_exit:
+            return 0;
+        default:
+            return 1;
+    }
+}
+
+/* Mark where instructions start, then make sure that every jump lands on one
+   (or the end). */
+static int scan(lily_optimizer *o)
+{
+    lily_code_iter ci;
+    int offset, size = o->size;
+
+    memset(o->marks, 0, (size + 1) * sizeof(*o->marks));
+
+    for (offset = 0;offset < size;offset += ci.round_total) {
+        if (decode(o, &ci, offset) == 0 ||
+            offset + ci.round_total > size)
+            return 0;
+
+        o->marks[offset] = MARK_START;
+    }
+
+    for (offset = 0;offset < size;offset += ci.round_total) {
+        decode(o, &ci, offset);
+
+        int spot = jump_spot(&ci);
+
+        if (spot == 0)
+            continue;
+
+        int target = jump_target(o, offset, spot);
+
+        if (target == -1 || target == size)
+            continue;
+
+        if (target < 0 || target > size ||
+            (o->marks[target] & MARK_START) == 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+static void thread_jumps(lily_optimizer *o)
+{
+    lily_code_iter ci;
+    uint16_t *code = o->code;
+    int offset, size = o->size;
+
+    for (offset = 0;offset < size;offset += ci.round_total) {
+        decode(o, &ci, offset);
+
+        int spot = jump_spot(&ci);
+
+        /* The vm finds catch branches on its own, so leave those alone. */
+        if (spot == 0 ||
+            ci.opcode == o_catch_push ||
+            ci.opcode == o_exception_catch)
+            continue;
+
+        int first = jump_target(o, offset, spot);
+        int target = first;
+        int i;
+
+        for (i = 0;i < MAX_THREAD;i++) {
+            if (target >= size || code[target] != o_jump)
+                break;
+
+            target += (int16_t)code[target + 1];
+        }
+
+        if (target == first)
+            continue;
+
+        int distance = target - offset;
+
+        if (is_signed_jump(ci.opcode)) {
+            if (distance < INT16_MIN || distance > INT16_MAX)
+                continue;
+        }
+        else if (distance <= 0)
+            continue;
+
+        code[offset + spot] = (uint16_t)distance;
+        o->changed = 1;
+    }
+}
+
+static void mark_reachable(lily_optimizer *o)
+{
+    lily_code_iter ci;
+    uint8_t *marks = o->marks;
+    uint16_t *todo = o->todo;
+    int todo_pos = 0, offset, size = o->size;
+
+#define ADD_TODO(x) \
+if ((marks[x] & MARK_REACHED) == 0) { \
+    marks[x] |= MARK_REACHED; \
+    todo[todo_pos] = x; \
+    todo_pos++; \
+}
+
+    ADD_TODO(0)
+
+    while (todo_pos) {
+        todo_pos--;
+        offset = todo[todo_pos];
+        decode(o, &ci, offset);
+
+        int next = offset + ci.round_total;
+        int spot = jump_spot(&ci);
+
+        if (falls_through(ci.opcode) && next < size)
+            ADD_TODO(next)
+
+        if (spot) {
+            int target = jump_target(o, offset, spot);
+
+            if (target != -1 && target < size)
+                ADD_TODO(target)
+        }
+    }
+
+#undef ADD_TODO
+
+    for (offset = 0;offset < size;offset += ci.round_total) {
+        decode(o, &ci, offset);
+
+        if ((marks[offset] & MARK_REACHED) == 0) {
+            marks[offset] |= MARK_DELETED;
+            o->changed = 1;
+        }
+    }
+}
+
+static void remove_jumps_to_next(lily_optimizer *o)
+{
+    lily_code_iter ci;
+    uint8_t *marks = o->marks;
+    int offset, size = o->size;
+
+    for (offset = 0;offset < size;offset += ci.round_total) {
+        decode(o, &ci, offset);
+
+        if (ci.opcode != o_jump || (marks[offset] & MARK_DELETED))
+            continue;
+
+        /* Deleted instructions send their jumps to the next instruction that
+           is kept, so the jump can go anywhere up to that. */
+        int next = offset + ci.round_total;
+        int target = jump_target(o, offset, 1);
+        lily_code_iter next_ci;
+
+        while (next < size && (marks[next] & MARK_DELETED))
+            next += decode(o, &next_ci, next);
+
+        if (target > offset && target <= next) {
+            marks[offset] |= MARK_DELETED;
+            o->changed = 1;
+        }
+    }
+}
+
+static void remove_dead_stores(lily_optimizer *o)
+{
+    lily_code_iter ci;
+    uint16_t *code = o->code;
+    uint8_t *marks = o->marks;
+    int offset, size = o->size;
+
+    for (offset = 0;offset < size;offset += ci.round_total) {
+        decode(o, &ci, offset);
+
+        int next = offset + ci.round_total;
+
+        if (next >= size ||
+            (marks[offset] & MARK_DELETED) ||
+            (marks[next] & MARK_DELETED) ||
+            is_simple_store(code[offset]) == 0 ||
+            is_simple_store(code[next]) == 0 ||
+            code[offset + 2] != code[next + 2])
+            continue;
+
+        /* An assign that reads the register needs the store. */
+        if ((code[next] == o_assign || code[next] == o_assign_noref) &&
+            code[next + 1] == code[offset + 2])
+            continue;
+
+        marks[offset] |= MARK_DELETED;
+        o->changed = 1;
+    }
+}
+
+/* Squeeze out deleted instructions, and fix jumps to where their targets were
+   moved to. A jump to a deleted instruction goes to the next one kept. */
+static void compact(lily_optimizer *o)
+{
+    lily_code_iter ci;
+    uint16_t *code = o->code;
+    uint16_t *new_pos = o->new_pos;
+    int offset, pos = 0, size = o->size;
+
+    for (offset = 0;offset < size;offset += ci.round_total) {
+        decode(o, &ci, offset);
+        new_pos[offset] = pos;
+
+        if ((o->marks[offset] & MARK_DELETED) == 0)
+            pos += ci.round_total;
+    }
+
+    new_pos[size] = pos;
+
+    /* Kept instructions only move backward, so an instruction is always read
+       before anything is written over it. */
+    for (offset = 0;offset < size;offset += ci.round_total) {
+        decode(o, &ci, offset);
+
+        if (o->marks[offset] & MARK_DELETED)
+            continue;
+
+        int spot = jump_spot(&ci);
+        int dest = new_pos[offset];
+        uint16_t distance = 0;
+
+        if (spot) {
+            int target = jump_target(o, offset, spot);
+
+            if (target != -1)
+                distance = (uint16_t)(new_pos[target] - dest);
+        }
+
+        memmove(code + dest, code + offset,
+                ci.round_total * sizeof(*code));
+
+        if (spot)
+            code[dest + spot] = distance;
+    }
+
+    o->size = pos;
+}
+
+/* Optimize 'size' words of 'code' in place. The result is the new size. */
+int lily_optimize_code(uint16_t *code, int size)
+{
+    /* The code iterator can't go further than this. */
+    if (size == 0 || size > UINT16_MAX)
+        return size;
+
+    lily_optimizer o;
+    int i;
+
+    o.code = code;
+    o.size = size;
+    o.marks = lily_malloc((size + 1) * sizeof(*o.marks));
+    o.new_pos = lily_malloc((size + 1) * sizeof(*o.new_pos));
+    o.todo = lily_malloc((size + 1) * sizeof(*o.todo));
+
+    for (i = 0;i < MAX_ROUNDS;i++) {
+        o.changed = 0;
+
+        if (scan(&o) == 0)
+            break;
+
+        thread_jumps(&o);
+        mark_reachable(&o);
+        remove_jumps_to_next(&o);
+        remove_dead_stores(&o);
+
+        if (o.changed == 0)
+            break;
+
+        compact(&o);
+    }
+
+    lily_free(o.todo);
+    lily_free(o.new_pos);
+    lily_free(o.marks);
+    return o.size;
+}
@@ -0,0 +1,8 @@
+#ifndef LILY_OPTIMIZE_H
+# define LILY_OPTIMIZE_H
+
+# include <stdint.h>
+
+int lily_optimize_code(uint16_t *, int);
+
+#endif
@@ -5,9 +5,11 @@
 
 #include "lily.h"
 
+#include "lily_cache.h"
 #include "lily_config.h"
 #include "lily_library.h"
 #include "lily_parser.h"
+#include "lily_profile.h"
 #include "lily_parser_tok_table.h"
 #include "lily_keyword_table.h"
 #include "lily_string_pile.h"
@@ -93,6 +95,9 @@ void *lily_random_loader(lily_state *s, int);
 extern const char *lily_time_table[];
 void *lily_time_loader(lily_state *s, int);
 
+extern const char *lily_parallel_table[];
+void *lily_parallel_loader(lily_state *s, int);
+
 void lily_init_pkg_builtin(lily_symtab *);
 
 void lily_config_init(lily_config *conf)
@@ -103,6 +108,10 @@ void lily_config_init(lily_config *conf)
     /* Starting gc options are completely arbitrary. */
     conf->gc_start = 100;
     conf->gc_multiplier = 4;
+    conf->bytecode_cache = 0;
+    conf->optimize = 1;
+    conf->output_size = 0;
+    conf->profile_path = NULL;
 
     char key[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 0xa, 0xb, 0xc, 0xd, 0xe, 0xf};
 
@@ -131,8 +140,9 @@ lily_state *lily_new_state(lily_config *config)
     parser->raiser = raiser;
     parser->expr = lily_new_expr_state();
     parser->generics = lily_new_generic_pool();
-    parser->symtab = lily_new_symtab(parser->generics);
-    parser->vm = lily_new_vm_state(raiser);
+    parser->vm = lily_new_vm_state(raiser, NULL);
+    parser->symtab = lily_new_symtab(parser->generics, parser->vm->pool,
+            config->sipkey, parser->vm->interned_strings);
     parser->rs = lily_malloc(sizeof(*parser->rs));
     parser->rs->pending = 0;
 
@@ -140,6 +150,11 @@ lily_state *lily_new_state(lily_config *config)
     parser->vm->gc_multiplier = config->gc_multiplier;
     parser->vm->gc_threshold = config->gc_start;
 
+    if (config->output_size > 0) {
+        parser->vm->out_buffer = lily_new_msgbuf((uint32_t)config->output_size);
+        parser->vm->out_limit = (uint32_t)config->output_size;
+    }
+
     lily_module_register(parser->vm, "", lily_builtin_table, lily_builtin_loader);
     lily_set_builtin(parser->symtab, parser->module_top);
     lily_init_pkg_builtin(parser->symtab);
@@ -150,6 +165,8 @@ lily_state *lily_new_state(lily_config *config)
     parser->data_stack = lily_new_buffer_u16(4);
     parser->keyarg_strings = lily_new_string_pile();
     parser->keyarg_current = 0;
+    parser->save_cache = 0;
+    parser->used_cache = 0;
 
     /* Here's the awful part where parser digs in and links everything that different
        sections need. */
@@ -178,12 +195,103 @@ lily_state *lily_new_state(lily_config *config)
     lily_module_register(parser->vm, "sys", lily_sys_table, lily_sys_loader);
     lily_module_register(parser->vm, "random", lily_random_table, lily_random_loader);
     lily_module_register(parser->vm, "time", lily_time_table, lily_time_loader);
+    lily_module_register(parser->vm, "parallel", lily_parallel_table,
+            lily_parallel_loader);
 
     parser->executing = 0;
 
+    if (config->profile_path)
+        parser->profiler = lily_new_profiler(parser, config->profile_path);
+    else
+        parser->profiler = NULL;
+
     return parser->vm;
 }
 
+/* The source of a clone has to be at rest: Not running, and not holding the
+   leftovers of a failed parse (those are cleaned up by the next parse). */
+static int can_clone(lily_state *s)
+{
+    lily_parse_state *parser = s->parser;
+
+    return s == parser->vm &&
+           parser->executing == 0 &&
+           parser->rs->pending == 0;
+}
+
+static lily_state *new_clone(lily_state *s, lily_arena *arena)
+{
+    lily_parse_state *parser = s->parser;
+    lily_vm_state *vm = lily_vm_clone(s, parser->symtab->next_global_id,
+            arena);
+    lily_config *config = parser->config;
+
+    if (config->output_size > 0) {
+        vm->out_buffer = lily_new_msgbuf((uint32_t)config->output_size);
+        vm->out_limit = (uint32_t)config->output_size;
+    }
+
+    return vm;
+}
+
+lily_state *lily_clone_state(lily_state *s)
+{
+    if (can_clone(s) == 0)
+        return NULL;
+
+    return new_clone(s, NULL);
+}
+
+lily_state *lily_open_scope(lily_state *s)
+{
+    if (can_clone(s) == 0)
+        return NULL;
+
+    /* This is NULL if arenas are turned off. The scope works like a clone in
+       that case. */
+    lily_arena *arena = lily_new_arena();
+
+    return new_clone(s, arena);
+}
+
+static void free_clone(lily_state *vm)
+{
+    /* Clones have their own pool and raiser, but everything else belongs to
+       the source. */
+    lily_slab_pool *pool = vm->pool;
+    lily_raiser *raiser = vm->raiser;
+
+    lily_flush_output(vm);
+    lily_free_vm(vm);
+    lily_free_slab_pool(pool);
+    lily_free_raiser(raiser);
+}
+
+void lily_close_scope(lily_state *s)
+{
+    lily_arena *arena = s->arena;
+
+    if (arena == NULL) {
+        lily_free_state(s);
+        return;
+    }
+
+    lily_slab_pool *pool = s->pool;
+    lily_raiser *raiser = s->raiser;
+
+    lily_flush_output(s);
+
+#ifdef LILY_SCOPE_CHECK
+    lily_vm_check_escapes(s);
+#endif
+
+    /* The values the scope made are in the arena, or the pool's slabs. */
+    lily_free_scope_vm(s);
+    lily_free_slab_pool(pool);
+    lily_free_raiser(raiser);
+    lily_free_arena(arena);
+}
+
 static void free_links_until(lily_module_link *link_iter,
         lily_module_link *stop)
 {
@@ -199,13 +307,35 @@ static void free_links_until(lily_module_link *link_iter,
 
 void lily_free_state(lily_state *vm)
 {
+    if (vm->arena) {
+        lily_close_scope(vm);
+        return;
+    }
+    else if (vm->error_buffer) {
+        free_clone(vm);
+        return;
+    }
+
     lily_parse_state *parser = vm->parser;
+    /* Symtab's literals come from the vm's pool, and they're freed after the
+       vm is. Release the pool last. */
+    lily_slab_pool *pool = vm->pool;
 
     /* The code for the toplevel function (really __main__) is a pointer to
        emitter's code that gets refreshed before every vm entry. Set it to NULL
        so that these teardown functions don't double free the code. */
     parser->toplevel_func->proto->code = NULL;
 
+    lily_flush_output(vm);
+
+    /* The profile is written out now, since it needs emitter's protos. */
+    if (parser->profiler)
+        lily_free_profiler(parser->profiler);
+
+#ifdef LILY_OPCODE_STATS
+    lily_vm_dump_stats(vm);
+#endif
+
     lily_free_raiser(parser->raiser);
 
     lily_free_expr_state(parser->expr);
@@ -251,6 +381,7 @@ void lily_free_state(lily_state *vm)
     lily_free(parser->rs);
 
     lily_free(parser);
+    lily_free_slab_pool(pool);
 }
 
 static void rewind_parser(lily_parse_state *parser, lily_rewind_state *rs)
@@ -351,6 +482,7 @@ static void rewind_parser(lily_parse_state *parser, lily_rewind_state *rs)
 
     vm->call_chain = call_iter;
     vm->call_depth = 0;
+    vm->sample_depth = 0;
 
     /* Symtab will choose to hide new classes (if executing) or destroy them (if
        not executing). New vars are destroyed, and the main module is made
@@ -523,6 +655,20 @@ static void add_path_to_module(lily_module_entry *module, const char *path)
     strcpy(module->path, path);
 }
 
+/* This makes a module for a source file of a program that has been loaded from
+   the bytecode cache. The module is empty, but the functions of the program
+   need a path to point to. */
+lily_module_entry *lily_new_cached_module(lily_parse_state *parser,
+        const char *path)
+{
+    lily_module_entry *module = new_module(parser);
+
+    add_path_to_module(module, path);
+    module->root_dirname = module->dirname;
+    module->flags |= MODULE_IS_FILE;
+    return module;
+}
+
 static lily_module_entry *find_existing_module(lily_parse_state *parser,
         const char *path)
 {
@@ -584,7 +730,7 @@ int lily_load_file(lily_state *s, const char *path)
 
     module->root_dirname = parser->symtab->active_module->root_dirname;
     add_path_to_module(module, path);
-    module->flags |= MODULE_NOT_EXECUTED;
+    module->flags |= MODULE_NOT_EXECUTED | MODULE_IS_FILE;
     return 1;
 }
 
@@ -839,7 +985,7 @@ static lily_module_entry *load_module(lily_parse_state *parser,
 static void make_new_function(lily_parse_state *parser, const char *class_name,
         lily_var *var, lily_foreign_func foreign_func)
 {
-    lily_function_val *f = lily_malloc(sizeof(*f));
+    lily_function_val *f = lily_slab_malloc(parser->vm->pool, sizeof(*f));
     lily_module_entry *m = parser->symtab->active_module;
     lily_proto *proto = lily_emit_new_proto(parser->emit, m->path, class_name,
             var->name);
@@ -2179,6 +2325,22 @@ lily_class *lily_dynaload_exception(lily_parse_state *parser, const char *name)
     return (lily_class *)try_toplevel_dynaload(parser, m, name);
 }
 
+/* The bytecode cache uses this to find the foreign symbols that a cached
+   program needs, dynaloading them if they aren't loaded yet. */
+lily_item *lily_find_or_dl_toplevel(lily_parse_state *parser,
+        lily_module_entry *m, const char *name)
+{
+    lily_item *result = (lily_item *)lily_find_var(parser->symtab, m, name);
+
+    if (result == NULL)
+        result = (lily_item *)lily_find_class(parser->symtab, m, name);
+
+    if (result == NULL)
+        result = try_toplevel_dynaload(parser, m, name);
+
+    return result;
+}
+
 /* Like find_run_dynaload, but only do the dynaload if the entity to be loaded
    is a class-like entity. */
 static lily_class *find_run_class_dynaload(lily_parse_state *parser,
@@ -5204,6 +5366,11 @@ static void setup_and_exec_vm(lily_parse_state *parser)
     maybe_fix_print(parser);
     update_all_cid_tables(parser);
 
+    if (parser->save_cache) {
+        parser->save_cache = 0;
+        lily_cache_save(parser);
+    }
+
     parser->executing = 1;
     lily_call_prepare(parser->vm, parser->toplevel_func);
     /* The above function pushes a Unit value to act as a sink for lily_call to
@@ -5214,6 +5381,7 @@ static void setup_and_exec_vm(lily_parse_state *parser)
     /* This is to undo preparing __main__. */
     parser->vm->call_chain = parser->vm->call_chain->prev;
     parser->vm->call_depth = 1;
+    parser->vm->sample_depth = 0;
     parser->executing = 0;
 
     /* Clear __main__ for the next pass. */
@@ -5228,7 +5396,12 @@ static void template_read_loop(lily_parse_state *parser, lily_lex_state *lex)
     do {
         char *buffer;
         result = lily_lexer_read_content(lex, &buffer);
-        if (buffer[0])
+        if (buffer[0] == '\0')
+            continue;
+
+        if (parser->vm->out_buffer)
+            lily_vm_write_out(parser->vm, buffer, strlen(buffer));
+        else
             config->render_func(buffer, config->data);
     } while (result);
 }
@@ -5314,14 +5487,16 @@ static void fix_first_file_name(lily_parse_state *parser,
 
 /* This is called when the interpreter encounters an error. This builds an
    error message that is stored within parser's msgbuf. A runner can later fetch
-   this error with lily_get_error. */
-static void build_error(lily_parse_state *parser)
+   this error with lily_get_error. A clone's error is from running code, and is
+   built into its own buffer instead. */
+static void build_error(lily_parse_state *parser, lily_vm_state *vm,
+        lily_msgbuf *msgbuf)
 {
-    lily_raiser *raiser = parser->raiser;
-    lily_msgbuf *msgbuf = lily_mb_flush(parser->msgbuf);
-    lily_vm_state *vm = parser->vm;
+    lily_raiser *raiser = vm->raiser;
     const char *msg = lily_mb_raw(raiser->msgbuf);
 
+    lily_mb_flush(msgbuf);
+
     if (vm->exception_cls)
         lily_mb_add(msgbuf, vm->exception_cls->name);
     else
@@ -5332,7 +5507,7 @@ static void build_error(lily_parse_state *parser)
     else
         lily_mb_add_char(msgbuf, '\n');
 
-    if (parser->executing == 0) {
+    if (parser->executing == 0 && vm == parser->vm) {
         lily_lex_entry *iter = parser->lex->entry;
         if (iter) {
             int fixed_line_num = (raiser->line_adjust == 0 ?
@@ -5343,7 +5518,7 @@ static void build_error(lily_parse_state *parser)
         }
     }
     else {
-        lily_call_frame *frame = parser->vm->call_chain;
+        lily_call_frame *frame = vm->call_chain;
 
         lily_mb_add(msgbuf, "Traceback:\n");
 
@@ -5383,6 +5558,10 @@ static FILE *load_file_to_parse(lily_parse_state *parser, const char *path)
 static int parse_file(lily_parse_state *parser, const char *filename,
         int in_template)
 {
+    /* The cache holds a whole program, so it's only for the first file. */
+    int use_cache = parser->first_pass && in_template == 0 &&
+                    parser->config->bytecode_cache;
+
     if (parser->first_pass)
         fix_first_file_name(parser, filename);
 
@@ -5395,6 +5574,18 @@ static int parse_file(lily_parse_state *parser, const char *filename,
         if (suffix == NULL || strcmp(suffix, ".lily") != 0)
             lily_raise_err(parser->raiser, "File name must end with '.lily'.");
 
+        if (use_cache) {
+            if (lily_cache_load(parser, filename)) {
+                parser->used_cache = 1;
+                setup_and_exec_vm(parser);
+                lily_mb_flush(parser->msgbuf);
+                return 1;
+            }
+
+            /* The cache is missing or stale, so make a new one. */
+            parser->save_cache = 1;
+        }
+
         FILE *f = load_file_to_parse(parser, filename);
 
         lily_lexer_load(parser->lex, et_file, f);
@@ -5404,8 +5595,10 @@ static int parse_file(lily_parse_state *parser, const char *filename,
 
         return 1;
     }
-    else
+    else {
+        parser->save_cache = 0;
         parser->rs->pending = 1;
+    }
 
     return 0;
 }
@@ -5431,14 +5624,43 @@ static int parse_string(lily_parse_state *parser, const char *name, char *str,
     return 0;
 }
 
+/* Clones share parser with the state they came from, so they can't use it. */
+static int reject_clone(lily_state *s)
+{
+    if (s->error_buffer == NULL)
+        return 0;
+
+    lily_mb_flush(s->error_buffer);
+    lily_mb_add(s->error_buffer,
+            "Error: Cannot parse or render with a cloned state.\n");
+    return 1;
+}
+
 int lily_parse_file(lily_state *s, const char *path)
 {
-    return parse_file(s->parser, path, 0);
+    if (reject_clone(s))
+        return 0;
+
+    int result = parse_file(s->parser, path, 0);
+
+    lily_flush_output(s);
+    return result;
+}
+
+int lily_used_cache(lily_state *s)
+{
+    return s->parser->used_cache;
 }
 
 int lily_parse_string(lily_state *s, const char *name, const char *str)
 {
-    return parse_string(s->parser, name, (char *)str, 0);
+    if (reject_clone(s))
+        return 0;
+
+    int result = parse_string(s->parser, name, (char *)str, 0);
+
+    lily_flush_output(s);
+    return result;
 }
 
 int lily_parse_expr(lily_state *s, const char *name, char *str,
@@ -5447,6 +5669,9 @@ int lily_parse_expr(lily_state *s, const char *name, char *str,
     if (text)
         *text = NULL;
 
+    if (reject_clone(s))
+        return 0;
+
     lily_parse_state *parser = s->parser;
     if (parser->first_pass)
         fix_first_file_name(parser, name);
@@ -5469,7 +5694,7 @@ int lily_parse_expr(lily_state *s, const char *name, char *str,
 
         if (sym && text) {
             /* This grabs the symbol from __main__. */
-            lily_value *reg = s->call_chain->next->start[sym->reg_spot];
+            lily_value *reg = s->call_chain->next->start + sym->reg_spot;
             lily_msgbuf *msgbuf = lily_mb_flush(parser->msgbuf);
 
             lily_mb_add_fmt(msgbuf, "(^T): ", sym->type);
@@ -5477,29 +5702,73 @@ int lily_parse_expr(lily_state *s, const char *name, char *str,
             /* Add value doesn't quote String values, because most callers do
                not want that. This one does, so bypass that. */
             if (reg->class_id == LILY_ID_STRING)
-                lily_mb_add_fmt(msgbuf, "\"%s\"", reg->value.string->string);
+                lily_mb_add_fmt(msgbuf, "\"%s\"", lily_as_string_raw(reg));
             else
                 lily_mb_add_value(msgbuf, s, reg);
 
             *text = lily_mb_raw(msgbuf);
         }
 
+        lily_flush_output(s);
         return 1;
     }
     else
         parser->rs->pending = 1;
 
+    lily_flush_output(s);
     return 0;
 }
 
 int lily_render_string(lily_state *s, const char *name, const char *str)
 {
-    return parse_string(s->parser, name, (char *)str, 1);
+    if (reject_clone(s))
+        return 0;
+
+    int result = parse_string(s->parser, name, (char *)str, 1);
+
+    lily_flush_output(s);
+    return result;
 }
 
 int lily_render_file(lily_state *s, const char *filename)
 {
-    return parse_file(s->parser, filename, 1);
+    if (reject_clone(s))
+        return 0;
+
+    int result = parse_file(s->parser, filename, 1);
+
+    lily_flush_output(s);
+    return result;
+}
+
+int lily_call_trapped(lily_state *s, int count)
+{
+    lily_call_frame *frame = s->call_chain;
+    lily_vm_catch_entry *catch_entry = s->catch_chain;
+    uint32_t depth = s->call_depth;
+    sig_atomic_t sample_depth = s->sample_depth;
+
+    /* Parser owns the first jump of the state it made, so only clones can
+       do this. Nothing else uses a clone's first jump, so an exception that
+       nothing catches lands here. */
+    if (s->error_buffer == NULL)
+        return 0;
+
+    if (setjmp(s->raiser->all_jumps->jump) == 0) {
+        lily_call(s, count);
+        return 1;
+    }
+
+    build_error(s->parser, s, s->error_buffer);
+
+    /* Go back to where the call started, so the clone can be used again. */
+    s->call_chain = frame;
+    s->catch_chain = catch_entry;
+    s->call_depth = depth;
+    s->sample_depth = sample_depth;
+    s->exception_value = NULL;
+    s->exception_cls = NULL;
+    return 0;
 }
 
 lily_function_val *lily_find_function(lily_vm_state *vm, const char *name)
@@ -5523,7 +5792,10 @@ lily_function_val *lily_find_function(lily_vm_state *vm, const char *name)
    interpreter. */
 const char *lily_error_message(lily_state *s)
 {
-    build_error(s->parser);
+    if (s->error_buffer)
+        return lily_mb_raw(s->error_buffer);
+
+    build_error(s->parser, s, s->parser->msgbuf);
     return lily_mb_raw(s->parser->msgbuf);
 }
 
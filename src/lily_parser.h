@@ -15,6 +15,7 @@
 # include "lily_generic_pool.h"
 
 struct lily_rewind_state_;
+struct lily_profiler_;
 
 typedef struct lily_parse_state_ {
     lily_module_entry *module_start;
@@ -35,8 +36,11 @@ typedef struct lily_parse_state_ {
     /* Same idea, but for keyword arguments. */
     uint16_t keyarg_current;
 
-    uint16_t pad1;
-    uint32_t pad2;
+    /* If 1, the next run of the vm saves the program to a bytecode cache. */
+    uint16_t save_cache;
+    /* 1 if the first file was loaded from a bytecode cache. */
+    uint16_t used_cache;
+    uint16_t pad2;
 
     /* The current expression state. */
     lily_expr_state *expr;
@@ -66,6 +70,8 @@ typedef struct lily_parse_state_ {
     lily_raiser *raiser;
     lily_config *config;
     struct lily_rewind_state_ *rs;
+    /* This is NULL unless the config has a profile_path. */
+    struct lily_profiler_ *profiler;
 } lily_parse_state;
 
 lily_var *lily_parser_lambda_eval(lily_parse_state *, int, const char *,
@@ -73,5 +79,8 @@ lily_var *lily_parser_lambda_eval(lily_parse_state *, int, const char *,
 lily_item *lily_find_or_dl_member(lily_parse_state *, lily_class *,
         const char *, lily_class *);
 lily_class *lily_dynaload_exception(lily_parse_state *, const char *);
+lily_item *lily_find_or_dl_toplevel(lily_parse_state *, lily_module_entry *,
+        const char *);
+lily_module_entry *lily_new_cached_module(lily_parse_state *, const char *);
 
 #endif
@@ -12,6 +12,7 @@ foundation of Lily.
 #include "lily.h"
 
 #include "lily_parser.h"
+#include "lily_string_scan.h"
 #include "lily_symtab.h"
 #include "lily_utf8.h"
 #include "lily_value_structs.h"
@@ -19,8 +20,18 @@ foundation of Lily.
 #include "lily_alloc.h"
 
 /** Begin autogen section. **/
+typedef struct lily_builtin_StringBuffer_ {
+    LILY_FOREIGN_HEADER
+    lily_msgbuf *buffer;
+} lily_builtin_StringBuffer;
+#define ARG_StringBuffer(state, index) \
+(lily_builtin_StringBuffer *)lily_arg_generic(state, index)
+#define ID_StringBuffer(state) lily_cid_at(state, 0)
+#define INIT_StringBuffer(state)\
+(lily_builtin_StringBuffer *) lily_push_foreign(state, ID_StringBuffer(state), (lily_destroy_func)destroy_StringBuffer, sizeof(lily_builtin_StringBuffer))
+
 const char *lily_builtin_table[] = {
-    "\0\0"
+    "\01StringBuffer\0"
     ,"N\02Boolean\0"
     ,"m\0to_i\0(Boolean): Integer"
     ,"m\0to_s\0(Boolean): String"
@@ -114,11 +125,12 @@ const char *lily_builtin_table[] = {
     ,"V\0Success\0(B)"
     ,"N\01RuntimeError\0< Exception"
     ,"m\0<new>\0(String): RuntimeError"
-    ,"N\024String\0"
+    ,"N\025String\0"
     ,"m\0format\0(String,$1...): String"
     ,"m\0ends_with\0(String,String): Boolean"
     ,"m\0find\0(String,String,*Integer): Option[Integer]"
     ,"m\0html_encode\0(String): String"
+    ,"m\0intern\0(String): String"
     ,"m\0is_alnum\0(String): Boolean"
     ,"m\0is_alpha\0(String): Boolean"
     ,"m\0is_digit\0(String): Boolean"
@@ -135,6 +147,12 @@ const char *lily_builtin_table[] = {
     ,"m\0to_bytestring\0(String): ByteString"
     ,"m\0trim\0(String): String"
     ,"m\0upper\0(String): String"
+    ,"C\05StringBuffer\0"
+    ,"m\0<new>\0(*Integer): StringBuffer"
+    ,"m\0clear\0(StringBuffer)"
+    ,"m\0push\0[A](StringBuffer,A)"
+    ,"m\0size\0(StringBuffer): Integer"
+    ,"m\0to_s\0(StringBuffer): String"
     ,"N\0Tuple\0"
     ,"N\01ValueError\0< Exception"
     ,"m\0<new>\0(String): ValueError"
@@ -164,9 +182,10 @@ const char *lily_builtin_table[] = {
 #define Result_OFFSET 85
 #define RuntimeError_OFFSET 92
 #define String_OFFSET 94
-#define Tuple_OFFSET 115
-#define ValueError_OFFSET 116
-#define toplevel_OFFSET 118
+#define StringBuffer_OFFSET 116
+#define Tuple_OFFSET 122
+#define ValueError_OFFSET 123
+#define toplevel_OFFSET 125
 void lily_builtin_Boolean_to_i(lily_state *);
 void lily_builtin_Boolean_to_s(lily_state *);
 void lily_builtin_Byte_to_i(lily_state *);
@@ -240,6 +259,7 @@ void lily_builtin_String_format(lily_state *);
 void lily_builtin_String_ends_with(lily_state *);
 void lily_builtin_String_find(lily_state *);
 void lily_builtin_String_html_encode(lily_state *);
+void lily_builtin_String_intern(lily_state *);
 void lily_builtin_String_is_alnum(lily_state *);
 void lily_builtin_String_is_alpha(lily_state *);
 void lily_builtin_String_is_digit(lily_state *);
@@ -256,6 +276,11 @@ void lily_builtin_String_strip(lily_state *);
 void lily_builtin_String_to_bytestring(lily_state *);
 void lily_builtin_String_trim(lily_state *);
 void lily_builtin_String_upper(lily_state *);
+void lily_builtin_StringBuffer_new(lily_state *);
+void lily_builtin_StringBuffer_clear(lily_state *);
+void lily_builtin_StringBuffer_push(lily_state *);
+void lily_builtin_StringBuffer_size(lily_state *);
+void lily_builtin_StringBuffer_to_s(lily_state *);
 void lily_builtin_ValueError_new(lily_state *);
 void lily_builtin__print(lily_state *);
 void lily_builtin__calltrace(lily_state *);
@@ -338,22 +363,28 @@ void *lily_builtin_loader(lily_state *s, int id)
         case String_OFFSET + 2: return lily_builtin_String_ends_with;
         case String_OFFSET + 3: return lily_builtin_String_find;
         case String_OFFSET + 4: return lily_builtin_String_html_encode;
-        case String_OFFSET + 5: return lily_builtin_String_is_alnum;
-        case String_OFFSET + 6: return lily_builtin_String_is_alpha;
-        case String_OFFSET + 7: return lily_builtin_String_is_digit;
-        case String_OFFSET + 8: return lily_builtin_String_is_space;
-        case String_OFFSET + 9: return lily_builtin_String_lower;
-        case String_OFFSET + 10: return lily_builtin_String_lstrip;
-        case String_OFFSET + 11: return lily_builtin_String_parse_i;
-        case String_OFFSET + 12: return lily_builtin_String_replace;
-        case String_OFFSET + 13: return lily_builtin_String_rstrip;
-        case String_OFFSET + 14: return lily_builtin_String_slice;
-        case String_OFFSET + 15: return lily_builtin_String_split;
-        case String_OFFSET + 16: return lily_builtin_String_starts_with;
-        case String_OFFSET + 17: return lily_builtin_String_strip;
-        case String_OFFSET + 18: return lily_builtin_String_to_bytestring;
-        case String_OFFSET + 19: return lily_builtin_String_trim;
-        case String_OFFSET + 20: return lily_builtin_String_upper;
+        case String_OFFSET + 5: return lily_builtin_String_intern;
+        case String_OFFSET + 6: return lily_builtin_String_is_alnum;
+        case String_OFFSET + 7: return lily_builtin_String_is_alpha;
+        case String_OFFSET + 8: return lily_builtin_String_is_digit;
+        case String_OFFSET + 9: return lily_builtin_String_is_space;
+        case String_OFFSET + 10: return lily_builtin_String_lower;
+        case String_OFFSET + 11: return lily_builtin_String_lstrip;
+        case String_OFFSET + 12: return lily_builtin_String_parse_i;
+        case String_OFFSET + 13: return lily_builtin_String_replace;
+        case String_OFFSET + 14: return lily_builtin_String_rstrip;
+        case String_OFFSET + 15: return lily_builtin_String_slice;
+        case String_OFFSET + 16: return lily_builtin_String_split;
+        case String_OFFSET + 17: return lily_builtin_String_starts_with;
+        case String_OFFSET + 18: return lily_builtin_String_strip;
+        case String_OFFSET + 19: return lily_builtin_String_to_bytestring;
+        case String_OFFSET + 20: return lily_builtin_String_trim;
+        case String_OFFSET + 21: return lily_builtin_String_upper;
+        case StringBuffer_OFFSET + 1: return lily_builtin_StringBuffer_new;
+        case StringBuffer_OFFSET + 2: return lily_builtin_StringBuffer_clear;
+        case StringBuffer_OFFSET + 3: return lily_builtin_StringBuffer_push;
+        case StringBuffer_OFFSET + 4: return lily_builtin_StringBuffer_size;
+        case StringBuffer_OFFSET + 5: return lily_builtin_StringBuffer_to_s;
         case ValueError_OFFSET + 1: return lily_builtin_ValueError_new;
         case toplevel_OFFSET + 0: return lily_builtin__print;
         case toplevel_OFFSET + 1: return lily_builtin__calltrace;
@@ -509,7 +540,7 @@ static void return_exception(lily_state *s, uint16_t id)
 {
     lily_container_val *result = lily_push_super(s, id, 2);
 
-    lily_con_set(result, 0, lily_arg_value(s, 0));
+    lily_con_set(s, result, 0, lily_arg_value(s, 0));
 
     lily_push_list(s, 0);
     lily_con_set_from_stack(s, result, 1);
@@ -616,11 +647,11 @@ void lily_builtin_ByteString_encode(lily_state *s)
     else
         encode_method = "error";
 
-    char *byte_buffer = NULL;
+    int byte_buffer_size = lily_bytestring_length(input_bytestring);
 
     if (strcmp(encode_method, "error") == 0) {
-        byte_buffer = lily_bytestring_raw(input_bytestring);
-        int byte_buffer_size = lily_bytestring_length(input_bytestring);
+        /* This only reads, so there's no need to unshare a slice. */
+        char *byte_buffer = input_bytestring->string;
 
         if (lily_is_valid_sized_utf8(byte_buffer, byte_buffer_size) == 0) {
             lily_return_none(s);
@@ -633,7 +664,8 @@ void lily_builtin_ByteString_encode(lily_state *s)
     }
 
     lily_container_val *variant = lily_push_some(s);
-    lily_push_string(s, byte_buffer);
+    lily_push_string_slice(s, LILY_ID_STRING, lily_arg_value(s, 0), 0,
+            byte_buffer_size);
     lily_con_set_from_stack(s, variant, 0);
     lily_return_top(s);
 }
@@ -700,21 +732,23 @@ void do_str_slice(lily_state *s, int is_bytestring)
         return;
     }
 
-    char *raw = lily_string_raw(sv);
+    /* A slice may not have a \0 after it, so don't look past the end. */
+    char *raw = sv->string;
     if (is_bytestring == 0) {
-        if (follower_table[(unsigned char)raw[start]] == -1 ||
-            follower_table[(unsigned char)raw[stop]] == -1) {
+        if ((start != sv->size &&
+             follower_table[(unsigned char)raw[start]] == -1) ||
+            (stop != sv->size &&
+             follower_table[(unsigned char)raw[stop]] == -1)) {
             lily_push_string(s, "");
             lily_return_top(s);
             return;
         }
     }
 
-    if (is_bytestring == 0)
-        lily_push_string_sized(s, raw + start, stop - start);
-    else
-        lily_push_bytestring(s, raw + start, stop - start);
+    uint16_t class_id = is_bytestring ? LILY_ID_BYTESTRING : LILY_ID_STRING;
 
+    lily_push_string_slice(s, class_id, lily_arg_value(s, 0), start,
+            stop - start);
     lily_return_top(s);
 }
 
@@ -816,9 +850,13 @@ void lily_builtin_File_close(lily_state *s)
     lily_file_val *filev = lily_arg_file(s, 0);
 
     if (filev->inner_file != NULL) {
+        if (filev->inner_file == stdout)
+            lily_flush_output(s);
+
         if (filev->is_builtin == 0)
             fclose(filev->inner_file);
         filev->inner_file = NULL;
+        lily_file_free_buffer(filev);
     }
 
     lily_return_unit(s);
@@ -836,46 +874,20 @@ Read each line of text from `self`, passing it down to `fn` for processing.
 void lily_builtin_File_each_line(lily_state *s)
 {
     lily_file_val *filev = lily_arg_file(s, 0);
-    lily_msgbuf *vm_buffer = lily_msgbuf_get(s);
-    char read_buffer[128];
-    int ch = 0, pos = 0;
-
-    FILE *f = lily_file_for_read(s, filev);
+    const char *line;
+    uint32_t size;
 
     lily_call_prepare(s, lily_arg_function(s, 1));
 
-    /* This uses fgetc in a loop because fgets may read in \0's, but doesn't
-       tell how much was written. */
-    while (1) {
-        ch = fgetc(f);
-
-        if (ch == EOF)
+    /* The reader checks that the File is open before each line, in case the
+       function closes it. Lines are sent without the newline, and a last line
+       without one is not sent. */
+    while ((size = lily_file_next_line(s, filev, &line)) != 0) {
+        if (line[size - 1] != '\n')
             break;
 
-        if (pos == sizeof(read_buffer)) {
-            lily_mb_add_slice(vm_buffer, read_buffer, 0, sizeof(read_buffer));
-            pos = 0;
-        }
-
-        read_buffer[pos] = (char)ch;
-
-        /* \r is intentionally not checked for, because it's been a very, very
-           long time since any os used \r alone for newlines. */
-        if (ch == '\n') {
-            if (pos != 0) {
-                lily_mb_add_slice(vm_buffer, read_buffer, 0, pos);
-                pos = 0;
-            }
-
-            const char *text = lily_mb_raw(vm_buffer);
-            int pos = lily_mb_pos(vm_buffer);
-
-            lily_push_bytestring(s, text, pos);
-            lily_call(s, 1);
-            lily_mb_flush(vm_buffer);
-        }
-        else
-            pos++;
+        lily_push_bytestring(s, line, size - 1);
+        lily_call(s, 1);
     }
 
     lily_return_unit(s);
@@ -956,7 +968,7 @@ with a newline at the end.
 void lily_builtin_File_print(lily_state *s)
 {
     lily_builtin_File_write(s);
-    fputc('\n', lily_file_for_write(s, lily_arg_file(s, 0)));
+    lily_vm_write(s, lily_file_for_write(s, lily_arg_file(s, 0)), "\n", 1);
     lily_return_unit(s);
 }
 
@@ -1033,42 +1045,11 @@ should check the result against `B""`. This will be fixed in a future release.
 void lily_builtin_File_read_line(lily_state *s)
 {
     lily_file_val *filev = lily_arg_file(s, 0);
-    lily_msgbuf *vm_buffer = lily_msgbuf_get(s);
-    char read_buffer[128];
-    int ch = 0, pos = 0, total_pos = 0;
-
-    FILE *f = lily_file_for_read(s, filev);
-
-    /* This uses fgetc in a loop because fgets may read in \0's, but doesn't
-       tell how much was written. */
-    while (1) {
-        ch = fgetc(f);
-
-        if (ch == EOF)
-            break;
-
-        if (pos == sizeof(read_buffer)) {
-            lily_mb_add_slice(vm_buffer, read_buffer, 0, sizeof(read_buffer));
-            total_pos += pos;
-            pos = 0;
-        }
-
-        read_buffer[pos] = (char)ch;
-        pos++;
+    const char *line = "";
+    uint32_t size;
 
-        /* \r is intentionally not checked for, because it's been a very, very
-           long time since any os used \r alone for newlines. */
-        if (ch == '\n')
-            break;
-    }
-
-    if (pos != 0) {
-        lily_mb_add_slice(vm_buffer, read_buffer, 0, pos);
-        total_pos += pos;
-    }
-
-    const char *text = lily_mb_raw(vm_buffer);
-    lily_push_bytestring(s, text, total_pos);
+    size = lily_file_next_line(s, filev, &line);
+    lily_push_bytestring(s, line, size);
     lily_return_top(s);
 }
 
@@ -1088,12 +1069,15 @@ void lily_builtin_File_write(lily_state *s)
 
     FILE *inner_file = lily_file_for_write(s, filev);
 
-    if (to_write->class_id == LILY_ID_STRING)
-        fputs(to_write->value.string->string, inner_file);
+    if (to_write->class_id == LILY_ID_STRING) {
+        lily_string_val *sv = to_write->value.string;
+
+        lily_vm_write(s, inner_file, sv->string, sv->size);
+    }
     else {
         lily_msgbuf *msgbuf = lily_mb_flush(s->vm_buffer);
         lily_mb_add_value(msgbuf, s, to_write);
-        fputs(lily_mb_raw(msgbuf), inner_file);
+        lily_vm_write(s, inner_file, lily_mb_raw(msgbuf), lily_mb_pos(msgbuf));
     }
 
     lily_return_unit(s);
@@ -1124,7 +1108,8 @@ be created through `[key1 => value1, key2 => value2, ...]`. When writing a
 `[1 => "a", 2 => "b", 3 => "c"]` would therefore be written as
 `Hash[Integer, String]`.
 
-Currently, only `Integer` and `String` can be used as keys.
+Currently, only `Integer` and `String` can be used as keys. Iteration visits
+pairs in the order that their keys were first inserted.
 */
 
 static inline void remove_key_check(lily_state *s, lily_hash_val *hash_val)
@@ -1136,22 +1121,13 @@ static inline void remove_key_check(lily_state *s, lily_hash_val *hash_val)
 static void destroy_hash_elems(lily_hash_val *hash_val)
 {
     int i;
-    for (i = 0;i < hash_val->num_bins;i++) {
-        lily_hash_entry *entry = hash_val->bins[i];
-        lily_hash_entry *next_entry;
-        while (entry) {
-            lily_deref(entry->boxed_key);
-            lily_free(entry->boxed_key);
-
-            lily_deref(entry->record);
-            lily_free(entry->record);
-
-            next_entry = entry->next;
-            lily_free(entry);
-            entry = next_entry;
-        }
+    for (i = 0;i < hash_val->entries_used;i++) {
+        lily_hash_entry *entry = hash_val->entries + i;
+        if (entry->key.flags == 0)
+            continue;
 
-        hash_val->bins[i] = NULL;
+        lily_deref(&entry->key);
+        lily_deref(&entry->record);
     }
 }
 
@@ -1159,10 +1135,13 @@ void lily_destroy_hash(lily_value *v)
 {
     lily_hash_val *hv = v->value.hash;
 
+    lily_arena *arena = lily_slab_arena(hv);
+
     destroy_hash_elems(hv);
 
-    lily_free(hv->bins);
-    lily_free(hv);
+    lily_arena_free(arena, hv->slots);
+    lily_arena_free(arena, hv->entries);
+    lily_slab_free(hv);
 }
 
 /**
@@ -1183,7 +1162,10 @@ void lily_builtin_Hash_clear(lily_state *s)
 
     destroy_hash_elems(hash_val);
 
+    memset(hash_val->slots, 0,
+            (hash_val->slot_mask + 1) * sizeof(*hash_val->slots));
     hash_val->num_entries = 0;
+    hash_val->entries_used = 0;
 
     lily_return_unit(s);
 }
@@ -1235,15 +1217,14 @@ void lily_builtin_Hash_each_pair(lily_state *s)
     hash_val->iter_count++;
 
     int i;
-    for (i = 0;i < hash_val->num_bins;i++) {
-        lily_hash_entry *entry = hash_val->bins[i];
-        while (entry) {
-            lily_push_value(s, entry->boxed_key);
-            lily_push_value(s, entry->record);
-            lily_call(s, 2);
+    for (i = 0;i < hash_val->entries_used;i++) {
+        lily_hash_entry *entry = hash_val->entries + i;
+        if (entry->key.flags == 0)
+            continue;
 
-            entry = entry->next;
-        }
+        lily_push_value(s, &entry->key);
+        lily_push_value(s, &entry->record);
+        lily_call(s, 2);
     }
 
     lily_error_callback_pop(s);
@@ -1288,8 +1269,8 @@ void lily_builtin_Hash_has_key(lily_state *s)
 /**
 define Hash.keys: List[A]
 
-Construct a `List` containing all values that are present within `self`. There
-is no guarantee of the ordering of the resulting `List`.
+Construct a `List` containing all keys that are present within `self`. The keys
+are in the order that they were first inserted.
 */
 void lily_builtin_Hash_keys(lily_state *s)
 {
@@ -1297,13 +1278,13 @@ void lily_builtin_Hash_keys(lily_state *s)
     lily_container_val *result_lv = lily_push_list(s, hash_val->num_entries);
     int i, list_i;
 
-    for (i = 0, list_i = 0;i < hash_val->num_bins;i++) {
-        lily_hash_entry *entry = hash_val->bins[i];
-        while (entry) {
-            lily_con_set(result_lv, list_i, entry->boxed_key);
-            list_i++;
-            entry = entry->next;
-        }
+    for (i = 0, list_i = 0;i < hash_val->entries_used;i++) {
+        lily_hash_entry *entry = hash_val->entries + i;
+        if (entry->key.flags == 0)
+            continue;
+
+        lily_con_set(s, result_lv, list_i, &entry->key);
+        list_i++;
     }
 
     lily_return_top(s);
@@ -1321,22 +1302,23 @@ void lily_builtin_Hash_map_values(lily_state *s)
     lily_hash_val *hash_val = lily_arg_hash(s, 0);
 
     lily_call_prepare(s, lily_arg_function(s, 1));
-    lily_value *result = lily_call_result(s);
 
     lily_error_callback_push(s, hash_iter_callback);
 
     lily_hash_val *h = lily_push_hash(s, hash_val->num_entries);
 
+    hash_val->iter_count++;
+
     int i;
-    for (i = 0;i < hash_val->num_bins;i++) {
-        lily_hash_entry *entry = hash_val->bins[i];
-        while (entry) {
-            lily_push_value(s, entry->record);
-            lily_call(s, 1);
-
-            lily_hash_set(s, h, entry->boxed_key, result);
-            entry = entry->next;
-        }
+    for (i = 0;i < hash_val->entries_used;i++) {
+        if (hash_val->entries[i].key.flags == 0)
+            continue;
+
+        lily_push_value(s, &hash_val->entries[i].record);
+        lily_call(s, 1);
+
+        /* Entries can move if the call adds to this hash. */
+        lily_hash_set(s, h, &hash_val->entries[i].key, lily_call_result(s));
     }
 
     hash_val->iter_count--;
@@ -1360,25 +1342,19 @@ void lily_builtin_Hash_merge(lily_state *s)
 
     int i, j;
 
-    for (i = 0;i < hash_val->num_bins;i++) {
-        lily_hash_entry *entry = hash_val->bins[i];
-        while (entry) {
-            lily_hash_set(s, result_hash, entry->boxed_key,
-                    entry->record);
-            entry = entry->next;
-        }
+    for (i = 0;i < hash_val->entries_used;i++) {
+        lily_hash_entry *entry = hash_val->entries + i;
+        if (entry->key.flags)
+            lily_hash_set(s, result_hash, &entry->key, &entry->record);
     }
 
     lily_container_val *to_merge = lily_arg_container(s, 1);
     for (i = 0;i < to_merge->num_values;i++) {
-        lily_hash_val *merging_hash = to_merge->values[i]->value.hash;
-        for (j = 0;j < merging_hash->num_bins;j++) {
-            lily_hash_entry *entry = merging_hash->bins[j];
-            while (entry) {
-                lily_hash_set(s, result_hash, entry->boxed_key,
-                        entry->record);
-                entry = entry->next;
-            }
+        lily_hash_val *merging_hash = to_merge->values[i].value.hash;
+        for (j = 0;j < merging_hash->entries_used;j++) {
+            lily_hash_entry *entry = merging_hash->entries + j;
+            if (entry->key.flags)
+                lily_hash_set(s, result_hash, &entry->key, &entry->record);
         }
     }
 
@@ -1389,7 +1365,6 @@ static void hash_select_reject_common(lily_state *s, int expect)
 {
     lily_hash_val *hash_val = lily_arg_hash(s, 0);
     lily_call_prepare(s, lily_arg_function(s, 1));
-    lily_value *result = lily_call_result(s);
     lily_hash_val *h = lily_push_hash(s, hash_val->num_entries);
 
     lily_error_callback_push(s, hash_iter_callback);
@@ -1397,25 +1372,24 @@ static void hash_select_reject_common(lily_state *s, int expect)
     hash_val->iter_count++;
 
     int i;
-    for (i = 0;i < hash_val->num_bins;i++) {
-        lily_hash_entry *entry = hash_val->bins[i];
-        while (entry) {
-            lily_push_value(s, entry->boxed_key);
-            lily_push_value(s, entry->record);
+    for (i = 0;i < hash_val->entries_used;i++) {
+        lily_hash_entry *entry = hash_val->entries + i;
+        if (entry->key.flags == 0)
+            continue;
 
-            lily_push_value(s, entry->boxed_key);
-            lily_push_value(s, entry->record);
+        lily_push_value(s, &entry->key);
+        lily_push_value(s, &entry->record);
 
-            lily_call(s, 2);
-            if (lily_as_boolean(result) != expect) {
-                lily_stack_drop_top(s);
-                lily_stack_drop_top(s);
-            }
-            else
-                lily_hash_set_from_stack(s, h);
+        lily_push_value(s, &entry->key);
+        lily_push_value(s, &entry->record);
 
-            entry = entry->next;
+        lily_call(s, 2);
+        if (lily_as_boolean(lily_call_result(s)) != expect) {
+            lily_stack_drop_top(s);
+            lily_stack_drop_top(s);
         }
+        else
+            lily_hash_set_from_stack(s, h);
     }
 
     hash_val->iter_count--;
@@ -1570,9 +1544,9 @@ void lily_builtin_List_clear(lily_state *s)
     lily_container_val *list_val = lily_arg_container(s, 0);
     int i;
 
-    for (i = 0;i < list_val->num_values;i++) {
-        lily_deref(list_val->values[i]);
-        lily_free(list_val->values[i]);
+    if (list_val->packed_id == 0) {
+        for (i = 0;i < list_val->num_values;i++)
+            lily_deref(list_val->values + i);
     }
 
     list_val->extra_space += list_val->num_values;
@@ -1591,15 +1565,15 @@ void lily_builtin_List_count(lily_state *s)
 {
     lily_container_val *list_val = lily_arg_container(s, 0);
     lily_call_prepare(s, lily_arg_function(s, 1));
-    lily_value *result = lily_call_result(s);
+    lily_value scratch;
     int count = 0;
 
     int i;
     for (i = 0;i < list_val->num_values;i++) {
-        lily_push_value(s, list_val->values[i]);
+        lily_push_value(s, lily_list_peek(list_val, i, &scratch));
         lily_call(s, 1);
 
-        if (lily_as_boolean(result) == 1)
+        if (lily_as_boolean(lily_call_result(s)) == 1)
             count++;
     }
 
@@ -1659,10 +1633,11 @@ void lily_builtin_List_each(lily_state *s)
 {
     lily_container_val *list_val = lily_arg_container(s, 0);
     lily_call_prepare(s, lily_arg_function(s, 1));
+    lily_value scratch;
     int i;
 
     for (i = 0;i < list_val->num_values;i++) {
-        lily_push_value(s, lily_con_get(list_val, i));
+        lily_push_value(s, lily_list_peek(list_val, i, &scratch));
         lily_call(s, 1);
     }
 
@@ -1702,28 +1677,27 @@ element within `self`.
 void lily_builtin_List_fold(lily_state *s)
 {
     lily_container_val *list_val = lily_arg_container(s, 0);
-    lily_value *start = lily_arg_value(s, 1);
 
     if (list_val->num_values == 0)
-        lily_return_value(s, start);
+        lily_return_value(s, lily_arg_value(s, 1));
     else {
         lily_call_prepare(s, lily_arg_function(s, 2));
-        lily_value *result = lily_call_result(s);
-        lily_push_value(s, start);
+        lily_push_value(s, lily_arg_value(s, 1));
+        lily_value scratch;
         int i = 0;
         while (1) {
-            lily_push_value(s, lily_con_get(list_val, i));
+            lily_push_value(s, lily_list_peek(list_val, i, &scratch));
             lily_call(s, 2);
 
             if (i == list_val->num_values - 1)
                 break;
 
-            lily_push_value(s, result);
+            lily_push_value(s, lily_call_result(s));
 
             i++;
         }
 
-        lily_return_value(s, result);
+        lily_return_value(s, lily_call_result(s));
     }
 }
 
@@ -1745,7 +1719,7 @@ void lily_builtin_List_insert(lily_state *s)
 
     insert_pos = get_relative_index(s, list_val, insert_pos);
 
-    lily_list_insert(list_val, insert_pos, insert_value);
+    lily_list_insert(s, list_val, insert_pos, insert_value);
     lily_return_unit(s);
 }
 
@@ -1767,13 +1741,13 @@ void lily_builtin_List_join(lily_state *s)
 
     if (lv->num_values) {
         int i, stop = lv->num_values - 1;
-        lily_value **values = lv->values;
+        lily_value scratch;
         for (i = 0;i < stop;i++) {
-            lily_mb_add_value(vm_buffer, s, values[i]);
+            lily_mb_add_value(vm_buffer, s, lily_list_peek(lv, i, &scratch));
             lily_mb_add(vm_buffer, delim);
         }
         if (stop != -1)
-            lily_mb_add_value(vm_buffer, s, values[i]);
+            lily_mb_add_value(vm_buffer, s, lily_list_peek(lv, i, &scratch));
     }
 
     lily_push_string(s, lily_mb_raw(vm_buffer));
@@ -1793,13 +1767,13 @@ void lily_builtin_List_map(lily_state *s)
     lily_call_prepare(s, lily_arg_function(s, 1));
     lily_container_val *con = lily_push_list(s, 0);
     lily_list_reserve(con, list_val->num_values);
+    lily_value scratch;
 
     int i;
     for (i = 0;i < list_val->num_values;i++) {
-        lily_value *e = list_val->values[i];
-        lily_push_value(s, e);
+        lily_push_value(s, lily_list_peek(list_val, i, &scratch));
         lily_call(s, 1);
-        lily_list_push(con, lily_call_result(s));
+        lily_list_push(s, con, lily_call_result(s));
     }
 
     lily_return_top(s);
@@ -1835,7 +1809,7 @@ void lily_builtin_List_push(lily_state *s)
     lily_container_val *list_val = lily_arg_container(s, 0);
     lily_value *insert_value = lily_arg_value(s, 1);
 
-    lily_list_insert(list_val, lily_con_size(list_val), insert_value);
+    lily_list_insert(s, list_val, lily_con_size(list_val), insert_value);
     lily_return_unit(s);
 }
 
@@ -1843,18 +1817,18 @@ static void list_select_reject_common(lily_state *s, int expect)
 {
     lily_container_val *list_val = lily_arg_container(s, 0);
     lily_call_prepare(s, lily_arg_function(s, 1));
-    lily_value *result = lily_call_result(s);
     lily_container_val *con = lily_push_list(s, 0);
+    lily_value scratch;
 
     int i;
     for (i = 0;i < list_val->num_values;i++) {
-        lily_push_value(s, list_val->values[i]);
+        lily_push_value(s, lily_list_peek(list_val, i, &scratch));
         lily_call(s, 1);
 
-        int ok = lily_as_boolean(result) == expect;
+        int ok = lily_as_boolean(lily_call_result(s)) == expect;
 
         if (ok)
-            lily_list_push(con, list_val->values[i]);
+            lily_list_push(s, con, lily_list_peek(list_val, i, &scratch));
     }
 
     lily_return_top(s);
@@ -1886,12 +1860,14 @@ void lily_builtin_List_repeat(lily_state *s)
     if (n < 0)
         lily_ValueError(s, "Repeat count must be >= 0 (%ld given).", n);
 
+    lily_container_val *lv = lily_push_list(s, 0);
     lily_value *to_repeat = lily_arg_value(s, 1);
-    lily_container_val *lv = lily_push_list(s, n);
+
+    lily_list_reserve(lv, n);
 
     int i;
     for (i = 0;i < n;i++)
-        lily_con_set(lv, i, to_repeat);
+        lily_list_push(s, lv, to_repeat);
 
     lily_return_top(s);
 }
@@ -1979,12 +1955,15 @@ void lily_builtin_List_slice(lily_state *s)
     }
 
     int new_size = (stop - start);
-    lily_container_val *new_lv = lily_push_list(s, new_size);
-    int i, j;
+    lily_container_val *new_lv = lily_push_list(s, 0);
+    lily_value scratch;
+    int i;
 
-    for (i = 0, j = start;i < new_size;i++, j++) {
-        lily_con_set(new_lv, i, lily_con_get(lv, j));
-    }
+    /* The new List is packed if this one is. */
+    lily_list_reserve(new_lv, new_size);
+
+    for (i = start;i < stop;i++)
+        lily_list_push(s, new_lv, lily_list_peek(lv, i, &scratch));
 
     lily_return_top(s);
 }
@@ -1999,7 +1978,7 @@ void lily_builtin_List_unshift(lily_state *s)
     lily_container_val *list_val = lily_arg_container(s, 0);
     lily_value *input_reg = lily_arg_value(s, 1);
 
-    lily_list_insert(list_val, 0, input_reg);
+    lily_list_insert(s, list_val, 0, input_reg);
 }
 
 /**
@@ -2089,7 +2068,7 @@ void lily_builtin_Option_map(lily_state *s)
         lily_call(s, 1);
 
         lily_container_val *variant = lily_push_some(s);
-        lily_con_set(variant, 0, lily_call_result(s));
+        lily_con_set(s, variant, 0, lily_call_result(s));
         lily_return_top(s);
     }
     else
@@ -2207,7 +2186,7 @@ static void result_optionize(lily_state *s, int expect)
         lily_container_val *con = lily_arg_container(s, 0);
 
         lily_container_val *variant = lily_push_some(s);
-        lily_con_set(variant, 0, lily_con_get(con, 0));
+        lily_con_set(s, variant, 0, lily_con_get(con, 0));
         lily_return_top(s);
     }
     else
@@ -2360,7 +2339,8 @@ void lily_builtin_String_format(lily_state *s)
             idx++;
             last_idx = idx;
 
-            lily_value *v = lily_con_get(lv, total);
+            lily_value scratch;
+            lily_value *v = lily_list_peek(lv, total, &scratch);
             lily_mb_add_value(msgbuf, s, v);
         }
         else {
@@ -2435,43 +2415,20 @@ void lily_builtin_String_find(lily_state *s)
 
     if (find_length > input_length ||
         find_length == 0 ||
-        start > input_length ||
+        start < 0 ||
+        start >= input_length ||
         follower_table[(unsigned char)input_str[start]] == -1) {
         lily_return_none(s);
         return;
     }
 
-    char find_ch;
-    int i, j, k, length_diff, match;
-
-    length_diff = input_length - find_length;
-    find_ch = find_str[0];
-    match = 0;
-
-    /* This stops at length_diff for two reasons:
-       * The inner loop won't have to do a boundary check.
-       * Search will stop if there isn't enough length left for a match
-         (ex: "abcdef".find("defg")) */
-    for (i = start;i <= length_diff;i++) {
-        if (input_str[i] == find_ch) {
-            match = 1;
-            /* j starts at i + 1 to skip the first match.
-               k starts at 1 for the same reason. */
-            for (j = i + 1, k = 1;k < find_length;j++, k++) {
-                if (input_str[j] != find_str[k]) {
-                    match = 0;
-                    break;
-                }
-            }
-            if (match == 1)
-                break;
-        }
-    }
+    int i = lily_scan_find(input_str + start, input_length - start, find_str,
+            find_length);
 
-    if (match) {
+    if (i != -1) {
         lily_container_val *variant = lily_push_some(s);
 
-        lily_push_integer(s, i);
+        lily_push_integer(s, start + i);
         lily_con_set_from_stack(s, variant, 0);
 
         lily_return_top(s);
@@ -2507,7 +2464,40 @@ void lily_builtin_String_html_encode(lily_state *s)
     }
 }
 
-#define CTYPE_WRAP(WRAP_NAME, WRAPPED_CALL) \
+/**
+define String.intern: String
+
+Return the interpreter's shared copy of `self`. If there isn't one yet, then
+`self` becomes the shared copy. `String` literals are already shared.
+
+A `Hash` with many repeated `String` keys can intern them to keep one copy of
+each key. Interned values are never freed, so don't intern values that are only
+used once.
+*/
+void lily_builtin_String_intern(lily_state *s)
+{
+    lily_value *input_arg = lily_arg_value(s, 0);
+    lily_hash_val *interned = s->interned_strings;
+    uint64_t hash = lily_string_hash(input_arg->value.string,
+            lily_config_get(s)->sipkey);
+    lily_hash_entry *entry = lily_hash_find_entry(interned, input_arg, hash);
+
+    if (entry) {
+        lily_return_value(s, &entry->key);
+        return;
+    }
+
+    lily_value not_literal;
+
+    /* Interned values live forever, so they shouldn't keep a parent alive. */
+    lily_string_unshare(input_arg->value.string);
+    not_literal.flags = LILY_ID_INTEGER;
+    not_literal.value.integer = -1;
+    lily_hash_set_hashed(interned, input_arg, &not_literal, hash);
+    lily_return_value(s, input_arg);
+}
+
+#define CTYPE_WRAP(WRAP_NAME, SCAN_CLASS) \
 void lily_builtin_String_##WRAP_NAME(lily_state *s) \
 { \
     lily_string_val *input = lily_arg_string(s, 0); \
@@ -2518,18 +2508,9 @@ void lily_builtin_String_##WRAP_NAME(lily_state *s) \
         return; \
     } \
 \
-    const char *loop_str = lily_string_raw(input); \
-    int i = 0; \
-    int ok = 1; \
+    const char *raw = input->string; \
 \
-    for (i = 0;i < length;i++) { \
-        if (WRAPPED_CALL(loop_str[i]) == 0) { \
-            ok = 0; \
-            break; \
-        } \
-    } \
-\
-    lily_return_boolean(s, ok); \
+    lily_return_boolean(s, lily_scan_is_class(raw, length, SCAN_CLASS)); \
 }
 
 /**
@@ -2538,7 +2519,7 @@ define String.is_alnum: Boolean
 Return `true` if `self` has only alphanumeric([a-zA-Z0-9]+) characters, `false`
 otherwise.
 */
-CTYPE_WRAP(is_alnum, isalnum)
+CTYPE_WRAP(is_alnum, LILY_SCAN_ALNUM)
 
 /**
 define String.is_alpha: Boolean
@@ -2546,14 +2527,14 @@ define String.is_alpha: Boolean
 Return `true` if `self` has only alphabetical([a-zA-Z]+) characters, `false`
 otherwise.
 */
-CTYPE_WRAP(is_alpha, isalpha)
+CTYPE_WRAP(is_alpha, LILY_SCAN_ALPHA)
 
 /**
 define String.is_digit: Boolean
 
 Return `true` if `self` has only digit([0-9]+) characters, `false` otherwise.
 */
-CTYPE_WRAP(is_digit, isdigit)
+CTYPE_WRAP(is_digit, LILY_SCAN_DIGIT)
 
 /**
 define String.is_space: Boolean
@@ -2561,7 +2542,7 @@ define String.is_space: Boolean
 Returns `true` if `self` has only space(" \t\r\n") characters, `false`
 otherwise.
 */
-CTYPE_WRAP(is_space, isspace)
+CTYPE_WRAP(is_space, LILY_SCAN_SPACE)
 
 /**
 define String.lower: String
@@ -2575,7 +2556,7 @@ void lily_builtin_String_lower(lily_state *s)
     int input_length = input_arg->value.string->size;
     int i;
 
-    lily_push_string(s, lily_as_string_raw(input_arg));
+    lily_push_string_sized(s, input_arg->value.string->string, input_length);
     char *raw_out = lily_as_string_raw(lily_stack_get_top(s));
 
     for (i = 0;i < input_length;i++) {
@@ -2735,7 +2716,7 @@ void lily_builtin_String_lstrip(lily_state *s)
 
     strip_sv = strip_arg->value.string;
     strip_str = strip_sv->string;
-    strip_str_len = strlen(strip_str);
+    strip_str_len = strip_sv->size;
     has_multibyte_char = 0;
 
     for (i = 0;i < strip_str_len;i++) {
@@ -2751,10 +2732,10 @@ void lily_builtin_String_lstrip(lily_state *s)
     else
         copy_from = lstrip_utf8_start(input_arg, strip_sv);
 
-    const char *raw = input_arg->value.string->string + copy_from;
     int size = input_arg->value.string->size;
 
-    lily_push_string_sized(s, raw, size - copy_from);
+    lily_push_string_slice(s, LILY_ID_STRING, input_arg, copy_from,
+            size - copy_from);
     lily_return_top(s);
 }
 
@@ -2840,39 +2821,29 @@ void lily_builtin_String_replace(lily_state *s)
         return;
     }
 
-    lily_msgbuf *msgbuf = lily_msgbuf_get(s);
-    char *source = lily_string_raw(source_sv);
-    char *needle = lily_string_raw(needle_sv);
-    char *replace_with = lily_arg_string_raw(s, 2);
-    char needle_first = *needle;
-    char ch;
+    char *source = source_sv->string;
+    char *needle = needle_sv->string;
     int start = 0;
-    int i;
+    int i = lily_scan_find(source, source_len, needle, needle_len);
 
-    for (i = 0;i < source_len;i++) {
-        ch = source[i];
-        if (ch == needle_first &&
-            (i + needle_len) <= source_len) {
-            int match = 1;
-            int j;
-            for (j = 1;j < needle_len;j++) {
-                if (needle[j] != source[i + j])
-                    match = 0;
-            }
+    if (i == -1) {
+        lily_return_value(s, lily_arg_value(s, 0));
+        return;
+    }
 
-            if (match) {
-                if (i != start)
-                    lily_mb_add_slice(msgbuf, source, start, i);
+    lily_msgbuf *msgbuf = lily_msgbuf_get(s);
+    lily_string_val *replace_sv = lily_arg_string(s, 2);
 
-                lily_mb_add(msgbuf, replace_with);
-                i += needle_len - 1;
-                start = i + 1;
-            }
-        }
+    while (i != -1) {
+        i += start;
+        lily_mb_add_slice(msgbuf, source, start, i);
+        lily_mb_add_slice(msgbuf, replace_sv->string, 0, replace_sv->size);
+        start = i + needle_len;
+        i = lily_scan_find(source + start, source_len - start, needle,
+                needle_len);
     }
 
-    if (i != start)
-        lily_mb_add_slice(msgbuf, source, start, i);
+    lily_mb_add_slice(msgbuf, source, start, source_len);
 
     lily_push_string(s, lily_mb_raw(msgbuf));
     lily_return_top(s);
@@ -2995,7 +2966,7 @@ void lily_builtin_String_rstrip(lily_state *s)
 
     strip_sv = strip_arg->value.string;
     strip_str = strip_sv->string;
-    strip_str_len = strlen(strip_str);
+    strip_str_len = strip_sv->size;
     has_multibyte_char = 0;
 
     for (i = 0;i < strip_str_len;i++) {
@@ -3011,107 +2982,48 @@ void lily_builtin_String_rstrip(lily_state *s)
     else
         copy_to = rstrip_utf8_stop(input_arg, strip_sv);
 
-    const char *raw = input_arg->value.string->string;
-
-    lily_push_string_sized(s, raw, copy_to);
+    lily_push_string_slice(s, LILY_ID_STRING, input_arg, 0, copy_to);
     lily_return_top(s);
 }
 
-static const char move_table[256] =
+/* The input is the first argument. Slices of it are pushed, and pushing can
+   move the argument, so it's fetched again each time. */
+static void string_split_by_val(lily_state *s, lily_string_val *input_sv,
+        lily_string_val *split_sv)
 {
-     /* 0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F */
-/* 0 */ 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-/* 1 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-/* 2 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-/* 3 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-/* 4 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-/* 5 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-/* 6 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-/* 7 */ 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
-/* 8 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-/* 9 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-/* A */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-/* B */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-/* C */ 0, 0, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
-/* D */ 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
-/* E */ 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
-/* F */ 4, 4, 4, 4, 4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
-};
-
-static void string_split_by_val(lily_state *s, char *input, char *splitby)
-{
-    char *input_ch = &input[0];
-    char *splitby_ch = &splitby[0];
-    int values_needed = 0;
-
-    while (move_table[(unsigned char)*input_ch] != 0) {
-        if (*input_ch == *splitby_ch) {
-            char *restore_ch = input_ch;
-            int is_match = 1;
-            while (*input_ch == *splitby_ch) {
-                splitby_ch++;
-                input_ch++;
-                if (*splitby_ch == '\0')
-                    break;
-
-                if (*input_ch != *splitby_ch) {
-                    is_match = 0;
-                    input_ch = restore_ch + 1;
-                    break;
-                }
-            }
+    const char *input = input_sv->string;
+    const char *splitby = split_sv->string;
+    int input_size = input_sv->size;
+    int split_size = split_sv->size;
+    int values_needed = 1;
+    int start = 0;
+    int at;
 
-            splitby_ch = &splitby[0];
-            values_needed += is_match;
-        }
-        else
-            input_ch += move_table[(unsigned char)*input_ch];
+    /* Count first, so that the List is made at the right size. */
+    while ((at = lily_scan_find(input + start, input_size - start, splitby,
+                    split_size)) != -1) {
+        values_needed++;
+        start += at + split_size;
     }
 
-    values_needed++;
-    input_ch = &input[0];
     lily_container_val *list_val = lily_push_list(s, values_needed);
-    int i = 0;
-    char *last_start = input_ch;
+    int i;
 
-    while (1) {
-        char *match_start = input_ch;
-        int is_match = 0;
-        if (*input_ch == *splitby_ch) {
-            is_match = 1;
-            while (*input_ch == *splitby_ch) {
-                splitby_ch++;
-                if (*splitby_ch == '\0')
-                    break;
+    start = 0;
 
-                input_ch++;
-                if (*input_ch != *splitby_ch) {
-                    is_match = 0;
-                    input_ch = match_start;
-                    break;
-                }
-            }
-            splitby_ch = &splitby[0];
-        }
+    /* If the input ends with a match, the last value is an empty String.
+       Ex: "1 2 3 ".split(" ") # ["1", "2", "3", ""] */
+    for (i = 0;i < values_needed;i++) {
+        at = lily_scan_find(input + start, input_size - start, splitby,
+                split_size);
 
-        /* The second check is so that if the last bit of the input string
-           matches the split string, an empty string will be made.
-           Ex: "1 2 3 ".split(" ") # ["1", "2", "3", ""] */
-        if (is_match || *input_ch == '\0') {
-            int size = match_start - last_start;
-            lily_push_string_sized(s, last_start, size);
-            lily_con_set_from_stack(s, list_val, i);
+        if (at == -1)
+            at = input_size - start;
 
-            i++;
-            if (*input_ch == '\0')
-                break;
-
-            last_start = input_ch + 1;
-        }
-        else if (*input_ch == '\0')
-            break;
-
-        input_ch++;
+        lily_push_string_slice(s, LILY_ID_STRING, lily_arg_value(s, 0), start,
+                at);
+        lily_con_set_from_stack(s, list_val, i);
+        start += at + split_size;
     }
 }
 
@@ -3162,7 +3074,7 @@ void lily_builtin_String_split(lily_state *s)
         split_strval = &fake_sv;
     }
 
-    string_split_by_val(s, input_strval->string, split_strval->string);
+    string_split_by_val(s, input_strval, split_strval);
     lily_return_top(s);
 }
 
@@ -3218,7 +3130,7 @@ void lily_builtin_String_strip(lily_state *s)
     char ch;
     lily_string_val *strip_sv = strip_arg->value.string;
     char *strip_str = strip_sv->string;
-    size_t strip_str_len = strlen(strip_str);
+    size_t strip_str_len = strip_sv->size;
     int has_multibyte_char = 0;
     int copy_from, copy_to, i;
 
@@ -3246,8 +3158,8 @@ void lily_builtin_String_strip(lily_state *s)
            result is an empty string. */
         copy_to = copy_from;
 
-    const char *raw = input_arg->value.string->string + copy_from;
-    lily_push_string_sized(s, raw, copy_to - copy_from);
+    lily_push_string_slice(s, LILY_ID_STRING, input_arg, copy_from,
+            copy_to - copy_from);
     lily_return_top(s);
 }
 
@@ -3259,10 +3171,12 @@ to be performed.
 */
 void lily_builtin_String_to_bytestring(lily_state *s)
 {
-    /* They currently have the same internal representation. This method is
-       provided for the type system. */
-    lily_string_val *sv = lily_arg_string(s, 0);
-    lily_push_bytestring(s, lily_string_raw(sv), lily_string_length(sv));
+    /* They have the same internal representation, so the result can share the
+       buffer. A ByteString is unshared before it's changed. */
+    lily_value *input_arg = lily_arg_value(s, 0);
+
+    lily_push_string_slice(s, LILY_ID_BYTESTRING, input_arg, 0,
+            input_arg->value.string->size);
     lily_return_top(s);
 }
 
@@ -3286,8 +3200,9 @@ void lily_builtin_String_trim(lily_state *s)
 
     if (copy_from != input_arg->value.string->size) {
         int copy_to = rstrip_ascii_stop(input_arg, &fake_sv);
-        const char *raw = input_arg->value.string->string;
-        lily_push_string_sized(s, raw + copy_from, copy_to - copy_from);
+
+        lily_push_string_slice(s, LILY_ID_STRING, input_arg, copy_from,
+                copy_to - copy_from);
     }
     else {
         /* It's all space, so make a new empty string. */
@@ -3309,7 +3224,7 @@ void lily_builtin_String_upper(lily_state *s)
     int input_length = input_arg->value.string->size;
     int i;
 
-    lily_push_string(s, lily_as_string_raw(input_arg));
+    lily_push_string_sized(s, input_arg->value.string->string, input_length);
     char *raw_out = lily_as_string_raw(lily_stack_get_top(s));
 
     for (i = 0;i < input_length;i++) {
@@ -3321,6 +3236,95 @@ void lily_builtin_String_upper(lily_state *s)
     lily_return_top(s);
 }
 
+/**
+foreign class StringBuffer(size: *Integer=64) {
+    layout {
+        lily_msgbuf *buffer;
+    }
+}
+
+The `StringBuffer` class builds a `String` out of many pieces. Adding to a
+`StringBuffer` doesn't make a new `String` each time, so it's the way to build a
+large `String` from a loop. `size` is how many bytes the buffer starts with (up
+to 1MB). If `size` is less than 1, the default is used instead.
+*/
+static void destroy_StringBuffer(lily_builtin_StringBuffer *sb)
+{
+    lily_free_msgbuf(sb->buffer);
+}
+
+void lily_builtin_StringBuffer_new(lily_state *s)
+{
+    int64_t size = 64;
+
+    if (lily_arg_count(s) == 2)
+        size = lily_arg_integer(s, 1);
+
+    /* This is only a hint, so don't let it ask for too much up front. */
+    if (size < 1)
+        size = 64;
+    else if (size > (1 << 20))
+        size = 1 << 20;
+
+    lily_builtin_StringBuffer *sb = INIT_StringBuffer(s);
+
+    sb->buffer = lily_new_msgbuf((uint32_t)size);
+    lily_return_top(s);
+}
+
+/**
+define StringBuffer.clear
+
+Remove everything that was added to `self`. The space used is kept for the
+next round of building.
+*/
+void lily_builtin_StringBuffer_clear(lily_state *s)
+{
+    lily_builtin_StringBuffer *sb = ARG_StringBuffer(s, 0);
+
+    lily_mb_flush(sb->buffer);
+    lily_return_unit(s);
+}
+
+/**
+define StringBuffer.push[A](value: A)
+
+Add `value` to the end of `self`. A `String` is added as-is. Other values are
+added the same way that interpolation would show them.
+*/
+void lily_builtin_StringBuffer_push(lily_state *s)
+{
+    lily_builtin_StringBuffer *sb = ARG_StringBuffer(s, 0);
+
+    lily_mb_add_value(sb->buffer, s, lily_arg_value(s, 1));
+    lily_return_unit(s);
+}
+
+/**
+define StringBuffer.size: Integer
+
+Return how many bytes have been added to `self`.
+*/
+void lily_builtin_StringBuffer_size(lily_state *s)
+{
+    lily_builtin_StringBuffer *sb = ARG_StringBuffer(s, 0);
+
+    lily_return_integer(s, lily_mb_pos(sb->buffer));
+}
+
+/**
+define StringBuffer.to_s: String
+
+Return a `String` of what has been added to `self`. `self` is not changed.
+*/
+void lily_builtin_StringBuffer_to_s(lily_state *s)
+{
+    lily_builtin_StringBuffer *sb = ARG_StringBuffer(s, 0);
+
+    lily_push_string_sized(s, lily_mb_raw(sb->buffer), lily_mb_pos(sb->buffer));
+    lily_return_top(s);
+}
+
 /**
 builtin class Tuple
 
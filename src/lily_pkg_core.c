@@ -19,6 +19,7 @@ contents of `builtin` are instead available without a namespace.
 /**
 PackageFiles
     lily_pkg_builtin.c
+    lily_pkg_parallel.c
     lily_pkg_random.c
     lily_pkg_sys.c
     lily_pkg_time.c
@@ -0,0 +1,756 @@
+/**
+library parallel
+
+The parallel package runs a function over the elements of a `List` on several
+threads at once.
+
+Each thread is a worker with an interpreter of its own. A worker starts with a
+copy of the globals of the program (as they are when the work is started), so
+nothing a worker does to a global can be seen by the program or by other
+workers. Values are sent to and from workers as bytes, so only the following
+kinds of values can be sent: `Integer`, `Double`, `Boolean`, `Byte`, `String`,
+`ByteString`, `Unit`, `Option`, and `List`, `Hash`, and `Tuple` values made of
+those.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(_WIN32)
+# include <windows.h>
+#elif !defined(__EMSCRIPTEN__)
+# include <pthread.h>
+# include <signal.h>
+# include <unistd.h>
+#endif
+
+#include "lily.h"
+
+#include "lily_alloc.h"
+#include "lily_parser.h"
+#include "lily_value_raw.h"
+#include "lily_value_structs.h"
+#include "lily_vm.h"
+
+/** Begin autogen section. **/
+const char *lily_parallel_table[] = {
+    "\0\0"
+    ,"F\0map\0[A,B](List[A],Function(A=>B),*Integer): List[B]"
+    ,"Z"
+};
+#define toplevel_OFFSET 1
+void lily_parallel__map(lily_state *);
+void *lily_parallel_loader(lily_state *s, int id)
+{
+    switch (id) {
+        case toplevel_OFFSET + 0: return lily_parallel__map;
+        default: return NULL;
+    }
+}
+/** End autogen section. **/
+
+/* Threads are left out where they aren't available. Workers run one after
+   another on the calling thread instead. */
+#if defined(_WIN32)
+typedef HANDLE worker_thread;
+typedef CRITICAL_SECTION worker_lock;
+# define lock_init(l) InitializeCriticalSection(l)
+# define lock_free(l) DeleteCriticalSection(l)
+# define lock_take(l) EnterCriticalSection(l)
+# define lock_give(l) LeaveCriticalSection(l)
+#elif !defined(__EMSCRIPTEN__)
+typedef pthread_t worker_thread;
+typedef pthread_mutex_t worker_lock;
+# define lock_init(l) pthread_mutex_init(l, NULL)
+# define lock_free(l) pthread_mutex_destroy(l)
+# define lock_take(l) pthread_mutex_lock(l)
+# define lock_give(l) pthread_mutex_unlock(l)
+#else
+# define PARALLEL_NO_THREADS
+typedef int worker_thread;
+typedef int worker_lock;
+# define lock_init(l) (void)(l)
+# define lock_free(l) (void)(l)
+# define lock_take(l) (void)(l)
+# define lock_give(l) (void)(l)
+#endif
+
+/** Values go to and from workers as bytes. Each value starts with the id of
+    its class (every class that can be sent has an id below 256). Integers and
+    sizes are written as varints, with Integers zigzagged first so that small
+    negative numbers are small too. **/
+
+typedef struct {
+    unsigned char *data;
+    size_t pos;
+    size_t size;
+} parallel_buffer;
+
+static void buffer_reserve(parallel_buffer *b, size_t need)
+{
+    if (b->pos + need <= b->size)
+        return;
+
+    size_t size = b->size ? b->size : 256;
+
+    while (size < b->pos + need)
+        size *= 2;
+
+    b->data = lily_realloc(b->data, size);
+    b->size = size;
+}
+
+static void write_byte(parallel_buffer *b, unsigned char ch)
+{
+    buffer_reserve(b, 1);
+    b->data[b->pos] = ch;
+    b->pos++;
+}
+
+static void write_size(parallel_buffer *b, uint64_t n)
+{
+    buffer_reserve(b, 10);
+
+    unsigned char *out = b->data + b->pos;
+
+    while (n >= 0x80) {
+        *out = (unsigned char)(n | 0x80);
+        out++;
+        n >>= 7;
+    }
+
+    *out = (unsigned char)n;
+    b->pos = (size_t)(out + 1 - b->data);
+}
+
+static void write_bytes(parallel_buffer *b, const char *source, uint32_t size)
+{
+    write_size(b, size);
+    buffer_reserve(b, size);
+    memcpy(b->data + b->pos, source, size);
+    b->pos += size;
+}
+
+/* Write 'v' to 'b'. This returns 0 if it worked, or the class id of a value
+   that can't be sent. */
+static uint16_t write_value(parallel_buffer *b, lily_value *v)
+{
+    uint16_t id = v->class_id;
+
+    switch (id) {
+        case LILY_ID_INTEGER: {
+            uint64_t n = (uint64_t)v->value.integer;
+
+            write_byte(b, LILY_ID_INTEGER);
+            write_size(b, (n << 1) ^ (uint64_t)(v->value.integer >> 63));
+            break;
+        }
+        case LILY_ID_DOUBLE:
+            write_byte(b, LILY_ID_DOUBLE);
+            buffer_reserve(b, sizeof(double));
+            memcpy(b->data + b->pos, &v->value.doubleval, sizeof(double));
+            b->pos += sizeof(double);
+            break;
+        case LILY_ID_BOOLEAN:
+        case LILY_ID_BYTE:
+            write_byte(b, (unsigned char)id);
+            write_byte(b, (unsigned char)v->value.integer);
+            break;
+        case LILY_ID_STRING:
+        case LILY_ID_BYTESTRING:
+            write_byte(b, (unsigned char)id);
+            write_bytes(b, v->value.string->string, v->value.string->size);
+            break;
+        case LILY_ID_UNIT:
+        case LILY_ID_NONE:
+            write_byte(b, (unsigned char)id);
+            break;
+        case LILY_ID_SOME:
+            write_byte(b, LILY_ID_SOME);
+            return write_value(b, v->value.container->values);
+        case LILY_ID_LIST:
+        case LILY_ID_TUPLE: {
+            lily_container_val *con = v->value.container;
+            lily_value scratch;
+            uint32_t i;
+
+            write_byte(b, (unsigned char)id);
+            write_size(b, con->num_values);
+
+            for (i = 0;i < con->num_values;i++) {
+                uint16_t bad_id = write_value(b,
+                        lily_list_peek(con, i, &scratch));
+
+                if (bad_id)
+                    return bad_id;
+            }
+
+            break;
+        }
+        case LILY_ID_HASH: {
+            lily_hash_val *hv = v->value.hash;
+            int i;
+
+            write_byte(b, LILY_ID_HASH);
+            write_size(b, (uint64_t)hv->num_entries);
+
+            for (i = 0;i < hv->entries_used;i++) {
+                lily_hash_entry *entry = hv->entries + i;
+
+                if (entry->key.flags == 0)
+                    continue;
+
+                uint16_t bad_id = write_value(b, &entry->key);
+
+                if (bad_id == 0)
+                    bad_id = write_value(b, &entry->record);
+
+                if (bad_id)
+                    return bad_id;
+            }
+
+            break;
+        }
+        default:
+            return id;
+    }
+
+    return 0;
+}
+
+static const unsigned char *read_size(const unsigned char *p, uint64_t *out)
+{
+    uint64_t n = 0;
+    int shift = 0;
+
+    while (*p & 0x80) {
+        n |= (uint64_t)(*p & 0x7f) << shift;
+        shift += 7;
+        p++;
+    }
+
+    *out = n | ((uint64_t)*p << shift);
+    return p + 1;
+}
+
+/* Push the value that starts at 'p' onto 's', and return where the next value
+   starts. */
+static const unsigned char *read_value(lily_state *s, const unsigned char *p)
+{
+    unsigned char id = *p;
+    uint64_t n;
+
+    p++;
+
+    switch (id) {
+        case LILY_ID_INTEGER:
+            p = read_size(p, &n);
+            lily_push_integer(s, (int64_t)(n >> 1) ^ -(int64_t)(n & 1));
+            break;
+        case LILY_ID_DOUBLE: {
+            double d;
+
+            memcpy(&d, p, sizeof(double));
+            lily_push_double(s, d);
+            p += sizeof(double);
+            break;
+        }
+        case LILY_ID_BOOLEAN:
+            lily_push_boolean(s, *p);
+            p++;
+            break;
+        case LILY_ID_BYTE:
+            lily_push_byte(s, *p);
+            p++;
+            break;
+        case LILY_ID_STRING:
+            p = read_size(p, &n);
+            lily_push_string_sized(s, (const char *)p, (int)n);
+            p += n;
+            break;
+        case LILY_ID_BYTESTRING:
+            p = read_size(p, &n);
+            lily_push_bytestring(s, (const char *)p, (int)n);
+            p += n;
+            break;
+        case LILY_ID_UNIT:
+            lily_push_unit(s);
+            break;
+        case LILY_ID_NONE:
+            lily_push_empty_variant(s, LILY_ID_NONE);
+            break;
+        case LILY_ID_SOME: {
+            lily_container_val *con = lily_push_variant(s, LILY_ID_SOME, 1);
+
+            p = read_value(s, p);
+            lily_con_set_from_stack(s, con, 0);
+            break;
+        }
+        case LILY_ID_LIST:
+        case LILY_ID_TUPLE: {
+            lily_container_val *con;
+            uint32_t i;
+
+            p = read_size(p, &n);
+
+            if (id == LILY_ID_LIST)
+                con = lily_push_list(s, (uint32_t)n);
+            else
+                con = lily_push_tuple(s, (uint32_t)n);
+
+            for (i = 0;i < n;i++) {
+                p = read_value(s, p);
+                lily_con_set_from_stack(s, con, i);
+            }
+
+            break;
+        }
+        case LILY_ID_HASH: {
+            uint32_t i;
+
+            p = read_size(p, &n);
+
+            lily_hash_val *hv = lily_push_hash(s, (int)n);
+
+            for (i = 0;i < n;i++) {
+                p = read_value(s, p);
+                p = read_value(s, p);
+                lily_hash_set_from_stack(s, hv);
+            }
+
+            break;
+        }
+    }
+
+    return p;
+}
+
+/** A job splits the input into one range for each worker. A worker takes
+    items from the front of its range. When that runs out, it steals the back
+    half of what another worker has left.
+
+    If an item fails, the worker cuts every range short at that item, since
+    later items can't change the outcome. Items before it still run, so that
+    the error reported is always from the first item that fails. **/
+
+typedef struct parallel_job_ parallel_job;
+
+typedef struct {
+    worker_lock lock;
+    /* Items from 'next' up to 'end' are waiting to be run. */
+    uint32_t next;
+    uint32_t end;
+
+    /* The first item that failed (or UINT32_MAX), and the id of the exception
+       to raise for it. */
+    uint32_t error_index;
+    uint16_t error_id;
+    uint16_t id;
+
+    lily_state *vm;
+    lily_function_val *function;
+    lily_msgbuf *error;
+    parallel_buffer output;
+    parallel_job *job;
+    worker_thread thread;
+} parallel_worker;
+
+struct parallel_job_ {
+    parallel_worker *workers;
+    uint32_t worker_count;
+    uint32_t count;
+
+    parallel_buffer input;
+    /* Where each item starts in input. */
+    size_t *input_pos;
+    /* Where each result starts, and which worker's output it's in. */
+    size_t *result_pos;
+    uint32_t *result_worker;
+};
+
+static int take_item(parallel_worker *w, uint32_t *out)
+{
+    parallel_job *job = w->job;
+    int result = 0;
+    uint32_t i;
+
+    lock_take(&w->lock);
+
+    if (w->next < w->end) {
+        *out = w->next;
+        w->next++;
+        result = 1;
+    }
+
+    lock_give(&w->lock);
+
+    for (i = 1;result == 0 && i < job->worker_count;i++) {
+        parallel_worker *victim = job->workers +
+                ((w->id + i) % job->worker_count);
+        uint32_t start, end;
+
+        lock_take(&victim->lock);
+
+        start = victim->end;
+        end = victim->end;
+
+        if (victim->next < victim->end) {
+            start = victim->end - (victim->end - victim->next + 1) / 2;
+            victim->end = start;
+        }
+
+        lock_give(&victim->lock);
+
+        if (start == end)
+            continue;
+
+        lock_take(&w->lock);
+        *out = start;
+        w->next = start + 1;
+        w->end = end;
+        lock_give(&w->lock);
+        result = 1;
+    }
+
+    return result;
+}
+
+static void fail_item(parallel_worker *w, uint32_t index, uint16_t error_id)
+{
+    parallel_job *job = w->job;
+    uint32_t i;
+
+    w->error_index = index;
+    w->error_id = error_id;
+
+    for (i = 0;i < job->worker_count;i++) {
+        parallel_worker *other = job->workers + i;
+
+        lock_take(&other->lock);
+
+        if (other->end > index)
+            other->end = (other->next > index ? other->next : index);
+
+        lock_give(&other->lock);
+    }
+}
+
+static void run_worker(parallel_worker *w)
+{
+    parallel_job *job = w->job;
+    lily_state *s = w->vm;
+    uint32_t index;
+
+    lily_call_prepare(s, w->function);
+
+    while (take_item(w, &index)) {
+        read_value(s, job->input.data + job->input_pos[index]);
+
+        if (lily_call_trapped(s, 1) == 0) {
+            if (index < w->error_index) {
+                lily_mb_flush(w->error);
+                lily_mb_add(w->error, lily_error_message(s));
+                fail_item(w, index, LILY_ID_RUNTIMEERROR);
+            }
+
+            continue;
+        }
+
+        size_t pos = w->output.pos;
+        uint16_t bad_id = write_value(&w->output, lily_call_result(s));
+
+        if (bad_id) {
+            w->output.pos = pos;
+
+            if (index < w->error_index) {
+                lily_mb_flush(w->error);
+                lily_mb_add_fmt(w->error, "Cannot send a %s from a worker.",
+                        s->class_table[bad_id]->name);
+                fail_item(w, index, LILY_ID_VALUEERROR);
+            }
+
+            continue;
+        }
+
+        job->result_pos[index] = pos;
+        job->result_worker[index] = w->id;
+    }
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI worker_entry(LPVOID data)
+{
+    run_worker((parallel_worker *)data);
+    return 0;
+}
+
+static int start_thread(parallel_worker *w)
+{
+    w->thread = CreateThread(NULL, 0, worker_entry, w, 0, NULL);
+    return w->thread != NULL;
+}
+
+static void join_thread(parallel_worker *w)
+{
+    WaitForSingleObject(w->thread, INFINITE);
+    CloseHandle(w->thread);
+}
+#elif !defined(PARALLEL_NO_THREADS)
+static void *worker_entry(void *data)
+{
+    run_worker((parallel_worker *)data);
+    return NULL;
+}
+
+/* A new thread starts with the signal mask of the thread that made it. SIGPROF
+   is blocked while making a worker, so that the profiler's signal never lands
+   on a worker. The handler only reads the vm that is being profiled. */
+static int start_thread(parallel_worker *w)
+{
+    sigset_t profile_set, old_set;
+    int ok;
+
+    sigemptyset(&profile_set);
+    sigaddset(&profile_set, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &profile_set, &old_set);
+    ok = pthread_create(&w->thread, NULL, worker_entry, w) == 0;
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+    return ok;
+}
+
+static void join_thread(parallel_worker *w)
+{
+    pthread_join(w->thread, NULL);
+}
+#else
+static int start_thread(parallel_worker *w)
+{
+    (void)w;
+    return 0;
+}
+
+static void join_thread(parallel_worker *w)
+{
+    (void)w;
+}
+#endif
+
+static int cpu_count(void)
+{
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#elif !defined(PARALLEL_NO_THREADS) && defined(_SC_NPROCESSORS_ONLN)
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return count > 0 ? (int)count : 1;
+#else
+    return 1;
+#endif
+}
+
+static void free_job(parallel_job *job)
+{
+    uint32_t i;
+
+    for (i = 0;i < job->worker_count;i++) {
+        parallel_worker *w = job->workers + i;
+
+        lock_free(&w->lock);
+        lily_free_msgbuf(w->error);
+        lily_free(w->output.data);
+    }
+
+    lily_free(job->workers);
+    lily_free(job->input.data);
+    lily_free(job->input_pos);
+    lily_free(job->result_pos);
+    lily_free(job->result_worker);
+}
+
+static void run_job(lily_state *s, parallel_job *job, lily_value *fn)
+{
+    uint32_t worker_count = job->worker_count;
+    uint32_t count = job->count;
+    int global_count = s->parser->symtab->next_global_id;
+    uint32_t i;
+
+    job->workers = lily_malloc(worker_count * sizeof(*job->workers));
+    job->result_pos = lily_malloc(count * sizeof(*job->result_pos));
+    job->result_worker = lily_malloc(count * sizeof(*job->result_worker));
+
+    /* 's' is running this call, so lily_clone_state would refuse it. The
+       workers only need the globals and 'fn', which lily_vm_clone copies from
+       a running state too. */
+    for (i = 0;i < worker_count;i++) {
+        parallel_worker *w = job->workers + i;
+        lily_state *vm = lily_vm_clone(s, global_count, NULL);
+
+        lily_vm_clone_push(vm, fn);
+
+        lock_init(&w->lock);
+        w->next = (uint32_t)((uint64_t)count * i / worker_count);
+        w->end = (uint32_t)((uint64_t)count * (i + 1) / worker_count);
+        w->error_index = UINT32_MAX;
+        w->error_id = 0;
+        w->id = (uint16_t)i;
+        w->vm = vm;
+        w->function = lily_as_function(lily_stack_get_top(vm));
+        w->error = lily_new_msgbuf(64);
+        w->output.data = NULL;
+        w->output.pos = 0;
+        w->output.size = 0;
+        w->job = job;
+    }
+
+    /* The first worker runs here, and any worker that couldn't get a thread
+       runs here after it. */
+    int *started = lily_malloc(worker_count * sizeof(*started));
+
+    for (i = 1;i < worker_count;i++)
+        started[i] = start_thread(job->workers + i);
+
+    run_worker(job->workers);
+
+    for (i = 1;i < worker_count;i++) {
+        if (started[i])
+            join_thread(job->workers + i);
+        else
+            run_worker(job->workers + i);
+    }
+
+    lily_free(started);
+
+    for (i = 0;i < worker_count;i++)
+        lily_free_state(job->workers[i].vm);
+}
+
+/**
+define map[A, B](input: List[A], fn: Function(A => B), workers: *Integer = 0): List[B]
+
+Call `fn` on each element of `input` using `workers` threads, and return a
+`List` of the results (in the same order as `input`). If `workers` is 0, then
+there's one worker for each cpu. There are never more workers than elements.
+
+Each worker gets a copy of `fn`, as well as a copy of the globals of the program.
+Since each worker has its own copies, `fn` should only work with the element
+that it's given.
+
+Output that a worker writes to `stdout` is written directly, instead of through
+the interpreter's output buffer or render function.
+
+Foreign values (such as a `random.Random`) that the globals hold are shared with
+the workers instead of being copied. A worker must not use them.
+
+# Errors
+
+* `ValueError` if `workers` is negative.
+
+* `ValueError` if an element of `input`, or a value that `fn` returns, can't be
+  sent to or from a worker.
+
+* `RuntimeError` if `fn` raises an exception. The message of the error is the
+  message of the exception (with a traceback) from the first element that
+  failed.
+*/
+void lily_parallel__map(lily_state *s)
+{
+    lily_container_val *input = lily_arg_container(s, 0);
+    lily_value *fn = lily_arg_value(s, 1);
+    uint32_t count = lily_con_size(input);
+    int64_t worker_count = 0;
+    lily_value scratch;
+    uint32_t i;
+
+    if (lily_arg_count(s) == 3) {
+        worker_count = lily_arg_integer(s, 2);
+
+        if (worker_count < 0)
+            lily_ValueError(s, "Worker count must be >= 0 (%ld given).",
+                    worker_count);
+    }
+
+    if (worker_count == 0)
+        worker_count = cpu_count();
+
+    if (worker_count > count)
+        worker_count = count;
+
+    if (worker_count > UINT16_MAX)
+        worker_count = UINT16_MAX;
+
+    if (count == 0) {
+        lily_push_list(s, 0);
+        lily_return_top(s);
+        return;
+    }
+
+    parallel_job job;
+    uint16_t bad_id = 0;
+
+    memset(&job, 0, sizeof(job));
+    job.input_pos = lily_malloc(count * sizeof(*job.input_pos));
+    job.count = count;
+
+    for (i = 0;i < count;i++) {
+        job.input_pos[i] = job.input.pos;
+        bad_id = write_value(&job.input, lily_list_peek(input, i, &scratch));
+
+        if (bad_id)
+            break;
+    }
+
+    if (bad_id) {
+        free_job(&job);
+        lily_ValueError(s, "Cannot send a %s to a worker.",
+                s->class_table[bad_id]->name);
+    }
+
+    /* Output from here on is written directly, so send what's buffered. */
+    lily_flush_output(s);
+
+    job.worker_count = (uint32_t)worker_count;
+    run_job(s, &job, fn);
+
+    parallel_worker *failed = NULL;
+
+    for (i = 0;i < job.worker_count;i++) {
+        parallel_worker *w = job.workers + i;
+
+        if (failed == NULL || w->error_index < failed->error_index)
+            failed = w;
+    }
+
+    if (failed->error_index != UINT32_MAX) {
+        lily_msgbuf *msgbuf = lily_msgbuf_get(s);
+        const char *message = lily_mb_raw(failed->error);
+        int size = (int)strlen(message);
+        uint16_t error_id = failed->error_id;
+
+        /* Tracebacks end with a newline that the message shouldn't have. */
+        if (size && message[size - 1] == '\n')
+            size--;
+
+        lily_mb_add_slice(msgbuf, message, 0, size);
+        free_job(&job);
+
+        if (error_id == LILY_ID_VALUEERROR)
+            lily_ValueError(s, "%s", lily_mb_raw(msgbuf));
+        else
+            lily_RuntimeError(s, "%s", lily_mb_raw(msgbuf));
+    }
+
+    lily_container_val *result = lily_push_list(s, count);
+
+    for (i = 0;i < count;i++) {
+        parallel_worker *w = job.workers + job.result_worker[i];
+
+        read_value(s, w->output.data + job.result_pos[i]);
+        lily_con_set_from_stack(s, result, i);
+    }
+
+    free_job(&job);
+    lily_return_top(s);
+}
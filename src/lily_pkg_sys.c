@@ -14,24 +14,30 @@ The sys package provides access to the arguments given to Lily.
 /** Begin autogen section. **/
 const char *lily_sys_table[] = {
     "\0\0"
+    ,"F\0call_counts\0: Hash[String,Integer]"
     ,"F\0getenv\0(String): Option[String]"
+    ,"F\0opcode_counts\0: Hash[String,Integer]"
     ,"F\0recursion_limit\0: Integer"
     ,"F\0set_recursion_limit\0(Integer)"
     ,"R\0argv\0List[String]"
     ,"Z"
 };
 #define toplevel_OFFSET 1
+void lily_sys__call_counts(lily_state *);
 void lily_sys__getenv(lily_state *);
+void lily_sys__opcode_counts(lily_state *);
 void lily_sys__recursion_limit(lily_state *);
 void lily_sys__set_recursion_limit(lily_state *);
 void lily_sys_var_argv(lily_state *);
 void *lily_sys_loader(lily_state *s, int id)
 {
     switch (id) {
-        case toplevel_OFFSET + 0: return lily_sys__getenv;
-        case toplevel_OFFSET + 1: return lily_sys__recursion_limit;
-        case toplevel_OFFSET + 2: return lily_sys__set_recursion_limit;
-        case toplevel_OFFSET + 3: lily_sys_var_argv(s); return NULL;
+        case toplevel_OFFSET + 0: return lily_sys__call_counts;
+        case toplevel_OFFSET + 1: return lily_sys__getenv;
+        case toplevel_OFFSET + 2: return lily_sys__opcode_counts;
+        case toplevel_OFFSET + 3: return lily_sys__recursion_limit;
+        case toplevel_OFFSET + 4: return lily_sys__set_recursion_limit;
+        case toplevel_OFFSET + 5: lily_sys_var_argv(s); return NULL;
         default: return NULL;
     }
 }
@@ -57,6 +63,19 @@ void lily_sys_var_argv(lily_state *s)
     }
 }
 
+/**
+define call_counts: Hash[String, Integer]
+
+Return how many times each function has been called, by name. Functions that
+have the same name (such as lambdas) are added together. This is only filled in
+if Lily was built with `WITH_OPCODE_STATS`. Otherwise, it's empty.
+*/
+void lily_sys__call_counts(lily_state *s)
+{
+    lily_vm_push_call_counts(s);
+    lily_return_top(s);
+}
+
 /**
 define getenv(name: String): Option[String]
 
@@ -77,6 +96,20 @@ void lily_sys__getenv(lily_state *s)
         lily_return_none(s);
 }
 
+/**
+define opcode_counts: Hash[String, Integer]
+
+Return how many times each opcode has run, by name (such as `"o_int_add"`). The
+key for a pair of opcodes is both names with a space between them, and counts
+how many times the second ran right after the first. This is only filled in if
+Lily was built with `WITH_OPCODE_STATS`. Otherwise, it's empty.
+*/
+void lily_sys__opcode_counts(lily_state *s)
+{
+    lily_vm_push_opcode_counts(s);
+    lily_return_top(s);
+}
+
 /**
 define recursion_limit: Integer
 
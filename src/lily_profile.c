@@ -0,0 +1,429 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef _WIN32
+# include <signal.h>
+# include <sys/time.h>
+#endif
+
+#include "lily_alloc.h"
+#include "lily_parser.h"
+#include "lily_profile.h"
+
+/** The profiler is a sampling profiler. A timer goes off every millisecond of
+    cpu time that the interpreter uses (or less often, if the system's clock
+    is coarser than that). If the vm is running at the time, the
+    signal handler copies the vm's call chain into a buffer.
+
+    The signal can land in the middle of a call or a return, so the handler
+    doesn't follow the vm's call chain. Instead, the vm keeps a sample depth
+    that only covers frames that are filled in. The handler walks that many
+    frames up from the toplevel frame, which never moves. Parallel workers
+    block the signal, so it only lands on the thread running the vm.
+
+    The signal handler can't allocate memory, so the buffer is made up front. A
+    sample is written as a header (a frame with a NULL proto and the depth as
+    the line), followed by frames from the top of the chain down. Once the
+    buffer is full, later samples are counted and then dropped.
+
+    When the interpreter is freed, the samples are written out in two files.
+    The first is in the collapsed stack format that flame graph tools take.
+    The second file has a '.txt' suffix, and lists the self and total time of
+    each function.
+
+    Only one interpreter can be profiled at a time, since the timer is for the
+    whole process. The profiler doesn't work on Windows, which doesn't have the
+    timer. **/
+
+/* How often a sample is taken, in microseconds of cpu time. */
+#define SAMPLE_INTERVAL 1000
+
+/* How many frames the buffer can hold (about 16MB). */
+#define SAMPLE_BUFFER_SIZE (1 << 20)
+
+/* Frames beyond this depth are left out of a sample. */
+#define SAMPLE_MAX_DEPTH 256
+
+typedef struct {
+    lily_proto *proto;
+    /* 0 if the line isn't known. */
+    uint32_t line;
+    uint32_t pad;
+} lily_profile_frame;
+
+typedef struct lily_profiler_ {
+    lily_parse_state *parser;
+    /* The first frame of the vm, which samples start from. */
+    lily_call_frame *toplevel;
+    char *path;
+
+    lily_profile_frame *frames;
+    uint32_t frame_pos;
+
+    uint32_t sample_count;
+    uint32_t dropped_count;
+
+    /* How many times the timer went off, even if the vm wasn't running. */
+    uint32_t tick_count;
+
+    /* The timer's interval is rounded up to what the system's clock can do, so
+       the real time of a sample is cpu time over ticks. */
+    clock_t start_clock;
+    clock_t stop_clock;
+} lily_profiler;
+
+typedef struct {
+    lily_proto *proto;
+    uint32_t self;
+    uint32_t total;
+    /* This is the last sample that added to total. A function that recurses is
+       only counted once per sample. */
+    uint32_t last_sample;
+    uint32_t pad;
+} lily_profile_stat;
+
+static lily_profiler *active_profiler = NULL;
+
+#ifndef _WIN32
+static void take_sample(int signum)
+{
+    (void)signum;
+
+    lily_profiler *p = active_profiler;
+
+    if (p == NULL)
+        return;
+
+    p->tick_count++;
+
+    lily_vm_state *vm = p->parser->vm;
+    uint32_t depth = (uint32_t)vm->sample_depth;
+    lily_profile_frame *frames = p->frames + p->frame_pos;
+    uint32_t space = SAMPLE_BUFFER_SIZE - p->frame_pos;
+    uint32_t skip = 0, i;
+
+    if (depth == 0)
+        return;
+
+    /* Deep samples keep the frames closest to the top. */
+    if (depth > SAMPLE_MAX_DEPTH) {
+        skip = depth - SAMPLE_MAX_DEPTH;
+        depth = SAMPLE_MAX_DEPTH;
+    }
+
+    if (space < depth + 1) {
+        p->dropped_count++;
+        return;
+    }
+
+    /* The toplevel frame holds globals, so the walk starts after it. Frames
+       are written top first, so the frame at 'i' goes to 'depth - i'. A frame
+       below the top stopped to make a call. Emitter writes line numbers at the
+       end of instructions, so that frame's line is code[-1]. The top frame
+       doesn't reliably have code set, so it doesn't get a line, and neither do
+       foreign frames. */
+    lily_call_frame *frame = p->toplevel->next;
+
+    for (i = 0;i < skip;i++)
+        frame = frame->next;
+
+    for (i = 0;i < depth;i++, frame = frame->next) {
+        lily_function_val *f = frame->function;
+        lily_profile_frame *out = frames + depth - i;
+
+        out->proto = f->proto;
+
+        if (i + 1 != depth && f->code != NULL && frame->code != NULL)
+            out->line = frame->code[-1];
+        else
+            out->line = 0;
+    }
+
+    frames[0].proto = NULL;
+    frames[0].line = depth;
+    p->frame_pos += depth + 1;
+    p->sample_count++;
+}
+
+static void start_timer(lily_profiler *p)
+{
+    struct sigaction action;
+    struct itimerval timer;
+
+    if (active_profiler != NULL)
+        return;
+
+    active_profiler = p;
+    p->start_clock = clock();
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = take_sample;
+    /* Without this, a read or write that the signal interrupts would fail. */
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, NULL);
+
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = SAMPLE_INTERVAL;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+static void stop_timer(lily_profiler *p)
+{
+    struct itimerval timer;
+
+    if (active_profiler != p)
+        return;
+
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    signal(SIGPROF, SIG_IGN);
+    active_profiler = NULL;
+    p->stop_clock = clock();
+}
+#else
+static void start_timer(lily_profiler *p)
+{
+    (void)p;
+}
+
+static void stop_timer(lily_profiler *p)
+{
+    (void)p;
+}
+#endif
+
+lily_profiler *lily_new_profiler(lily_parse_state *parser, const char *path)
+{
+    lily_profiler *p = lily_malloc(sizeof(*p));
+
+    p->parser = parser;
+    p->toplevel = parser->vm->call_chain;
+
+    while (p->toplevel->prev)
+        p->toplevel = p->toplevel->prev;
+
+    p->path = lily_malloc((strlen(path) + 1) * sizeof(*p->path));
+    strcpy(p->path, path);
+    p->frames = lily_malloc(SAMPLE_BUFFER_SIZE * sizeof(*p->frames));
+    p->frame_pos = 0;
+    p->sample_count = 0;
+    p->dropped_count = 0;
+    p->tick_count = 0;
+    p->start_clock = 0;
+    p->stop_clock = 0;
+
+    start_timer(p);
+    return p;
+}
+
+/***
+ *      ____                       _
+ *     |  _ \ ___ _ __   ___  _ __| |_
+ *     | |_) / _ \ '_ \ / _ \| '__| __|
+ *     |  _ <  __/ |_) | (_) | |  | |_
+ *     |_| \_\___| .__/ \___/|_|   \__|
+ *               |_|
+ */
+
+static int compare_strings(const void *left, const void *right)
+{
+    return strcmp(*(char * const *)left, *(char * const *)right);
+}
+
+static int compare_protos(const void *left, const void *right)
+{
+    const lily_profile_stat *l = left;
+    const lily_profile_stat *r = right;
+
+    if (l->proto < r->proto)
+        return -1;
+
+    return l->proto > r->proto;
+}
+
+static int compare_self(const void *left, const void *right)
+{
+    const lily_profile_stat *l = left;
+    const lily_profile_stat *r = right;
+
+    if (l->self != r->self)
+        return l->self < r->self ? 1 : -1;
+
+    return (l->total < r->total) - (l->total > r->total);
+}
+
+/* Flame graph tools split frames on ';' and the count on the last space, so
+   those can't be in a frame's name. */
+static void add_frame_name(lily_msgbuf *msgbuf, lily_profile_frame *frame)
+{
+    const char *name = frame->proto->name;
+    char ch;
+
+    while ((ch = *name) != '\0') {
+        if (ch == ';' || ch == ' ')
+            ch = '_';
+
+        lily_mb_add_char(msgbuf, ch);
+        name++;
+    }
+
+    if (frame->line)
+        lily_mb_add_fmt(msgbuf, ":%d", frame->line);
+}
+
+static void write_folded(lily_profiler *p, FILE *f)
+{
+    char **stacks = lily_malloc((p->sample_count + 1) * sizeof(*stacks));
+    lily_msgbuf *msgbuf = lily_new_msgbuf(64);
+    uint32_t pos = 0, i;
+
+    for (i = 0;i < p->sample_count;i++) {
+        lily_profile_frame *frames = p->frames + pos + 1;
+        uint32_t depth = p->frames[pos].line;
+        int j;
+
+        lily_mb_flush(msgbuf);
+
+        /* Samples are stored top down, but stacks are written from the root. */
+        for (j = depth - 1;j >= 0;j--) {
+            add_frame_name(msgbuf, frames + j);
+
+            if (j)
+                lily_mb_add_char(msgbuf, ';');
+        }
+
+        const char *raw = lily_mb_raw(msgbuf);
+
+        stacks[i] = lily_malloc((strlen(raw) + 1) * sizeof(*stacks[i]));
+        strcpy(stacks[i], raw);
+        pos += depth + 1;
+    }
+
+    qsort(stacks, p->sample_count, sizeof(*stacks), compare_strings);
+
+    for (i = 0;i < p->sample_count;) {
+        uint32_t start = i;
+
+        while (i < p->sample_count && strcmp(stacks[start], stacks[i]) == 0)
+            i++;
+
+        fprintf(f, "%s %u\n", stacks[start], i - start);
+    }
+
+    for (i = 0;i < p->sample_count;i++)
+        lily_free(stacks[i]);
+
+    lily_free_msgbuf(msgbuf);
+    lily_free(stacks);
+}
+
+static void write_table(lily_profiler *p, FILE *f)
+{
+    lily_proto_stack *protos = p->parser->emit->protos;
+    uint32_t count = protos->pos;
+    lily_profile_stat *stats = lily_malloc((count + 1) * sizeof(*stats));
+    uint32_t pos = 0, i;
+
+    for (i = 0;i < count;i++) {
+        stats[i].proto = protos->data[i];
+        stats[i].self = 0;
+        stats[i].total = 0;
+        stats[i].last_sample = UINT32_MAX;
+    }
+
+    qsort(stats, count, sizeof(*stats), compare_protos);
+
+    for (i = 0;i < p->sample_count;i++) {
+        lily_profile_frame *frames = p->frames + pos + 1;
+        uint32_t depth = p->frames[pos].line;
+        uint32_t j;
+
+        for (j = 0;j < depth;j++) {
+            lily_profile_stat key, *s;
+
+            key.proto = frames[j].proto;
+            s = bsearch(&key, stats, count, sizeof(*stats), compare_protos);
+
+            if (s == NULL)
+                continue;
+
+            if (j == 0)
+                s->self++;
+
+            if (s->last_sample != i) {
+                s->last_sample = i;
+                s->total++;
+            }
+        }
+
+        pos += depth + 1;
+    }
+
+    qsort(stats, count, sizeof(*stats), compare_self);
+
+    double ms = SAMPLE_INTERVAL / 1000.0;
+
+    if (p->tick_count)
+        ms = (double)(p->stop_clock - p->start_clock) * 1000.0 /
+             CLOCKS_PER_SEC / p->tick_count;
+    double percent = p->sample_count ? 100.0 / p->sample_count : 0;
+
+    fprintf(f, "%u samples, %.1f ms each", p->sample_count, ms);
+
+    if (p->dropped_count)
+        fprintf(f, " (%u dropped, buffer full)", p->dropped_count);
+
+    fprintf(f, "\n\n%10s %7s %10s %7s  %s\n", "self ms", "self %", "total ms",
+            "total %", "function");
+
+    for (i = 0;i < count && stats[i].total;i++) {
+        lily_profile_stat *s = stats + i;
+        const char *where = s->proto->module_path;
+
+        /* Foreign functions don't have a path. */
+        if (where == NULL)
+            where = "[C]";
+
+        fprintf(f, "%10.1f %6.1f%% %10.1f %6.1f%%  %s (%s)\n",
+                s->self * ms, s->self * percent,
+                s->total * ms, s->total * percent,
+                s->proto->name, where);
+    }
+
+    lily_free(stats);
+}
+
+/* This must be called before emitter is freed, because samples point to the
+   protos that emitter holds. */
+void lily_free_profiler(lily_profiler *p)
+{
+    stop_timer(p);
+
+    FILE *f = fopen(p->path, "w");
+
+    if (f) {
+        write_folded(p, f);
+        fclose(f);
+    }
+
+    char *table_path = lily_malloc((strlen(p->path) + 5) *
+            sizeof(*table_path));
+
+    strcpy(table_path, p->path);
+    strcat(table_path, ".txt");
+    f = fopen(table_path, "w");
+
+    if (f) {
+        write_table(p, f);
+        fclose(f);
+    }
+
+    lily_free(table_path);
+    lily_free(p->frames);
+    lily_free(p->path);
+    lily_free(p);
+}
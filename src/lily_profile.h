@@ -0,0 +1,11 @@
+#ifndef LILY_PROFILE_H
+# define LILY_PROFILE_H
+
+struct lily_parse_state_;
+struct lily_profiler_;
+
+struct lily_profiler_ *lily_new_profiler(struct lily_parse_state_ *,
+        const char *);
+void lily_free_profiler(struct lily_profiler_ *);
+
+#endif
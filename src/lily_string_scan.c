@@ -0,0 +1,504 @@
+#include <string.h>
+
+#include "lily_string_scan.h"
+
+/** Each scan is written three times. The scalar version is the reference, and
+    is also what finishes the bytes that don't fill a vector. The sse2 version
+    is built whenever the compiler targets x86 with sse2 (which all x86-64 cpus
+    have). The avx2 version is built with gcc or clang, and only used if the cpu
+    says it has avx2.
+
+    Searches load a block from where a match would start and a block from where
+    it would end. A position is only checked with memcmp if both the first and
+    last bytes of the needle are there. This is much better than checking on
+    the first byte when the first byte is common (such as a space). **/
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# define SCAN_SSE2
+# include <emmintrin.h>
+#endif
+
+#if defined(SCAN_SSE2) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+# define SCAN_AVX2
+# include <immintrin.h>
+# define AVX2_FN __attribute__((target("avx2")))
+#endif
+
+#ifdef _MSC_VER
+# include <intrin.h>
+static int first_bit(unsigned int mask)
+{
+    unsigned long index;
+
+    _BitScanForward(&index, mask);
+    return (int)index;
+}
+#else
+# define first_bit(mask) __builtin_ctz(mask)
+#endif
+
+/* The level is picked the first time a scan runs, which may be on any of the
+   threads that parallel.map starts. Every thread picks the same level, but
+   the loads and stores still need to be atomic. */
+#ifdef _MSC_VER
+static volatile long scan_level = -1;
+# define SCAN_LEVEL_LOAD() (int)scan_level
+# define SCAN_LEVEL_STORE(level) (scan_level = (level))
+#else
+static int scan_level = -1;
+# define SCAN_LEVEL_LOAD() __atomic_load_n(&scan_level, __ATOMIC_RELAXED)
+# define SCAN_LEVEL_STORE(level) \
+    __atomic_store_n(&scan_level, level, __ATOMIC_RELAXED)
+#endif
+
+int lily_scan_best_level(void)
+{
+#ifdef SCAN_AVX2
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+        return LILY_SCAN_AVX2;
+#endif
+
+#ifdef SCAN_SSE2
+    return LILY_SCAN_SSE2;
+#else
+    return LILY_SCAN_SCALAR;
+#endif
+}
+
+void lily_scan_set_level(int level)
+{
+    int best = lily_scan_best_level();
+
+    if (level > best)
+        level = best;
+
+    SCAN_LEVEL_STORE(level);
+}
+
+static int get_level(void)
+{
+    int level = SCAN_LEVEL_LOAD();
+
+    if (level == -1) {
+        level = lily_scan_best_level();
+        SCAN_LEVEL_STORE(level);
+    }
+
+    return level;
+}
+
+/***
+ *      ____            _
+ *     / ___|  ___ __ _| | __ _ _ __
+ *     \___ \ / __/ _` | |/ _` | '__|
+ *      ___) | (_| (_| | | (_| | |
+ *     |____/ \___\__,_|_|\__,_|_|
+ *
+ */
+
+static int find_scalar(const char *input, int size, const char *needle,
+        int needle_size)
+{
+    const char *iter = input;
+    const char *last = input + (size - needle_size);
+    char first = needle[0];
+
+    while (iter <= last) {
+        const char *at = memchr(iter, first, last - iter + 1);
+
+        if (at == NULL)
+            break;
+
+        if (memcmp(at + 1, needle + 1, needle_size - 1) == 0)
+            return (int)(at - input);
+
+        iter = at + 1;
+    }
+
+    return -1;
+}
+
+static int html_scalar(const char *input, int size)
+{
+    int i;
+
+    for (i = 0;i < size;i++) {
+        char ch = input[i];
+
+        if (ch == '&' || ch == '<' || ch == '>')
+            break;
+    }
+
+    return i;
+}
+
+static int ascii_scalar(const char *input, int size)
+{
+    int i;
+
+    for (i = 0;i < size;i++) {
+        if ((unsigned char)input[i] > 127)
+            break;
+    }
+
+    return i;
+}
+
+static int in_class(unsigned char ch, int cls)
+{
+    int alpha = (unsigned char)((ch | 0x20) - 'a') < 26;
+    int digit = (unsigned char)(ch - '0') < 10;
+
+    switch (cls) {
+        case LILY_SCAN_ALNUM:
+            return alpha || digit;
+        case LILY_SCAN_ALPHA:
+            return alpha;
+        case LILY_SCAN_DIGIT:
+            return digit;
+        default:
+            /* ' ', or one of \t \n \v \f \r. */
+            return ch == ' ' || (unsigned char)(ch - '\t') < 5;
+    }
+}
+
+static int is_class_scalar(const char *input, int size, int cls)
+{
+    int i;
+
+    for (i = 0;i < size;i++) {
+        if (in_class((unsigned char)input[i], cls) == 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+/* The vector versions finish with these, so the result has to be moved by
+   where the vector part stopped. */
+static int find_tail(const char *input, int size, int start,
+        const char *needle, int needle_size)
+{
+    if (size - start < needle_size)
+        return -1;
+
+    int result = find_scalar(input + start, size - start, needle, needle_size);
+
+    if (result != -1)
+        result += start;
+
+    return result;
+}
+
+/***
+ *      ____ ____  _____ ____
+ *     / ___/ ___|| ____|___ \
+ *     \___ \___ \|  _|   __) |
+ *      ___) |__) | |___ / __/
+ *     |____/____/|_____|_____|
+ *
+ */
+
+#ifdef SCAN_SSE2
+static int find_sse2(const char *input, int size, const char *needle,
+        int needle_size)
+{
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i last = _mm_set1_epi8(needle[needle_size - 1]);
+    /* The block for the last byte must not go past the end. */
+    int stop = size - needle_size - 15;
+    int i;
+
+    for (i = 0;i <= stop;i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(input + i));
+        __m128i block_last = _mm_loadu_si128(
+                (const __m128i *)(input + i + needle_size - 1));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_and_si128(
+                _mm_cmpeq_epi8(block_first, first),
+                _mm_cmpeq_epi8(block_last, last)));
+
+        while (mask) {
+            int at = i + first_bit(mask);
+
+            if (memcmp(input + at + 1, needle + 1, needle_size - 1) == 0)
+                return at;
+
+            mask &= mask - 1;
+        }
+    }
+
+    return find_tail(input, size, i, needle, needle_size);
+}
+
+static int html_sse2(const char *input, int size)
+{
+    __m128i amp = _mm_set1_epi8('&');
+    __m128i lt = _mm_set1_epi8('<');
+    __m128i gt = _mm_set1_epi8('>');
+    int i;
+
+    for (i = 0;i + 16 <= size;i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(input + i));
+        __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(block, amp),
+                _mm_or_si128(_mm_cmpeq_epi8(block, lt),
+                             _mm_cmpeq_epi8(block, gt)));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(hits);
+
+        if (mask)
+            return i + first_bit(mask);
+    }
+
+    return i + html_scalar(input + i, size - i);
+}
+
+static int ascii_sse2(const char *input, int size)
+{
+    int i;
+
+    for (i = 0;i + 16 <= size;i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(input + i));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(block);
+
+        if (mask)
+            return i + first_bit(mask);
+    }
+
+    return i + ascii_scalar(input + i, size - i);
+}
+
+/* Bytes in [low, low + count) are set in the result. */
+static __m128i in_range_sse2(__m128i block, char low, char count)
+{
+    __m128i offset = _mm_sub_epi8(block, _mm_set1_epi8(low));
+
+    return _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(count - 1)),
+            offset);
+}
+
+static int is_class_sse2(const char *input, int size, int cls)
+{
+    __m128i lower = _mm_set1_epi8(0x20);
+    int i;
+
+    for (i = 0;i + 16 <= size;i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(input + i));
+        __m128i ok;
+
+        if (cls == LILY_SCAN_SPACE)
+            ok = _mm_or_si128(in_range_sse2(block, '\t', 5),
+                    _mm_cmpeq_epi8(block, _mm_set1_epi8(' ')));
+        else if (cls == LILY_SCAN_DIGIT)
+            ok = in_range_sse2(block, '0', 10);
+        else {
+            ok = in_range_sse2(_mm_or_si128(block, lower), 'a', 26);
+
+            if (cls == LILY_SCAN_ALNUM)
+                ok = _mm_or_si128(ok, in_range_sse2(block, '0', 10));
+        }
+
+        if (_mm_movemask_epi8(ok) != 0xFFFF)
+            return 0;
+    }
+
+    return is_class_scalar(input + i, size - i, cls);
+}
+#endif
+
+/***
+ *         ___     ____  __ ____
+ *        / \ \   / /\ \/ /|___ \
+ *       / _ \ \ / /  \  /   __) |
+ *      / ___ \ V /   /  \  / __/
+ *     /_/   \_\_/   /_/\_\|_____|
+ *
+ */
+
+#ifdef SCAN_AVX2
+AVX2_FN
+static int find_avx2(const char *input, int size, const char *needle,
+        int needle_size)
+{
+    __m256i first = _mm256_set1_epi8(needle[0]);
+    __m256i last = _mm256_set1_epi8(needle[needle_size - 1]);
+    int stop = size - needle_size - 31;
+    int i;
+
+    for (i = 0;i <= stop;i += 32) {
+        __m256i block_first = _mm256_loadu_si256(
+                (const __m256i *)(input + i));
+        __m256i block_last = _mm256_loadu_si256(
+                (const __m256i *)(input + i + needle_size - 1));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+                _mm256_and_si256(_mm256_cmpeq_epi8(block_first, first),
+                                 _mm256_cmpeq_epi8(block_last, last)));
+
+        while (mask) {
+            int at = i + first_bit(mask);
+
+            if (memcmp(input + at + 1, needle + 1, needle_size - 1) == 0)
+                return at;
+
+            mask &= mask - 1;
+        }
+    }
+
+    return find_tail(input, size, i, needle, needle_size);
+}
+
+AVX2_FN
+static int html_avx2(const char *input, int size)
+{
+    __m256i amp = _mm256_set1_epi8('&');
+    __m256i lt = _mm256_set1_epi8('<');
+    __m256i gt = _mm256_set1_epi8('>');
+    int i;
+
+    for (i = 0;i + 32 <= size;i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(input + i));
+        __m256i hits = _mm256_or_si256(_mm256_cmpeq_epi8(block, amp),
+                _mm256_or_si256(_mm256_cmpeq_epi8(block, lt),
+                                _mm256_cmpeq_epi8(block, gt)));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(hits);
+
+        if (mask)
+            return i + first_bit(mask);
+    }
+
+    return i + html_scalar(input + i, size - i);
+}
+
+AVX2_FN
+static int ascii_avx2(const char *input, int size)
+{
+    int i;
+
+    for (i = 0;i + 32 <= size;i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(input + i));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(block);
+
+        if (mask)
+            return i + first_bit(mask);
+    }
+
+    return i + ascii_scalar(input + i, size - i);
+}
+
+AVX2_FN
+static __m256i in_range_avx2(__m256i block, char low, char count)
+{
+    __m256i offset = _mm256_sub_epi8(block, _mm256_set1_epi8(low));
+
+    return _mm256_cmpeq_epi8(
+            _mm256_min_epu8(offset, _mm256_set1_epi8(count - 1)), offset);
+}
+
+AVX2_FN
+static int is_class_avx2(const char *input, int size, int cls)
+{
+    __m256i lower = _mm256_set1_epi8(0x20);
+    int i;
+
+    for (i = 0;i + 32 <= size;i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(input + i));
+        __m256i ok;
+
+        if (cls == LILY_SCAN_SPACE)
+            ok = _mm256_or_si256(in_range_avx2(block, '\t', 5),
+                    _mm256_cmpeq_epi8(block, _mm256_set1_epi8(' ')));
+        else if (cls == LILY_SCAN_DIGIT)
+            ok = in_range_avx2(block, '0', 10);
+        else {
+            ok = in_range_avx2(_mm256_or_si256(block, lower), 'a', 26);
+
+            if (cls == LILY_SCAN_ALNUM)
+                ok = _mm256_or_si256(ok, in_range_avx2(block, '0', 10));
+        }
+
+        if ((unsigned int)_mm256_movemask_epi8(ok) != 0xFFFFFFFF)
+            return 0;
+    }
+
+    return is_class_scalar(input + i, size - i, cls);
+}
+#endif
+
+/***
+ *      ____  _                 _       _
+ *     |  _ \(_)___ _ __   __ _| |_ ___| |__
+ *     | | | | / __| '_ \ / _` | __/ __| '_ \
+ *     | |_| | \__ \ |_) | (_| | || (__| | | |
+ *     |____/|_|___/ .__/ \__,_|\__\___|_| |_|
+ *                 |_|
+ */
+
+int lily_scan_find(const char *input, int size, const char *needle,
+        int needle_size)
+{
+    if (needle_size == 0 || needle_size > size)
+        return -1;
+
+    switch (get_level()) {
+#ifdef SCAN_AVX2
+        case LILY_SCAN_AVX2:
+            return find_avx2(input, size, needle, needle_size);
+#endif
+#ifdef SCAN_SSE2
+        case LILY_SCAN_SSE2:
+            return find_sse2(input, size, needle, needle_size);
+#endif
+        default:
+            return find_scalar(input, size, needle, needle_size);
+    }
+}
+
+int lily_scan_html(const char *input, int size)
+{
+    switch (get_level()) {
+#ifdef SCAN_AVX2
+        case LILY_SCAN_AVX2:
+            return html_avx2(input, size);
+#endif
+#ifdef SCAN_SSE2
+        case LILY_SCAN_SSE2:
+            return html_sse2(input, size);
+#endif
+        default:
+            return html_scalar(input, size);
+    }
+}
+
+int lily_scan_ascii(const char *input, int size)
+{
+    switch (get_level()) {
+#ifdef SCAN_AVX2
+        case LILY_SCAN_AVX2:
+            return ascii_avx2(input, size);
+#endif
+#ifdef SCAN_SSE2
+        case LILY_SCAN_SSE2:
+            return ascii_sse2(input, size);
+#endif
+        default:
+            return ascii_scalar(input, size);
+    }
+}
+
+int lily_scan_is_class(const char *input, int size, int cls)
+{
+    switch (get_level()) {
+#ifdef SCAN_AVX2
+        case LILY_SCAN_AVX2:
+            return is_class_avx2(input, size, cls);
+#endif
+#ifdef SCAN_SSE2
+        case LILY_SCAN_SSE2:
+            return is_class_sse2(input, size, cls);
+#endif
+        default:
+            return is_class_scalar(input, size, cls);
+    }
+}
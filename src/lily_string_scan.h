@@ -0,0 +1,45 @@
+#ifndef LILY_STRING_SCAN_H
+# define LILY_STRING_SCAN_H
+
+/* These are the byte scanning loops behind String's find, replace, split,
+   html_encode, the is_* family, and utf-8 checking. Each one has a scalar
+   version that works everywhere, an sse2 version for x86 machines that have
+   it, and an avx2 version that's only used if the cpu running the interpreter
+   has avx2.
+
+   The scans work on bytes, so the inputs don't need to be valid utf-8 or have
+   a \0 terminator. */
+
+# define LILY_SCAN_SCALAR 0
+# define LILY_SCAN_SSE2   1
+# define LILY_SCAN_AVX2   2
+
+# define LILY_SCAN_ALNUM  0
+# define LILY_SCAN_ALPHA  1
+# define LILY_SCAN_DIGIT  2
+# define LILY_SCAN_SPACE  3
+
+/* The best level that this build and cpu can use. */
+int lily_scan_best_level(void);
+
+/* Scans use the best level by default. This is for tests that want to check a
+   lower level against the others. Levels above the best are lowered to it. */
+void lily_scan_set_level(int);
+
+/* Return where the first 'needle' is within 'input', or -1 if it isn't there.
+   An empty needle is never found. */
+int lily_scan_find(const char *input, int size, const char *needle,
+        int needle_size);
+
+/* Return where the first '&', '<', or '>' is, or 'size' if there isn't one. */
+int lily_scan_html(const char *input, int size);
+
+/* Return where the first byte over 127 is, or 'size' if there isn't one. */
+int lily_scan_ascii(const char *input, int size);
+
+/* Return 1 if every byte of 'input' is in the class given (one of the
+   LILY_SCAN_ALNUM family), 0 otherwise. This matches the C locale's isalnum
+   and the others, so bytes over 127 are never in a class. */
+int lily_scan_is_class(const char *input, int size, int cls);
+
+#endif
@@ -18,7 +18,8 @@
  *                          |_|
  */
 
-lily_symtab *lily_new_symtab(lily_generic_pool *gp)
+lily_symtab *lily_new_symtab(lily_generic_pool *gp, lily_slab_pool *pool,
+        const char *sipkey, lily_hash_val *interned_strings)
 {
     lily_symtab *symtab = lily_malloc(sizeof(*symtab));
 
@@ -28,6 +29,9 @@ lily_symtab *lily_new_symtab(lily_generic_pool *gp)
     symtab->hidden_class_chain = NULL;
     symtab->literals = lily_new_value_stack();
     symtab->generics = gp;
+    symtab->pool = pool;
+    symtab->sipkey = sipkey;
+    symtab->interned_strings = interned_strings;
     symtab->next_global_id = 0;
     symtab->next_reverse_id = LILY_LAST_ID;
 
@@ -361,7 +365,8 @@ lily_literal *lily_get_bytestring_literal(lily_symtab *symtab,
     if (iter)
         iter->next_index = lily_vs_pos(symtab->literals);
 
-    lily_bytestring_val *sv = lily_new_bytestring_raw(want_string, len);
+    lily_bytestring_val *sv = lily_new_bytestring_raw(symtab->pool, want_string,
+            len);
     lily_literal *v = (lily_literal *)new_value_of_bytestring(sv);
 
     /* Drop the derefable marker. */
@@ -376,34 +381,52 @@ lily_literal *lily_get_bytestring_literal(lily_symtab *symtab,
 lily_literal *lily_get_string_literal(lily_symtab *symtab,
         const char *want_string)
 {
-    lily_literal *iter = first_lit_of(symtab->literals, LILY_ID_STRING);
-    size_t want_string_len = strlen(want_string);
-
-    while (iter) {
-        if (iter->value.string->size == want_string_len &&
-            strcmp(iter->value.string->string, want_string) == 0)
-            return iter;
-
-        int next = iter->next_index;
-
-        if (next == 0)
-            break;
-        else
-            iter = (lily_literal *)lily_vs_nth(symtab->literals, next);
+    lily_string_val want_sv;
+    lily_value want_key;
+
+    want_sv.string = (char *)want_string;
+    want_sv.size = strlen(want_string);
+    want_sv.hash = 0;
+    want_key.flags = LILY_ID_STRING;
+    want_key.value.string = &want_sv;
+
+    uint64_t hash = lily_string_hash(&want_sv, symtab->sipkey);
+    lily_hash_entry *entry = lily_hash_find_entry(symtab->interned_strings,
+            &want_key, hash);
+    int64_t index = lily_vs_pos(symtab->literals);
+
+    if (entry) {
+        if (entry->record.value.integer != -1)
+            return (lily_literal *)lily_vs_nth(symtab->literals,
+                    entry->record.value.integer);
+
+        /* String.intern got to this one first. The interned String is in use
+           by the vm, so it can't become a literal. Make a literal of its own
+           for the entry to point to. */
+        entry->record.value.integer = index;
     }
 
-    if (iter)
-        iter->next_index = lily_vs_pos(symtab->literals);
-
-    lily_string_val *sv = lily_new_string_raw(want_string);
+    lily_string_val *sv = lily_new_string_raw(symtab->pool, want_string);
     lily_literal *v = (lily_literal *)new_value_of_string(sv);
 
+    sv->hash = hash;
+
     /* Drop the derefable marker. */
     v->flags = LILY_ID_STRING;
-    v->reg_spot = lily_vs_pos(symtab->literals);
+    v->reg_spot = index;
     v->next_index = 0;
 
     lily_vs_push(symtab->literals, (lily_value *)v);
+
+    if (entry == NULL) {
+        lily_value index_value;
+
+        index_value.flags = LILY_ID_INTEGER;
+        index_value.value.integer = index;
+        lily_hash_set_hashed(symtab->interned_strings, (lily_value *)v,
+                &index_value, hash);
+    }
+
     return (lily_literal *)v;
 }
 
@@ -1,6 +1,7 @@
 #ifndef LILY_SYMTAB_H
 # define LILY_SYMTAB_H
 
+# include "lily_alloc.h"
 # include "lily_core_types.h"
 # include "lily_generic_pool.h"
 # include "lily_value_structs.h"
@@ -24,6 +25,17 @@ typedef struct lily_symtab_ {
     /* Symtab uses this to search for generics. */
     lily_generic_pool *generics;
 
+    /* String and ByteString literals are made from the vm's pool. */
+    lily_slab_pool *pool;
+
+    /* String literals are hashed with this key when they're made, so Hash
+       lookups with them never need to. */
+    const char *sipkey;
+
+    /* The vm's table of interned Strings. String literals are found through
+       here, and new ones are added to it. */
+    lily_hash_val *interned_strings;
+
     /* Each class gets a unique id. This is mostly for the builtin classes
        which have some special behavior sometimes. */
     uint16_t next_class_id;
@@ -51,7 +63,8 @@ typedef struct lily_symtab_ {
     lily_class *optarg_class;
 } lily_symtab;
 
-lily_symtab *lily_new_symtab(lily_generic_pool *);
+lily_symtab *lily_new_symtab(lily_generic_pool *, lily_slab_pool *,
+        const char *, lily_hash_val *);
 void lily_set_builtin(lily_symtab *, lily_module_entry *);
 void lily_free_module_symbols(lily_symtab *, lily_module_entry *);
 void lily_hide_module_symbols(lily_symtab *, lily_module_entry *);
@@ -1,5 +1,6 @@
 #include <stdint.h>
 
+#include "lily_string_scan.h"
 #include "lily_utf8.h"
 
 // Copyright (c) 2008-2009 Bjoern Hoehrmann <bjoern@hoehrmann.de>
@@ -51,7 +52,7 @@ int lily_is_valid_utf8(const char *input)
     return state == UTF8_ACCEPT;
 }
 
-/* Check if 'input' is valid utf-8 and \0 terminated. */
+/* Check if the first 'size' bytes of 'input' are valid utf-8 without a \0. */
 int lily_is_valid_sized_utf8(const char *input, int size)
 {
     uint8_t *s = (uint8_t *)input;
@@ -59,9 +60,42 @@ int lily_is_valid_sized_utf8(const char *input, int size)
     uint32_t codepoint;
     uint32_t state = 0;
 
-    for (;*s; ++s)
-        if (decode(&state, &codepoint, *s) == UTF8_REJECT)
+    /* Stop at the size instead of a \0, since a slice may not have one. A \0
+       inside is invalid. */
+    for (;s != end; ++s)
+        if (*s == '\0' ||
+            decode(&state, &codepoint, *s) == UTF8_REJECT)
             break;
 
     return (state == UTF8_ACCEPT) && (s == end);
 }
+
+/* Return where the first invalid byte of 'input' is, or -1 if it's all valid.
+   A sequence cut off by the end is reported at the last byte. Runs of ascii
+   are skipped by vector, since most source is ascii. */
+int lily_find_invalid_utf8(const char *input, int size)
+{
+    const uint8_t *s = (const uint8_t *)input;
+    uint32_t codepoint;
+    uint32_t state = UTF8_ACCEPT;
+    int i = 0;
+
+    while (i < size) {
+        if (state == UTF8_ACCEPT) {
+            i += lily_scan_ascii(input + i, size - i);
+
+            if (i == size)
+                break;
+        }
+
+        if (decode(&state, &codepoint, s[i]) == UTF8_REJECT)
+            return i;
+
+        i++;
+    }
+
+    if (state != UTF8_ACCEPT)
+        return size - 1;
+
+    return -1;
+}
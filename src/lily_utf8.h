@@ -3,5 +3,6 @@
 
 int lily_is_valid_utf8(const char *);
 int lily_is_valid_sized_utf8(const char *, int);
+int lily_find_invalid_utf8(const char *, int);
 
 #endif
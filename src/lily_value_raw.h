@@ -2,15 +2,69 @@
 # define LILY_VALUE_RAW_H
 
 # include "lily_value_structs.h"
+# include "lily_alloc.h"
 
 # include "lily.h"
 
+/* Lists can grow, so their values always come from malloc. Other containers
+   never change size, and take their values from the slab pool if they fit. */
+# define LILY_POOLED_VALUES(class_id, count) \
+    ((class_id) != LILY_ID_LIST && (count) && \
+     (count) * sizeof(lily_value) <= LILY_SLAB_MAX)
+
+/* Lists of Integer, Double, or Byte values can hold them packed: As an array
+   of raw values (Integer and Double) or bytes (Byte), instead of lily_value.
+   The values of a List all have the same class, so only packed_id says what
+   they are. */
+# define LILY_LIST_IS_PACKED(c) \
+    ((c)->class_id == LILY_ID_LIST && (c)->packed_id)
+
+# define LILY_CAN_PACK(class_id) \
+    ((class_id) == LILY_ID_INTEGER || \
+     (class_id) == LILY_ID_DOUBLE || \
+     (class_id) == LILY_ID_BYTE)
+
+void lily_list_pack(lily_container_val *, uint16_t, uint32_t);
+void lily_list_unpack(lily_container_val *);
+void lily_list_packed_get(lily_container_val *, uint32_t, lily_value *);
+void lily_list_packed_set(lily_container_val *, uint32_t, lily_value *);
+lily_value *lily_list_peek(lily_container_val *, uint32_t, lily_value *);
+
+/* Return the size of the next line of the File, and set the last argument to
+   where it starts. The line has the \n, unless it's the last line and the File
+   doesn't end with one. The line can be used until the next read. 0 means
+   that there are no more lines. This raises IOError if the File is closed or
+   not open for reading. */
+uint32_t lily_file_next_line(lily_state *, lily_file_val *, const char **);
+void lily_file_free_buffer(lily_file_val *);
+
+/* Return the File's stream, placed where the last line read stopped. */
+FILE *lily_file_raw(lily_file_val *);
+
 lily_container_val *lily_new_list_raw(int);
 lily_container_val *lily_new_tuple_raw(int);
 lily_container_val *lily_new_instance_raw(uint16_t, int);
-lily_bytestring_val *lily_new_bytestring_raw(const char *, int);
-lily_string_val *lily_new_string_raw(const char *);
-lily_hash_val *lily_new_hash_raw(int);
+lily_bytestring_val *lily_new_bytestring_raw(lily_slab_pool *, const char *,
+        int);
+lily_string_val *lily_new_string_raw(lily_slab_pool *, const char *);
+lily_hash_val *lily_new_hash_raw(lily_slab_pool *, lily_arena *, int);
+
+uint64_t lily_string_hash(lily_string_val *, const char *);
+uint64_t lily_hash_key(lily_state *, lily_value *);
+lily_hash_entry *lily_hash_find_entry(lily_hash_val *, lily_value *, uint64_t);
+void lily_hash_set_hashed(lily_hash_val *, lily_value *, lily_value *,
+        uint64_t);
+int lily_string_eq(lily_string_val *, lily_string_val *);
+int lily_string_cmp(lily_string_val *, lily_string_val *);
+
+/* Push a new value of 'class_id' (String or ByteString) holding 'len' bytes of
+   the source (also a String or ByteString) from 'start'. If the source is
+   refcounted, the result shares its buffer instead of copying it. */
+void lily_push_string_slice(lily_state *, uint16_t, lily_value *, int, int);
+
+/* If the string is a slice, give it a buffer of its own. This must be done
+   before changing a string in place. */
+void lily_string_unshare(lily_string_val *);
 
 void lily_deref(lily_value *);
 void lily_value_assign(lily_value *, lily_value *);
@@ -18,6 +72,6 @@ void lily_value_take(lily_state *, lily_value *);
 int lily_value_compare(lily_state *, lily_value *, lily_value *);
 lily_value *lily_value_copy(lily_value *);
 lily_value *lily_stack_take(lily_state *);
-void lily_stack_push_and_destroy(lily_state *, lily_value *);
+void lily_gc_barrier(lily_state *, lily_value *);
 
 #endif
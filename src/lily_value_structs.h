@@ -83,11 +83,25 @@ typedef struct lily_value_ {
     lily_raw_value value;
 } lily_value;
 
-/* This is a string. It's pretty simple. These are refcounted. */
+/* This is a string. These are refcounted.
+   A string made by slicing another can share the buffer of that other string.
+   If so, 'parent' holds a ref to the string that owns the buffer, and 'string'
+   points into it. A slice's 'string' is 'size' bytes long, but may not end
+   with a \0. The raw accessors (lily_string_raw and friends) copy the slice out
+   when a \0 is needed. Anything else must go by 'size'. */
 typedef struct lily_string_val_ {
     uint32_t refcount;
     uint32_t size;
     char *string;
+    struct lily_string_val_ *parent;
+    /* The hash used by Hash, or 0 if it hasn't been computed yet. Strings are
+       not changed after they're made. Anything that does change one in place
+       must set this back to 0. */
+    uint64_t hash;
+    /* How many bytes 'string' has room for (not counting the \0). This is only
+       more than 'size' if the vm has appended to the string in place. */
+    uint32_t capacity;
+    uint32_t pad;
 } lily_string_val;
 
 /* Internally, ByteString values are represented by strings. This exists apart
@@ -97,6 +111,10 @@ typedef struct lily_bytestring_val_ {
     uint32_t refcount;
     uint32_t size;
     char *string;
+    struct lily_string_val_ *parent;
+    uint64_t hash;
+    uint32_t capacity;
+    uint32_t pad;
 } lily_bytestring_val;
 
 /* This serves List, Tuple, Dynamic, class instances, and variants. All they
@@ -105,27 +123,45 @@ typedef struct lily_bytestring_val_ {
 typedef struct lily_container_val_ {
     uint32_t refcount;
     uint16_t class_id;
-    uint16_t instance_ctor_need;
+    union {
+        uint16_t instance_ctor_need;
+        /* List: If this isn't 0, the values are packed (unboxed), and this is
+           the class id that all of them have. */
+        uint16_t packed_id;
+    };
     uint32_t num_values;
     uint32_t extra_space;
-    struct lily_value_ **values;
+    struct lily_value_ *values;
     struct lily_gc_entry_ *gc_entry;
 } lily_container_val;
 
+/* Hash entries are kept in insertion order. A removed entry is left as a hole
+   (key flags of 0) until the hash is rebuilt. */
 typedef struct lily_hash_entry_ {
     uint64_t hash;
-    lily_raw_value raw_key;
-    lily_value *boxed_key;
-    lily_value *record;
-    struct lily_hash_entry_ *next;
+    lily_value key;
+    lily_value record;
 } lily_hash_entry;
 
+/* A slot refers to an entry by index + 1 (0 is an empty slot). A folded copy of
+   the entry's hash is kept here to avoid touching entries while probing. */
+typedef struct lily_hash_slot_ {
+    uint32_t entry;
+    uint32_t hash;
+} lily_hash_slot;
+
 typedef struct lily_hash_val_ {
     uint32_t refcount;
     uint32_t iter_count;
-    int num_bins;
+    /* How many keys are in the hash. */
     int num_entries;
-    lily_hash_entry **bins;
+    /* How many entries have been used, including holes. */
+    int entries_used;
+    int entries_size;
+    uint32_t slot_mask;
+    uint32_t slot_bits;
+    lily_hash_slot *slots;
+    lily_hash_entry *entries;
 } lily_hash_val;
 
 typedef struct lily_file_val_ {
@@ -133,8 +169,15 @@ typedef struct lily_file_val_ {
     uint8_t read_ok;
     uint8_t write_ok;
     uint8_t is_builtin;
-    uint8_t pad1;
-    uint32_t pad2;
+    /* If 1, lines are read ahead in large blocks (only for regular files). */
+    uint8_t read_ahead;
+    /* File.read_line and File.each_line read through this buffer. The bytes
+       from read_pos to read_end were taken from inner_file, but haven't been
+       handed out yet. */
+    uint32_t read_pos;
+    uint32_t read_end;
+    uint32_t read_size;
+    char *read_buffer;
     FILE *inner_file;
 } lily_file_val;
 
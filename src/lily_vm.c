@@ -1,6 +1,7 @@
 #include <stdarg.h>
 #include <stddef.h>
 #include <string.h>
+#include <time.h>
 
 #include "lily.h"
 
@@ -14,6 +15,7 @@
 #include "lily_int_opcode.h"
 
 extern lily_gc_entry *lily_gc_stopper;
+extern void lily_destroy_hash(lily_value *);
 /* This isn't included in a header file because only vm should use this. */
 void lily_value_destroy(lily_value *);
 /* Same here: Safely escape string values for `KeyError`. */
@@ -30,6 +32,26 @@ static uint16_t foreign_code[1] = {o_vm_exit};
 #define SAVE_LINE(to_add) \
 current_frame->code = code + to_add
 
+/* These are the states of vm->gc_state. */
+/* Builds with WITH_OPCODE_STATS count each opcode that runs (and the opcode
+   that ran before it), as well as each call. The previous opcode is kept in
+   'last_op' of lily_vm_execute. See lily_vm_stats.c. */
+#ifdef LILY_OPCODE_STATS
+# define COUNT_OPCODE \
+    vm->op_counts[code[0]]++; \
+    vm->pair_counts[last_op * (o_vm_exit + 1) + code[0]]++; \
+    last_op = code[0];
+# define COUNT_CALL(f) (f)->proto->call_count++
+#else
+# define COUNT_OPCODE
+# define COUNT_CALL(f)
+#endif
+
+#define GC_IDLE     0
+#define GC_MARKING  1
+#define GC_SWEEPING 2
+#define GC_FREEING  3
+
 /***
  *      ____       _
  *     / ___|  ___| |_ _   _ _ __
@@ -42,21 +64,19 @@ current_frame->code = code + to_add
 static void add_call_frame(lily_vm_state *);
 static void invoke_gc(lily_vm_state *);
 
-lily_vm_state *lily_new_vm_state(lily_raiser *raiser)
+lily_vm_state *lily_new_vm_state(lily_raiser *raiser, lily_arena *arena)
 {
     lily_vm_catch_entry *catch_entry = lily_malloc(sizeof(*catch_entry));
     catch_entry->prev = NULL;
     catch_entry->next = NULL;
 
     int i, count = 16;
-    lily_value **register_base = lily_malloc(count * sizeof(*register_base));
+    lily_value *register_base = lily_malloc(count * sizeof(*register_base));
 
-    for (i = 0;i < count;i++) {
-        register_base[i] = lily_malloc(sizeof(*register_base[i]));
-        register_base[i]->flags = 0;
-    }
+    for (i = 0;i < count;i++)
+        register_base[i].flags = 0;
 
-    lily_value **register_end = register_base + count;
+    lily_value *register_end = register_base + count;
 
     /* Globals are stored in this frame so they outlive __main__. This allows
        direct calls from outside the interpreter. */
@@ -78,7 +98,7 @@ lily_vm_state *lily_new_vm_state(lily_raiser *raiser)
     first_frame->register_end = register_end;
     first_frame->code = NULL;
     first_frame->function = NULL;
-    first_frame->return_target = register_base[0];
+    first_frame->return_target = register_base;
     first_frame->prev = toplevel_frame;
     first_frame->next = NULL;
 
@@ -86,12 +106,19 @@ lily_vm_state *lily_new_vm_state(lily_raiser *raiser)
 
     vm->call_depth = 0;
     vm->depth_max = 100;
+    vm->sample_depth = 0;
     vm->raiser = raiser;
     vm->regs_from_main = NULL;
     vm->gc_live_entries = NULL;
     vm->gc_spare_entries = NULL;
     vm->gc_live_entry_count = 0;
     vm->gc_pass = 0;
+    vm->gc_state = GC_IDLE;
+    vm->gc_sweep_entries = NULL;
+    vm->gc_hollow_entries = NULL;
+    vm->gc_gray = NULL;
+    vm->gc_gray_pos = 0;
+    vm->gc_gray_size = 0;
     vm->catch_chain = NULL;
     vm->readonly_table = NULL;
     vm->readonly_count = 0;
@@ -105,6 +132,28 @@ lily_vm_state *lily_new_vm_state(lily_raiser *raiser)
     vm->call_chain = toplevel_frame;
     vm->regs_from_main = register_base;
     vm->vm_buffer = lily_new_msgbuf(64);
+    vm->out_buffer = NULL;
+    vm->out_limit = 0;
+    vm->error_buffer = NULL;
+    vm->arena = arena;
+    vm->scope_values = NULL;
+    vm->scope_count = 0;
+    vm->scope_size = 0;
+    vm->pool = lily_new_slab_pool(arena);
+    vm->interned_strings = lily_new_hash_raw(vm->pool, vm->arena, 0);
+
+    memset(vm->gc_pause_counts, 0, sizeof(vm->gc_pause_counts));
+
+#ifdef LILY_OPCODE_STATS
+    int op_count = o_vm_exit + 1;
+
+    vm->op_counts = lily_malloc(op_count * sizeof(*vm->op_counts));
+    vm->pair_counts = lily_malloc(op_count * op_count *
+            sizeof(*vm->pair_counts));
+    memset(vm->op_counts, 0, op_count * sizeof(*vm->op_counts));
+    memset(vm->pair_counts, 0, op_count * op_count *
+            sizeof(*vm->pair_counts));
+#endif
 
     return vm;
 }
@@ -117,7 +166,7 @@ static void destroy_gc_entries(lily_vm_state *vm)
     while (gc_iter != NULL) {
         gc_temp = gc_iter->next;
 
-        lily_free(gc_iter);
+        lily_slab_free(gc_iter);
 
         gc_iter = gc_temp;
     }
@@ -126,17 +175,15 @@ static void destroy_gc_entries(lily_vm_state *vm)
     while (gc_iter != NULL) {
         gc_temp = gc_iter->next;
 
-        lily_free(gc_iter);
+        lily_slab_free(gc_iter);
 
         gc_iter = gc_temp;
     }
 }
 
-void lily_free_vm(lily_vm_state *vm)
+/* Free everything the vm has that isn't a value, and the vm itself. */
+static void free_vm_parts(lily_vm_state *vm)
 {
-    lily_value **regs_from_main = vm->regs_from_main;
-    lily_value *reg;
-    int i;
     if (vm->catch_chain != NULL) {
         while (vm->catch_chain->prev)
             vm->catch_chain = vm->catch_chain->prev;
@@ -150,22 +197,7 @@ void lily_free_vm(lily_vm_state *vm)
         }
     }
 
-    /* If there are any entries left over, then do a final gc pass that will
-       destroy the tagged values. */
-    if (vm->gc_live_entry_count)
-        invoke_gc(vm);
-
-    int total = vm->call_chain->register_end - regs_from_main - 1;
-
-    for (i = total;i >= 0;i--) {
-        reg = regs_from_main[i];
-
-        lily_deref(reg);
-
-        lily_free(reg);
-    }
-
-    lily_free(regs_from_main);
+    lily_free(vm->regs_from_main);
 
     lily_call_frame *frame_iter = vm->call_chain;
     lily_call_frame *frame_next;
@@ -179,13 +211,56 @@ void lily_free_vm(lily_vm_state *vm)
         frame_iter = frame_next;
     }
 
-    destroy_gc_entries(vm);
+#ifdef LILY_OPCODE_STATS
+    lily_free(vm->pair_counts);
+    lily_free(vm->op_counts);
+#endif
 
+    lily_free(vm->gc_gray);
+    lily_free(vm->scope_values);
     lily_free(vm->class_table);
     lily_free_msgbuf(vm->vm_buffer);
+
+    if (vm->out_buffer)
+        lily_free_msgbuf(vm->out_buffer);
+
+    if (vm->error_buffer)
+        lily_free_msgbuf(vm->error_buffer);
+
     lily_free(vm);
 }
 
+void lily_free_vm(lily_vm_state *vm)
+{
+    lily_value *regs_from_main = vm->regs_from_main;
+    int i;
+    int total = vm->call_chain->register_end - regs_from_main - 1;
+
+    /* Clear the registers first. Otherwise, the final gc pass would think that
+       values held by globals are still alive, and cycles among them would
+       never be destroyed. */
+    for (i = total;i >= 0;i--) {
+        lily_deref(regs_from_main + i);
+        regs_from_main[i].flags = 0;
+    }
+
+    /* If there are any entries left over, then do a final gc pass that will
+       destroy the tagged values. */
+    if (vm->gc_live_entry_count || vm->gc_state != GC_IDLE)
+        invoke_gc(vm);
+
+    destroy_gc_entries(vm);
+
+    /* Literals in here aren't refcounted, so this only drops Strings that
+       String.intern added. */
+    lily_value interned_strings;
+    interned_strings.flags = LILY_ID_HASH;
+    interned_strings.value.hash = vm->interned_strings;
+    lily_destroy_hash(&interned_strings);
+
+    free_vm_parts(vm);
+}
+
 /***
  *       ____    ____
  *      / ___|  / ___|
@@ -195,221 +270,429 @@ void lily_free_vm(lily_vm_state *vm)
  *
  */
 
-static void gc_mark(int, lily_value *);
-
-/* This is Lily's garbage collector. It runs in multiple stages:
-   1: Go to each _in-use_ register that is not nil and use the appropriate
-      gc_marker call to mark all values inside that value which are visible.
-      Visible items are set to the vm's ->gc_pass.
-   2: Go through all the gc items now. Anything which doesn't have the current
-      pass as its last_pass is considered unreachable. This will deref values
-      that cannot be circular, or forcibly collect possibly-circular values.
-      Caveats:
-      * Some gc_entries may have their value set to 0/NULL. This happens when
-        a possibly-circular value has been deleted through typical ref/deref
-        means.
-      * lily_value_destroy will collect everything inside a non-circular value,
-        but not the value itself. It will set last_pass to -1 when it does that.
-        This is necessary because it's possible that a value may be visited
-        multiple times. If it's deleted during this step, then extra visits will
-        trigger invalid reads.
-   3: Stage 1 skipped registers that are not in-use, because Lily just hasn't
-      gotten around to clearing them yet. However, some of those registers may
-      contain a value that has a gc_entry that indicates that the value is to be
-      destroyed. It's -very- important that these registers be marked as nil so
-      that prep_registers will not try to deref a value that has been destroyed
-      by the gc.
-   4: Finally, destroy any values that stage 2 didn't clear.
-      Absolutely nothing is using these now, so it's safe to destroy them. */
-static void invoke_gc(lily_vm_state *vm)
+/** Lily's garbage collector is an incremental mark-and-sweep collector. Values
+    that might be circular are tagged with a gc_entry when they are made. Once
+    there are enough live entries, a collection starts. Each time that a value
+    is tagged during a collection, the collection does a little more work. No
+    single step takes too long, so the interpreter isn't paused for the length
+    of the whole collection.
+
+    Marking colors entries by their last_pass:
+    * White: last_pass is not the current pass. Not known to be reachable yet.
+    * Gray: last_pass is the current pass, and the entry is on the gray stack.
+      The values inside of it have not been visited yet.
+    * Black: last_pass is the current pass, and the entry is not on the stack.
+
+    Values made during marking start off gray, so that they are scanned before
+    marking is done. Since the interpreter keeps running between steps, a black
+    value can be given a white value that nothing else holds. To keep that white
+    value from being swept, anything that stores a value inside of another value
+    must call lily_gc_barrier. While this vm is marking, the barrier makes the
+    stored value gray. Other vms are not affected.
+
+    Registers aren't covered by the barrier. Once the gray stack is empty, they
+    are marked again, and that is the only part of marking done all at once. If
+    that finds anything new, marking keeps going in steps. Marking is done when
+    the gray stack is empty right after registers are marked. Whatever is still
+    white at that point is unreachable.
+
+    Sweeping is also done in steps. The live entries are moved to a separate
+    list, and new entries go onto a fresh live list. Each unreachable value is
+    hollowed out. A hollowed value's gc_entry is set to lily_gc_stopper, so that
+    destroying it again (through another hollowed value or a dead register)
+    does nothing. Once every entry has been visited, dead registers holding a
+    hollowed value are cleared. Only then can the hollowed values be freed.
+
+    Destroying a value through ref/deref leaves the entry's value as NULL, and
+    the entry in place. Those entries are skipped when scanning, and recycled
+    by sweeping. **/
+
+/* How many entries each step of a collection gets through. */
+#define GC_STEP_SIZE 128
+
+/* The profiler's signal handler can interrupt the vm anywhere, and reads up to
+   the sample depth. A push fences before the new depth is stored, so the frame
+   is filled in first. A pop fences after, so the frame isn't reused until the
+   handler can't see it. Signal fences only stop the compiler from moving
+   writes, and don't emit any instructions. */
+#ifdef _MSC_VER
+# include <intrin.h>
+# define SAMPLE_FENCE() _ReadWriteBarrier()
+#else
+# define SAMPLE_FENCE() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+#endif
+
+#define SAMPLE_PUSH(vm) \
+    do { \
+        SAMPLE_FENCE(); \
+        (vm)->sample_depth++; \
+    } while (0)
+
+#define SAMPLE_POP(vm) \
+    do { \
+        (vm)->sample_depth--; \
+        SAMPLE_FENCE(); \
+    } while (0)
+
+static void gc_shade(lily_vm_state *, lily_value *);
+
+static void dynamic_marker(lily_vm_state *vm, lily_value *v)
 {
-    /* This is (sort of) a mark-and-sweep garbage collector. This is called when
-       a certain number of allocations have been done. Take note that values
-       can be destroyed by deref. However, those values will have the gc_entry's
-       value set to NULL as an indicator. */
-    vm->gc_pass++;
+    lily_container_val *c = lily_as_container(v);
+    lily_value *inner_value = lily_con_get(c, 0);
+
+    if (inner_value->flags & VAL_IS_GC_SWEEPABLE)
+        gc_shade(vm, inner_value);
+}
+
+static void list_marker(lily_vm_state *vm, lily_value *v)
+{
+    lily_container_val *list_val = v->value.container;
+    int i;
 
-    lily_value **regs_from_main = vm->regs_from_main;
-    int pass = vm->gc_pass;
+    /* Packed values can't hold anything the gc needs to see. */
+    if (LILY_LIST_IS_PACKED(list_val))
+        return;
+
+    for (i = 0;i < list_val->num_values;i++) {
+        lily_value *elem = list_val->values + i;
+
+        if (elem->flags & VAL_IS_GC_SWEEPABLE)
+            gc_shade(vm, elem);
+    }
+}
+
+static void hash_marker(lily_vm_state *vm, lily_value *v)
+{
+    lily_hash_val *hv = v->value.hash;
+    int i;
+
+    for (i = 0;i < hv->entries_used;i++) {
+        lily_value *record = &hv->entries[i].record;
+
+        if (record->flags & VAL_IS_GC_SWEEPABLE)
+            gc_shade(vm, record);
+    }
+}
+
+static void function_marker(lily_vm_state *vm, lily_value *v)
+{
+    lily_function_val *function_val = v->value.function;
+
+    lily_value **upvalues = function_val->upvalues;
+    int count = function_val->num_upvalues;
+    int i;
+
+    for (i = 0;i < count;i++) {
+        lily_value *up = upvalues[i];
+        if (up && (up->flags & VAL_IS_GC_SWEEPABLE))
+            gc_shade(vm, up);
+    }
+}
+
+/* Visit the values inside of 'v', shading any that are sweepable. */
+static void gc_scan(lily_vm_state *vm, lily_value *v)
+{
+    int class_id = v->class_id;
+    if (class_id == LILY_ID_LIST ||
+        class_id == LILY_ID_TUPLE ||
+        v->flags & (VAL_IS_ENUM | VAL_IS_INSTANCE))
+        list_marker(vm, v);
+    else if (class_id == LILY_ID_HASH)
+        hash_marker(vm, v);
+    else if (class_id == LILY_ID_DYNAMIC)
+        dynamic_marker(vm, v);
+    else if (class_id == LILY_ID_FUNCTION)
+        function_marker(vm, v);
+}
+
+static void gc_push_gray(lily_vm_state *vm, lily_gc_entry *entry)
+{
+    if (vm->gc_gray_pos == vm->gc_gray_size) {
+        uint32_t new_size = vm->gc_gray_size * 2;
+
+        if (new_size == 0)
+            new_size = 64;
+
+        vm->gc_gray = lily_realloc(vm->gc_gray,
+                new_size * sizeof(*vm->gc_gray));
+        vm->gc_gray_size = new_size;
+    }
+
+    vm->gc_gray[vm->gc_gray_pos] = entry;
+    vm->gc_gray_pos++;
+}
+
+/* Make a sweepable value reachable for the current pass. Tagged values become
+   gray. Untagged values are scanned right away, since they don't have an entry
+   to hold onto. */
+static void gc_shade(lily_vm_state *vm, lily_value *v)
+{
+    if (v->flags & VAL_IS_GC_TAGGED) {
+        lily_gc_entry *e = v->value.gc_generic->gc_entry;
+
+        if (e->last_pass != (int32_t)vm->gc_pass) {
+            e->last_pass = vm->gc_pass;
+            gc_push_gray(vm, e);
+        }
+    }
+    else
+        gc_scan(vm, v);
+}
+
+/* This must be called when a sweepable value is stored anywhere except for a
+   register. Without it, the gc may miss the value if it is stored into another
+   value that has already been marked. This does nothing unless 'vm' is
+   marking. */
+void lily_gc_barrier(lily_vm_state *vm, lily_value *v)
+{
+    if (vm->gc_state != GC_MARKING)
+        return;
+
+    gc_shade(vm, v);
+}
+
+static void gc_mark_registers(lily_vm_state *vm)
+{
+    lily_value *regs_from_main = vm->regs_from_main;
+    int total = vm->call_chain->register_end - regs_from_main;
     int i;
-    lily_gc_entry *gc_iter;
-    int total = vm->call_chain->register_end - vm->regs_from_main;
 
-    /* Stage 1: Go through all registers and use the appropriate gc_marker call
-                that will mark every inner value that's visible. */
     for (i = 0;i < total;i++) {
-        lily_value *reg = regs_from_main[i];
+        lily_value *reg = regs_from_main + i;
         if (reg->flags & VAL_IS_GC_SWEEPABLE)
-            gc_mark(pass, reg);
-    }
-
-    /* Stage 2: Start destroying everything that wasn't marked as visible.
-                Don't forget to check ->value for NULL in case the value was
-                destroyed through normal ref/deref means. */
-    for (gc_iter = vm->gc_live_entries;
-         gc_iter;
-         gc_iter = gc_iter->next) {
-        if (gc_iter->last_pass != pass &&
-            gc_iter->value.generic != NULL) {
-            /* This tells value destroy to just hollow the value since it may be
-               visited multiple times. */
-            gc_iter->last_pass = -1;
-            lily_value_destroy((lily_value *)gc_iter);
+            gc_shade(vm, reg);
+    }
+}
+
+/* Scan up to 'count' entries from the gray stack. When the stack runs out,
+   registers are marked again, since the barrier doesn't cover them. Marking is
+   done if that doesn't find anything new. Returns 1 if marking is done. */
+static int gc_mark(lily_vm_state *vm, uint32_t count)
+{
+    while (1) {
+        while (vm->gc_gray_pos && count) {
+            vm->gc_gray_pos--;
+
+            lily_gc_entry *e = vm->gc_gray[vm->gc_gray_pos];
+
+            if (e->value.generic != NULL)
+                gc_scan(vm, (lily_value *)e);
+
+            count--;
         }
+
+        if (vm->gc_gray_pos)
+            return 0;
+
+        gc_mark_registers(vm);
+
+        if (vm->gc_gray_pos == 0)
+            return 1;
+
+        if (count == 0)
+            return 0;
     }
+}
+
+static void gc_begin(lily_vm_state *vm)
+{
+    vm->gc_pass++;
+    vm->gc_state = GC_MARKING;
+    gc_mark_registers(vm);
+}
+
+/* Everything reachable has been found once this is called. The live entries
+   are handed over to sweeping. */
+static void gc_finish_marking(lily_vm_state *vm)
+{
+    vm->gc_sweep_entries = vm->gc_live_entries;
+    vm->gc_live_entries = NULL;
+    vm->gc_state = GC_SWEEPING;
+}
 
-    int current_top = vm->call_chain->top - vm->regs_from_main;
+/* Marking skipped registers that are not in-use, because Lily just hasn't
+   gotten around to clearing them yet. However, some of those registers may
+   contain a value that has been hollowed by sweeping. It's -very- important
+   that these registers be marked as nil so that prep_registers will not try to
+   deref a value after it has been freed. */
+static void gc_clear_dead_registers(lily_vm_state *vm)
+{
+    lily_value *regs_from_main = vm->regs_from_main;
+    int total = vm->call_chain->register_end - regs_from_main;
+    int current_top = vm->call_chain->top - regs_from_main;
+    int i;
 
-    /* Stage 3: Check registers not currently in use to see if they hold a
-                value that's going to be collected. If so, then mark the
-                register as nil so that the value will be cleared later. */
     for (i = total;i < current_top;i++) {
-        lily_value *reg = regs_from_main[i];
+        lily_value *reg = regs_from_main + i;
         if (reg->flags & VAL_IS_GC_TAGGED &&
             reg->value.gc_generic->gc_entry == lily_gc_stopper) {
             reg->flags = 0;
         }
     }
+}
 
-    /* Stage 4: Delete the values that stage 2 didn't delete.
-                Nothing is using them anymore. Also, sort entries into those
-                that are living and those that are no longer used. */
-    i = 0;
-    lily_gc_entry *new_live_entries = NULL;
-    lily_gc_entry *new_spare_entries = vm->gc_spare_entries;
-    lily_gc_entry *iter_next = NULL;
-    gc_iter = vm->gc_live_entries;
+/* Visit up to 'count' entries that marking handed over. Reachable entries go
+   back onto the live list. Entries whose value was destroyed through deref are
+   recycled. Anything else is unreachable, and its value is hollowed.
+   Hollowing a value will deref values inside of it. This will destroy values
+   that cannot be circular, or hollowed values (which does nothing). Setting
+   last_pass to -1 is what tells value destroy to hollow instead of freeing. */
+static void gc_sweep(lily_vm_state *vm, uint32_t count)
+{
+    int32_t pass = vm->gc_pass;
 
-    while (gc_iter) {
-        iter_next = gc_iter->next;
+    while (vm->gc_sweep_entries && count) {
+        lily_gc_entry *e = vm->gc_sweep_entries;
 
-        if (gc_iter->last_pass == -1) {
-            lily_free(gc_iter->value.generic);
+        vm->gc_sweep_entries = e->next;
+        count--;
 
-            gc_iter->next = new_spare_entries;
-            new_spare_entries = gc_iter;
+        if (e->last_pass == pass) {
+            e->next = vm->gc_live_entries;
+            vm->gc_live_entries = e;
+            continue;
         }
-        else {
-            i++;
-            gc_iter->next = new_live_entries;
-            new_live_entries = gc_iter;
+
+        vm->gc_live_entry_count--;
+
+        if (e->value.generic == NULL) {
+            e->next = vm->gc_spare_entries;
+            vm->gc_spare_entries = e;
+            continue;
         }
 
-        gc_iter = iter_next;
-    }
+        e->last_pass = -1;
+        lily_value_destroy((lily_value *)e);
 
-    /* Did the sweep reclaim enough objects? If not, then increase the threshold
-       to prevent spamming sweeps when everything is alive. */
-    if (vm->gc_threshold <= i)
-        vm->gc_threshold *= vm->gc_multiplier;
+        e->next = vm->gc_hollow_entries;
+        vm->gc_hollow_entries = e;
+    }
 
-    vm->gc_live_entry_count = i;
-    vm->gc_live_entries = new_live_entries;
-    vm->gc_spare_entries = new_spare_entries;
+    if (vm->gc_sweep_entries == NULL) {
+        gc_clear_dead_registers(vm);
+        vm->gc_state = GC_FREEING;
+    }
 }
 
-static void dynamic_marker(int pass, lily_value *v)
+/* Free up to 'count' hollowed values. Nothing is using them anymore, so it's
+   safe to free them. */
+static void gc_free_hollow(lily_vm_state *vm, uint32_t count)
 {
-    if (v->flags & VAL_IS_GC_TAGGED) {
-        lily_gc_entry *e = v->value.container->gc_entry;
-        if (e->last_pass == pass)
-            return;
+    while (vm->gc_hollow_entries && count) {
+        lily_gc_entry *e = vm->gc_hollow_entries;
+
+        vm->gc_hollow_entries = e->next;
+        count--;
 
-        e->last_pass = pass;
+        lily_slab_free(e->value.generic);
+
+        e->next = vm->gc_spare_entries;
+        vm->gc_spare_entries = e;
     }
 
-    lily_container_val *c = lily_as_container(v);
-    lily_value *inner_value = lily_con_get(c, 0);
+    if (vm->gc_hollow_entries)
+        return;
 
-    if (inner_value->flags & VAL_IS_GC_SWEEPABLE)
-        gc_mark(pass, inner_value);
+    /* Did the sweep reclaim enough objects? If not, then increase the threshold
+       to prevent spamming sweeps when everything is alive. */
+    if (vm->gc_threshold <= vm->gc_live_entry_count)
+        vm->gc_threshold *= vm->gc_multiplier;
+
+    vm->gc_state = GC_IDLE;
 }
 
-static void list_marker(int pass, lily_value *v)
+/* Do up to 'count' entries worth of work on the current collection, starting
+   one if there isn't one already. */
+static void gc_run(lily_vm_state *vm, uint32_t count)
 {
-    if (v->flags & VAL_IS_GC_TAGGED) {
-        /* Only instances/enums that pass through here are tagged. */
-        lily_gc_entry *e = v->value.container->gc_entry;
-        if (e->last_pass == pass)
-            return;
-
-        e->last_pass = pass;
-    }
-
-    lily_container_val *list_val = v->value.container;
-    int i;
+    switch (vm->gc_state) {
+        case GC_IDLE:
+            gc_begin(vm);
+            /* fallthrough */
+        case GC_MARKING:
+            if (gc_mark(vm, count) == 0)
+                break;
 
-    for (i = 0;i < list_val->num_values;i++) {
-        lily_value *elem = list_val->values[i];
+            gc_finish_marking(vm);
+            /* fallthrough */
+        case GC_SWEEPING:
+            gc_sweep(vm, count);
 
-        if (elem->flags & VAL_IS_GC_SWEEPABLE)
-            gc_mark(pass, elem);
+            if (vm->gc_state == GC_SWEEPING)
+                break;
+            /* fallthrough */
+        case GC_FREEING:
+            gc_free_hollow(vm, count);
+            break;
     }
 }
 
-static void hash_marker(int pass, lily_value *v)
+static uint64_t gc_clock_us(void)
 {
-    lily_hash_val *hv = v->value.hash;
-    int i;
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+#else
+    return (uint64_t)clock() * 1000000 / CLOCKS_PER_SEC;
+#endif
+}
 
-    for (i = 0;i < hv->num_bins;i++) {
-        lily_hash_entry *entry = hv->bins[i];
-        if (entry)
-            gc_mark(pass, entry->record);
+/* Bucket 0 holds pauses under 1us. Bucket n holds pauses from 2^(n-1)us to
+   under 2^n us. The last bucket also takes anything longer. */
+static void gc_record_pause(lily_vm_state *vm, uint64_t start)
+{
+    uint64_t elapsed = gc_clock_us() - start;
+    int bucket = 0;
+
+    while (elapsed && bucket < LILY_GC_PAUSE_BUCKETS - 1) {
+        elapsed >>= 1;
+        bucket++;
     }
+
+    vm->gc_pause_counts[bucket]++;
 }
 
-static void function_marker(int pass, lily_value *v)
+static void gc_step(lily_vm_state *vm)
 {
-    if (v->flags & VAL_IS_GC_TAGGED) {
-        lily_gc_entry *e = v->value.function->gc_entry;
-        if (e->last_pass == pass)
-            return;
+    uint64_t start = gc_clock_us();
 
-        e->last_pass = pass;
-    }
+    gc_run(vm, GC_STEP_SIZE);
+    gc_record_pause(vm, start);
+}
 
-    lily_function_val *function_val = v->value.function;
+/* Run a full collection all at once. A collection that is already running is
+   finished first, since it started from older roots. */
+static void invoke_gc(lily_vm_state *vm)
+{
+    uint64_t start = gc_clock_us();
 
-    lily_value **upvalues = function_val->upvalues;
-    int count = function_val->num_upvalues;
-    int i;
+    if (vm->gc_state != GC_IDLE)
+        gc_run(vm, UINT32_MAX);
 
-    for (i = 0;i < count;i++) {
-        lily_value *up = upvalues[i];
-        if (up && (up->flags & VAL_IS_GC_SWEEPABLE))
-            gc_mark(pass, up);
-    }
+    gc_run(vm, UINT32_MAX);
+    gc_record_pause(vm, start);
 }
 
-static void gc_mark(int pass, lily_value *v)
+void lily_gc_pause_histogram(lily_vm_state *vm, uint64_t *buckets)
 {
-    if (v->flags & (VAL_IS_GC_TAGGED | VAL_IS_GC_SPECULATIVE)) {
-        int class_id = v->class_id;
-        if (class_id == LILY_ID_LIST ||
-            class_id == LILY_ID_TUPLE ||
-            v->flags & (VAL_IS_ENUM | VAL_IS_INSTANCE))
-            list_marker(pass, v);
-        else if (class_id == LILY_ID_HASH)
-            hash_marker(pass, v);
-        else if (class_id == LILY_ID_DYNAMIC)
-            dynamic_marker(pass, v);
-        else if (class_id == LILY_ID_FUNCTION)
-            function_marker(pass, v);
-    }
+    memcpy(buckets, vm->gc_pause_counts, sizeof(vm->gc_pause_counts));
 }
 
 /* This will attempt to grab a spare entry and associate it with the value
    given. If there are no spare entries, then a new entry is made. These entries
    are how the gc is able to locate values later.
 
-   If the number of living gc objects is at or past the threshold, then the
-   collector will run BEFORE the association. This is intentional, as 'value' is
-   not guaranteed to be in a register. */
+   If the number of living gc objects is at or past the threshold, or if a
+   collection is in progress, then the collector will run a step BEFORE the
+   association. This is intentional, as 'value' is not guaranteed to be in a
+   register. */
 void lily_value_tag(lily_vm_state *vm, lily_value *v)
 {
-    if (vm->gc_live_entry_count >= vm->gc_threshold)
-        invoke_gc(vm);
+    if (vm->gc_state != GC_IDLE ||
+        vm->gc_live_entry_count >= vm->gc_threshold)
+        gc_step(vm);
 
     lily_gc_entry *new_entry;
     if (vm->gc_spare_entries != NULL) {
@@ -417,12 +700,20 @@ void lily_value_tag(lily_vm_state *vm, lily_value *v)
         vm->gc_spare_entries = vm->gc_spare_entries->next;
     }
     else
-        new_entry = lily_malloc(sizeof(*new_entry));
+        new_entry = lily_slab_malloc(vm->pool, sizeof(*new_entry));
 
     new_entry->value.gc_generic = v->value.gc_generic;
     new_entry->last_pass = 0;
     new_entry->flags = v->flags;
 
+    /* New values start gray during marking. If they started white, a program
+       that keeps making values could keep every register rescan busy, and
+       marking would never finish. */
+    if (vm->gc_state == GC_MARKING) {
+        new_entry->last_pass = vm->gc_pass;
+        gc_push_gray(vm, new_entry);
+    }
+
     new_entry->next = vm->gc_live_entries;
     vm->gc_live_entries = new_entry;
 
@@ -449,10 +740,20 @@ void lily_value_tag(lily_vm_state *vm, lily_value *v)
 
 static void vm_error(lily_vm_state *, uint8_t, const char *);
 
+/* Frames hold return targets that are registers of the frame before them. The
+   register block may move when it grows, so those need to move too. Targets
+   outside of the old block (such as those of foreign callers) stay put. */
+#define FIX_RETURN_TARGET(frame) \
+if (frame->return_target >= old_start && \
+    frame->return_target < old_end) \
+    frame->return_target = new_regs + (frame->return_target - old_start);
+
 /* A function has checked and knows it doesn't have enough size left. Ensure
    that there are 'size' more empty spots available. This grows by powers of 2
    so that grows are not frequent.
-   This will also fix the locals and top of all frames currently entered. */
+   Registers are a single block of values, so growing may move all of them. This
+   will fix the locals, top, and return target of all frames. Callers must not
+   hold register pointers across a grow. */
 static void grow_vm_registers(lily_vm_state *vm, int need)
 {
     int size = vm->call_chain->register_end - vm->regs_from_main;
@@ -464,38 +765,39 @@ static void grow_vm_registers(lily_vm_state *vm, int need)
         size *= 2;
     while (size < need);
 
-    lily_value **old_start = vm->regs_from_main;
-    lily_value **new_regs = lily_realloc(vm->regs_from_main, size *
+    lily_value *old_start = vm->regs_from_main;
+    lily_value *old_end = vm->call_chain->register_end;
+    lily_value *new_regs = lily_realloc(vm->regs_from_main, size *
             sizeof(*new_regs));
 
     vm->regs_from_main = new_regs;
 
-    /* Now create the registers as a bunch of empty values, to be filled in
-       whenever they are needed. */
-    for (;i < size;i++) {
-        lily_value *v = lily_malloc(sizeof(*v));
-        v->flags = 0;
+    /* The new registers start out empty, to be filled in whenever they are
+       needed. */
+    for (;i < size;i++)
+        new_regs[i].flags = 0;
 
-        new_regs[i] = v;
-    }
-
-    lily_value **end = vm->regs_from_main + size;
+    lily_value *end = new_regs + size;
     lily_call_frame *frame = vm->call_chain;
 
     while (frame) {
         frame->start = new_regs + (frame->start - old_start);
         frame->top = new_regs + (frame->top - old_start);
         frame->register_end = end;
+        FIX_RETURN_TARGET(frame)
         frame = frame->prev;
     }
 
     frame = vm->call_chain->next;
     while (frame) {
         frame->register_end = end;
+        FIX_RETURN_TARGET(frame)
         frame = frame->next;
     }
 }
 
+#undef FIX_RETURN_TARGET
+
 static void vm_setup_before_call(lily_vm_state *vm, uint16_t *code)
 {
     lily_call_frame *current_frame = vm->call_chain;
@@ -515,21 +817,21 @@ static void vm_setup_before_call(lily_vm_state *vm, uint16_t *code)
     lily_call_frame *next_frame = current_frame->next;
     next_frame->start = current_frame->top;
     next_frame->code = NULL;
-    next_frame->return_target = current_frame->start[code[i + 3]];
+    next_frame->return_target = current_frame->start + code[i + 3];
 }
 
 static void prep_registers(lily_call_frame *frame, uint16_t *code)
 {
     lily_call_frame *next_frame = frame->next;
     int i;
-    lily_value **input_regs = frame->start;
-    lily_value **target_regs = next_frame->start;
+    lily_value *input_regs = frame->start;
+    lily_value *target_regs = next_frame->start;
 
     /* A function's args always come first, so copy arguments over while clearing
        old values. */
     for (i = 0;i < code[2];i++) {
-        lily_value *get_reg = input_regs[code[3+i]];
-        lily_value *set_reg = target_regs[i];
+        lily_value *get_reg = input_regs + code[3+i];
+        lily_value *set_reg = target_regs + i;
 
         if (get_reg->flags & VAL_IS_DEREFABLE)
             get_reg->value.generic->refcount++;
@@ -541,56 +843,71 @@ static void prep_registers(lily_call_frame *frame, uint16_t *code)
     }
 
     for (;i < next_frame->function->reg_count;i++) {
-        lily_value *reg = target_regs[i];
+        lily_value *reg = target_regs + i;
         lily_deref(reg);
 
         reg->flags = 0;
     }
 }
 
-static lily_string_val *new_sv(char *buffer, int size)
+/* Make a string that uses 'buffer' as-is. */
+static lily_string_val *sv_from_buffer(lily_slab_pool *pool, char *buffer,
+        int size)
 {
-    lily_string_val *sv = lily_malloc(sizeof(*sv));
+    lily_string_val *sv = lily_slab_malloc(pool, sizeof(*sv));
     sv->refcount = 1;
     sv->string = buffer;
     sv->size = size;
+    sv->parent = NULL;
+    sv->hash = 0;
+    sv->capacity = size;
     return sv;
 }
 
-lily_bytestring_val *lily_new_bytestring_raw(const char *source, int len)
+/* Make a string holding a copy of 'source', with the buffer from 'arena'. */
+static lily_string_val *new_sv(lily_slab_pool *pool, lily_arena *arena,
+        const char *source, int size)
 {
-    char *buffer = lily_malloc((len + 1) * sizeof(*buffer));
-    memcpy(buffer, source, len);
-    buffer[len] = '\0';
+    char *buffer = lily_arena_malloc(arena, (size + 1) * sizeof(*buffer));
+    memcpy(buffer, source, size);
+    buffer[size] = '\0';
 
-    return (lily_bytestring_val *)new_sv(buffer, len);
+    return sv_from_buffer(pool, buffer, size);
 }
 
-lily_string_val *lily_new_string_raw(const char *source)
+lily_bytestring_val *lily_new_bytestring_raw(lily_slab_pool *pool,
+        const char *source, int len)
 {
-    size_t len = strlen(source);
-    char *buffer = lily_malloc((len + 1) * sizeof(*buffer));
-    strcpy(buffer, source);
+    return (lily_bytestring_val *)new_sv(pool, NULL, source, len);
+}
 
-    return new_sv(buffer, len);
+lily_string_val *lily_new_string_raw(lily_slab_pool *pool, const char *source)
+{
+    return new_sv(pool, NULL, source, strlen(source));
 }
 
-static lily_container_val *new_container(uint16_t class_id, int num_values)
+static lily_container_val *new_container(lily_vm_state *vm, uint16_t class_id,
+        int num_values)
 {
-    lily_container_val *cv = lily_malloc(sizeof(*cv));
-    cv->values = lily_malloc(num_values * sizeof(*cv->values));
+    lily_container_val *cv = lily_slab_malloc(vm->pool, sizeof(*cv));
+
+    if (LILY_POOLED_VALUES(class_id, num_values))
+        cv->values = lily_slab_malloc(vm->pool,
+                num_values * sizeof(*cv->values));
+    else
+        cv->values = lily_arena_malloc(vm->arena,
+                num_values * sizeof(*cv->values));
+
     cv->refcount = 1;
     cv->num_values = num_values;
     cv->extra_space = 0;
     cv->class_id = class_id;
+    cv->packed_id = 0;
     cv->gc_entry = NULL;
 
     int i;
-    for (i = 0;i < num_values;i++) {
-        lily_value *elem = lily_malloc(sizeof(*elem));
-        elem->flags = 0;
-        cv->values[i] = elem;
-    }
+    for (i = 0;i < num_values;i++)
+        cv->values[i].flags = 0;
 
     return cv;
 }
@@ -682,7 +999,7 @@ if (frame->top == frame->register_end) { \
     grow_vm_registers(s, 1); \
 } \
  \
-lily_value *target = *frame->top; \
+lily_value *target = frame->top; \
 if (target->flags & VAL_IS_DEREFABLE) \
     lily_deref(target); \
  \
@@ -694,7 +1011,7 @@ target->value.field = push_value
 
 #define PUSH_CONTAINER(id, container_flags, size) \
 PUSH_PREAMBLE \
-lily_container_val *c = new_container(id, size); \
+lily_container_val *c = new_container(s, id, size); \
 SET_TARGET(id | VAL_IS_DEREFABLE | VAL_IS_CONTAINER | container_flags, container, c); \
 return c
 
@@ -707,11 +1024,7 @@ void lily_push_boolean(lily_state *s, int v)
 void lily_push_bytestring(lily_state *s, const char *source, int len)
 {
     PUSH_PREAMBLE
-    char *buffer = lily_malloc((len + 1) * sizeof(*buffer));
-    memcpy(buffer, source, len);
-    buffer[len] = '\0';
-
-    lily_string_val *sv = new_sv(buffer, len);
+    lily_string_val *sv = new_sv(s->pool, s->arena, source, len);
 
     SET_TARGET(LILY_ID_BYTESTRING | VAL_IS_DEREFABLE, string, sv);
 }
@@ -739,6 +1052,24 @@ void lily_push_empty_variant(lily_state *s, uint16_t id)
     SET_TARGET(id | VAL_IS_ENUM, container, NULL);
 }
 
+/* A scope doesn't destroy values one by one when it closes, so it keeps a ref
+   to values that need more than their memory given back. */
+static void scope_keep(lily_vm_state *vm, lily_value *v, uint32_t refcount)
+{
+    if (vm->scope_count == vm->scope_size) {
+        vm->scope_size = vm->scope_size ? vm->scope_size * 2 : 8;
+        vm->scope_values = lily_realloc(vm->scope_values,
+                vm->scope_size * sizeof(*vm->scope_values));
+    }
+
+    lily_value *keep = vm->scope_values + vm->scope_count;
+
+    keep->flags = v->flags;
+    keep->cell_refcount = refcount;
+    keep->value = v->value;
+    vm->scope_count++;
+}
+
 void lily_push_file(lily_state *s, FILE *inner_file, const char *mode)
 {
     PUSH_PREAMBLE
@@ -751,8 +1082,18 @@ void lily_push_file(lily_state *s, FILE *inner_file, const char *mode)
     filev->read_ok = (*mode == 'r' || plus);
     filev->write_ok = (*mode == 'w' || plus);
     filev->is_builtin = 0;
+    filev->read_ahead = 0;
+    filev->read_pos = 0;
+    filev->read_end = 0;
+    filev->read_size = 0;
+    filev->read_buffer = NULL;
 
     SET_TARGET(LILY_ID_FILE | VAL_IS_DEREFABLE, file, filev);
+
+    if (s->arena) {
+        filev->refcount++;
+        scope_keep(s, target, 0);
+    }
 }
 
 lily_foreign_val *lily_push_foreign(lily_state *s, uint16_t id,
@@ -765,13 +1106,19 @@ lily_foreign_val *lily_push_foreign(lily_state *s, uint16_t id,
     fv->destroy_func = func;
 
     SET_TARGET(id | VAL_IS_DEREFABLE | VAL_IS_FOREIGN, foreign, fv);
+
+    if (s->arena) {
+        fv->refcount++;
+        scope_keep(s, target, 0);
+    }
+
     return fv;
 }
 
 lily_hash_val *lily_push_hash(lily_state *s, int size)
 {
     PUSH_PREAMBLE
-    lily_hash_val *h = lily_new_hash_raw(size);
+    lily_hash_val *h = lily_new_hash_raw(s->pool, s->arena, size);
     SET_TARGET(LILY_ID_HASH | VAL_IS_DEREFABLE, hash, h);
     return h;
 }
@@ -813,11 +1160,7 @@ lily_container_val *lily_push_super(lily_state *s, uint16_t id,
 void lily_push_string(lily_state *s, const char *source)
 {
     PUSH_PREAMBLE
-    size_t len = strlen(source);
-    char *buffer = lily_malloc((len + 1) * sizeof(*buffer));
-    strcpy(buffer, source);
-
-    lily_string_val *sv = new_sv(buffer, len);
+    lily_string_val *sv = new_sv(s->pool, s->arena, source, strlen(source));
 
     SET_TARGET(LILY_ID_STRING | VAL_IS_DEREFABLE, string, sv);
 }
@@ -825,15 +1168,78 @@ void lily_push_string(lily_state *s, const char *source)
 void lily_push_string_sized(lily_state *s, const char *source, int len)
 {
     PUSH_PREAMBLE
-    char *buffer = lily_malloc((len + 1) * sizeof(*buffer));
-    memcpy(buffer, source, len);
-    buffer[len] = '\0';
-
-    lily_string_val *sv = new_sv(buffer, len);
+    lily_string_val *sv = new_sv(s->pool, s->arena, source, len);
 
     SET_TARGET(LILY_ID_STRING | VAL_IS_DEREFABLE, string, sv);
 }
 
+/* A scope frees its memory without destroying values one at a time, so a
+   slice made in one can't hold a ref to a string that the scope doesn't own. */
+static int scope_can_share(lily_vm_state *vm, lily_string_val *sv)
+{
+    lily_string_val *owner = sv->parent ? sv->parent : sv;
+
+    return vm->arena == NULL || lily_arena_owns(vm->arena, owner->string);
+}
+
+void lily_push_string_slice(lily_state *s, uint16_t class_id,
+        lily_value *source, int start, int len)
+{
+    lily_string_val *source_sv = source->value.string;
+
+    /* Strings can't change, so the whole of one is the same thing. This
+       doesn't work for ByteString, since the copy must not see changes made
+       to the source. */
+    if (len == source_sv->size &&
+        class_id == LILY_ID_STRING &&
+        source->class_id == LILY_ID_STRING) {
+        lily_push_value(s, source);
+        return;
+    }
+
+    /* Only a refcounted string can give out its buffer. Literals aren't
+       refcounted, and every clone of the interpreter reads the same ones, so
+       slices of them are copies. An empty slice is a copy so it doesn't keep
+       the source alive for nothing. */
+    if (len == 0 || (source->flags & VAL_IS_DEREFABLE) == 0 ||
+        scope_can_share(s, source_sv) == 0) {
+        const char *buffer = source_sv->string + start;
+
+        if (class_id == LILY_ID_STRING)
+            lily_push_string_sized(s, buffer, len);
+        else
+            lily_push_bytestring(s, buffer, len);
+
+        return;
+    }
+
+    lily_string_val *owner = source_sv->parent;
+
+    if (owner == NULL) {
+        if (source->class_id == LILY_ID_BYTESTRING) {
+            /* ByteString can be changed in place, so the buffer goes to an
+               owner that only slices can see. The source becomes a slice of
+               the whole, and is unshared before it's changed. */
+            owner = sv_from_buffer(s->pool, source_sv->string,
+                    source_sv->size);
+            source_sv->parent = owner;
+        }
+        else
+            owner = source_sv;
+    }
+
+    /* Take what's needed before the push, in case it moves the source. */
+    char *buffer = source_sv->string + start;
+
+    owner->refcount++;
+
+    PUSH_PREAMBLE
+    lily_string_val *sv = sv_from_buffer(s->pool, buffer, len);
+
+    sv->parent = owner;
+    SET_TARGET(class_id | VAL_IS_DEREFABLE, string, sv);
+}
+
 lily_container_val *lily_push_tuple(lily_state *s, uint32_t size)
 {
     PUSH_CONTAINER(LILY_ID_TUPLE, 0, size);
@@ -847,12 +1253,17 @@ void lily_push_unit(lily_state *s)
 
 void lily_push_value(lily_state *s, lily_value *v)
 {
-    PUSH_PREAMBLE
-    if (v->flags & VAL_IS_DEREFABLE)
-        v->value.generic->refcount++;
+    /* The source may be a register, which would move if the stack grows. Take
+       what's needed from it before pushing. */
+    uint32_t flags = v->flags;
+    lily_raw_value raw = v->value;
+
+    if (flags & VAL_IS_DEREFABLE)
+        raw.generic->refcount++;
 
-    target->flags = v->flags;
-    target->value = v->value;
+    PUSH_PREAMBLE
+    target->flags = flags;
+    target->value = raw;
 }
 
 lily_container_val *lily_push_variant(lily_state *s, uint16_t id, uint32_t size)
@@ -898,7 +1309,7 @@ void lily_return_none(lily_state *s)
 void lily_return_super(lily_state *s)
 {
     lily_value *target = s->call_chain->return_target;
-    lily_value *top = *(s->call_chain->top - 1);
+    lily_value *top = s->call_chain->top - 1;
 
     if (target->flags & VAL_IS_INSTANCE &&
         target->value.container == top->value.container) {
@@ -918,7 +1329,7 @@ void lily_return_top(lily_state *s)
     if (target->flags & VAL_IS_DEREFABLE)
         lily_deref(target);
 
-    lily_value *top = *(s->call_chain->top - 1);
+    lily_value *top = s->call_chain->top - 1;
     *target = *top;
 
     top->flags = 0;
@@ -990,10 +1401,8 @@ static const char *names[] = {
 
 static void dispatch_exception(lily_vm_state *vm);
 
-/* This raises an error in the vm that won't have a proper value backing it. The
-   id should be the id of some exception class. This may run a faux dynaload of
-   the error, so that printing has a class name to go by. */
-static void vm_error(lily_vm_state *vm, uint8_t id, const char *message)
+/* Get the class of a builtin exception, loading it if it hasn't been loaded. */
+static lily_class *load_exception(lily_vm_state *vm, uint8_t id)
 {
     lily_class *c = vm->class_table[id];
     if (c == NULL) {
@@ -1012,6 +1421,16 @@ static void vm_error(lily_vm_state *vm, uint8_t id, const char *message)
         vm->class_table[id] = c;
     }
 
+    return c;
+}
+
+/* This raises an error in the vm that won't have a proper value backing it. The
+   id should be the id of some exception class. This may run a faux dynaload of
+   the error, so that printing has a class name to go by. */
+static void vm_error(lily_vm_state *vm, uint8_t id, const char *message)
+{
+    lily_class *c = load_exception(vm, id);
+
     vm->exception_cls = c;
     lily_msgbuf *msgbuf = lily_mb_flush(vm->raiser->msgbuf);
     lily_mb_add(msgbuf, message);
@@ -1045,7 +1464,7 @@ static void key_error(lily_vm_state *vm, lily_value *key, uint16_t line_num)
     lily_msgbuf *msgbuf = lily_mb_flush(vm->raiser->aux_msgbuf);
 
     if (key->class_id == LILY_ID_STRING)
-        lily_mb_escape_add_str(msgbuf, key->value.string->string);
+        lily_mb_escape_add_str(msgbuf, lily_as_string_raw(key));
     else
         lily_mb_add_fmt(msgbuf, "%ld", key->value.integer);
 
@@ -1088,17 +1507,67 @@ void lily_builtin__calltrace(lily_vm_state *vm)
     move_list_f(0, vm->call_chain->return_target, trace);
 }
 
+void lily_flush_output(lily_vm_state *vm)
+{
+    lily_msgbuf *out = vm->out_buffer;
+
+    if (out == NULL || lily_mb_pos(out) == 0)
+        return;
+
+    lily_config *config = vm->parser->config;
+
+    config->render_func(lily_mb_raw(out), config->data);
+    lily_mb_flush(out);
+}
+
+/* Add 'size' bytes of 'text' to the output buffer. The caller must make sure
+   that 'text[size]' can be read: Callers send template content, String data
+   (a slice is followed by the rest of its source), or a msgbuf's contents. */
+void lily_vm_write_out(lily_vm_state *vm, const char *text, uint32_t size)
+{
+    lily_msgbuf *out = vm->out_buffer;
+
+    /* Text that would fill the buffer on its own is sent as-is after what's
+       already there, instead of being copied in. That needs a \0 after it. */
+    if (size >= vm->out_limit && text[size] == '\0') {
+        lily_config *config = vm->parser->config;
+
+        lily_flush_output(vm);
+        config->render_func(text, config->data);
+        return;
+    }
+
+    lily_mb_add_slice(out, text, 0, (int)size);
+
+    if ((uint32_t)lily_mb_pos(out) >= vm->out_limit)
+        lily_flush_output(vm);
+}
+
+/* Write to 'target', or to the output buffer if 'target' is stdout and there
+   is one. */
+void lily_vm_write(lily_vm_state *vm, FILE *target, const char *text,
+        uint32_t size)
+{
+    if (target == stdout && vm->out_buffer)
+        lily_vm_write_out(vm, text, size);
+    else
+        fwrite(text, 1, size, target);
+}
+
 static void do_print(lily_vm_state *vm, FILE *target, lily_value *source)
 {
-    if (source->class_id == LILY_ID_STRING)
-        fputs(source->value.string->string, target);
+    if (source->class_id == LILY_ID_STRING) {
+        lily_string_val *sv = source->value.string;
+
+        lily_vm_write(vm, target, sv->string, sv->size);
+    }
     else {
         lily_msgbuf *msgbuf = lily_mb_flush(vm->vm_buffer);
         lily_mb_add_value(msgbuf, vm, source);
-        fputs(lily_mb_raw(msgbuf), target);
+        lily_vm_write(vm, target, lily_mb_raw(msgbuf), lily_mb_pos(msgbuf));
     }
 
-    fputc('\n', target);
+    lily_vm_write(vm, target, "\n", 1);
     lily_return_unit(vm);
 }
 
@@ -1117,7 +1586,7 @@ void lily_stdout_print(lily_vm_state *vm)
        stdin.
        The other trick is to use regs_from_main to grab the globals. */
     uint16_t spot = *vm->call_chain->function->cid_table;
-    lily_file_val *stdout_val = vm->regs_from_main[spot]->value.file;
+    lily_file_val *stdout_val = vm->regs_from_main[spot].value.file;
     if (stdout_val->inner_file == NULL)
         vm_error(vm, LILY_ID_VALUEERROR, "IO operation on closed file.");
 
@@ -1126,10 +1595,8 @@ void lily_stdout_print(lily_vm_state *vm)
 
 void lily_builtin_Dynamic_new(lily_vm_state *vm)
 {
-    lily_value *input = lily_arg_value(vm, 0);
-
     lily_container_val *dynamic_val = lily_push_dynamic(vm);
-    lily_con_set(dynamic_val, 0, input);
+    lily_con_set(vm, dynamic_val, 0, lily_arg_value(vm, 0));
 
     lily_return_top(vm);
     lily_value_tag(vm, vm->call_chain->return_target);
@@ -1152,30 +1619,33 @@ void lily_builtin_Dynamic_new(lily_vm_state *vm)
    be loaded from a register. */
 static void do_o_property_set(lily_vm_state *vm, uint16_t *code)
 {
-    lily_value **vm_regs = vm->call_chain->start;
+    lily_value *vm_regs = vm->call_chain->start;
     lily_value *rhs_reg;
     int index;
     lily_container_val *ival;
 
     index = code[1];
-    ival = vm_regs[code[2]]->value.container;
-    rhs_reg = vm_regs[code[3]];
+    ival = vm_regs[code[2]].value.container;
+    rhs_reg = vm_regs + code[3];
 
-    lily_value_assign(ival->values[index], rhs_reg);
+    if (rhs_reg->flags & VAL_IS_GC_SWEEPABLE)
+        lily_gc_barrier(vm, rhs_reg);
+
+    lily_value_assign(ival->values + index, rhs_reg);
 }
 
 static void do_o_property_get(lily_vm_state *vm, uint16_t *code)
 {
-    lily_value **vm_regs = vm->call_chain->start;
+    lily_value *vm_regs = vm->call_chain->start;
     lily_value *result_reg;
     int index;
     lily_container_val *ival;
 
     index = code[1];
-    ival = vm_regs[code[2]]->value.container;
-    result_reg = vm_regs[code[3]];
+    ival = vm_regs[code[2]].value.container;
+    result_reg = vm_regs + code[3];
 
-    lily_value_assign(result_reg, ival->values[index]);
+    lily_value_assign(result_reg, ival->values + index);
 }
 
 #define RELATIVE_INDEX(limit) \
@@ -1193,12 +1663,12 @@ static void do_o_property_get(lily_vm_state *vm, uint16_t *code)
    validated. */
 static void do_o_subscript_set(lily_vm_state *vm, uint16_t *code)
 {
-    lily_value **vm_regs = vm->call_chain->start;
+    lily_value *vm_regs = vm->call_chain->start;
     lily_value *lhs_reg, *index_reg, *rhs_reg;
 
-    lhs_reg = vm_regs[code[1]];
-    index_reg = vm_regs[code[2]];
-    rhs_reg = vm_regs[code[3]];
+    lhs_reg = vm_regs + code[1];
+    index_reg = vm_regs + code[2];
+    rhs_reg = vm_regs + code[3];
 
     if (lhs_reg->class_id != LILY_ID_HASH) {
         int64_t index_int = index_reg->value.integer;
@@ -1206,13 +1676,28 @@ static void do_o_subscript_set(lily_vm_state *vm, uint16_t *code)
         if (lhs_reg->class_id == LILY_ID_BYTESTRING) {
             lily_string_val *bytev = lhs_reg->value.string;
             RELATIVE_INDEX(bytev->size)
+            lily_string_unshare(bytev);
             bytev->string[index_int] = (char)rhs_reg->value.integer;
+            bytev->hash = 0;
         }
         else {
             /* List and Tuple have the same internal representation. */
             lily_container_val *list_val = lhs_reg->value.container;
             RELATIVE_INDEX(list_val->num_values)
-            lily_value_assign(list_val->values[index_int], rhs_reg);
+
+            if (list_val->packed_id) {
+                if (list_val->packed_id == rhs_reg->class_id) {
+                    lily_list_packed_set(list_val, index_int, rhs_reg);
+                    return;
+                }
+
+                lily_list_unpack(list_val);
+            }
+
+            if (rhs_reg->flags & VAL_IS_GC_SWEEPABLE)
+                lily_gc_barrier(vm, rhs_reg);
+
+            lily_value_assign(list_val->values + index_int, rhs_reg);
         }
     }
     else
@@ -1223,12 +1708,12 @@ static void do_o_subscript_set(lily_vm_state *vm, uint16_t *code)
    validated. */
 static void do_o_subscript_get(lily_vm_state *vm, uint16_t *code)
 {
-    lily_value **vm_regs = vm->call_chain->start;
+    lily_value *vm_regs = vm->call_chain->start;
     lily_value *lhs_reg, *index_reg, *result_reg;
 
-    lhs_reg = vm_regs[code[1]];
-    index_reg = vm_regs[code[2]];
-    result_reg = vm_regs[code[3]];
+    lhs_reg = vm_regs + code[1];
+    index_reg = vm_regs + code[2];
+    result_reg = vm_regs + code[3];
 
     if (lhs_reg->class_id != LILY_ID_HASH) {
         int64_t index_int = index_reg->value.integer;
@@ -1242,7 +1727,15 @@ static void do_o_subscript_get(lily_vm_state *vm, uint16_t *code)
             /* List and Tuple have the same internal representation. */
             lily_container_val *list_val = lhs_reg->value.container;
             RELATIVE_INDEX(list_val->num_values)
-            lily_value_assign(result_reg, list_val->values[index_int]);
+
+            if (list_val->packed_id) {
+                if (result_reg->flags & VAL_IS_DEREFABLE)
+                    lily_deref(result_reg);
+
+                lily_list_packed_get(list_val, index_int, result_reg);
+            }
+            else
+                lily_value_assign(result_reg, list_val->values + index_int);
         }
     }
     else {
@@ -1260,20 +1753,20 @@ static void do_o_subscript_get(lily_vm_state *vm, uint16_t *code)
 
 static void do_o_build_hash(lily_vm_state *vm, uint16_t *code)
 {
-    lily_value **vm_regs = vm->call_chain->start;
+    lily_value *vm_regs = vm->call_chain->start;
     int i, num_values;
     lily_value *result, *key_reg, *value_reg;
 
     num_values = code[2];
-    result = vm_regs[code[3 + num_values]];
+    result = vm_regs + code[3 + num_values];
 
-    lily_hash_val *hash_val = lily_new_hash_raw(num_values / 2);
+    lily_hash_val *hash_val = lily_new_hash_raw(vm->pool, vm->arena, num_values / 2);
 
     for (i = 0;
          i < num_values;
          i += 2) {
-        key_reg = vm_regs[code[3 + i]];
-        value_reg = vm_regs[code[3 + i + 1]];
+        key_reg = vm_regs + code[3 + i];
+        value_reg = vm_regs + code[3 + i + 1];
 
         lily_hash_set(vm, hash_val, key_reg, value_reg);
     }
@@ -1286,24 +1779,55 @@ static void do_o_build_hash(lily_vm_state *vm, uint16_t *code)
    However, variant types are also tuples (but with a different name). */
 static void do_o_build_list_tuple(lily_vm_state *vm, uint16_t *code)
 {
-    lily_value **vm_regs = vm->call_chain->start;
+    lily_value *vm_regs = vm->call_chain->start;
     int num_elems = code[1];
-    lily_value *result = vm_regs[code[2+num_elems]];
+    lily_value *result = vm_regs + code[2+num_elems];
     lily_container_val *lv;
 
+    int i;
+
+    /* A List is packed if all of the values have the same class, and that
+       class can be packed. The values usually do, but a List made for a
+       foreign function's $1... can have anything. A packed List is never
+       interesting to the gc. */
+    if (code[0] == o_build_list && num_elems) {
+        uint16_t pack_id = vm_regs[code[2]].class_id;
+
+        for (i = 1;i < num_elems;i++) {
+            if (vm_regs[code[2+i]].class_id != pack_id)
+                break;
+        }
+
+        if (i != num_elems || LILY_CAN_PACK(pack_id) == 0)
+            pack_id = 0;
+
+        if (pack_id) {
+            lv = new_container(vm, LILY_ID_LIST, 0);
+            lily_list_pack(lv, pack_id, num_elems);
+
+            for (i = 0;i < num_elems;i++)
+                lily_list_packed_set(lv, i, vm_regs + code[2+i]);
+
+            lv->num_values = num_elems;
+            lv->extra_space = 0;
+            move_list_f(0, result, lv);
+            return;
+        }
+    }
+
     if (code[0] == o_build_list) {
-        lv = new_container(LILY_ID_LIST, num_elems);
+        lv = new_container(vm, LILY_ID_LIST, num_elems);
     }
     else {
-        lv = (lily_container_val *)new_container(LILY_ID_TUPLE, num_elems);
+        lv = (lily_container_val *)new_container(vm, LILY_ID_TUPLE,
+                num_elems);
     }
 
-    lily_value **elems = lv->values;
+    lily_value *elems = lv->values;
 
-    int i;
     for (i = 0;i < num_elems;i++) {
-        lily_value *rhs_reg = vm_regs[code[2+i]];
-        lily_value_assign(elems[i], rhs_reg);
+        lily_value *rhs_reg = vm_regs + code[2+i];
+        lily_value_assign(elems + i, rhs_reg);
     }
 
     if (code[0] == o_build_list)
@@ -1314,18 +1838,18 @@ static void do_o_build_list_tuple(lily_vm_state *vm, uint16_t *code)
 
 static void do_o_build_variant(lily_vm_state *vm, uint16_t *code)
 {
-    lily_value **vm_regs = vm->call_chain->start;
+    lily_value *vm_regs = vm->call_chain->start;
     int variant_id = code[1];
     int count = code[2];
-    lily_value *result = vm_regs[code[code[2] + 3]];
+    lily_value *result = vm_regs + code[code[2] + 3];
 
-    lily_container_val *ival = new_container(variant_id, count);
-    lily_value **slots = ival->values;
+    lily_container_val *ival = new_container(vm, variant_id, count);
+    lily_value *slots = ival->values;
 
     int i;
     for (i = 0;i < count;i++) {
-        lily_value *rhs_reg = vm_regs[code[3+i]];
-        lily_value_assign(slots[i], rhs_reg);
+        lily_value *rhs_reg = vm_regs + code[3+i];
+        lily_value_assign(slots + i, rhs_reg);
     }
 
     move_variant_f(VAL_IS_GC_SPECULATIVE, result, ival);
@@ -1339,7 +1863,7 @@ static void do_o_exception_raise(lily_vm_state *vm, lily_value *exception_val)
        container for traceback. */
 
     lily_container_val *ival = exception_val->value.container;
-    char *message = ival->values[0]->value.string->string;
+    char *message = lily_as_string_raw(ival->values);
     lily_class *raise_cls = vm->class_table[ival->class_id];
 
     /* There's no need for a ref/deref here, because the gc cannot trigger
@@ -1362,8 +1886,8 @@ static void do_o_new_instance(lily_vm_state *vm, uint16_t *code)
 {
     int total_entries;
     int cls_id = code[1];
-    lily_value **vm_regs = vm->call_chain->start;
-    lily_value *result = vm_regs[code[2]];
+    lily_value *vm_regs = vm->call_chain->start;
+    lily_value *result = vm_regs + code[2];
     lily_class *instance_class = vm->class_table[cls_id];
 
     total_entries = instance_class->prop_count;
@@ -1383,7 +1907,7 @@ static void do_o_new_instance(lily_vm_state *vm, uint16_t *code)
     uint32_t flags =
         (instance_class->flags & CLS_GC_FLAGS) << VAL_FROM_CLS_GC_SHIFT;
 
-    lily_container_val *iv = new_container(cls_id, total_entries);
+    lily_container_val *iv = new_container(vm, cls_id, total_entries);
     iv->instance_ctor_need = instance_class->inherit_depth;
 
     if (flags == VAL_IS_GC_SPECULATIVE)
@@ -1395,21 +1919,64 @@ static void do_o_new_instance(lily_vm_state *vm, uint16_t *code)
     }
 }
 
+/* Add 'size' bytes of 'text' to the end of 'sv'. The buffer grows by doubling,
+   so that a String built by appending in a loop is copied O(log n) times. */
+static void string_append(lily_string_val *sv, const char *text, uint32_t size)
+{
+    uint32_t want = sv->size + size;
+
+    if (want > sv->capacity) {
+        uint64_t capacity = (uint64_t)sv->capacity * 2;
+
+        if (capacity < want)
+            capacity = want;
+
+        if (capacity > UINT32_MAX - 1)
+            capacity = UINT32_MAX - 1;
+
+        sv->string = lily_arena_realloc(lily_slab_arena(sv), sv->string,
+                (capacity + 1) * sizeof(*sv->string));
+        sv->capacity = (uint32_t)capacity;
+    }
+
+    memcpy(sv->string + sv->size, text, size);
+    sv->size = want;
+    sv->string[want] = '\0';
+    sv->hash = 0;
+}
+
 static void do_o_interpolation(lily_vm_state *vm, uint16_t *code)
 {
-    lily_value **vm_regs = vm->call_chain->start;
+    lily_value *vm_regs = vm->call_chain->start;
     int count = code[1];
     lily_msgbuf *vm_buffer = lily_mb_flush(vm->vm_buffer);
-
+    lily_value *first = vm_regs + code[2];
+    lily_value *result_reg = vm_regs + code[2 + count];
+
+    /* For `s = s ++ ...`, emitter writes the result to the first value. If the
+       String there isn't held by anything else, add the rest to it. The rest
+       goes through the msgbuf first, in case it includes the first value.
+       Literals aren't refcounted, so they're never changed here. */
+    int in_place = (first == result_reg &&
+                    first->class_id == LILY_ID_STRING &&
+                    (first->flags & VAL_IS_DEREFABLE) &&
+                    first->value.string->refcount == 1 &&
+                    first->value.string->parent == NULL);
     int i;
-    for (i = 0;i < count;i++) {
-        lily_value *v = vm_regs[code[2 + i]];
+
+    for (i = in_place;i < count;i++) {
+        lily_value *v = vm_regs + code[2 + i];
         lily_mb_add_value(vm_buffer, vm, v);
     }
 
-    lily_value *result_reg = vm_regs[code[2 + i]];
+    if (in_place) {
+        string_append(first->value.string, lily_mb_raw(vm_buffer),
+                lily_mb_pos(vm_buffer));
+        return;
+    }
 
-    lily_string_val *sv = lily_new_string_raw(lily_mb_raw(vm_buffer));
+    lily_string_val *sv = new_sv(vm->pool, vm->arena, lily_mb_raw(vm_buffer),
+            lily_mb_pos(vm_buffer));
     move_string(result_reg, sv);
 }
 
@@ -1441,9 +2008,9 @@ static void do_o_interpolation(lily_vm_state *vm, uint16_t *code)
 
 /* This takes a value and makes a closure cell that is a copy of that value. The
    value is given a ref increase. */
-static lily_value *make_cell_from(lily_value *value)
+static lily_value *make_cell_from(lily_vm_state *vm, lily_value *value)
 {
-    lily_value *result = lily_malloc(sizeof(*result));
+    lily_value *result = lily_slab_malloc(vm->pool, sizeof(*result));
     *result = *value;
     result->cell_refcount = 1;
     if (value->flags & VAL_IS_DEREFABLE)
@@ -1453,9 +2020,10 @@ static lily_value *make_cell_from(lily_value *value)
 }
 
 /* This clones the data inside of 'to_copy'. */
-static lily_function_val *new_function_copy(lily_function_val *to_copy)
+static lily_function_val *new_function_copy(lily_vm_state *vm,
+        lily_function_val *to_copy)
 {
-    lily_function_val *f = lily_malloc(sizeof(*f));
+    lily_function_val *f = lily_slab_malloc(vm->pool, sizeof(*f));
 
     *f = *to_copy;
     f->refcount = 1;
@@ -1468,13 +2036,14 @@ static lily_function_val *new_function_copy(lily_function_val *to_copy)
 static lily_value **do_o_closure_new(lily_vm_state *vm, uint16_t *code)
 {
     int count = code[1];
-    lily_value *result = vm->call_chain->start[code[2]];
+    lily_value *result = vm->call_chain->start + code[2];
 
     lily_function_val *last_call = vm->call_chain->function;
 
-    lily_function_val *closure_func = new_function_copy(last_call);
+    lily_function_val *closure_func = new_function_copy(vm, last_call);
 
-    lily_value **upvalues = lily_malloc(sizeof(*upvalues) * count);
+    lily_value **upvalues = lily_arena_malloc(vm->arena,
+            sizeof(*upvalues) * count);
 
     /* Cells are initially NULL so that o_closure_set knows to copy a new value
        into a cell. */
@@ -1500,12 +2069,14 @@ static lily_value **do_o_closure_new(lily_vm_state *vm, uint16_t *code)
 
 /* This copies cells from 'source' to 'target'. Cells that exist are given a
    cell_refcount bump. */
-static void copy_upvalues(lily_function_val *target, lily_function_val *source)
+static void copy_upvalues(lily_vm_state *vm, lily_function_val *target,
+        lily_function_val *source)
 {
     lily_value **source_upvalues = source->upvalues;
     int count = source->num_upvalues;
 
-    lily_value **new_upvalues = lily_malloc(sizeof(*new_upvalues) * count);
+    lily_value **new_upvalues = lily_arena_malloc(vm->arena,
+            sizeof(*new_upvalues) * count);
     lily_value *up;
     int i;
 
@@ -1525,16 +2096,16 @@ static void copy_upvalues(lily_function_val *target, lily_function_val *source)
    the specified closure. */
 static void do_o_closure_function(lily_vm_state *vm, uint16_t *code)
 {
-    lily_value **vm_regs = vm->call_chain->start;
+    lily_value *vm_regs = vm->call_chain->start;
     lily_function_val *input_closure = vm->call_chain->function;
 
     lily_value *target = vm->readonly_table[code[1]];
     lily_function_val *target_func = target->value.function;
 
-    lily_value *result_reg = vm_regs[code[2]];
-    lily_function_val *new_closure = new_function_copy(target_func);
+    lily_value *result_reg = vm_regs + code[2];
+    lily_function_val *new_closure = new_function_copy(vm, target_func);
 
-    copy_upvalues(new_closure, input_closure);
+    copy_upvalues(vm, new_closure, input_closure);
 
     uint16_t *locals = new_closure->proto->locals;
     if (locals) {
@@ -1580,7 +2151,7 @@ static lily_container_val *build_traceback_raw(lily_vm_state *vm)
     int i;
 
     lily_msgbuf *msgbuf = lily_msgbuf_get(vm);
-    lily_container_val *lv = new_container(LILY_ID_LIST, depth);
+    lily_container_val *lv = new_container(vm, LILY_ID_LIST, depth);
 
     /* The call chain goes from the most recent to least. Work around that by
        allocating elements in reverse order. It's safe to do this because
@@ -1602,8 +2173,8 @@ static lily_container_val *build_traceback_raw(lily_vm_state *vm)
         const char *str = lily_mb_sprintf(msgbuf, "%s:%s from %s", path,
                 line, proto->name);
 
-        lily_string_val *sv = lily_new_string_raw(str);
-        move_string(lv->values[i - 1], sv);
+        lily_string_val *sv = new_sv(vm->pool, vm->arena, str, strlen(str));
+        move_string(lv->values + i - 1, sv);
     }
 
     return lv;
@@ -1617,12 +2188,13 @@ static void make_proper_exception_val(lily_vm_state *vm,
         lily_class *raised_cls, lily_value *result)
 {
     const char *raw_message = lily_mb_raw(vm->raiser->msgbuf);
-    lily_container_val *ival = new_container(raised_cls->id, 2);
+    lily_container_val *ival = new_container(vm, raised_cls->id, 2);
 
-    lily_string_val *sv = lily_new_string_raw(raw_message);
-    move_string(ival->values[0], sv);
+    lily_string_val *sv = new_sv(vm->pool, vm->arena, raw_message,
+            strlen(raw_message));
+    move_string(ival->values, sv);
 
-    move_list_f(0, ival->values[1], build_traceback_raw(vm));
+    move_list_f(0, ival->values + 1, build_traceback_raw(vm));
 
     move_instance_f(VAL_IS_GC_SPECULATIVE, result, ival);
 }
@@ -1639,6 +2211,19 @@ static void fixup_exception_val(lily_vm_state *vm, lily_value *result)
     move_list_f(VAL_IS_GC_SPECULATIVE, lily_con_get(iv, 1), raw_trace);
 }
 
+/* How many frames 'frame' is past the toplevel frame. */
+static int frame_index(lily_call_frame *frame)
+{
+    int index = 0;
+
+    while (frame->prev) {
+        frame = frame->prev;
+        index++;
+    }
+
+    return index;
+}
+
 /* This is called when the vm has raised an exception. This changes control to
    a jump that handles the error (some `except` clause), or parser. */
 static void dispatch_exception(lily_vm_state *vm)
@@ -1699,7 +2284,7 @@ static void dispatch_exception(lily_vm_state *vm)
     if (match) {
         code += jump_location;
         if (*code == o_exception_store) {
-            lily_value *catch_reg = catch_iter->call_frame->start[code[1]];
+            lily_value *catch_reg = catch_iter->call_frame->start + code[1];
 
             /* There is a var that the exception needs to be dropped into. If
                this exception was triggered by raise, then use that (after
@@ -1720,6 +2305,9 @@ static void dispatch_exception(lily_vm_state *vm)
         vm->call_chain = catch_iter->call_frame;
         vm->call_depth = catch_iter->call_frame_depth;
         vm->call_chain->code = code;
+        SAMPLE_FENCE();
+        vm->sample_depth = frame_index(vm->call_chain);
+        SAMPLE_FENCE();
         /* Each try block can only successfully handle one exception, so use
            ->prev to prevent using the same block again. */
         vm->catch_chain = catch_iter;
@@ -1771,9 +2359,10 @@ void lily_call_prepare(lily_vm_state *vm, lily_function_val *func)
     lily_call_frame *target_frame = caller_frame->next;
     target_frame->code = func->code;
     target_frame->function = func;
-    target_frame->return_target = *caller_frame->top;
 
+    /* Pushing may grow the registers, so take the target after. */
     lily_push_unit(vm);
+    target_frame->return_target = caller_frame->top - 1;
 }
 
 lily_value *lily_call_result(lily_vm_state *vm)
@@ -1793,11 +2382,14 @@ void lily_call(lily_vm_state *vm, int count)
     target_frame->start = source_frame->top;
 
     vm->call_depth++;
+    COUNT_CALL(target_fn);
 
     if (target_fn->code == NULL) {
         vm->call_chain = target_frame;
+        SAMPLE_PUSH(vm);
         target_fn->foreign_func(vm);
 
+        SAMPLE_POP(vm);
         vm->call_chain = target_frame->prev;
         vm->call_depth--;
     }
@@ -1809,17 +2401,17 @@ void lily_call(lily_vm_state *vm, int count)
             grow_vm_registers(vm, diff);
         }
 
-        lily_value **start = target_frame->top;
-        lily_value **end = target_frame->top + diff;
+        lily_value *start = target_frame->top;
+        lily_value *end = target_frame->top + diff;
         while (start != end) {
-            lily_value *v = *start;
-            lily_deref(v);
-            v->flags = 0;
+            lily_deref(start);
+            start->flags = 0;
             start++;
         }
 
         target_frame->top += diff;
         vm->call_chain = target_frame;
+        SAMPLE_PUSH(vm);
 
         lily_vm_execute(vm);
 
@@ -1847,6 +2439,517 @@ void lily_error_callback_pop(lily_state *s)
     s->catch_chain = s->catch_chain->prev;
 }
 
+/***
+ *       ____ _             _
+ *      / ___| | ___  _ __ (_)_ __   __ _
+ *     | |   | |/ _ \| '_ \| | '_ \ / _` |
+ *     | |___| | (_) | | | | | | | | (_| |
+ *      \____|_|\___/|_| |_|_|_| |_|\__, |
+ *                                  |___/
+ */
+
+/** A clone is a vm that shares everything parser made with the vm it came from
+    (code, classes, literals), but has its own globals. Globals are copied in
+    full, so that nothing a clone does to them can be seen by another vm. A map
+    from each source value to its copy makes sure that a value held in more than
+    one place (including through a cycle) is held the same way in the clone.
+
+    Foreign values can't be copied, so the clone takes a ref to the source's
+    value instead. A File is given a new File holding the same stream, but the
+    new one never closes the stream. **/
+
+typedef struct {
+    const void **keys;
+    void **values;
+    uint32_t mask;
+    uint32_t count;
+} clone_map;
+
+static void clone_map_init(clone_map *map, uint32_t size)
+{
+    map->keys = lily_malloc(size * sizeof(*map->keys));
+    map->values = lily_malloc(size * sizeof(*map->values));
+    map->mask = size - 1;
+    map->count = 0;
+    memset(map->keys, 0, size * sizeof(*map->keys));
+}
+
+static uint32_t clone_map_slot(clone_map *map, const void *key)
+{
+    /* Pointers are at least 8 byte aligned, so the low bits are always 0. */
+    uint32_t slot = (uint32_t)(((uintptr_t)key >> 3) * 2654435761u) & map->mask;
+
+    while (map->keys[slot] && map->keys[slot] != key)
+        slot = (slot + 1) & map->mask;
+
+    return slot;
+}
+
+static void *clone_map_find(clone_map *map, const void *key)
+{
+    uint32_t slot = clone_map_slot(map, key);
+
+    return map->keys[slot] ? map->values[slot] : NULL;
+}
+
+static void clone_map_add(clone_map *map, const void *key, void *value)
+{
+    /* Keep the map at most half full. */
+    if ((map->count + 1) * 2 > map->mask + 1) {
+        const void **old_keys = map->keys;
+        void **old_values = map->values;
+        uint32_t old_size = map->mask + 1;
+        uint32_t i;
+
+        clone_map_init(map, old_size * 2);
+
+        for (i = 0;i < old_size;i++) {
+            if (old_keys[i])
+                clone_map_add(map, old_keys[i], old_values[i]);
+        }
+
+        lily_free(old_keys);
+        lily_free(old_values);
+    }
+
+    uint32_t slot = clone_map_slot(map, key);
+
+    map->keys[slot] = key;
+    map->values[slot] = value;
+    map->count++;
+}
+
+static void clone_value(lily_vm_state *, clone_map *, lily_value *,
+        lily_value *);
+
+static lily_generic_val *clone_string(lily_vm_state *vm, lily_string_val *sv)
+{
+    return (lily_generic_val *)new_sv(vm->pool, vm->arena, sv->string,
+            sv->size);
+}
+
+static lily_generic_val *clone_file(lily_file_val *source)
+{
+    lily_file_val *filev = lily_malloc(sizeof(*filev));
+
+    filev->refcount = 1;
+    /* This gives back lines that were read ahead, so that the clone starts at
+       the same place. */
+    filev->inner_file = lily_file_raw(source);
+    filev->read_ok = source->read_ok;
+    filev->write_ok = source->write_ok;
+    filev->is_builtin = 1;
+    filev->read_ahead = 0;
+    filev->read_pos = 0;
+    filev->read_end = 0;
+    filev->read_size = 0;
+    filev->read_buffer = NULL;
+
+    return (lily_generic_val *)filev;
+}
+
+static lily_generic_val *clone_hash(lily_vm_state *vm, clone_map *map,
+        lily_hash_val *source)
+{
+    lily_hash_val *hv = lily_new_hash_raw(vm->pool, vm->arena,
+            source->num_entries);
+    int i;
+
+    clone_map_add(map, source, hv);
+
+    for (i = 0;i < source->entries_used;i++) {
+        lily_hash_entry *entry = source->entries + i;
+        lily_value key, record;
+
+        /* This is a hole left by a removed entry. */
+        if (entry->key.flags == 0)
+            continue;
+
+        clone_value(vm, map, &entry->key, &key);
+        clone_value(vm, map, &entry->record, &record);
+
+        if (record.flags & VAL_IS_GC_SWEEPABLE)
+            lily_gc_barrier(vm, &record);
+
+        lily_hash_set_hashed(hv, &key, &record, entry->hash);
+        lily_deref(&key);
+        lily_deref(&record);
+    }
+
+    return (lily_generic_val *)hv;
+}
+
+static lily_generic_val *clone_function(lily_vm_state *vm, clone_map *map,
+        lily_function_val *source)
+{
+    lily_function_val *f = new_function_copy(vm, source);
+    int count = source->num_upvalues;
+    int i;
+
+    f->gc_entry = NULL;
+    clone_map_add(map, source, f);
+
+    if (count == 0)
+        return (lily_generic_val *)f;
+
+    f->upvalues = lily_arena_malloc(vm->arena, count * sizeof(*f->upvalues));
+
+    /* Closures can share cells, so cells go through the map too. */
+    for (i = 0;i < count;i++) {
+        lily_value *cell = source->upvalues[i];
+        lily_value *new_cell;
+
+        if (cell == NULL)
+            new_cell = NULL;
+        else {
+            new_cell = clone_map_find(map, cell);
+
+            if (new_cell)
+                new_cell->cell_refcount++;
+            else {
+                new_cell = lily_slab_malloc(vm->pool, sizeof(*new_cell));
+                new_cell->cell_refcount = 1;
+                clone_map_add(map, cell, new_cell);
+                clone_value(vm, map, cell, new_cell);
+            }
+        }
+
+        f->upvalues[i] = new_cell;
+    }
+
+    return (lily_generic_val *)f;
+}
+
+static lily_generic_val *clone_container(lily_vm_state *vm, clone_map *map,
+        lily_container_val *source)
+{
+    uint32_t count = source->num_values;
+    uint32_t i;
+    lily_container_val *c;
+
+    if (LILY_LIST_IS_PACKED(source)) {
+        lily_value v;
+
+        c = new_container(vm, LILY_ID_LIST, 0);
+        lily_list_pack(c, source->packed_id, count);
+        clone_map_add(map, source, c);
+
+        for (i = 0;i < count;i++) {
+            lily_list_packed_get(source, i, &v);
+            lily_list_packed_set(c, i, &v);
+        }
+
+        c->num_values = count;
+        c->extra_space = 0;
+        return (lily_generic_val *)c;
+    }
+
+    c = new_container(vm, source->class_id, count);
+    c->instance_ctor_need = source->instance_ctor_need;
+    clone_map_add(map, source, c);
+
+    for (i = 0;i < count;i++)
+        clone_value(vm, map, source->values + i, c->values + i);
+
+    return (lily_generic_val *)c;
+}
+
+/* Copy 'source' into 'target' (which is overwritten), giving the target a ref
+   to the result. */
+static void clone_value(lily_vm_state *vm, clone_map *map, lily_value *source,
+        lily_value *target)
+{
+    uint32_t flags = source->flags;
+
+    target->flags = flags;
+
+    /* Plain values, and literals (which aren't refcounted), are shared. */
+    if ((flags & VAL_IS_DEREFABLE) == 0) {
+        target->value = source->value;
+        return;
+    }
+
+    /* Foreign values are shared too. A scope takes one ref on each for all of
+       its copies, and gives it back when it closes. The copies aren't
+       refcounted, so that what runs in the scope doesn't change the refcount
+       of a value that the source holds. */
+    if (vm->arena && (flags & VAL_IS_FOREIGN)) {
+        lily_generic_val *shared = source->value.generic;
+
+        target->flags &= ~VAL_IS_DEREFABLE;
+        target->value.generic = shared;
+
+        if (clone_map_find(map, shared) == NULL) {
+            clone_map_add(map, shared, shared);
+            scope_keep(vm, source, 1);
+            shared->refcount++;
+        }
+
+        return;
+    }
+
+    lily_generic_val *result = clone_map_find(map, source->value.generic);
+    int class_id = source->class_id;
+
+    if (result) {
+        result->refcount++;
+        target->value.generic = result;
+        return;
+    }
+
+    if (class_id == LILY_ID_STRING || class_id == LILY_ID_BYTESTRING) {
+        result = clone_string(vm, source->value.string);
+        clone_map_add(map, source->value.generic, result);
+    }
+    else if (class_id == LILY_ID_FILE) {
+        result = clone_file(source->value.file);
+        clone_map_add(map, source->value.generic, result);
+    }
+    else if (class_id == LILY_ID_HASH)
+        result = clone_hash(vm, map, source->value.hash);
+    else if (class_id == LILY_ID_FUNCTION)
+        result = clone_function(vm, map, source->value.function);
+    else if (class_id == LILY_ID_LIST || class_id == LILY_ID_TUPLE ||
+             (flags & VAL_IS_CONTAINER))
+        result = clone_container(vm, map, source->value.container);
+    else {
+        /* A foreign value, shared with the source. */
+        result = source->value.generic;
+        clone_map_add(map, result, result);
+        result->refcount++;
+    }
+
+    target->value.generic = result;
+
+    /* Like a File made in the scope, the copy is destroyed when the scope
+       closes. */
+    if (vm->arena && class_id == LILY_ID_FILE) {
+        result->refcount++;
+        scope_keep(vm, target, 0);
+    }
+
+    if (flags & VAL_IS_GC_TAGGED) {
+        target->flags &= ~VAL_IS_GC_TAGGED;
+        lily_value_tag(vm, target);
+    }
+}
+
+/* Make a new vm with copies of the first 'global_count' globals of 'source'.
+   If 'arena' isn't NULL, the vm is a scope that allocates from it.
+
+   This doesn't check 'source' first. It may be a clone, and it may be running,
+   in which case the calls in progress aren't copied (only the globals are).
+   lily_clone_state and lily_open_scope check for those cases and refuse them.
+   parallel.map calls this directly, because it has to clone the state that
+   called it. */
+lily_vm_state *lily_vm_clone(lily_vm_state *source, int global_count,
+        lily_arena *arena)
+{
+    int i;
+
+    /* Clones can't use the parser to load an exception when one is raised, so
+       load them all now. */
+    for (i = LILY_ID_EXCEPTION;i <= LILY_ID_DBZERROR;i++)
+        load_exception(source, i);
+
+    lily_vm_state *vm = lily_new_vm_state(lily_new_raiser(), arena);
+
+    vm->error_buffer = lily_new_msgbuf(64);
+
+    vm->parser = source->parser;
+    vm->depth_max = source->depth_max;
+    vm->gc_multiplier = source->gc_multiplier;
+    vm->readonly_table = source->readonly_table;
+    vm->readonly_count = source->readonly_count;
+    vm->class_count = source->class_count;
+    vm->class_table = lily_malloc(vm->class_count * sizeof(*vm->class_table));
+    memcpy(vm->class_table, source->class_table,
+            vm->class_count * sizeof(*vm->class_table));
+
+    /* The gc can't run until the copies are in registers where it can see
+       them. */
+    vm->gc_threshold = UINT32_MAX;
+
+    lily_call_frame *toplevel = vm->call_chain;
+
+    if (toplevel->register_end - toplevel->start <= global_count)
+        grow_vm_registers(vm, global_count);
+
+    lily_value *regs = vm->regs_from_main;
+    lily_value *source_regs = source->regs_from_main;
+    clone_map map;
+
+    clone_map_init(&map, 64);
+
+    for (i = 0;i < global_count;i++)
+        clone_value(vm, &map, source_regs + i, regs + i);
+
+    /* Strings that String.intern added are refcounted, and need copies. The
+       rest are literals. */
+    lily_hash_val *interned = source->interned_strings;
+
+    for (i = 0;i < interned->entries_used;i++) {
+        lily_hash_entry *entry = interned->entries + i;
+        lily_value key;
+
+        if (entry->key.flags == 0)
+            continue;
+
+        clone_value(vm, &map, &entry->key, &key);
+        lily_hash_set_hashed(vm->interned_strings, &key, &entry->record,
+                entry->hash);
+        lily_deref(&key);
+    }
+
+    lily_free(map.keys);
+    lily_free(map.values);
+
+    /* The source may be running (the parallel package clones the state that
+       called it), so start from the frame that its chain starts from. */
+    lily_call_frame *source_toplevel = source->call_chain;
+
+    while (source_toplevel->prev)
+        source_toplevel = source_toplevel->prev;
+
+    /* The toplevel frame holds globals, but isn't running. Tracebacks stop at
+       the call depth, so that stays at 0 to keep them from reaching this. */
+    toplevel->function = source_toplevel->function;
+    toplevel->top = regs + global_count;
+    toplevel->next->top = regs + global_count;
+    vm->gc_threshold = source->gc_threshold;
+
+    return vm;
+}
+
+/* Push a copy of 'source' (a value of the vm that 'vm' was cloned from) onto
+   the stack of 'vm'. */
+void lily_vm_clone_push(lily_vm_state *vm, lily_value *source)
+{
+    clone_map map;
+    lily_value copy;
+
+    clone_map_init(&map, 16);
+    clone_value(vm, &map, source, &copy);
+    lily_push_value(vm, &copy);
+    lily_deref(&copy);
+
+    lily_free(map.keys);
+    lily_free(map.values);
+}
+
+/* Free a scope's vm, without destroying the values that it made. Their memory
+   is in the scope's arena and pool, which the caller frees next. The values
+   that hold something else (such as an open file) are destroyed. Foreign values
+   from the source get back the ref that the scope took. */
+void lily_free_scope_vm(lily_vm_state *vm)
+{
+    uint32_t i;
+
+    for (i = 0;i < vm->scope_count;i++) {
+        lily_value *v = vm->scope_values + i;
+
+        if (v->cell_refcount == 0)
+            lily_value_destroy(v);
+        else
+            lily_deref(v);
+    }
+
+    free_vm_parts(vm);
+}
+
+#ifdef LILY_SCOPE_CHECK
+
+static int scope_owns(lily_vm_state *scope, void *ptr)
+{
+    return lily_arena_owns(scope->arena, ptr) ||
+           lily_slab_pool_owns(scope->pool, ptr);
+}
+
+static void check_escape(lily_vm_state *scope, clone_map *seen, lily_value *v,
+        int index)
+{
+    if ((v->flags & VAL_IS_DEREFABLE) == 0 ||
+        clone_map_find(seen, v->value.generic))
+        return;
+
+    int class_id = v->class_id;
+    void *buffer = NULL;
+
+    clone_map_add(seen, v->value.generic, v->value.generic);
+
+    if (class_id == LILY_ID_STRING || class_id == LILY_ID_BYTESTRING)
+        buffer = v->value.string->string;
+    else if (class_id == LILY_ID_HASH)
+        buffer = v->value.hash->entries;
+    else if (class_id == LILY_ID_LIST || class_id == LILY_ID_TUPLE ||
+             (v->flags & VAL_IS_CONTAINER))
+        buffer = v->value.container->values;
+
+    if (scope_owns(scope, v->value.generic) ||
+        (buffer && scope_owns(scope, buffer))) {
+        fprintf(stderr,
+                "Scope escape: Global #%d holds a %s from a closed scope.\n",
+                index, scope->class_table[class_id]->name);
+        return;
+    }
+
+    if (class_id == LILY_ID_HASH) {
+        lily_hash_val *hv = v->value.hash;
+        int i;
+
+        for (i = 0;i < hv->entries_used;i++) {
+            lily_hash_entry *entry = hv->entries + i;
+
+            if (entry->key.flags == 0)
+                continue;
+
+            check_escape(scope, seen, &entry->key, index);
+            check_escape(scope, seen, &entry->record, index);
+        }
+    }
+    else if (class_id == LILY_ID_FUNCTION) {
+        lily_function_val *f = v->value.function;
+        int i;
+
+        for (i = 0;i < f->num_upvalues;i++) {
+            if (f->upvalues[i])
+                check_escape(scope, seen, f->upvalues[i], index);
+        }
+    }
+    else if (buffer && class_id != LILY_ID_STRING &&
+             class_id != LILY_ID_BYTESTRING &&
+             LILY_LIST_IS_PACKED(v->value.container) == 0) {
+        lily_container_val *c = v->value.container;
+        uint32_t i;
+
+        for (i = 0;i < c->num_values;i++)
+            check_escape(scope, seen, c->values + i, index);
+    }
+}
+
+/* Report values of the source that are (or hold) memory from a scope's arena
+   or pool. Those are dangling once the scope is closed. Nothing that a scope
+   runs can store into the source, so the usual cause is an embedder moving a
+   value from a scope into the source. */
+void lily_vm_check_escapes(lily_vm_state *scope)
+{
+    lily_vm_state *source = scope->parser->vm;
+    lily_value *regs = source->regs_from_main;
+    int count = (int)(source->call_chain->top - regs);
+    clone_map seen;
+    int i;
+
+    clone_map_init(&seen, 64);
+
+    for (i = 0;i < count;i++)
+        check_escape(scope, &seen, regs + i, i);
+
+    lily_free(seen.keys);
+    lily_free(seen.values);
+}
+
+#endif
+
 /***
  *      ____
  *     |  _ \ _ __ ___ _ __
@@ -1902,19 +3005,26 @@ void lily_vm_add_class_unchecked(lily_vm_state *vm, lily_class *cls)
  */
 
 #define INTEGER_OP(OP) \
-lhs_reg = vm_regs[code[1]]; \
-rhs_reg = vm_regs[code[2]]; \
-vm_regs[code[3]]->value.integer = \
+lhs_reg = vm_regs + code[1]; \
+rhs_reg = vm_regs + code[2]; \
+vm_regs[code[3]].value.integer = \
 lhs_reg->value.integer OP rhs_reg->value.integer; \
-vm_regs[code[3]]->flags = LILY_ID_INTEGER; \
+vm_regs[code[3]].flags = LILY_ID_INTEGER; \
+code += 5;
+
+#define INTEGER_IMM_OP(OP) \
+lhs_reg = vm_regs + code[2]; \
+vm_regs[code[3]].value.integer = \
+lhs_reg->value.integer OP (int16_t)code[1]; \
+vm_regs[code[3]].flags = LILY_ID_INTEGER; \
 code += 5;
 
 #define DOUBLE_OP(OP) \
-lhs_reg = vm_regs[code[1]]; \
-rhs_reg = vm_regs[code[2]]; \
-vm_regs[code[3]]->value.doubleval = \
+lhs_reg = vm_regs + code[1]; \
+rhs_reg = vm_regs + code[2]; \
+vm_regs[code[3]].value.doubleval = \
 lhs_reg->value.doubleval OP rhs_reg->value.doubleval; \
-vm_regs[code[3]]->flags = LILY_ID_DOUBLE; \
+vm_regs[code[3]].flags = LILY_ID_DOUBLE; \
 code += 5;
 
 /* EQUALITY_COMPARE_OP is used for == and !=, instead of a normal COMPARE_OP.
@@ -1925,55 +3035,158 @@ code += 5;
    Arguments are:
    * op:       The operation to perform relative to the values given. This will
                be substituted like: lhs->value OP rhs->value
-               Do it for string too, but against 0. */
+               Strings and other values are compared against 1 (equal). */
 #define EQUALITY_COMPARE_OP(OP) \
-lhs_reg = vm_regs[code[1]]; \
-rhs_reg = vm_regs[code[2]]; \
+lhs_reg = vm_regs + code[1]; \
+rhs_reg = vm_regs + code[2]; \
 if (lhs_reg->class_id == LILY_ID_DOUBLE) { \
-    vm_regs[code[3]]->value.integer = \
+    vm_regs[code[3]].value.integer = \
     (lhs_reg->value.doubleval OP rhs_reg->value.doubleval); \
 } \
 else if (lhs_reg->class_id == LILY_ID_INTEGER) { \
-    vm_regs[code[3]]->value.integer =  \
+    vm_regs[code[3]].value.integer =  \
     (lhs_reg->value.integer OP rhs_reg->value.integer); \
 } \
 else if (lhs_reg->class_id == LILY_ID_STRING) { \
-    vm_regs[code[3]]->value.integer = \
-    strcmp(lhs_reg->value.string->string, \
-           rhs_reg->value.string->string) OP 0; \
+    vm_regs[code[3]].value.integer = \
+    lily_string_eq(lhs_reg->value.string, rhs_reg->value.string) OP 1; \
 } \
 else { \
     SAVE_LINE(+5); \
-    vm_regs[code[3]]->value.integer = \
+    vm_regs[code[3]].value.integer = \
     lily_value_compare(vm, lhs_reg, rhs_reg) OP 1; \
 } \
-vm_regs[code[3]]->flags = LILY_ID_BOOLEAN; \
+vm_regs[code[3]].flags = LILY_ID_BOOLEAN; \
 code += 5;
 
 #define COMPARE_OP(OP) \
-lhs_reg = vm_regs[code[1]]; \
-rhs_reg = vm_regs[code[2]]; \
+lhs_reg = vm_regs + code[1]; \
+rhs_reg = vm_regs + code[2]; \
 if (lhs_reg->class_id == LILY_ID_DOUBLE) { \
-    vm_regs[code[3]]->value.integer = \
+    vm_regs[code[3]].value.integer = \
     (lhs_reg->value.doubleval OP rhs_reg->value.doubleval); \
 } \
 else if (lhs_reg->class_id == LILY_ID_INTEGER || \
          lhs_reg->class_id == LILY_ID_BYTE) { \
-    vm_regs[code[3]]->value.integer = \
+    vm_regs[code[3]].value.integer = \
     (lhs_reg->value.integer OP rhs_reg->value.integer); \
 } \
 else if (lhs_reg->class_id == LILY_ID_STRING) { \
-    vm_regs[code[3]]->value.integer = \
-    strcmp(lhs_reg->value.string->string, \
-           rhs_reg->value.string->string) OP 0; \
+    vm_regs[code[3]].value.integer = \
+    lily_string_cmp(lhs_reg->value.string, rhs_reg->value.string) OP 0; \
 } \
-vm_regs[code[3]]->flags = LILY_ID_BOOLEAN; \
+vm_regs[code[3]].flags = LILY_ID_BOOLEAN; \
 code += 5;
 
+/* These are used by the o_jump_if_* opcodes that compare two values. The jump
+   is taken if the result of the comparison matches the check bit. */
+#define INTEGER_JUMP_OP(OP) \
+lhs_reg = vm_regs + code[2]; \
+rhs_reg = vm_regs + code[3]; \
+if ((lhs_reg->value.integer OP rhs_reg->value.integer) == code[1]) \
+    code += (int16_t)code[4]; \
+else \
+    code += 5;
+
+#define DOUBLE_JUMP_OP(OP) \
+lhs_reg = vm_regs + code[2]; \
+rhs_reg = vm_regs + code[3]; \
+if ((lhs_reg->value.doubleval OP rhs_reg->value.doubleval) == code[1]) \
+    code += (int16_t)code[4]; \
+else \
+    code += 5;
+
+/* If the compiler supports labels as values, each opcode jumps directly to the
+   next opcode through a table of labels. Each opcode then has an indirect jump
+   of its own, which is easier to predict than the single jump at the top of a
+   switch. The switch is still used to enter the loop, and is the only means of
+   dispatch on compilers without the extension. */
+#ifdef LILY_COMPUTED_GOTO
+# define vm_case(op) case op: label_##op
+# define vm_default  default: label_default
+# define vm_next     COUNT_OPCODE goto *dispatch_table[code[0]]
+#else
+# define vm_case(op) case op
+# define vm_default  default
+# define vm_next     break
+#endif
+
 void lily_vm_execute(lily_vm_state *vm)
 {
+#ifdef LILY_COMPUTED_GOTO
+    static void *dispatch_table[] = {
+        [o_assign]             = &&label_o_assign,
+        [o_assign_noref]       = &&label_o_assign_noref,
+        [o_int_add]            = &&label_o_int_add,
+        [o_int_minus]          = &&label_o_int_minus,
+        [o_int_modulo]         = &&label_o_int_modulo,
+        [o_int_multiply]       = &&label_o_int_multiply,
+        [o_int_divide]         = &&label_o_int_divide,
+        [o_int_left_shift]     = &&label_o_int_left_shift,
+        [o_int_right_shift]    = &&label_o_int_right_shift,
+        [o_int_bitwise_and]    = &&label_o_int_bitwise_and,
+        [o_int_bitwise_or]     = &&label_o_int_bitwise_or,
+        [o_int_bitwise_xor]    = &&label_o_int_bitwise_xor,
+        [o_int_add_imm]        = &&label_o_int_add_imm,
+        [o_int_minus_imm]      = &&label_o_int_minus_imm,
+        [o_number_add]         = &&label_o_number_add,
+        [o_number_minus]       = &&label_o_number_minus,
+        [o_number_multiply]    = &&label_o_number_multiply,
+        [o_number_divide]      = &&label_o_number_divide,
+        [o_compare_eq]         = &&label_o_compare_eq,
+        [o_compare_not_eq]     = &&label_o_compare_not_eq,
+        [o_compare_greater]    = &&label_o_compare_greater,
+        [o_compare_greater_eq] = &&label_o_compare_greater_eq,
+        [o_unary_not]          = &&label_o_unary_not,
+        [o_unary_minus]        = &&label_o_unary_minus,
+        [o_unary_bitwise_not]  = &&label_o_unary_bitwise_not,
+        [o_jump]               = &&label_o_jump,
+        [o_jump_if]            = &&label_o_jump_if,
+        [o_jump_if_not_class]  = &&label_o_jump_if_not_class,
+        [o_jump_if_int_eq]     = &&label_o_jump_if_int_eq,
+        [o_jump_if_int_greater] = &&label_o_jump_if_int_greater,
+        [o_jump_if_int_greater_eq] = &&label_o_jump_if_int_greater_eq,
+        [o_jump_if_number_eq]  = &&label_o_jump_if_number_eq,
+        [o_jump_if_number_greater] = &&label_o_jump_if_number_greater,
+        [o_jump_if_number_greater_eq] = &&label_o_jump_if_number_greater_eq,
+        [o_for_integer]        = &&label_o_for_integer,
+        [o_for_setup]          = &&label_o_for_setup,
+        [o_call_foreign]       = &&label_o_call_foreign,
+        [o_call_native]        = &&label_o_call_native,
+        [o_call_register]      = &&label_o_call_register,
+        [o_return_value]       = &&label_o_return_value,
+        [o_return_unit]        = &&label_o_return_unit,
+        [o_build_list]         = &&label_o_build_list,
+        [o_build_tuple]        = &&label_o_build_tuple,
+        [o_build_hash]         = &&label_o_build_hash,
+        [o_build_variant]      = &&label_o_build_variant,
+        [o_subscript_get]      = &&label_o_subscript_get,
+        [o_subscript_set]      = &&label_o_subscript_set,
+        [o_global_get]         = &&label_o_global_get,
+        [o_global_set]         = &&label_o_global_set,
+        [o_load_readonly]      = &&label_o_load_readonly,
+        [o_load_integer]       = &&label_o_load_integer,
+        [o_load_boolean]       = &&label_o_load_boolean,
+        [o_load_byte]          = &&label_o_load_byte,
+        [o_load_empty_variant] = &&label_o_load_empty_variant,
+        [o_instance_new]       = &&label_o_instance_new,
+        [o_property_get]       = &&label_o_property_get,
+        [o_property_set]       = &&label_o_property_set,
+        [o_catch_push]         = &&label_o_catch_push,
+        [o_catch_pop]          = &&label_o_catch_pop,
+        [o_exception_catch]    = &&label_default,
+        [o_exception_store]    = &&label_default,
+        [o_exception_raise]    = &&label_o_exception_raise,
+        [o_closure_get]        = &&label_o_closure_get,
+        [o_closure_set]        = &&label_o_closure_set,
+        [o_closure_new]        = &&label_o_closure_new,
+        [o_closure_function]   = &&label_o_closure_function,
+        [o_interpolation]      = &&label_o_interpolation,
+        [o_vm_exit]            = &&label_o_vm_exit,
+    };
+#endif
     uint16_t *code;
-    lily_value **vm_regs;
+    lily_value *vm_regs;
     int i;
     register int64_t for_temp;
     register lily_value *lhs_reg, *rhs_reg, *loop_reg, *step_reg;
@@ -1982,6 +3195,10 @@ void lily_vm_execute(lily_vm_state *vm)
 
     lily_call_frame *current_frame = vm->call_chain;
     lily_call_frame *next_frame = NULL;
+#ifdef LILY_OPCODE_STATS
+    /* Pairs that start with o_vm_exit are the first opcode of an entry. */
+    uint16_t last_op = o_vm_exit;
+#endif
 
     code = current_frame->function->code;
 
@@ -1996,100 +3213,107 @@ void lily_vm_execute(lily_vm_state *vm)
     vm_regs = vm->call_chain->start;
 
     while (1) {
+        COUNT_OPCODE
         switch(code[0]) {
-            case o_assign_noref:
-                rhs_reg = vm_regs[code[1]];
-                lhs_reg = vm_regs[code[2]];
+            vm_case(o_assign_noref):
+                rhs_reg = vm_regs + code[1];
+                lhs_reg = vm_regs + code[2];
                 lhs_reg->flags = rhs_reg->flags;
                 lhs_reg->value = rhs_reg->value;
                 code += 4;
-                break;
-            case o_load_readonly:
+                vm_next;
+            vm_case(o_load_readonly):
                 rhs_reg = vm->readonly_table[code[1]];
-                lhs_reg = vm_regs[code[2]];
+                lhs_reg = vm_regs + code[2];
 
                 lily_deref(lhs_reg);
 
                 lhs_reg->value = rhs_reg->value;
                 lhs_reg->flags = rhs_reg->flags;
                 code += 4;
-                break;
-            case o_load_empty_variant:
-                lhs_reg = vm_regs[code[2]];
+                vm_next;
+            vm_case(o_load_empty_variant):
+                lhs_reg = vm_regs + code[2];
 
                 lily_deref(lhs_reg);
 
                 lhs_reg->value.container = NULL;
                 lhs_reg->flags = VAL_IS_ENUM | code[1];
                 code += 4;
-                break;
-            case o_load_integer:
-                lhs_reg = vm_regs[code[2]];
+                vm_next;
+            vm_case(o_load_integer):
+                lhs_reg = vm_regs + code[2];
                 lhs_reg->value.integer = (int16_t)code[1];
                 lhs_reg->flags = LILY_ID_INTEGER;
                 code += 4;
-                break;
-            case o_load_boolean:
-                lhs_reg = vm_regs[code[2]];
+                vm_next;
+            vm_case(o_load_boolean):
+                lhs_reg = vm_regs + code[2];
                 lhs_reg->value.integer = code[1];
                 lhs_reg->flags = LILY_ID_BOOLEAN;
                 code += 4;
-                break;
-            case o_load_byte:
-                lhs_reg = vm_regs[code[2]];
+                vm_next;
+            vm_case(o_load_byte):
+                lhs_reg = vm_regs + code[2];
                 lhs_reg->value.integer = (uint8_t)code[1];
                 lhs_reg->flags = LILY_ID_BYTE;
                 code += 4;
-                break;
-            case o_int_add:
+                vm_next;
+            vm_case(o_int_add):
                 INTEGER_OP(+)
-                break;
-            case o_int_minus:
+                vm_next;
+            vm_case(o_int_minus):
                 INTEGER_OP(-)
-                break;
-            case o_number_add:
+                vm_next;
+            vm_case(o_int_add_imm):
+                INTEGER_IMM_OP(+)
+                vm_next;
+            vm_case(o_int_minus_imm):
+                INTEGER_IMM_OP(-)
+                vm_next;
+            vm_case(o_number_add):
                 DOUBLE_OP(+)
-                break;
-            case o_number_minus:
+                vm_next;
+            vm_case(o_number_minus):
                 DOUBLE_OP(-)
-                break;
-            case o_compare_eq:
+                vm_next;
+            vm_case(o_compare_eq):
                 EQUALITY_COMPARE_OP(==)
-                break;
-            case o_compare_greater:
+                vm_next;
+            vm_case(o_compare_greater):
                 COMPARE_OP(>)
-                break;
-            case o_compare_greater_eq:
+                vm_next;
+            vm_case(o_compare_greater_eq):
                 COMPARE_OP(>=)
-                break;
-            case o_compare_not_eq:
+                vm_next;
+            vm_case(o_compare_not_eq):
                 EQUALITY_COMPARE_OP(!=)
-                break;
-            case o_jump:
+                vm_next;
+            vm_case(o_jump):
                 code += (int16_t)code[1];
-                break;
-            case o_int_multiply:
+                vm_next;
+            vm_case(o_int_multiply):
                 INTEGER_OP(*)
-                break;
-            case o_number_multiply:
+                vm_next;
+            vm_case(o_number_multiply):
                 DOUBLE_OP(*)
-                break;
-            case o_int_divide:
+                vm_next;
+            vm_case(o_int_divide):
                 /* Before doing INTEGER_OP, check for a division by zero. This
                    will involve some redundant checking of the rhs, but better
                    than dumping INTEGER_OP's contents here or rewriting
                    INTEGER_OP for the special case of division. */
-                rhs_reg = vm_regs[code[2]];
+                rhs_reg = vm_regs + code[2];
                 if (rhs_reg->value.integer == 0) {
                     SAVE_LINE(+5);
                     vm_error(vm, LILY_ID_DBZERROR,
                             "Attempt to divide by zero.");
                 }
                 INTEGER_OP(/)
-                break;
-            case o_int_modulo:
+                vm_next;
+            vm_case(o_int_modulo):
                 /* x % 0 will do the same thing as x / 0... */
-                rhs_reg = vm_regs[code[2]];
+                rhs_reg = vm_regs + code[2];
                 if (rhs_reg->value.integer == 0) {
                     SAVE_LINE(+5);
                     vm_error(vm, LILY_ID_DBZERROR,
@@ -2097,24 +3321,24 @@ void lily_vm_execute(lily_vm_state *vm)
                 }
 
                 INTEGER_OP(%)
-                break;
-            case o_int_left_shift:
+                vm_next;
+            vm_case(o_int_left_shift):
                 INTEGER_OP(<<)
-                break;
-            case o_int_right_shift:
+                vm_next;
+            vm_case(o_int_right_shift):
                 INTEGER_OP(>>)
-                break;
-            case o_int_bitwise_and:
+                vm_next;
+            vm_case(o_int_bitwise_and):
                 INTEGER_OP(&)
-                break;
-            case o_int_bitwise_or:
+                vm_next;
+            vm_case(o_int_bitwise_or):
                 INTEGER_OP(|)
-                break;
-            case o_int_bitwise_xor:
+                vm_next;
+            vm_case(o_int_bitwise_xor):
                 INTEGER_OP(^)
-                break;
-            case o_number_divide:
-                rhs_reg = vm_regs[code[2]];
+                vm_next;
+            vm_case(o_number_divide):
+                rhs_reg = vm_regs + code[2];
                 if (rhs_reg->value.doubleval == 0) {
                     SAVE_LINE(+5);
                     vm_error(vm, LILY_ID_DBZERROR,
@@ -2122,9 +3346,9 @@ void lily_vm_execute(lily_vm_state *vm)
                 }
 
                 DOUBLE_OP(/)
-                break;
-            case o_jump_if:
-                lhs_reg = vm_regs[code[2]];
+                vm_next;
+            vm_case(o_jump_if):
+                lhs_reg = vm_regs + code[2];
                 {
                     int id = lhs_reg->class_id;
                     int result;
@@ -2143,12 +3367,13 @@ void lily_vm_execute(lily_vm_state *vm)
                     else
                         code += 4;
                 }
-                break;
-            case o_call_foreign:
+                vm_next;
+            vm_case(o_call_foreign):
                 fval = vm->readonly_table[code[1]]->value.function;
 
                 foreign_func_body: ;
 
+                COUNT_CALL(fval);
                 vm_setup_before_call(vm, code);
 
                 i = code[2];
@@ -2157,9 +3382,12 @@ void lily_vm_execute(lily_vm_state *vm)
                 next_frame->function = fval;
                 next_frame->top = next_frame->start + i;
 
-                if (next_frame->top >= next_frame->register_end) {
+                /* prep_registers clears every register the function has,
+                   including optional arguments that weren't passed. */
+                if (next_frame->start + fval->reg_count >=
+                    next_frame->register_end) {
                     vm->call_chain = next_frame;
-                    grow_vm_registers(vm, i + 1);
+                    grow_vm_registers(vm, fval->reg_count + 1);
                 }
 
                 prep_registers(current_frame, code);
@@ -2167,20 +3395,23 @@ void lily_vm_execute(lily_vm_state *vm)
                 vm_regs = next_frame->start;
                 vm->call_chain = next_frame;
                 vm->call_depth++;
+                SAMPLE_PUSH(vm);
 
                 fval->foreign_func(vm);
 
+                SAMPLE_POP(vm);
                 vm->call_depth--;
                 vm->call_chain = current_frame;
                 vm_regs = current_frame->start;
                 code = current_frame->code;
 
-                break;
-            case o_call_native: {
+                vm_next;
+            vm_case(o_call_native): {
                 fval = vm->readonly_table[code[1]]->value.function;
 
                 native_func_body: ;
 
+                COUNT_CALL(fval);
                 vm_setup_before_call(vm, code);
 
                 next_frame = current_frame->next;
@@ -2197,61 +3428,63 @@ void lily_vm_execute(lily_vm_state *vm)
                 current_frame = current_frame->next;
                 vm->call_chain = current_frame;
                 vm->call_depth++;
+                SAMPLE_PUSH(vm);
 
                 vm_regs = current_frame->start;
                 code = fval->code;
                 upvalues = fval->upvalues;
 
-                break;
+                vm_next;
             }
-            case o_call_register:
-                fval = vm_regs[code[1]]->value.function;
+            vm_case(o_call_register):
+                fval = vm_regs[code[1]].value.function;
 
                 if (fval->code != NULL)
                     goto native_func_body;
                 else
                     goto foreign_func_body;
 
-                break;
-            case o_interpolation:
+                vm_next;
+            vm_case(o_interpolation):
                 do_o_interpolation(vm, code);
                 code += code[1] + 4;
-                break;
-            case o_unary_not:
-                lhs_reg = vm_regs[code[1]];
+                vm_next;
+            vm_case(o_unary_not):
+                lhs_reg = vm_regs + code[1];
 
-                rhs_reg = vm_regs[code[2]];
+                rhs_reg = vm_regs + code[2];
                 rhs_reg->flags = lhs_reg->flags;
                 rhs_reg->value.integer = !(lhs_reg->value.integer);
                 code += 4;
-                break;
-            case o_unary_minus:
-                lhs_reg = vm_regs[code[1]];
+                vm_next;
+            vm_case(o_unary_minus):
+                lhs_reg = vm_regs + code[1];
 
-                rhs_reg = vm_regs[code[2]];
+                rhs_reg = vm_regs + code[2];
                 rhs_reg->flags = LILY_ID_INTEGER;
                 rhs_reg->value.integer = -(lhs_reg->value.integer);
                 code += 4;
-                break;
-            case o_unary_bitwise_not:
-                lhs_reg = vm_regs[code[1]];
+                vm_next;
+            vm_case(o_unary_bitwise_not):
+                lhs_reg = vm_regs + code[1];
 
-                rhs_reg = vm_regs[code[2]];
+                rhs_reg = vm_regs + code[2];
                 rhs_reg->flags = lhs_reg->flags;
                 rhs_reg->value.integer = ~(lhs_reg->value.integer);
                 code += 4;
-                break;
-            case o_return_unit:
+                vm_next;
+            vm_case(o_return_unit):
                 move_unit(current_frame->return_target);
                 goto return_common;
 
-            case o_return_value:
+            vm_case(o_return_value):
                 lhs_reg = current_frame->return_target;
-                rhs_reg = vm_regs[code[1]];
+                rhs_reg = vm_regs + code[1];
                 lily_value_assign(lhs_reg, rhs_reg);
 
                 return_common: ;
 
+                SAMPLE_POP(vm);
                 current_frame = current_frame->prev;
                 vm->call_chain = current_frame;
                 vm->call_depth--;
@@ -2259,87 +3492,91 @@ void lily_vm_execute(lily_vm_state *vm)
                 vm_regs = current_frame->start;
                 upvalues = current_frame->function->upvalues;
                 code = current_frame->code;
-                break;
-            case o_global_get:
-                rhs_reg = vm->regs_from_main[code[1]];
-                lhs_reg = vm_regs[code[2]];
+                vm_next;
+            vm_case(o_global_get):
+                rhs_reg = vm->regs_from_main + code[1];
+                lhs_reg = vm_regs + code[2];
 
                 lily_value_assign(lhs_reg, rhs_reg);
                 code += 4;
-                break;
-            case o_global_set:
-                rhs_reg = vm_regs[code[1]];
-                lhs_reg = vm->regs_from_main[code[2]];
+                vm_next;
+            vm_case(o_global_set):
+                rhs_reg = vm_regs + code[1];
+                lhs_reg = vm->regs_from_main + code[2];
 
                 lily_value_assign(lhs_reg, rhs_reg);
                 code += 4;
-                break;
-            case o_assign:
-                rhs_reg = vm_regs[code[1]];
-                lhs_reg = vm_regs[code[2]];
+                vm_next;
+            vm_case(o_assign):
+                rhs_reg = vm_regs + code[1];
+                lhs_reg = vm_regs + code[2];
 
                 lily_value_assign(lhs_reg, rhs_reg);
                 code += 4;
-                break;
-            case o_subscript_get:
+                vm_next;
+            vm_case(o_subscript_get):
                 /* Might raise IndexError or KeyError. */
                 SAVE_LINE(+5);
                 do_o_subscript_get(vm, code);
                 code += 5;
-                break;
-            case o_property_get:
+                vm_next;
+            vm_case(o_property_get):
                 do_o_property_get(vm, code);
                 code += 5;
-                break;
-            case o_subscript_set:
+                vm_next;
+            vm_case(o_subscript_set):
                 /* Might raise IndexError or KeyError. */
                 SAVE_LINE(+5);
                 do_o_subscript_set(vm, code);
                 code += 5;
-                break;
-            case o_property_set:
+                vm_next;
+            vm_case(o_property_set):
                 do_o_property_set(vm, code);
                 code += 5;
-                break;
-            case o_build_hash:
+                vm_next;
+            vm_case(o_build_hash):
                 do_o_build_hash(vm, code);
                 code += code[2] + 5;
-                break;
-            case o_build_list:
-            case o_build_tuple:
+                vm_next;
+            vm_case(o_build_list):
+            vm_case(o_build_tuple):
                 do_o_build_list_tuple(vm, code);
                 code += code[1] + 4;
-                break;
-            case o_build_variant:
+                vm_next;
+            vm_case(o_build_variant):
                 do_o_build_variant(vm, code);
                 code += code[2] + 5;
-                break;
-            case o_closure_function:
+                vm_next;
+            vm_case(o_closure_function):
                 do_o_closure_function(vm, code);
                 code += 4;
-                break;
-            case o_closure_set:
+                vm_next;
+            vm_case(o_closure_set):
                 lhs_reg = upvalues[code[1]];
-                rhs_reg = vm_regs[code[2]];
+                rhs_reg = vm_regs + code[2];
+
+                if (rhs_reg->flags & VAL_IS_GC_SWEEPABLE)
+                    lily_gc_barrier(vm, rhs_reg);
+
                 if (lhs_reg == NULL)
-                    upvalues[code[1]] = make_cell_from(rhs_reg);
+                    upvalues[code[1]] = make_cell_from(vm, rhs_reg);
                 else
                     lily_value_assign(lhs_reg, rhs_reg);
 
                 code += 4;
-                break;
-            case o_closure_get:
-                lhs_reg = vm_regs[code[2]];
+                vm_next;
+            vm_case(o_closure_get):
+                lhs_reg = vm_regs + code[2];
                 rhs_reg = upvalues[code[1]];
                 lily_value_assign(lhs_reg, rhs_reg);
                 code += 4;
-                break;
-            case o_for_integer:
+                vm_next;
+            vm_case(o_for_integer):
                 /* loop_reg is an internal counter, while lhs_reg is an external
                    counter. rhs_reg is the stopping point. */
-                loop_reg = vm_regs[code[1]];
-                rhs_reg  = vm_regs[code[2]];
-                step_reg = vm_regs[code[3]];
+                loop_reg = vm_regs + code[1];
+                rhs_reg  = vm_regs + code[2];
+                step_reg = vm_regs + code[3];
 
                 /* Note the use of the loop_reg. This makes it use the internal
                    counter, and thus prevent user assignments from damaging the loop. */
@@ -2354,7 +3591,7 @@ void lily_vm_execute(lily_vm_state *vm)
 
                     /* Haven't reached the end yet, so bump the internal and
                        external values.*/
-                    lhs_reg = vm_regs[code[4]];
+                    lhs_reg = vm_regs + code[4];
                     lhs_reg->value.integer = for_temp;
                     loop_reg->value.integer = for_temp;
                     code += 7;
@@ -2362,8 +3599,8 @@ void lily_vm_execute(lily_vm_state *vm)
                 else
                     code += code[5];
 
-                break;
-            case o_catch_push:
+                vm_next;
+            vm_case(o_catch_push):
             {
                 if (vm->catch_chain->next == NULL)
                     add_catch_entry(vm);
@@ -2377,46 +3614,64 @@ void lily_vm_execute(lily_vm_state *vm)
 
                 vm->catch_chain = vm->catch_chain->next;
                 code += 3;
-                break;
+                vm_next;
             }
-            case o_catch_pop:
+            vm_case(o_catch_pop):
                 vm->catch_chain = vm->catch_chain->prev;
 
                 code++;
-                break;
-            case o_exception_raise:
+                vm_next;
+            vm_case(o_exception_raise):
                 SAVE_LINE(+3);
-                lhs_reg = vm_regs[code[1]];
+                lhs_reg = vm_regs + code[1];
                 do_o_exception_raise(vm, lhs_reg);
                 code += 3;
-                break;
-            case o_instance_new:
+                vm_next;
+            vm_case(o_instance_new):
             {
                 do_o_new_instance(vm, code);
                 code += 4;
-                break;
+                vm_next;
             }
-            case o_jump_if_not_class:
+            vm_case(o_jump_if_not_class):
                 i = code[1];
-                lhs_reg = vm_regs[code[2]];
+                lhs_reg = vm_regs + code[2];
 
                 if (lhs_reg->class_id == i)
                     code += 4;
                 else
                     code += code[3];
 
-                break;
-            case o_closure_new:
+                vm_next;
+            vm_case(o_jump_if_int_eq):
+                INTEGER_JUMP_OP(==)
+                vm_next;
+            vm_case(o_jump_if_int_greater):
+                INTEGER_JUMP_OP(>)
+                vm_next;
+            vm_case(o_jump_if_int_greater_eq):
+                INTEGER_JUMP_OP(>=)
+                vm_next;
+            vm_case(o_jump_if_number_eq):
+                DOUBLE_JUMP_OP(==)
+                vm_next;
+            vm_case(o_jump_if_number_greater):
+                DOUBLE_JUMP_OP(>)
+                vm_next;
+            vm_case(o_jump_if_number_greater_eq):
+                DOUBLE_JUMP_OP(>=)
+                vm_next;
+            vm_case(o_closure_new):
                 do_o_closure_new(vm, code);
                 upvalues = current_frame->function->upvalues;
                 code += 4;
-                break;
-            case o_for_setup:
+                vm_next;
+            vm_case(o_for_setup):
                 /* lhs_reg is the start, rhs_reg is the stop. */
-                lhs_reg = vm_regs[code[1]];
-                rhs_reg = vm_regs[code[2]];
-                step_reg = vm_regs[code[3]];
-                loop_reg = vm_regs[code[4]];
+                lhs_reg = vm_regs + code[1];
+                rhs_reg = vm_regs + code[2];
+                step_reg = vm_regs + code[3];
+                loop_reg = vm_regs + code[4];
 
                 if (step_reg->value.integer == 0)
                     vm_error(vm, LILY_ID_VALUEERROR,
@@ -2429,11 +3684,11 @@ void lily_vm_execute(lily_vm_state *vm)
                 loop_reg->flags = LILY_ID_INTEGER;
 
                 code += 6;
-                break;
-            case o_vm_exit:
+                vm_next;
+            vm_case(o_vm_exit):
                 lily_release_jump(vm->raiser);
                 return;
-            default:
+            vm_default:
                 return;
         }
     }
@@ -1,6 +1,8 @@
 #ifndef LILY_VM_H
 # define LILY_VM_H
 
+# include <signal.h>
+
 # include "lily.h"
 
 # include "lily_raiser.h"
@@ -8,11 +10,11 @@
 
 typedef struct lily_call_frame_ {
     /* This frame's registers start here. */
-    lily_value **start;
+    lily_value *start;
     /* One past the last register used (next frame starts here). */
-    lily_value **top;
+    lily_value *top;
     /* Starts at the last register available. Grow when top == end. */
-    lily_value **register_end;
+    lily_value *register_end;
     /* With foreign functions, this is always set to an instruction to leave the
        vm.
 
@@ -53,12 +55,21 @@ typedef struct lily_vm_catch_entry_ {
 } lily_vm_catch_entry;
 
 typedef struct lily_vm_state_ {
-    lily_value **regs_from_main;
+    /* Registers are a single block of values that all frames share. Growing
+       the block may move it, so register pointers are only valid until the next
+       push or call. */
+    lily_value *regs_from_main;
 
     uint32_t call_depth;
 
     uint32_t depth_max;
 
+    /* How many frames past the toplevel frame are running. The profiler's
+       signal handler walks this many frames up from the toplevel frame, so
+       this only grows once the new frame is filled in, and only shrinks before
+       a frame is reused. */
+    volatile sig_atomic_t sample_depth;
+
     lily_call_frame *call_chain;
 
     lily_value **readonly_table;
@@ -72,7 +83,8 @@ typedef struct lily_vm_state_ {
     /* A linked list of entries not currently in use. */
     lily_gc_entry *gc_spare_entries;
 
-    /* How many entries are in ->gc_live_entries. If this is >= ->gc_threshold,
+    /* How many entries are in ->gc_live_entries (and ->gc_sweep_entries while
+       sweeping). If this is >= ->gc_threshold,
        then the gc is triggered when there is an attempt to attach a gc_entry
        to a value. */
     uint32_t gc_live_entry_count;
@@ -87,6 +99,25 @@ typedef struct lily_vm_state_ {
        the threshold is multiplied by to increase it. */
     uint32_t gc_multiplier;
 
+    /* Entries that have been marked, but not scanned yet. This is only used
+       while a collection is marking. */
+    lily_gc_entry **gc_gray;
+    uint32_t gc_gray_pos;
+    uint32_t gc_gray_size;
+
+    /* Which part of a collection is running (GC_* in lily_vm.c). */
+    uint32_t gc_state;
+
+    /* Entries that sweeping has not visited yet. */
+    lily_gc_entry *gc_sweep_entries;
+
+    /* Entries holding hollowed values that sweeping has not freed yet. */
+    lily_gc_entry *gc_hollow_entries;
+
+    /* How long collection steps have paused the interpreter. See
+       lily_gc_pause_histogram for what each bucket holds. */
+    uint64_t gc_pause_counts[LILY_GC_PAUSE_BUCKETS];
+
     lily_vm_catch_entry *catch_chain;
 
     /* If a proper value is being raised (currently only the `raise` keyword),
@@ -97,9 +128,56 @@ typedef struct lily_vm_state_ {
 
     lily_class *exception_cls;
 
+    /* Values made by the vm (and literals made by symtab) come from here. This
+       isn't freed with the vm, since symtab's literals outlive it. */
+    lily_slab_pool *pool;
+
+    /* One copy of each String that has been interned. Keys are the Strings,
+       and records are the literal index of the String (or -1 for Strings
+       interned by String.intern). Symtab uses this to find String literals,
+       so literals are in here from the start. */
+    lily_hash_val *interned_strings;
+
     /* This buffer is used as an intermediate storage for String values. */
     lily_msgbuf *vm_buffer;
 
+    /* If the config has an output_size, template content and output for stdout
+       are collected here, then sent to render_func in batches. Otherwise, this
+       is NULL. */
+    lily_msgbuf *out_buffer;
+
+    /* Send the buffer out once it holds at least this many bytes. */
+    uint32_t out_limit;
+
+    /* A state made by lily_clone_state builds its error messages here, since
+       parser's msgbuf belongs to the state that was cloned. This is NULL for
+       the state that owns the parser. */
+    lily_msgbuf *error_buffer;
+
+    /* A state made by lily_open_scope makes the buffers of its values (string
+       text, List elements, and so on) from this arena. Closing the scope frees
+       the arena and the pool without destroying values one at a time. This is
+       NULL for other states. */
+    lily_arena *arena;
+
+    /* Values that a scope has to finish before the arena is freed. Files and
+       foreign values made in the scope have a cell_refcount of 0, and are
+       destroyed. The rest are foreign values shared with the state the scope
+       came from. Those have a cell_refcount of 1, for the ref that the scope
+       took and gives back. */
+    lily_value *scope_values;
+    uint32_t scope_count;
+    uint32_t scope_size;
+
+#ifdef LILY_OPCODE_STATS
+    /* How many times each opcode has run. */
+    uint64_t *op_counts;
+
+    /* How many times each pair of opcodes has run, as first * count + second
+       (count is the number of opcodes). */
+    uint64_t *pair_counts;
+#endif
+
     /* This is used to dynaload exceptions when absolutely necessary. */
     struct lily_parse_state_ *parser;
     lily_raiser *raiser;
@@ -109,12 +187,25 @@ typedef struct lily_vm_state_ {
     void *data;
 } lily_vm_state;
 
-lily_vm_state *lily_new_vm_state(lily_raiser *);
+lily_vm_state *lily_new_vm_state(lily_raiser *, lily_arena *);
+lily_vm_state *lily_vm_clone(lily_vm_state *, int, lily_arena *);
+void lily_vm_clone_push(lily_vm_state *, lily_value *);
+#ifdef LILY_SCOPE_CHECK
+void lily_vm_check_escapes(lily_vm_state *);
+#endif
 void lily_free_vm(lily_vm_state *);
+void lily_free_scope_vm(lily_vm_state *);
 void lily_setup_toplevel(lily_vm_state *, lily_function_val *);
 void lily_vm_execute(lily_vm_state *);
 
+void lily_vm_write_out(lily_vm_state *, const char *, uint32_t);
+void lily_vm_write(lily_vm_state *, FILE *, const char *, uint32_t);
+
 void lily_vm_ensure_class_table(lily_vm_state *, int);
 void lily_vm_add_class_unchecked(lily_vm_state *, lily_class *);
 
+void lily_vm_push_opcode_counts(lily_vm_state *);
+void lily_vm_push_call_counts(lily_vm_state *);
+void lily_vm_dump_stats(lily_vm_state *);
+
 #endif
@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lily.h"
+
+#include "lily_alloc.h"
+#include "lily_parser.h"
+#include "lily_value_structs.h"
+
+#include "lily_int_opcode.h"
+
+/** These are counters for deciding which parts of the vm are worth making
+    faster. When Lily is built with WITH_OPCODE_STATS, the vm counts how many
+    times each opcode runs, how many times each opcode runs right after another,
+    and how many times each function is called. Calls are counted on the proto,
+    so closures made from the same function share a count.
+
+    The counters are always there for embedders and the sys package to look at.
+    In a normal build, they're always 0. **/
+
+#define OPCODE_COUNT (o_vm_exit + 1)
+
+#define OPCODE_NAME(op) [op] = #op
+
+static const char *opcode_names[OPCODE_COUNT] = {
+    OPCODE_NAME(o_assign),
+    OPCODE_NAME(o_assign_noref),
+    OPCODE_NAME(o_int_add),
+    OPCODE_NAME(o_int_minus),
+    OPCODE_NAME(o_int_modulo),
+    OPCODE_NAME(o_int_multiply),
+    OPCODE_NAME(o_int_divide),
+    OPCODE_NAME(o_int_left_shift),
+    OPCODE_NAME(o_int_right_shift),
+    OPCODE_NAME(o_int_bitwise_and),
+    OPCODE_NAME(o_int_bitwise_or),
+    OPCODE_NAME(o_int_bitwise_xor),
+    OPCODE_NAME(o_int_add_imm),
+    OPCODE_NAME(o_int_minus_imm),
+    OPCODE_NAME(o_number_add),
+    OPCODE_NAME(o_number_minus),
+    OPCODE_NAME(o_number_multiply),
+    OPCODE_NAME(o_number_divide),
+    OPCODE_NAME(o_compare_eq),
+    OPCODE_NAME(o_compare_not_eq),
+    OPCODE_NAME(o_compare_greater),
+    OPCODE_NAME(o_compare_greater_eq),
+    OPCODE_NAME(o_unary_not),
+    OPCODE_NAME(o_unary_minus),
+    OPCODE_NAME(o_unary_bitwise_not),
+    OPCODE_NAME(o_jump),
+    OPCODE_NAME(o_jump_if),
+    OPCODE_NAME(o_jump_if_not_class),
+    OPCODE_NAME(o_jump_if_int_eq),
+    OPCODE_NAME(o_jump_if_int_greater),
+    OPCODE_NAME(o_jump_if_int_greater_eq),
+    OPCODE_NAME(o_jump_if_number_eq),
+    OPCODE_NAME(o_jump_if_number_greater),
+    OPCODE_NAME(o_jump_if_number_greater_eq),
+    OPCODE_NAME(o_for_integer),
+    OPCODE_NAME(o_for_setup),
+    OPCODE_NAME(o_call_foreign),
+    OPCODE_NAME(o_call_native),
+    OPCODE_NAME(o_call_register),
+    OPCODE_NAME(o_return_value),
+    OPCODE_NAME(o_return_unit),
+    OPCODE_NAME(o_build_list),
+    OPCODE_NAME(o_build_tuple),
+    OPCODE_NAME(o_build_hash),
+    OPCODE_NAME(o_build_variant),
+    OPCODE_NAME(o_subscript_get),
+    OPCODE_NAME(o_subscript_set),
+    OPCODE_NAME(o_global_get),
+    OPCODE_NAME(o_global_set),
+    OPCODE_NAME(o_load_readonly),
+    OPCODE_NAME(o_load_integer),
+    OPCODE_NAME(o_load_boolean),
+    OPCODE_NAME(o_load_byte),
+    OPCODE_NAME(o_load_empty_variant),
+    OPCODE_NAME(o_instance_new),
+    OPCODE_NAME(o_property_get),
+    OPCODE_NAME(o_property_set),
+    OPCODE_NAME(o_catch_push),
+    OPCODE_NAME(o_catch_pop),
+    OPCODE_NAME(o_exception_catch),
+    OPCODE_NAME(o_exception_store),
+    OPCODE_NAME(o_exception_raise),
+    OPCODE_NAME(o_closure_get),
+    OPCODE_NAME(o_closure_set),
+    OPCODE_NAME(o_closure_new),
+    OPCODE_NAME(o_closure_function),
+    OPCODE_NAME(o_interpolation),
+    OPCODE_NAME(o_vm_exit)
+};
+
+/* Stats dumps only show this many of the top opcode pairs and functions. */
+#define DUMP_LIMIT 40
+
+const char *lily_opcode_name(int op)
+{
+    if (op < 0 || op >= OPCODE_COUNT)
+        return NULL;
+
+    return opcode_names[op];
+}
+
+uint64_t lily_opcode_count(lily_state *s, int op)
+{
+#ifdef LILY_OPCODE_STATS
+    if (op >= 0 && op < OPCODE_COUNT)
+        return s->op_counts[op];
+#else
+    (void)s;
+    (void)op;
+#endif
+    return 0;
+}
+
+uint64_t lily_opcode_pair_count(lily_state *s, int first, int second)
+{
+#ifdef LILY_OPCODE_STATS
+    if (first >= 0 && first < OPCODE_COUNT &&
+        second >= 0 && second < OPCODE_COUNT)
+        return s->pair_counts[first * OPCODE_COUNT + second];
+#else
+    (void)s;
+    (void)first;
+    (void)second;
+#endif
+    return 0;
+}
+
+uint64_t lily_function_call_count(lily_function_val *f)
+{
+#ifdef LILY_OPCODE_STATS
+    return f->proto->call_count;
+#else
+    (void)f;
+    return 0;
+#endif
+}
+
+#ifdef LILY_OPCODE_STATS
+static void push_count(lily_state *s, lily_hash_val *hv, const char *key,
+        uint64_t count)
+{
+    lily_push_string(s, key);
+    lily_push_integer(s, (int64_t)count);
+    lily_hash_set_from_stack(s, hv);
+}
+#endif
+
+/* Push a Hash of opcode names to how many times they ran. Opcode pairs have a
+   key of both names, separated by a space. Opcodes and pairs that never ran are
+   left out. */
+void lily_vm_push_opcode_counts(lily_vm_state *vm)
+{
+    lily_hash_val *hv = lily_push_hash(vm, 0);
+#ifdef LILY_OPCODE_STATS
+    lily_msgbuf *msgbuf = lily_new_msgbuf(64);
+    int i, j;
+
+    for (i = 0;i < OPCODE_COUNT;i++) {
+        if (vm->op_counts[i])
+            push_count(vm, hv, opcode_names[i], vm->op_counts[i]);
+    }
+
+    for (i = 0;i < OPCODE_COUNT;i++) {
+        for (j = 0;j < OPCODE_COUNT;j++) {
+            uint64_t count = vm->pair_counts[i * OPCODE_COUNT + j];
+
+            if (count == 0)
+                continue;
+
+            lily_mb_flush(msgbuf);
+            lily_mb_add_fmt(msgbuf, "%s %s", opcode_names[i], opcode_names[j]);
+            push_count(vm, hv, lily_mb_raw(msgbuf), count);
+        }
+    }
+
+    lily_free_msgbuf(msgbuf);
+#else
+    (void)hv;
+#endif
+}
+
+/* Push a Hash of function names to how many times they were called. Functions
+   with the same name (such as lambdas) are added together. */
+void lily_vm_push_call_counts(lily_vm_state *vm)
+{
+    lily_hash_val *hv = lily_push_hash(vm, 0);
+#ifdef LILY_OPCODE_STATS
+    lily_proto_stack *protos = vm->parser->emit->protos;
+    uint32_t i;
+
+    for (i = 0;i < protos->pos;i++) {
+        lily_proto *p = protos->data[i];
+
+        if (p->call_count == 0)
+            continue;
+
+        lily_push_string(vm, p->name);
+
+        lily_value *key = lily_stack_get_top(vm);
+        lily_value *record = lily_hash_get(vm, hv, key);
+        int64_t total = (int64_t)p->call_count;
+
+        if (record)
+            total += record->value.integer;
+
+        lily_push_integer(vm, total);
+        lily_hash_set_from_stack(vm, hv);
+    }
+#else
+    (void)hv;
+#endif
+}
+
+#ifdef LILY_OPCODE_STATS
+typedef struct {
+    uint64_t count;
+    const char *name;
+    const char *second;
+} stat_entry;
+
+static int compare_entries(const void *left, const void *right)
+{
+    const stat_entry *l = left;
+    const stat_entry *r = right;
+
+    return (l->count < r->count) - (l->count > r->count);
+}
+
+static void dump_entries(const char *title, stat_entry *entries, int count,
+        uint64_t total)
+{
+    int i;
+
+    qsort(entries, count, sizeof(*entries), compare_entries);
+    fprintf(stderr, "\n%s\n", title);
+
+    for (i = 0;i < count;i++) {
+        stat_entry *e = entries + i;
+        double percent = total ? 100.0 * e->count / total : 0;
+
+        fprintf(stderr, "%14llu %6.2f%%  %s%s%s\n",
+                (unsigned long long)e->count, percent, e->name,
+                e->second ? " " : "", e->second ? e->second : "");
+    }
+}
+
+/* This is called when the interpreter is freed. */
+void lily_vm_dump_stats(lily_vm_state *vm)
+{
+    lily_proto_stack *protos = vm->parser->emit->protos;
+    int size = OPCODE_COUNT * OPCODE_COUNT;
+    stat_entry *entries = lily_malloc(size * sizeof(*entries));
+    uint64_t total = 0;
+    int i, count = 0;
+
+    for (i = 0;i < OPCODE_COUNT;i++) {
+        if (vm->op_counts[i] == 0)
+            continue;
+
+        entries[count].count = vm->op_counts[i];
+        entries[count].name = opcode_names[i];
+        entries[count].second = NULL;
+        total += vm->op_counts[i];
+        count++;
+    }
+
+    fprintf(stderr, "Opcodes executed: %llu\n", (unsigned long long)total);
+    dump_entries("Opcodes:", entries, count, total);
+
+    for (i = 0, count = 0;i < size;i++) {
+        if (vm->pair_counts[i] == 0)
+            continue;
+
+        entries[count].count = vm->pair_counts[i];
+        entries[count].name = opcode_names[i / OPCODE_COUNT];
+        entries[count].second = opcode_names[i % OPCODE_COUNT];
+        count++;
+    }
+
+    if (count > DUMP_LIMIT) {
+        qsort(entries, count, sizeof(*entries), compare_entries);
+        count = DUMP_LIMIT;
+    }
+
+    dump_entries("Opcode pairs:", entries, count, total);
+
+    entries = lily_realloc(entries, (protos->pos + 1) * sizeof(*entries));
+    total = 0;
+
+    for (i = 0, count = 0;i < (int)protos->pos;i++) {
+        lily_proto *p = protos->data[i];
+
+        if (p->call_count == 0)
+            continue;
+
+        entries[count].count = p->call_count;
+        entries[count].name = p->name;
+        entries[count].second = NULL;
+        total += p->call_count;
+        count++;
+    }
+
+    if (count > DUMP_LIMIT) {
+        qsort(entries, count, sizeof(*entries), compare_entries);
+        count = DUMP_LIMIT;
+    }
+
+    dump_entries("Calls:", entries, count, total);
+    lily_free(entries);
+}
+#endif
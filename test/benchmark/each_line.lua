@@ -0,0 +1,20 @@
+local path = "each_line_bench.txt"
+local line = "the quick brown fox jumps over the lazy dog 0123456789\n"
+
+local f = io.open(path, "w")
+for i = 1, 200000 do
+  f:write(line)
+end
+f:close()
+
+local start = os.clock()
+local lines = 0
+local size = 0
+
+for l in io.lines(path, "L") do
+  lines = lines + 1
+  size = size + #l
+end
+
+io.write(lines .. " " .. size .. "\n")
+io.write(string.format("elapsed: %.8f\n", os.clock() - start))
@@ -0,0 +1,22 @@
+from __future__ import print_function
+
+import time
+
+path = "each_line_bench.txt"
+line = "the quick brown fox jumps over the lazy dog 0123456789\n"
+
+with open(path, "w") as f:
+  for i in range(200000):
+    f.write(line)
+
+start = time.clock()
+lines = 0
+size = 0
+
+with open(path, "rb") as f:
+  for l in f:
+    lines += 1
+    size += len(l)
+
+print(str(lines) + " " + str(size))
+print("elapsed: " + str(time.clock() - start))
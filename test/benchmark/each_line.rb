@@ -0,0 +1,20 @@
+path = "each_line_bench.txt"
+line = "the quick brown fox jumps over the lazy dog 0123456789\n"
+
+File.open(path, "w") do |f|
+  200000.times { f.write(line) }
+end
+
+start = Time.now
+lines = 0
+size = 0
+
+File.open(path, "rb") do |f|
+  f.each_line do |l|
+    lines += 1
+    size += l.bytesize
+  end
+end
+
+puts "#{lines} #{size}"
+puts "elapsed: " + (Time.now - start).to_s
@@ -4,7 +4,13 @@ library extend
 This provides extension functions to the testing suite.
 */
 
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
 #include "lily.h"
+#include "lily_string_scan.h"
 
 /** Begin autogen section. **/
 const char *lily_extend_table[] = {
@@ -13,6 +19,19 @@ const char *lily_extend_table[] = {
     ,"F\0parse_string\0(String,String): Result[String,Boolean]"
     ,"F\0parse_expr\0(String,String): Result[String,String]"
     ,"F\0parse_rewind\0(String,String,String): String"
+    ,"F\0parse_cached_file\0(String): Tuple[Boolean,String]"
+    ,"F\0remove_file\0(String)"
+    ,"F\0render_buffered\0(String,Integer): String"
+    ,"F\0run_clones\0(String,Integer): String"
+    ,"F\0run_scopes\0(String,Integer): String"
+    ,"F\0run_clones_after\0(String,String,Integer): String"
+    ,"F\0run_scope_and_source\0(String): String"
+    ,"F\0run_scopes_together\0(String): String"
+    ,"F\0call_at_depths\0(String,Integer): String"
+    ,"F\0gc_pauses\0(String): List[Integer]"
+    ,"F\0profile_string\0(String,String): Boolean"
+    ,"F\0opcode_stats\0: Boolean"
+    ,"F\0check_string_scan\0(Integer,Integer): String"
     ,"Z"
 };
 #define toplevel_OFFSET 1
@@ -20,6 +39,19 @@ void lily_extend__render_string(lily_state *);
 void lily_extend__parse_string(lily_state *);
 void lily_extend__parse_expr(lily_state *);
 void lily_extend__parse_rewind(lily_state *);
+void lily_extend__parse_cached_file(lily_state *);
+void lily_extend__remove_file(lily_state *);
+void lily_extend__render_buffered(lily_state *);
+void lily_extend__run_clones(lily_state *);
+void lily_extend__run_scopes(lily_state *);
+void lily_extend__run_clones_after(lily_state *);
+void lily_extend__run_scope_and_source(lily_state *);
+void lily_extend__run_scopes_together(lily_state *);
+void lily_extend__call_at_depths(lily_state *);
+void lily_extend__gc_pauses(lily_state *);
+void lily_extend__profile_string(lily_state *);
+void lily_extend__opcode_stats(lily_state *);
+void lily_extend__check_string_scan(lily_state *);
 void *lily_extend_loader(lily_state *s, int id)
 {
     switch (id) {
@@ -27,47 +59,123 @@ void *lily_extend_loader(lily_state *s, int id)
         case toplevel_OFFSET + 1: return lily_extend__parse_string;
         case toplevel_OFFSET + 2: return lily_extend__parse_expr;
         case toplevel_OFFSET + 3: return lily_extend__parse_rewind;
+        case toplevel_OFFSET + 4: return lily_extend__parse_cached_file;
+        case toplevel_OFFSET + 5: return lily_extend__remove_file;
+        case toplevel_OFFSET + 6: return lily_extend__render_buffered;
+        case toplevel_OFFSET + 7: return lily_extend__run_clones;
+        case toplevel_OFFSET + 8: return lily_extend__run_scopes;
+        case toplevel_OFFSET + 9: return lily_extend__run_clones_after;
+        case toplevel_OFFSET + 10: return lily_extend__run_scope_and_source;
+        case toplevel_OFFSET + 11: return lily_extend__run_scopes_together;
+        case toplevel_OFFSET + 12: return lily_extend__call_at_depths;
+        case toplevel_OFFSET + 13: return lily_extend__gc_pauses;
+        case toplevel_OFFSET + 14: return lily_extend__profile_string;
+        case toplevel_OFFSET + 15: return lily_extend__opcode_stats;
+        case toplevel_OFFSET + 16: return lily_extend__check_string_scan;
         default: return NULL;
     }
 }
 /** End autogen section. **/
 
+/* pre-commit-tests sets this if it's given -compare-opt. Each string that is
+   run is then run with and without the optimizer, and the result is a Failure
+   if the two runs don't have the same outcome. */
+int extend_compare_optimizer = 0;
+
+typedef enum {
+    run_parse,
+    run_render,
+    run_expr
+} run_mode;
+
 void noop_render(const char *to_render, void *data)
 {
     (void)data;
     (void)to_render;
 }
 
-static void run_interp(lily_state *s, int parse)
+/* Run 'data' in a new interpreter. The error message (or the output of an
+   expression) is put into 'msgbuf'. */
+static int run_subinterp(const char *context, const char *data, run_mode mode,
+        int optimize, lily_msgbuf *msgbuf)
 {
-    const char *context = lily_arg_string_raw(s, 0);
-    const char *data = lily_arg_string_raw(s, 1);
-
     lily_config config;
 
     lily_config_init(&config);
     config.render_func = noop_render;
+    config.optimize = optimize;
 
     lily_state *subinterp = lily_new_state(&config);
-    lily_container_val *con;
-
+    const char *output = NULL;
     int result;
 
-    if (parse)
+    if (mode == run_parse)
         result = lily_parse_string(subinterp, context, data);
-    else
+    else if (mode == run_render)
         result = lily_render_string(subinterp, context, data);
+    else
+        result = lily_parse_expr(subinterp, context, (char *)data, &output);
+
+    if (result == 0)
+        lily_mb_add(msgbuf, lily_error_message(subinterp));
+    else if (output)
+        lily_mb_add(msgbuf, output);
+
+    lily_free_state(subinterp);
+    return result;
+}
+
+/* If the runs don't match, 'msgbuf' is given both results, and the result is 0
+   so that the test fails. */
+static int compare_runs(int result, lily_msgbuf *msgbuf, int other_result,
+        lily_msgbuf *other)
+{
+    if (result == other_result &&
+        strcmp(lily_mb_raw(msgbuf), lily_mb_raw(other)) == 0)
+        return result;
+
+    lily_msgbuf *both = lily_new_msgbuf(64);
+
+    lily_mb_add_fmt(both, "Optimizer changed the result.\n"
+            "Optimized (%d):\n%s\nUnoptimized (%d):\n%s", result,
+            lily_mb_raw(msgbuf), other_result, lily_mb_raw(other));
+    lily_mb_flush(msgbuf);
+    lily_mb_add(msgbuf, lily_mb_raw(both));
+    lily_free_msgbuf(both);
+    return 0;
+}
+
+static void run_interp(lily_state *s, run_mode mode)
+{
+    const char *context = lily_arg_string_raw(s, 0);
+    const char *data = lily_arg_string_raw(s, 1);
+    lily_msgbuf *msgbuf = lily_new_msgbuf(64);
+    lily_container_val *con;
+
+    int result = run_subinterp(context, data, mode, 1, msgbuf);
+
+    if (extend_compare_optimizer) {
+        lily_msgbuf *other = lily_new_msgbuf(64);
+        int other_result = run_subinterp(context, data, mode, 0, other);
+
+        result = compare_runs(result, msgbuf, other_result, other);
+        lily_free_msgbuf(other);
+    }
 
     if (result == 0) {
         con = lily_push_failure(s);
-        lily_push_string(s, lily_error_message(subinterp));
+        lily_push_string(s, lily_mb_raw(msgbuf));
     }
     else {
         con = lily_push_success(s);
-        lily_push_boolean(s, 1);
+
+        if (mode == run_expr)
+            lily_push_string(s, lily_mb_raw(msgbuf));
+        else
+            lily_push_boolean(s, 1);
     }
 
-    lily_free_state(subinterp);
+    lily_free_msgbuf(msgbuf);
 
     lily_con_set_from_stack(s, con, 0);
     lily_return_top(s);
@@ -81,7 +189,7 @@ with `context` used as the filename.
 */
 void lily_extend__render_string(lily_state *s)
 {
-    run_interp(s, 0);
+    run_interp(s, run_render);
 }
 
 /**
@@ -92,7 +200,7 @@ This function processes `to_interpret` as a `String` containing code with
 */
 void lily_extend__parse_string(lily_state *s)
 {
-    run_interp(s, 1);
+    run_interp(s, run_parse);
 }
 
 /**
@@ -103,47 +211,312 @@ either an interpreter error or the result of interpolating the expression.
 */
 void lily_extend__parse_expr(lily_state *s)
 {
-    const char *context = lily_arg_string_raw(s, 0);
-    char *data = (char *)lily_arg_string_raw(s, 1);
+    run_interp(s, run_expr);
+}
 
+static void run_rewind(const char *context, const char *header,
+        const char *data, int optimize, lily_msgbuf *msgbuf)
+{
     lily_config config;
 
     lily_config_init(&config);
     config.render_func = noop_render;
+    config.optimize = optimize;
 
     lily_state *subinterp = lily_new_state(&config);
-    lily_container_val *con;
 
-    const char *output;
-    int result = lily_parse_expr(subinterp, context, data, &output);
+    lily_parse_string(subinterp, context, header);
+    lily_parse_string(subinterp, context, data);
+    lily_mb_add(msgbuf, lily_error_message(subinterp));
+    lily_parse_string(subinterp, context, data);
+    lily_mb_add(msgbuf, lily_error_message(subinterp));
 
-    if (result == 0) {
-        con = lily_push_failure(s);
+    lily_free_state(subinterp);
+}
+
+/**
+define parse_rewind(context: String, prelude: String, to_interpret: String): String
+
+This function processes `prelude` once, then `to_interpret` twice. This checks
+if the error message from `to_interpret` is the same for each pass.
+*/
+void lily_extend__parse_rewind(lily_state *s)
+{
+    const char *context = lily_arg_string_raw(s, 0);
+    const char *header = lily_arg_string_raw(s, 1);
+    const char *data = lily_arg_string_raw(s, 2);
+    lily_msgbuf *msgbuf = lily_msgbuf_get(s);
+
+    /* The prelude shouldn't fail, and the two passes both should. Return the
+       output of both parses in case they fail for different reasons. */
+    run_rewind(context, header, data, 1, msgbuf);
+
+    if (extend_compare_optimizer) {
+        lily_msgbuf *other = lily_new_msgbuf(64);
+
+        run_rewind(context, header, data, 0, other);
+        compare_runs(1, msgbuf, 1, other);
+        lily_free_msgbuf(other);
+    }
+
+    lily_push_string(s, lily_mb_raw(msgbuf));
+    lily_return_top(s);
+}
+
+/**
+define parse_cached_file(path: String): Tuple[Boolean, String]
+
+This function runs the file at `path` with the bytecode cache enabled. The first
+run saves a cache next to the file, and later runs load from it. The result is
+`true` if the program was loaded from the cache (`false` if it was parsed), and
+the error that the run raised (or an empty `String`).
+*/
+void lily_extend__parse_cached_file(lily_state *s)
+{
+    const char *path = lily_arg_string_raw(s, 0);
+
+    lily_config config;
+
+    lily_config_init(&config);
+    config.bytecode_cache = 1;
+
+    lily_state *subinterp = lily_new_state(&config);
+    lily_container_val *con = lily_push_tuple(s, 2);
+    int ok = lily_parse_file(subinterp, path);
+
+    lily_push_boolean(s, lily_used_cache(subinterp));
+    lily_con_set_from_stack(s, con, 0);
+
+    if (ok == 0)
         lily_push_string(s, lily_error_message(subinterp));
+    else
+        lily_push_string(s, "");
+
+    lily_con_set_from_stack(s, con, 1);
+    lily_free_state(subinterp);
+    lily_return_top(s);
+}
+
+/**
+define remove_file(path: String)
+
+This function removes the file at `path`, if there is one.
+*/
+void lily_extend__remove_file(lily_state *s)
+{
+    remove(lily_arg_string_raw(s, 0));
+    lily_return_unit(s);
+}
+
+static void capture_render(const char *to_render, void *data)
+{
+    lily_msgbuf *msgbuf = (lily_msgbuf *)data;
+
+    lily_mb_add(msgbuf, to_render);
+    lily_mb_add_char(msgbuf, '|');
+}
+
+/**
+define render_buffered(to_interpret: String, size: Integer): String
+
+This function renders `to_interpret` with an output buffer of `size` bytes. The
+result is each batch of output that was sent out, with a `|` after each.
+*/
+void lily_extend__render_buffered(lily_state *s)
+{
+    const char *data = lily_arg_string_raw(s, 0);
+    int size = (int)lily_arg_integer(s, 1);
+    lily_msgbuf *msgbuf = lily_new_msgbuf(64);
+
+    lily_config config;
+
+    lily_config_init(&config);
+    config.render_func = capture_render;
+    config.data = msgbuf;
+    config.output_size = size;
+
+    lily_state *subinterp = lily_new_state(&config);
+
+    if (lily_render_string(subinterp, "[buffered]", data) == 0)
+        lily_mb_add(msgbuf, lily_error_message(subinterp));
+
+    lily_free_state(subinterp);
+
+    lily_push_string(s, lily_mb_raw(msgbuf));
+    lily_free_msgbuf(msgbuf);
+    lily_return_top(s);
+}
+
+/* Parse 'data' in a new interpreter, then call its run function twice in each
+   of 'count' copies. The copies are scopes if 'scoped' is set, or clones
+   otherwise. */
+static void run_copies(lily_state *s, const char *first, const char *data,
+        int count, int scoped)
+{
+    lily_msgbuf *msgbuf = lily_new_msgbuf(64);
+    int i, j;
+
+    lily_config config;
+
+    lily_config_init(&config);
+    config.render_func = noop_render;
+
+    lily_state *subinterp = lily_new_state(&config);
+
+    /* This interpreter is running, so it can't be cloned. */
+    if (lily_clone_state(s) != NULL || lily_open_scope(s) != NULL)
+        lily_mb_add(msgbuf, "Cloned a running state.|");
+
+    if ((first && lily_parse_string(subinterp, "[clones]", first) == 0) ||
+        lily_parse_string(subinterp, "[clones]", data) == 0)
+        lily_mb_add(msgbuf, lily_error_message(subinterp));
+    else {
+        for (i = 0;i < count;i++) {
+            lily_state *clone;
+
+            if (scoped)
+                clone = lily_open_scope(subinterp);
+            else
+                clone = lily_clone_state(subinterp);
+
+            if (i == 0 &&
+                lily_parse_string(clone, "[clones]", "1") == 0)
+                lily_mb_add(msgbuf, lily_error_message(clone));
+
+            lily_call_prepare(clone, lily_find_function(clone, "run"));
+
+            for (j = 0;j < 2;j++) {
+                if (j)
+                    lily_mb_add_char(msgbuf, ',');
+
+                if (lily_call_trapped(clone, 0))
+                    lily_mb_add(msgbuf,
+                            lily_as_string_raw(lily_call_result(clone)));
+                else
+                    lily_mb_add(msgbuf, lily_error_message(clone));
+            }
+
+            lily_mb_add_char(msgbuf, '|');
+
+            if (scoped)
+                lily_close_scope(clone);
+            else
+                lily_free_state(clone);
+        }
     }
+
+    lily_free_state(subinterp);
+
+    lily_push_string(s, lily_mb_raw(msgbuf));
+    lily_free_msgbuf(msgbuf);
+    lily_return_top(s);
+}
+
+/**
+define run_clones(to_interpret: String, count: Integer): String
+
+This function parses `to_interpret`, then makes `count` clones of the result.
+Each clone calls the `run` function that `to_interpret` defines twice. `run`
+must return a `String`. The result is what each call returned (or the error it
+raised), with a `,` between the calls of a clone and a `|` after each clone.
+*/
+void lily_extend__run_clones(lily_state *s)
+{
+    run_copies(s, NULL, lily_arg_string_raw(s, 0),
+            (int)lily_arg_integer(s, 1), 0);
+}
+
+/**
+define run_scopes(to_interpret: String, count: Integer): String
+
+This is `run_clones`, except that each copy is a request scope.
+*/
+void lily_extend__run_scopes(lily_state *s)
+{
+    run_copies(s, NULL, lily_arg_string_raw(s, 0),
+            (int)lily_arg_integer(s, 1), 1);
+}
+
+/**
+define run_clones_after(first: String, to_interpret: String, count: Integer): String
+
+This is `run_clones`, except that `first` is parsed before `to_interpret`.
+*/
+void lily_extend__run_clones_after(lily_state *s)
+{
+    run_copies(s, lily_arg_string_raw(s, 0), lily_arg_string_raw(s, 1),
+            (int)lily_arg_integer(s, 2), 0);
+}
+
+/* Only clones can trap errors, so 'run' must not raise one in the source. */
+static void call_run(lily_state *s, lily_msgbuf *msgbuf, int trapped)
+{
+    lily_call_prepare(s, lily_find_function(s, "run"));
+
+    if (trapped == 0) {
+        lily_call(s, 0);
+        lily_mb_add(msgbuf, lily_as_string_raw(lily_call_result(s)));
+    }
+    else if (lily_call_trapped(s, 0))
+        lily_mb_add(msgbuf, lily_as_string_raw(lily_call_result(s)));
+    else
+        lily_mb_add(msgbuf, lily_error_message(s));
+
+    lily_mb_add_char(msgbuf, '|');
+}
+
+/**
+define run_scope_and_source(to_interpret: String): String
+
+This function parses `to_interpret`, then calls its `run` function in a scope,
+in the source while the scope is open, and in the source after the scope
+closes. The result is what each call returned, with a `|` after each. `run` must
+return a `String`, and must not raise an error in the source.
+*/
+void lily_extend__run_scope_and_source(lily_state *s)
+{
+    const char *data = lily_arg_string_raw(s, 0);
+    lily_msgbuf *msgbuf = lily_new_msgbuf(64);
+
+    lily_config config;
+
+    lily_config_init(&config);
+    config.render_func = noop_render;
+
+    lily_state *subinterp = lily_new_state(&config);
+
+    if (lily_parse_string(subinterp, "[scope]", data) == 0)
+        lily_mb_add(msgbuf, lily_error_message(subinterp));
     else {
-        con = lily_push_success(s);
-        lily_push_string(s, output);
+        lily_state *scope = lily_open_scope(subinterp);
+
+        call_run(scope, msgbuf, 1);
+        call_run(subinterp, msgbuf, 0);
+        lily_close_scope(scope);
+        call_run(subinterp, msgbuf, 0);
     }
 
     lily_free_state(subinterp);
 
-    lily_con_set_from_stack(s, con, 0);
+    lily_push_string(s, lily_mb_raw(msgbuf));
+    lily_free_msgbuf(msgbuf);
     lily_return_top(s);
 }
 
 /**
-define parse_rewind(context: String, prelude: String, to_interpret: String): String
+define run_scopes_together(to_interpret: String): String
 
-This function processes `prelude` once, then `to_interpret` twice. This checks
-if the error message from `to_interpret` is the same for each pass.
+This function parses `to_interpret`, then opens two scopes of it. `run` is
+called in the first scope, the second, and the first again. The first scope is
+closed, then `run` is called in the second scope, and in the source once both
+are closed. The result is what each call returned, with a `|` after each. `run`
+must return a `String`, and must not raise an error in the source.
 */
-void lily_extend__parse_rewind(lily_state *s)
+void lily_extend__run_scopes_together(lily_state *s)
 {
-    const char *context = lily_arg_string_raw(s, 0);
-    char *header = (char *)lily_arg_string_raw(s, 1);
-    char *data = (char *)lily_arg_string_raw(s, 2);
-    lily_msgbuf *msgbuf = lily_msgbuf_get(s);
+    const char *data = lily_arg_string_raw(s, 0);
+    lily_msgbuf *msgbuf = lily_new_msgbuf(64);
+
     lily_config config;
 
     lily_config_init(&config);
@@ -151,15 +524,357 @@ void lily_extend__parse_rewind(lily_state *s)
 
     lily_state *subinterp = lily_new_state(&config);
 
-    lily_parse_string(subinterp, context, header);
-    lily_parse_string(subinterp, context, data);
-    lily_mb_add(msgbuf, lily_error_message(subinterp));
-    lily_parse_string(subinterp, context, data);
-    lily_mb_add(msgbuf, lily_error_message(subinterp));
+    if (lily_parse_string(subinterp, "[scope]", data) == 0)
+        lily_mb_add(msgbuf, lily_error_message(subinterp));
+    else {
+        lily_state *first = lily_open_scope(subinterp);
+        lily_state *second = lily_open_scope(subinterp);
+
+        call_run(first, msgbuf, 1);
+        call_run(second, msgbuf, 1);
+        call_run(first, msgbuf, 1);
+        lily_close_scope(first);
+        call_run(second, msgbuf, 1);
+        lily_close_scope(second);
+        call_run(subinterp, msgbuf, 0);
+    }
 
-    /* The prelude shouldn't fail, and the two passes both should. Return the
-       output of both parses in case they fail for different reasons. */
     lily_free_state(subinterp);
+
     lily_push_string(s, lily_mb_raw(msgbuf));
+    lily_free_msgbuf(msgbuf);
+    lily_return_top(s);
+}
+
+/**
+define call_at_depths(to_interpret: String, count: Integer): String
+
+This function parses `to_interpret`, then calls the `run` function that it
+defines `count` times, each in a new clone. Before each call, the clone's stack
+is given one more value than the last, so that the result register lands on
+each spot of the stack (including the last one, which makes the stack grow).
+`run` must return a `String`. The result is what each call returned (or the
+error it raised), with a `|` after each.
+*/
+void lily_extend__call_at_depths(lily_state *s)
+{
+    const char *data = lily_arg_string_raw(s, 0);
+    int count = (int)lily_arg_integer(s, 1);
+    lily_msgbuf *msgbuf = lily_new_msgbuf(64);
+    int i, j;
+
+    lily_config config;
+
+    lily_config_init(&config);
+    config.render_func = noop_render;
+
+    lily_state *subinterp = lily_new_state(&config);
+
+    if (lily_parse_string(subinterp, "[depths]", data) == 0)
+        lily_mb_add(msgbuf, lily_error_message(subinterp));
+    else {
+        for (i = 0;i < count;i++) {
+            lily_state *clone = lily_clone_state(subinterp);
+
+            for (j = 0;j < i;j++)
+                lily_push_integer(clone, j);
+
+            lily_call_prepare(clone, lily_find_function(clone, "run"));
+
+            if (lily_call_trapped(clone, 0))
+                lily_mb_add(msgbuf,
+                        lily_as_string_raw(lily_call_result(clone)));
+            else
+                lily_mb_add(msgbuf, lily_error_message(clone));
+
+            lily_mb_add_char(msgbuf, '|');
+            lily_free_state(clone);
+        }
+    }
+
+    lily_free_state(subinterp);
+
+    lily_push_string(s, lily_mb_raw(msgbuf));
+    lily_free_msgbuf(msgbuf);
+    lily_return_top(s);
+}
+
+/**
+define gc_pauses(to_interpret: String): List[Integer]
+
+This function parses `to_interpret`, then returns the gc pause histogram of the
+interpreter that ran it.
+*/
+void lily_extend__gc_pauses(lily_state *s)
+{
+    const char *data = lily_arg_string_raw(s, 0);
+    uint64_t buckets[LILY_GC_PAUSE_BUCKETS];
+    int i;
+
+    lily_config config;
+
+    lily_config_init(&config);
+    config.render_func = noop_render;
+
+    lily_state *subinterp = lily_new_state(&config);
+
+    lily_parse_string(subinterp, "[pauses]", data);
+    lily_gc_pause_histogram(subinterp, buckets);
+    lily_free_state(subinterp);
+
+    lily_container_val *con = lily_push_list(s, LILY_GC_PAUSE_BUCKETS);
+
+    for (i = 0;i < LILY_GC_PAUSE_BUCKETS;i++) {
+        lily_push_integer(s, (int64_t)buckets[i]);
+        lily_con_set_from_stack(s, con, i);
+    }
+
+    lily_return_top(s);
+}
+
+/**
+define profile_string(to_interpret: String, path: String): Boolean
+
+This function parses `to_interpret` with the profiler writing to `path`. The
+folded stacks are written to `path`, and the table to `path` with ".txt" added.
+The result is `false` if the profiler doesn't take samples on this platform.
+*/
+void lily_extend__profile_string(lily_state *s)
+{
+    const char *data = lily_arg_string_raw(s, 0);
+
+    lily_config config;
+
+    lily_config_init(&config);
+    config.render_func = noop_render;
+    config.profile_path = lily_arg_string_raw(s, 1);
+
+    lily_state *subinterp = lily_new_state(&config);
+
+    lily_parse_string(subinterp, "[profile]", data);
+    lily_free_state(subinterp);
+
+#ifdef _WIN32
+    lily_return_boolean(s, 0);
+#else
+    lily_return_boolean(s, 1);
+#endif
+}
+
+/**
+define opcode_stats: Boolean
+
+This function returns `true` if Lily was built with `WITH_OPCODE_STATS`.
+*/
+void lily_extend__opcode_stats(lily_state *s)
+{
+#ifdef LILY_OPCODE_STATS
+    lily_return_boolean(s, 1);
+#else
+    lily_return_boolean(s, 0);
+#endif
+}
+
+/* These are the loops that String used before the scans were written, kept
+   here to check the scans against. */
+static int naive_find(const char *input, int size, const char *needle,
+        int needle_size)
+{
+    int i, j;
+
+    if (needle_size == 0)
+        return -1;
+
+    for (i = 0;i + needle_size <= size;i++) {
+        for (j = 0;j < needle_size;j++) {
+            if (input[i + j] != needle[j])
+                break;
+        }
+
+        if (j == needle_size)
+            return i;
+    }
+
+    return -1;
+}
+
+static int naive_html(const char *input, int size)
+{
+    int i;
+
+    for (i = 0;i < size;i++) {
+        if (input[i] == '&' || input[i] == '<' || input[i] == '>')
+            break;
+    }
+
+    return i;
+}
+
+static int naive_is_class(const char *input, int size, int cls)
+{
+    int i;
+
+    for (i = 0;i < size;i++) {
+        unsigned char ch = (unsigned char)input[i];
+        int ok;
+
+        if (ch > 127)
+            return 0;
+
+        switch (cls) {
+            case LILY_SCAN_ALNUM: ok = isalnum(ch); break;
+            case LILY_SCAN_ALPHA: ok = isalpha(ch); break;
+            case LILY_SCAN_DIGIT: ok = isdigit(ch); break;
+            default:              ok = isspace(ch); break;
+        }
+
+        if (ok == 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+static uint64_t next_random(uint64_t *seed)
+{
+    /* xorshift64 */
+    uint64_t x = *seed;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *seed = x;
+    return x;
+}
+
+/* A small alphabet makes partial matches common. Each class has a few members,
+   and the last byte isn't ascii. */
+static const char scan_alphabet[] = "aab<&> \t\n\v09Z~\xc3";
+
+static void random_bytes(uint64_t *seed, char *buffer, int size)
+{
+    int i;
+
+    for (i = 0;i < size;i++)
+        buffer[i] = scan_alphabet[next_random(seed) %
+                (sizeof(scan_alphabet) - 1)];
+}
+
+/* The input is made of one class with an outsider sometimes put in, so that
+   both results are common. */
+static void random_class_bytes(uint64_t *seed, char *buffer, int size,
+        int cls)
+{
+    static const char *members[] = {"az09MZ", "azAMZq", "0123456789",
+            " \t\n\v\f\r"};
+    const char *pick = members[cls];
+    int pick_size = (int)strlen(pick);
+    int i;
+
+    for (i = 0;i < size;i++)
+        buffer[i] = pick[next_random(seed) % pick_size];
+
+    if (size && next_random(seed) % 2)
+        buffer[next_random(seed) % size] = scan_alphabet[next_random(seed) %
+                (sizeof(scan_alphabet) - 1)];
+}
+
+#define SCAN_MESSAGE_SIZE 128
+
+static int check_scan_round(uint64_t *seed, char *message)
+{
+    char input[160];
+    char needle[8];
+    int size = (int)(next_random(seed) % sizeof(input));
+    int needle_size = (int)(next_random(seed) % sizeof(needle));
+    int cls = (int)(next_random(seed) % 4);
+    int got, want;
+
+    random_bytes(seed, input, size);
+
+    /* Take the needle from the input most of the time, so there's a match. */
+    if (size >= needle_size && next_random(seed) % 4) {
+        int at = (int)(next_random(seed) % (size - needle_size + 1));
+
+        memcpy(needle, input + at, needle_size);
+    }
+    else
+        random_bytes(seed, needle, needle_size);
+
+    got = lily_scan_find(input, size, needle, needle_size);
+    want = naive_find(input, size, needle, needle_size);
+
+    if (got != want) {
+        snprintf(message, SCAN_MESSAGE_SIZE,
+                "find (size %d, needle size %d): got %d, want %d.", size,
+                needle_size, got, want);
+        return 0;
+    }
+
+    got = lily_scan_html(input, size);
+    want = naive_html(input, size);
+
+    if (got != want) {
+        snprintf(message, SCAN_MESSAGE_SIZE,
+                "html (size %d): got %d, want %d.", size, got, want);
+        return 0;
+    }
+
+    random_class_bytes(seed, input, size, cls);
+    got = lily_scan_is_class(input, size, cls);
+    want = naive_is_class(input, size, cls);
+
+    if (got != want) {
+        snprintf(message, SCAN_MESSAGE_SIZE,
+                "class %d (size %d): got %d, want %d.", cls, size, got, want);
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+define check_string_scan(seed: Integer, rounds: Integer): String
+
+Check each level of the String scans that this machine has against simple
+versions of them, using random inputs. The result is an empty `String` if they
+all agree, or a message saying what went wrong.
+*/
+void lily_extend__check_string_scan(lily_state *s)
+{
+    uint64_t seed = (uint64_t)lily_arg_integer(s, 0) | 1;
+    int64_t rounds = lily_arg_integer(s, 1);
+    int best = lily_scan_best_level();
+    char message[SCAN_MESSAGE_SIZE];
+    int level, ok = 1;
+    int64_t i;
+
+    message[0] = '\0';
+
+    for (level = LILY_SCAN_SCALAR;level <= best;level++) {
+        lily_scan_set_level(level);
+
+        for (i = 0;i < rounds;i++) {
+            ok = check_scan_round(&seed, message);
+
+            if (ok == 0)
+                break;
+        }
+
+        if (ok == 0)
+            break;
+    }
+
+    lily_scan_set_level(best);
+
+    if (ok)
+        lily_push_string(s, "");
+    else {
+        lily_msgbuf *msgbuf = lily_msgbuf_get(s);
+
+        lily_mb_add_fmt(msgbuf, "Level %d: %s", level, message);
+        lily_push_string(s, lily_mb_raw(msgbuf));
+    }
+
     lily_return_top(s);
 }
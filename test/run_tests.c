@@ -1,15 +1,22 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "lily.h"
 
 extern const char *lily_extend_table[];
 void *lily_extend_loader(lily_state *s, int);
+extern int extend_compare_optimizer;
 
 int main(int argc, char **argv)
 {
     lily_config config;
 
+    /* With -compare-opt, each string that a test runs is run both with and
+       without the optimizer, and the results must match. */
+    if (argc > 1 && strcmp(argv[1], "-compare-opt") == 0)
+        extend_compare_optimizer = 1;
+
     lily_config_init(&config);
 
     lily_state *state = lily_new_state(&config);